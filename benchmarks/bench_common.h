@@ -0,0 +1,253 @@
+/**
+@file bench_common.h
+@brief Shared plumbing for the SunNet benchmarks: quiet servers and clients, result
+reporting as JSON, and comparison against a saved baseline
+*/
+#pragma once
+
+#include "tcp_socket_connection.h"
+#include "in_process_socket_connection.h"
+#include "unix_socket_connection.h"
+#include "channeled_client.h"
+#include "channeled_server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace SunNetBench {
+
+	/* A message of a fixed size. Each size is its own channel */
+	template <std::size_t Size>
+	struct Payload {
+		NETWORK_BYTE bytes[Size];
+	};
+
+	/* A server which ignores every hook and keeps track of its clients */
+	template <class TSocketConnection>
+	class BasicBenchServer : public SunNet::ChanneledServer<TSocketConnection> {
+	protected:
+		void handle_channeledclient_connect(SunNet::ChanneledSocketConnection_p client) {
+			this->clients.push_back(client);
+		}
+		void handle_poll_timeout() {}
+		void handle_server_connection_error() {}
+		void handle_channeledclient_error(SunNet::ChanneledSocketConnection_p) {}
+		void handleClientDisconnect(SunNet::ChanneledSocketConnection_p) {}
+		void handle_server_disconnect() {}
+
+	public:
+		std::vector<SunNet::ChanneledSocketConnection_p> clients;
+
+		BasicBenchServer(std::string port) :
+			SunNet::ChanneledServer<TSocketConnection>("127.0.0.1", port, 1024, 0) {}
+
+		BasicBenchServer(std::string address, std::string port) :
+			SunNet::ChanneledServer<TSocketConnection>(address, port, 1024, 0) {}
+
+		/* Poll until the given number of clients have connected */
+		void accept_clients(std::size_t count) {
+			while (this->clients.size() < count) {
+				this->poll();
+			}
+		}
+	};
+
+	/* A client which ignores every hook */
+	template <class TSocketConnection>
+	class BasicBenchClient : public SunNet::ChanneledClient<TSocketConnection> {
+	public:
+		BasicBenchClient() : SunNet::ChanneledClient<TSocketConnection>(0) {}
+
+		void handle_poll_timeout() {}
+		void handle_client_disconnect() {}
+		void handle_client_error() {}
+	};
+
+	typedef BasicBenchServer<SunNet::TCPSocketConnection> BenchServer;
+	typedef BasicBenchClient<SunNet::TCPSocketConnection> BenchClient;
+
+	/* One measured number. Regressions are judged by which way is better */
+	struct BenchResult {
+		std::string name;
+		double value;
+		std::string unit;
+		bool lower_is_better;
+	};
+
+	struct BenchOptions {
+		std::string output; /** < Where to write results as JSON. Empty writes to stdout only */
+		std::string baseline; /** < Results to compare against. Empty skips the comparison */
+		double tolerance; /** < How much worse than the baseline a result may be, as a fraction */
+		bool quick; /** < Run fewer iterations, for smoke testing */
+	};
+
+	inline BenchOptions parse_options(int argc, char** argv) {
+		BenchOptions options{ "", "", 0.10, false };
+		for (int index = 1; index < argc; index++) {
+			std::string argument = argv[index];
+			if (argument == "--output" && index + 1 < argc) {
+				options.output = argv[++index];
+			}
+			else if (argument == "--baseline" && index + 1 < argc) {
+				options.baseline = argv[++index];
+			}
+			else if (argument == "--tolerance" && index + 1 < argc) {
+				options.tolerance = std::atof(argv[++index]);
+			}
+			else if (argument == "--quick") {
+				options.quick = true;
+			}
+			else {
+				std::cerr << "usage: " << argv[0] << " [--output results.json] [--baseline baseline.json] "
+					"[--tolerance 0.10] [--quick]" << std::endl;
+				std::exit(2);
+			}
+		}
+
+		return options;
+	}
+
+	/**
+	@param sorted Samples in ascending order
+	@param quantile Between 0 and 1
+	*/
+	inline uint64_t percentile(const std::vector<uint64_t>& sorted, double quantile) {
+		if (sorted.empty()) {
+			return 0;
+		}
+
+		std::size_t rank = (std::size_t)(quantile * (double)(sorted.size() - 1) + 0.5);
+		return sorted[std::min(rank, sorted.size() - 1)];
+	}
+
+	inline uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/* Allow as many descriptors as the hard limit does, for benchmarks which open many connections */
+	inline std::size_t raise_descriptor_limit() {
+#ifndef _WIN32
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+			getrlimit(RLIMIT_NOFILE, &limit);
+			return (std::size_t)limit.rlim_cur;
+		}
+#endif
+		return 1024;
+	}
+
+	/**
+	Collects the results of one benchmark executable, writes them as JSON and compares
+	them against a baseline written by an earlier run.
+	*/
+	class BenchReport {
+	private:
+		std::string benchmark;
+		std::vector<BenchResult> results;
+
+		/* Read the results back out of a file written by write_json */
+		static std::map<std::string, double> read_json(const std::string& path) {
+			std::map<std::string, double> values;
+			std::ifstream file(path);
+			std::string line;
+			while (std::getline(file, line)) {
+				std::size_t name_start = line.find("\"name\": \"");
+				std::size_t value_start = line.find("\"value\": ");
+				if (name_start == std::string::npos || value_start == std::string::npos) {
+					continue;
+				}
+
+				name_start += 9;
+				std::string name = line.substr(name_start, line.find('"', name_start) - name_start);
+				values[name] = std::atof(line.c_str() + value_start + 9);
+			}
+
+			return values;
+		}
+
+	public:
+		BenchReport(std::string benchmark) : benchmark(benchmark) {}
+
+		void add(std::string name, double value, std::string unit, bool lower_is_better) {
+			std::cout << std::fixed << std::setprecision(1) << this->benchmark << "/" << name << ": " << value << " " << unit << std::endl;
+			this->results.push_back(BenchResult{ name, value, unit, lower_is_better });
+		}
+
+		/* One result per line, so that read_json does not need a real JSON parser */
+		std::string to_json() const {
+			std::ostringstream out;
+			out << std::fixed << std::setprecision(1);
+			out << "{\n  \"benchmark\": \"" << this->benchmark << "\",\n  \"results\": [\n";
+			for (std::size_t index = 0; index < this->results.size(); index++) {
+				const BenchResult& result = this->results[index];
+				out << "    {\"name\": \"" << result.name << "\", \"value\": " << result.value
+					<< ", \"unit\": \"" << result.unit << "\", \"lower_is_better\": "
+					<< (result.lower_is_better ? "true" : "false") << "}"
+					<< (index + 1 < this->results.size() ? "," : "") << "\n";
+			}
+			out << "  ]\n}\n";
+			return out.str();
+		}
+
+		/**
+		Compare every result against the baseline.
+		@return The number of results which are worse than the baseline by more than the tolerance
+		*/
+		int compare(const std::string& baseline_path, double tolerance) const {
+			std::map<std::string, double> baseline = read_json(baseline_path);
+			if (baseline.empty()) {
+				std::cerr << "No baseline results in " << baseline_path << std::endl;
+				return 0;
+			}
+
+			int regressions = 0;
+			for (const BenchResult& result : this->results) {
+				auto expected = baseline.find(result.name);
+				if (expected == baseline.end() || expected->second == 0) {
+					continue;
+				}
+
+				double change = (result.value - expected->second) / expected->second;
+				bool regressed = result.lower_is_better ? change > tolerance : change < -tolerance;
+				if (regressed) {
+					std::cout << "REGRESSION " << this->benchmark << "/" << result.name << ": " << result.value
+						<< " " << result.unit << " vs baseline " << expected->second << " (" << change * 100 << "%)" << std::endl;
+					regressions++;
+				}
+			}
+
+			return regressions;
+		}
+
+		/**
+		Write the results and compare them against the baseline, as the options ask.
+		@return The process exit code: non-zero if anything regressed
+		*/
+		int finish(const BenchOptions& options) const {
+			if (!options.output.empty()) {
+				std::ofstream(options.output) << this->to_json();
+			}
+
+			if (!options.baseline.empty() && this->compare(options.baseline, options.tolerance) > 0) {
+				return 1;
+			}
+
+			return 0;
+		}
+	};
+}
@@ -0,0 +1,78 @@
+/*
+A server broadcasting to N clients over loopback, on a single thread. Reports how long
+each broadcast takes to reach every client, and deliveries per second.
+*/
+#include "bench_common.h"
+
+#include <memory>
+
+using namespace SunNetBench;
+
+typedef Payload<64> Broadcast;
+
+void run_clients(BenchReport& report, std::size_t client_count, std::size_t broadcasts) {
+	BenchServer server("47003");
+	server.open();
+	server.serve();
+
+	std::size_t received = 0;
+	std::vector<std::unique_ptr<BenchClient>> clients;
+	for (std::size_t index = 0; index < client_count; index++) {
+		clients.push_back(std::make_unique<BenchClient>());
+		clients.back()->connect("127.0.0.1", "47003");
+		clients.back()->subscribe<Broadcast>([&received](SunNet::ChanneledSocketConnection_p, std::shared_ptr<Broadcast>) {
+			received++;
+		});
+	}
+	server.accept_clients(client_count);
+
+	Broadcast message{};
+	std::vector<uint64_t> samples;
+	samples.reserve(broadcasts);
+
+	std::chrono::steady_clock::time_point total_start = std::chrono::steady_clock::now();
+	for (std::size_t broadcast = 0; broadcast < broadcasts; broadcast++) {
+		received = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (const SunNet::ChanneledSocketConnection_p& client : server.clients) {
+			client->channeled_send(&message);
+		}
+
+		while (received < client_count) {
+			for (std::unique_ptr<BenchClient>& client : clients) {
+				client->poll();
+			}
+		}
+		samples.push_back(nanoseconds_since(start));
+	}
+	double seconds = nanoseconds_since(total_start) / 1e9;
+
+	std::sort(samples.begin(), samples.end());
+	std::string prefix = std::to_string(client_count) + "_clients/";
+	report.add(prefix + "broadcast_p50", (double)percentile(samples, 0.5), "ns", true);
+	report.add(prefix + "broadcast_p99", (double)percentile(samples, 0.99), "ns", true);
+	report.add(prefix + "deliveries_per_second", client_count * broadcasts / seconds, "msg/s", false);
+
+	for (std::unique_ptr<BenchClient>& client : clients) {
+		client->disconnect();
+	}
+	server.close();
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options = parse_options(argc, argv);
+	std::size_t broadcasts = options.quick ? 200 : 2000;
+	raise_descriptor_limit();
+
+	SunNet::Channels::addNewChannel<Broadcast>();
+
+	BenchReport report("fanout");
+	run_clients(report, 1, broadcasts);
+	run_clients(report, 16, broadcasts);
+	run_clients(report, 128, broadcasts / 4);
+	if (!options.quick) {
+		run_clients(report, 512, broadcasts / 16);
+	}
+
+	return report.finish(options);
+}
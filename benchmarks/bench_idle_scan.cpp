@@ -0,0 +1,87 @@
+/*
+Ping-pong between one client and a server which also holds many idle connections.
+Every poll() hands every connection to the kernel, so this shows what idle connections
+cost the active ones. Reports round-trip time for each number of idle connections, and
+the cost per idle connection relative to having none.
+*/
+#include "bench_common.h"
+
+using namespace SunNetBench;
+
+typedef Payload<64> Ping;
+
+int main(int argc, char** argv) {
+	BenchOptions options = parse_options(argc, argv);
+	std::size_t iterations = options.quick ? 1000 : 10000;
+
+	/* Each idle connection needs a descriptor on both ends */
+	std::size_t descriptor_limit = raise_descriptor_limit();
+	std::size_t max_idle = descriptor_limit > 256 ? (descriptor_limit - 256) / 2 : 0;
+
+	SunNet::Channels::addNewChannel<Ping>();
+
+	BenchServer server("47004");
+	server.open();
+	server.serve();
+	server.subscribe<Ping>([](SunNet::ChanneledSocketConnection_p sender, std::shared_ptr<Ping> message) {
+		sender->channeled_send(message.get());
+	});
+
+	BenchClient client;
+	bool received = false;
+	client.subscribe<Ping>([&received](SunNet::ChanneledSocketConnection_p, std::shared_ptr<Ping>) {
+		received = true;
+	});
+	client.connect("127.0.0.1", "47004");
+	server.accept_clients(1);
+
+	BenchReport report("idle_scan");
+	std::vector<SunNet::SocketConnection_p> idle_connections;
+	uint64_t baseline_p50 = 0;
+
+	for (std::size_t idle_count : { (std::size_t)0, (std::size_t)1000, (std::size_t)4000, (std::size_t)8000 }) {
+		if (idle_count > max_idle || (options.quick && idle_count > 1000)) {
+			break;
+		}
+
+		while (idle_connections.size() < idle_count) {
+			SunNet::SocketConnection_p connection = std::make_shared<SunNet::TCPSocketConnection>();
+			connection->connect("127.0.0.1", "47004");
+			idle_connections.push_back(connection);
+		}
+		server.accept_clients(idle_count + 1);
+
+		Ping message{};
+		std::vector<uint64_t> samples;
+		samples.reserve(iterations);
+		for (std::size_t iteration = 0; iteration < iterations; iteration++) {
+			received = false;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			client.channeled_send(&message);
+			while (!received) {
+				server.poll();
+				client.poll();
+			}
+			samples.push_back(nanoseconds_since(start));
+		}
+
+		std::sort(samples.begin(), samples.end());
+		uint64_t p50 = percentile(samples, 0.5);
+		std::string prefix = std::to_string(idle_count) + "_idle/";
+		report.add(prefix + "rtt_p50", (double)p50, "ns", true);
+		report.add(prefix + "rtt_p99", (double)percentile(samples, 0.99), "ns", true);
+
+		if (idle_count == 0) {
+			baseline_p50 = p50;
+		}
+		else {
+			double per_idle = p50 > baseline_p50 ? (double)(p50 - baseline_p50) / idle_count : 0.0;
+			report.add(prefix + "ns_per_idle_connection", per_idle, "ns", true);
+		}
+	}
+
+	client.disconnect();
+	idle_connections.clear();
+	server.close();
+	return report.finish(options);
+}
@@ -0,0 +1,92 @@
+/*
+Ping-pong between one client and one server over loopback, on a single thread.
+Reports round-trip time percentiles for each message size.
+
+The same runs are repeated over Unix domain sockets and, where it is available, the
+in-process transport, so the library's own overhead can be told apart from the kernel's.
+*/
+#include "bench_common.h"
+
+using namespace SunNetBench;
+
+template <std::size_t Size, class TServer, class TClient>
+void run_size(TServer& server, TClient& client, BenchReport& report, std::size_t iterations, const std::string& transport) {
+	server.template subscribe<Payload<Size>>([](SunNet::ChanneledSocketConnection_p sender, std::shared_ptr<Payload<Size>> message) {
+		sender->channeled_send(message.get());
+	});
+
+	bool received = false;
+	client.template subscribe<Payload<Size>>([&received](SunNet::ChanneledSocketConnection_p, std::shared_ptr<Payload<Size>>) {
+		received = true;
+	});
+
+	Payload<Size> message{};
+	std::vector<uint64_t> samples;
+	samples.reserve(iterations);
+
+	/* The first round trips warm up buffers and the branch predictor, so they are thrown away */
+	std::size_t warmup = iterations / 10;
+	for (std::size_t iteration = 0; iteration < warmup + iterations; iteration++) {
+		received = false;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		client.channeled_send(&message);
+		while (!received) {
+			server.poll();
+			client.poll();
+		}
+
+		if (iteration >= warmup) {
+			samples.push_back(nanoseconds_since(start));
+		}
+	}
+
+	std::sort(samples.begin(), samples.end());
+	std::string prefix = transport + "rtt/" + std::to_string(Size) + "B/";
+	report.add(prefix + "p50", (double)percentile(samples, 0.5), "ns", true);
+	report.add(prefix + "p99", (double)percentile(samples, 0.99), "ns", true);
+	report.add(prefix + "p999", (double)percentile(samples, 0.999), "ns", true);
+}
+
+template <class TSocketConnection>
+void run_transport(BenchReport& report, std::size_t iterations, const std::string& transport, const std::string& address) {
+	BasicBenchServer<TSocketConnection> server(address, "47001");
+	server.open();
+	server.serve();
+
+	BasicBenchClient<TSocketConnection> client;
+	client.connect(address, "47001");
+	server.accept_clients(1);
+
+	run_size<16>(server, client, report, iterations, transport);
+	run_size<64>(server, client, report, iterations, transport);
+	run_size<256>(server, client, report, iterations, transport);
+	run_size<1024>(server, client, report, iterations, transport);
+	run_size<4096>(server, client, report, iterations, transport);
+	run_size<16384>(server, client, report, iterations, transport);
+
+	client.disconnect();
+	server.close();
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options = parse_options(argc, argv);
+	std::size_t iterations = options.quick ? 1000 : 20000;
+
+	SunNet::Channels::addNewChannel<Payload<16>>();
+	SunNet::Channels::addNewChannel<Payload<64>>();
+	SunNet::Channels::addNewChannel<Payload<256>>();
+	SunNet::Channels::addNewChannel<Payload<1024>>();
+	SunNet::Channels::addNewChannel<Payload<4096>>();
+	SunNet::Channels::addNewChannel<Payload<16384>>();
+
+	BenchReport report("pingpong");
+	run_transport<SunNet::TCPSocketConnection>(report, iterations, "", "127.0.0.1");
+#ifdef SUNNET_HAS_UNIX_SOCKETS
+	run_transport<SunNet::UnixSocketConnection>(report, iterations, "unix/", "@sunnet_bench_pingpong");
+#endif
+#ifdef SUNNET_HAS_IN_PROCESS_TRANSPORT
+	run_transport<SunNet::InProcessSocketConnection>(report, iterations, "in_process/", "127.0.0.1");
+#endif
+
+	return report.finish(options);
+}
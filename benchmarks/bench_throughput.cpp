@@ -0,0 +1,61 @@
+/*
+One-way streaming from a client to a server over loopback. The client sends from its
+own thread as fast as the socket allows while the server polls on the main thread.
+Reports messages and bytes per second for each message size.
+*/
+#include "bench_common.h"
+
+#include <thread>
+
+using namespace SunNetBench;
+
+template <std::size_t Size>
+void run_size(BenchServer& server, BenchClient& client, BenchReport& report, std::size_t count) {
+	SunNet::Channels::addNewChannel<Payload<Size>>();
+
+	std::size_t received = 0;
+	server.subscribe<Payload<Size>>([&received](SunNet::ChanneledSocketConnection_p, std::shared_ptr<Payload<Size>>) {
+		received++;
+	});
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::thread sender([&client, count]() {
+		Payload<Size> message{};
+		for (std::size_t sent = 0; sent < count; sent++) {
+			client.channeled_send(&message);
+		}
+	});
+
+	while (received < count) {
+		server.poll();
+	}
+	double seconds = nanoseconds_since(start) / 1e9;
+	sender.join();
+
+	std::string prefix = "stream/" + std::to_string(Size) + "B/";
+	report.add(prefix + "messages_per_second", count / seconds, "msg/s", false);
+	report.add(prefix + "megabytes_per_second", count * (Size + sizeof(SunNet::CHANNEL_ID)) / seconds / 1e6, "MB/s", false);
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options = parse_options(argc, argv);
+	std::size_t scale = options.quick ? 10 : 1;
+
+	BenchServer server("47002");
+	server.open();
+	server.serve();
+
+	BenchClient client;
+	client.connect("127.0.0.1", "47002");
+	server.accept_clients(1);
+
+	BenchReport report("throughput");
+	run_size<16>(server, client, report, 2000000 / scale);
+	run_size<256>(server, client, report, 1000000 / scale);
+	run_size<4096>(server, client, report, 200000 / scale);
+	run_size<65536>(server, client, report, 20000 / scale);
+
+	client.disconnect();
+	server.close();
+	return report.finish(options);
+}
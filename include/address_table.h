@@ -0,0 +1,68 @@
+/**
+@file address_table.h
+@brief A compact count of connections per source address
+*/
+#pragma once
+
+#include "socketutil.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace SunNet {
+
+	/**
+	Counts connections by source address, in one flat array with open addressing, so
+	that checking an address while accepting is a hash and a probe or two, and the table
+	does not allocate per address.
+
+	Addresses are reduced to 64-bit keys. An IPv4 address is its own key, while IPv6
+	addresses are counted by their /64 prefix, since a single host usually has the
+	whole prefix to pick addresses from.
+	*/
+	class AddressTable {
+	private:
+		struct Entry {
+			uint64_t key; /** < 0 for an empty entry */
+			uint32_t count;
+		};
+
+		std::vector<Entry> entries; /** < Always a power of two in size */
+		size_t used;
+
+		size_t index_of(uint64_t key) const;
+		void grow();
+
+	public:
+		AddressTable();
+
+		/**
+		@param address The address a connection came from, as filled in by accept
+		@return The key for the address, or 0 for addresses which are not counted, such
+		as Unix domain sockets
+		*/
+		static uint64_t key_of(const struct sockaddr_storage& address);
+
+		/**
+		@return How many connections are counted for a key
+		*/
+		uint32_t count(uint64_t key) const;
+
+		/**
+		Count one more connection for a key. @return The new count
+		*/
+		uint32_t increment(uint64_t key);
+
+		/**
+		Count one fewer connection for a key, forgetting the key when none are left.
+		*/
+		void decrement(uint64_t key);
+
+		/**
+		@return How many keys have connections counted
+		*/
+		size_t size() const { return this->used; }
+
+		void clear();
+	};
+}
@@ -0,0 +1,216 @@
+/**
+@file async_connection.h
+@brief Awaitable receive, send, call and sleep operations on a channeled connection
+*/
+#pragma once
+
+#include "coroutine_task.h"
+
+#ifdef SUNNET_HAS_COROUTINES
+
+#include "channel_subscribable.h"
+#include "timer_wheel.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+namespace SunNet {
+
+	/**
+	Awaits the next message on a channel from a connection. The message is taken by the
+	awaiting coroutine and is not propagated to subscriptions.
+
+	Resuming throws ChanneledSocketConnection::ConnectionClosedException if the connection
+	goes away first.
+	*/
+	template <class TMessageType>
+	class RecvAwaitable : public ChannelWaiter {
+	private:
+		ChannelSubscribable* subscribable;
+		ChanneledSocketConnection_p connection;
+		std::shared_ptr<NETWORK_BYTE> data;
+		std::coroutine_handle<> handle;
+
+	public:
+		RecvAwaitable(ChannelSubscribable* subscribable, ChanneledSocketConnection_p connection) :
+			ChannelWaiter(Channels::getChannelId<TMessageType>(), connection.get()),
+			subscribable(subscribable), connection(connection) {}
+
+		bool await_ready() { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle) {
+			this->handle = handle;
+			this->subscribable->addChannelWaiter(this);
+		}
+
+		std::shared_ptr<TMessageType> await_resume() {
+			if (!this->data) {
+				throw ChanneledSocketConnection::ConnectionClosedException();
+			}
+
+			return std::shared_ptr<TMessageType>(this->data, reinterpret_cast<TMessageType*>(this->data.get()));
+		}
+
+		void deliver(std::shared_ptr<NETWORK_BYTE> data) {
+			this->data = std::move(data);
+
+			/* Resuming may free this awaitable, so it must be the last thing done */
+			resume_task(this->handle);
+		}
+	};
+
+	/**
+	Sends a message when awaited. Sends in SunNet complete synchronously, so awaiting one
+	never suspends; the message is copied so that temporaries may be sent.
+	*/
+	template <class TMessageType>
+	class SendAwaitable {
+	private:
+		ChanneledSocketConnection_p connection;
+		TMessageType message;
+
+	public:
+		SendAwaitable(ChanneledSocketConnection_p connection, const TMessageType& message) :
+			connection(connection), message(message) {}
+
+		bool await_ready() { return true; }
+		void await_suspend(std::coroutine_handle<>) {}
+
+		void await_resume() {
+			this->connection->channeled_send<TMessageType>(&this->message);
+		}
+	};
+
+	/**
+	Makes a call when awaited, and resumes the awaiting coroutine with the response.
+
+	Resuming throws the RpcException the call failed with, if it did.
+	*/
+	template <class TRequest, class TResponse>
+	class CallAwaitable {
+	private:
+		ChannelSubscribable* subscribable;
+		ChanneledSocketConnection_p connection;
+		TRequest request;
+		std::chrono::milliseconds timeout;
+
+		std::shared_ptr<TResponse> response;
+		std::exception_ptr error;
+		std::coroutine_handle<> handle;
+		bool suspended;
+		bool completed;
+
+	public:
+		CallAwaitable(ChannelSubscribable* subscribable, ChanneledSocketConnection_p connection, const TRequest& request,
+			std::chrono::milliseconds timeout) :
+			subscribable(subscribable), connection(connection), request(request), timeout(timeout), suspended(false), completed(false) {}
+
+		bool await_ready() { return false; }
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			this->handle = handle;
+			this->subscribable->call<TRequest, TResponse>(this->connection, this->request,
+				std::function<void(std::shared_ptr<TResponse>, std::exception_ptr)>(
+					[this](std::shared_ptr<TResponse> response, std::exception_ptr error) {
+						this->response = std::move(response);
+						this->error = error;
+						this->completed = true;
+
+						/* Resuming may free this awaitable, so it must be the last thing done */
+						if (this->suspended) {
+							resume_task(this->handle);
+						}
+					}), this->timeout);
+
+			/* A call which failed to send has already completed, so the coroutine carries on */
+			this->suspended = !this->completed;
+			return this->suspended;
+		}
+
+		std::shared_ptr<TResponse> await_resume() {
+			if (this->error) {
+				std::rethrow_exception(this->error);
+			}
+
+			return this->response;
+		}
+	};
+
+	/**
+	Suspends the awaiting coroutine for a duration, using the poll loop's timers.
+	*/
+	class SleepAwaitable {
+	private:
+		TimerWheel* timers;
+		std::chrono::milliseconds duration;
+
+	public:
+		SleepAwaitable(TimerWheel* timers, std::chrono::milliseconds duration) :
+			timers(timers), duration(duration) {}
+
+		bool await_ready() { return this->duration.count() <= 0; }
+
+		void await_suspend(std::coroutine_handle<> handle) {
+			this->timers->schedule(this->duration, [handle]() { resume_task(handle); });
+		}
+
+		void await_resume() {}
+	};
+
+	/**
+	A handle to a channeled connection for use inside a Task. All operations complete on
+	the polling thread of the server or client which made the handle.
+
+	Example:
+		std::shared_ptr<LoginRequest> login = co_await connection.recv<LoginRequest>();
+		co_await connection.send(LoginAccepted{ login->player_id });
+		std::shared_ptr<Profile> profile = co_await connection.call<ProfileRequest, Profile>(ProfileRequest{ login->player_id });
+		co_await connection.sleep(std::chrono::milliseconds(500));
+	*/
+	class AsyncConnection {
+	private:
+		ChannelSubscribable* subscribable;
+		ChanneledSocketConnection_p connection;
+		TimerWheel* timers;
+
+	public:
+		AsyncConnection(ChannelSubscribable* subscribable, ChanneledSocketConnection_p connection, TimerWheel* timers) :
+			subscribable(subscribable), connection(connection), timers(timers) {}
+
+		/**
+		Wait for the next message on a channel. The channel is determined by the template type.
+		*/
+		template <class TMessageType>
+		RecvAwaitable<TMessageType> recv() {
+			return RecvAwaitable<TMessageType>(this->subscribable, this->connection);
+		}
+
+		/**
+		Send a message on a channel. The channel is determined by the template type.
+		*/
+		template <class TMessageType>
+		SendAwaitable<TMessageType> send(const TMessageType& message) {
+			return SendAwaitable<TMessageType>(this->connection, message);
+		}
+
+		/**
+		Make a call on the connection and wait for its response. See ChannelSubscribable::call.
+		*/
+		template <class TRequest, class TResponse>
+		CallAwaitable<TRequest, TResponse> call(const TRequest& request, std::chrono::milliseconds timeout = DEFAULT_RPC_TIMEOUT) {
+			return CallAwaitable<TRequest, TResponse>(this->subscribable, this->connection, request, timeout);
+		}
+
+		/**
+		Suspend for a duration without blocking the poll loop.
+		*/
+		SleepAwaitable sleep(std::chrono::milliseconds duration) {
+			return SleepAwaitable(this->timers, duration);
+		}
+
+		ChanneledSocketConnection_p get_connection() { return this->connection; }
+	};
+}
+
+#endif
@@ -0,0 +1,180 @@
+/**
+@file channel_stream.h
+@brief The two ends of a stream of bytes sent alongside channel messages
+*/
+#pragma once
+
+#include "channeled_socket_connection.h"
+#include "stream.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace SunNet {
+	class ChannelSubscribable;
+
+	/**
+	The receiving end of a stream. Bytes are handed to the data callback as each chunk
+	arrives, so a stream of any size never has to fit in memory.
+
+	The sender may only run STREAM_WINDOW bytes ahead of the data callback, and a sender
+	which runs further is dropped. While the stream is paused the callback still gets
+	what was already sent, but nothing more is sent until it is resumed. A receiver which hands the bytes to slower work, such as
+	writing them to disk on another thread, pauses when that work backs up.
+
+	Streams are created by ChannelSubscribable and used from the polling thread.
+	*/
+	class IncomingStream {
+	friend class ChannelSubscribable;
+
+	public:
+		typedef std::function<void(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes)> DataCallback;
+		typedef std::function<void(bool complete)> EndCallback;
+
+	private:
+		ChannelSubscribable* owner;
+		std::weak_ptr<ChanneledSocketConnection> connection; /** < The stream does not keep its connection open */
+		STREAM_ID stream_id;
+		bool finished;
+
+		DataCallback data_callback;
+		EndCallback end_callback;
+
+		uint64_t bytes_received;
+		uint32_t untaken_bytes; /** < Bytes handed to the data callback since the sender was last told */
+		uint64_t window; /** < How many more bytes the sender has been allowed to send */
+		bool paused;
+
+		/* Hand a chunk to the data callback */
+		void deliver(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes);
+
+		/* Tell the sender how much it may send, once enough has been taken to be worth a frame */
+		void send_credit(bool force);
+
+		/* Stop the stream, calling the end callback */
+		void end(bool complete);
+
+	public:
+		IncomingStream(ChannelSubscribable* owner, ChanneledSocketConnection_p connection, STREAM_ID stream_id);
+
+		/**
+		@param callback Called with each chunk of the stream as it arrives. The bytes are
+		only valid during the call
+		*/
+		void on_data(DataCallback callback) { this->data_callback = std::move(callback); }
+
+		/**
+		@param callback Called once when the stream is over, with whether every byte arrived.
+		A stream which is cancelled, aborted by the sender or cut off by its connection
+		going away is incomplete
+		*/
+		void on_end(EndCallback callback) { this->end_callback = std::move(callback); }
+
+		/**
+		Stop the sender from sending more than it already has.
+		*/
+		void pause() { this->paused = true; }
+
+		/**
+		Let the sender carry on after pause().
+		@throws SendException if the sender could not be told
+		*/
+		void resume();
+
+		/**
+		Tell the sender to stop, and end the stream as incomplete. Chunks which were
+		already on their way are dropped.
+		@throws SendException if the sender could not be told. The stream ends anyway
+		*/
+		void cancel();
+
+		STREAM_ID get_id() const { return this->stream_id; }
+		uint64_t get_bytes_received() const { return this->bytes_received; }
+		bool is_paused() const { return this->paused; }
+		bool is_finished() const { return this->finished; }
+	};
+
+	typedef std::shared_ptr<IncomingStream> IncomingStream_p;
+
+	/**
+	The sending end of a stream. Its bytes come either from a file or from a producer,
+	and are sent a chunk at a time from the owner's poll(), taking turns with other
+	streams. A stream only sends while its connection has room and its egress limits
+	allow, so that messages sent in the meantime are not stuck behind a large transfer.
+	*/
+	class OutgoingStream {
+	friend class ChannelSubscribable;
+
+	public:
+		/**
+		Fills a buffer with the next bytes of a stream, returning how many it wrote, at
+		most the buffer's capacity, or 0 once the stream has been sent in full.
+		*/
+		typedef std::function<NETWORK_BYTE_SIZE(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE capacity)> Producer;
+		typedef std::function<void(bool complete)> FinishCallback;
+
+	private:
+		ChannelSubscribable* owner;
+		std::weak_ptr<ChanneledSocketConnection> connection; /** < The stream does not keep its connection open */
+		STREAM_ID stream_id;
+		CHANNEL_ID channel_id; /** < The channel of the message describing the stream, which egress limits are set by */
+		bool finished;
+		NETWORK_BYTE_SIZE chunk_size;
+
+		/* Where the bytes come from: a producer, or the part of a file still to send */
+		Producer producer;
+		int file;
+		uint64_t file_offset;
+		uint64_t file_remaining;
+
+		uint64_t credit; /** < How many more bytes the receiver has room for */
+		uint64_t bytes_sent;
+		FinishCallback finish_callback;
+
+		/* Whether the stream has anything it may send, which the end of a file always is */
+		bool can_send() const {
+			return !this->finished && (this->credit > 0 || (this->file != -1 && this->file_remaining == 0));
+		}
+
+		/*
+		Send the next chunk, of at most the given size, or the end of the stream if the
+		source has run out. @return The number of bytes sent
+		*/
+		NETWORK_BYTE_SIZE send_chunk(const ChanneledSocketConnection_p& connection, std::vector<NETWORK_BYTE>& buffer, NETWORK_BYTE_SIZE limit);
+
+		/* Stop the stream, closing its file and calling the finish callback */
+		void finish(bool complete);
+
+	public:
+		/**
+		@param file The file to send, which the stream closes when it finishes, or
+		-1 to send from the producer
+		*/
+		OutgoingStream(ChannelSubscribable* owner, ChanneledSocketConnection_p connection, STREAM_ID stream_id, CHANNEL_ID channel_id,
+			NETWORK_BYTE_SIZE chunk_size, Producer producer, int file, uint64_t file_offset, uint64_t file_length);
+
+		~OutgoingStream();
+
+		/**
+		@param callback Called once when the stream is over, with whether it was sent in
+		full. A stream which is cancelled by either side, fails to send or is cut off by
+		its connection going away is incomplete
+		*/
+		void on_finish(FinishCallback callback) { this->finish_callback = std::move(callback); }
+
+		/**
+		Tell the receiver that the rest of the stream will not come, and finish it as
+		incomplete.
+		@throws SendException if the receiver could not be told. The stream finishes anyway
+		*/
+		void cancel();
+
+		STREAM_ID get_id() const { return this->stream_id; }
+		CHANNEL_ID get_channel_id() const { return this->channel_id; }
+		uint64_t get_bytes_sent() const { return this->bytes_sent; }
+		bool is_finished() const { return this->finished; }
+	};
+
+	typedef std::shared_ptr<OutgoingStream> OutgoingStream_p;
+}
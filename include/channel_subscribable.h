@@ -2,14 +2,53 @@
 
 #include <functional>
 #include <unordered_map>
+#include <map>
 #include <set>
+#include <future>
+#include <exception>
 #include "channels.h"
 #include "socket_connection.h"
 #include "channel_subscription.h"
 #include "channeled_socket_connection.h"
+#include "timer_wheel.h"
+#include "rpc.h"
+#include "channel_stream.h"
+#include "token_bucket.h"
 
 
 namespace SunNet {
+	class ChannelSubscribable;
+
+	/**
+	A one-shot wait for the next message on a channel from a specific connection. A
+	message taken by a waiter is not propagated to subscriptions.
+
+	Waiters are intrusive, so that waiting does not allocate. A waiter must stay alive
+	until it has been delivered to.
+	*/
+	class ChannelWaiter {
+	friend class ChannelSubscribable;
+
+	private:
+		CHANNEL_ID channel_id;
+		ChanneledSocketConnection* connection;
+		ChannelWaiter* next = nullptr;
+
+	public:
+		ChannelWaiter(CHANNEL_ID channel_id, ChanneledSocketConnection* connection) :
+			channel_id(channel_id), connection(connection) {}
+
+		virtual ~ChannelWaiter() {}
+
+		/**
+		Called once with the message that was waited for, or with nullptr if the connection
+		went away first. The waiter may be destroyed as soon as this is called.
+
+		@param data The bytes of the message
+		*/
+		virtual void deliver(std::shared_ptr<NETWORK_BYTE> data) = 0;
+	};
+
 	/**
 	A component that is able to subscribe and unsubscribe to specific SunNet channels.
 
@@ -18,16 +57,171 @@ namespace SunNet {
 
 	Any messages that pertain to a subscription should then be sent to handleIncomingMessage,
 	where the channel id will be parsed and the corresponding subscription will be executed.
+
+	A ChannelSubscribable can also make and serve request/response calls. Each call is tagged
+	with a correlation id, so any number of calls may be in flight on a connection at once
+	and responses may arrive in any order.
 	*/
 	class ChannelSubscribable {
+	friend class IncomingStream;
+	friend class OutgoingStream;
+
 	private:
+		typedef std::function<void(std::shared_ptr<NETWORK_BYTE>, std::exception_ptr)> RpcCompletion;
+		typedef std::function<void(ChanneledSocketConnection_p, CORRELATION_ID, std::shared_ptr<NETWORK_BYTE>)> RpcHandler;
+		typedef std::function<void(ChanneledSocketConnection_p, std::shared_ptr<NETWORK_BYTE>, IncomingStream_p)> StreamHandler;
+
+		/* A call which is waiting on its response */
+		struct PendingCall {
+			ChanneledSocketConnection* connection;
+			TIMER_ID timeout_timer;
+			RpcCompletion complete;
+		};
+
 		/* Keep track of all the channel subscriptions */
 		std::unordered_map < CHANNEL_ID, std::shared_ptr<ChannelSubscriptionInterface>> subscriptions;
 
+		/* Calls made from here which are waiting on responses, and the handlers for calls made to here */
+		std::unordered_map<CORRELATION_ID, PendingCall> pending_calls;
+		std::unordered_map<CHANNEL_ID, RpcHandler> rpc_handlers;
+		CORRELATION_ID next_correlation_id = 1;
+
+		/* Streams being received, by connection and the sender's number, and the handlers for new ones */
+		std::map<std::pair<ChanneledSocketConnection*, STREAM_ID>, IncomingStream_p> incoming_streams;
+		std::unordered_map<CHANNEL_ID, StreamHandler> stream_handlers;
+		size_t max_incoming_streams = STREAM_MAX_INCOMING; /** < The most streams each connection may have open to here */
+
+		/*
+		The streams being sent on one connection. Connections take turns, deficit round robin:
+		each turn a connection with something to send may send STREAM_TURN_SIZE more bytes,
+		shared a chunk at a time between its streams.
+		*/
+		struct StreamLane {
+			std::weak_ptr<ChanneledSocketConnection> connection;
+			std::vector<OutgoingStream_p> streams;
+			size_t next_stream = 0;
+			NETWORK_BYTE_SIZE deficit = 0; /** < Bytes the connection may still send this turn */
+			bool parked = false; /** < Sits out turns until its full connection can be sent on again */
+		};
+		typedef std::shared_ptr<StreamLane> StreamLane_p;
+
+		/* Streams being sent, by number and by connection */
+		std::map<STREAM_ID, OutgoingStream_p> outgoing_streams;
+		std::vector<StreamLane_p> stream_lanes;
+		STREAM_ID next_stream_id = 1;
+
+		/* The lanes taking a turn, starting from a different one each time */
+		std::vector<StreamLane_p> lane_turns;
+		size_t next_lane = 0;
+		TIMER_ID stream_turn_timer = INVALID_TIMER_ID;
+		std::chrono::steady_clock::time_point stream_turn_due;
+
+		/* Limits on every stream sent from here, and on the streams of each descriptor type */
+		TokenBucket egress_limit;
+		std::unordered_map<CHANNEL_ID, TokenBucket> channel_egress_limits;
+
+		/* Holds a chunk of a stream being sent or received */
+		std::vector<NETWORK_BYTE> stream_buffer;
+
+		/* Waiters for each connection, kept in the order they started waiting */
+		std::unordered_map<ChanneledSocketConnection*, ChannelWaiter*> waiters;
+
+		/* Hand a message to the first waiter for its channel and connection. @return Whether a waiter took it */
+		bool deliverToWaiter(ChanneledSocketConnection* socket, CHANNEL_ID channel_id, std::unique_ptr<NETWORK_BYTE[]>& data);
+
+		/* Forget a connection and tell the subclass it is gone */
+		void dropConnection(ChanneledSocketConnection_p socket);
+
+		/* Drop a peer which sent a frame on a channel id nobody registered, or otherwise broke the protocol */
+		void dropBadChannel(ChanneledSocketConnection_p socket);
+
+		/*
+		Turn away a frame over its connection's ingress limits, reading its message off the wire or dropping the peer.
+		@return Whether the message was read off the wire
+		*/
+		bool refuseFrame(ChanneledSocketConnection_p socket, NETWORK_BYTE_SIZE message_size);
+
+		/* Count a message received in its connection's session, if it has one, acknowledging it when it is time */
+		void countSessionMessage(const ChanneledSocketConnection_p& socket, NETWORK_BYTE_SIZE frame_size);
+
+		void handleSessionFrame(ChanneledSocketConnection_p socket);
+
+		void handleRpcRequest(ChanneledSocketConnection_p socket);
+		void handleRpcResponse(ChanneledSocketConnection_p socket);
+
+		/* Complete a pending call with either a response or an error, forgetting about it */
+		void completeCall(CORRELATION_ID id, std::shared_ptr<NETWORK_BYTE> response, std::exception_ptr error);
+
+		void startCall(ChanneledSocketConnection_p connection, CHANNEL_ID request_channel,
+			const NETWORK_BYTE* request, std::chrono::milliseconds timeout, RpcCompletion complete);
+
+		void handleStreamFrame(ChanneledSocketConnection_p socket);
+		void handleStreamOpen(ChanneledSocketConnection_p socket, const StreamHeader& header);
+
+		OutgoingStream_p startStream(ChanneledSocketConnection_p connection, CHANNEL_ID descriptor_channel, const NETWORK_BYTE* descriptor,
+			NETWORK_BYTE_SIZE chunk_size, OutgoingStream::Producer producer, int file, uint64_t offset, uint64_t length);
+
+		/* Give every stream with something to send a turn after the given wait, or on the next tick of the timers */
+		void scheduleStreamTurns(std::chrono::nanoseconds wait = std::chrono::nanoseconds(0));
+		void takeStreamTurns();
+
+		/* Send a lane's share. @return How long until it has more to send, or nanoseconds::max() if it has nothing */
+		std::chrono::nanoseconds takeLaneTurn(StreamLane& lane, std::chrono::steady_clock::time_point now);
+
+		/* How long until the egress limits let a stream send. The connection's limit must already be refilled */
+		std::chrono::nanoseconds egressWait(const OutgoingStream& stream, const TokenBucket& connection_limit) const;
+
+		/* End every stream to and from a connection which has gone away. Rethrows the first exception a stream's handler threw, after ending the rest */
+		void forgetStreams(ChanneledSocketConnection* socket);
+
+		void forgetIncomingStream(ChanneledSocketConnection* socket, STREAM_ID stream_id) {
+			this->incoming_streams.erase(std::make_pair(socket, stream_id));
+		}
+
+		void forgetOutgoingStream(STREAM_ID stream_id) {
+			this->outgoing_streams.erase(stream_id);
+
+			/* Its lane lets go of it on the next turn */
+			this->scheduleStreamTurns();
+		}
+
 	protected:
 		/* Should be implemented by subclasses to handle when a recv() returns 0 */
 		virtual void handleSocketDisconnect(ChanneledSocketConnection_p socket) = 0;
 
+		/**
+		The timers used to time out calls and to send streams. Subclasses which own a
+		PollService should return its timers; without them, calls never time out and
+		streams are never sent.
+		*/
+		virtual TimerWheel* getTimerWheel() { return nullptr; }
+
+		/**
+		Ask to be told through handleWritable once a connection whose send buffer is full
+		can be sent on. Subclasses which own a PollService should watch the connection for
+		writing and return true; otherwise streams on a full connection try again every tick.
+
+		@return Whether handleWritable will be called
+		*/
+		virtual bool waitForWritable(ChanneledSocketConnection_p) { return false; }
+
+		/**
+		Let streams on a connection passed to waitForWritable carry on sending.
+
+		@param socket The connection which can be sent on
+		*/
+		void handleWritable(ChanneledSocketConnection* socket);
+
+		/**
+		Fail every call, waiter and stream waiting on the given connection. Subclasses should call
+		this whenever they find out that a connection has gone away.
+
+		@param socket The connection which has gone away
+		@throws Whatever a resumed coroutine or completion threw first, once everything
+		waiting on the connection has been let go of
+		*/
+		void forgetConnection(ChanneledSocketConnection* socket);
+
 	public:
 		virtual ~ChannelSubscribable();
 
@@ -62,7 +256,7 @@ namespace SunNet {
 				subscription = subscription_iter->second;
 			}
 			else {
-				subscription = std::make_shared<ChannelSubscription<TSubscriptionType>>();
+				subscription = std::make_shared<ChannelSubscription<TSubscriptionType>>(channel_id);
 				this->subscriptions[channel_id] = subscription;
 			}
 
@@ -92,5 +286,238 @@ namespace SunNet {
 				this->subscriptions.erase(channel_id);
 			}
 		}
+
+		/**
+		Get how long a subscription's callback takes to run. Callbacks are only timed when
+		SunNet is built with SUNNET_ENABLE_METRICS.
+
+		@param id The subscription, as returned by subscribe
+		@return A summary of the callback's run times, or an empty summary if there is no
+		such subscription
+		*/
+		template <class TSubscriptionType>
+		HistogramSnapshot getSubscriptionLatency(SUBSCRIPTION_ID id) {
+			auto subscription = this->subscriptions.find(Channels::getChannelId<TSubscriptionType>());
+			if (subscription == this->subscriptions.end()) {
+				return HistogramSnapshot{};
+			}
+
+			return subscription->second->get_latency(id);
+		}
+
+		/**
+		Make a call on a connection, sending a request and completing a callback with the
+		response. The request and response types must both be registered channels. The
+		callback runs on the polling thread.
+
+		Calls must be made from the polling thread, such as from a subscription callback,
+		a timer or a Task, since the pending calls and the timers which time them out are
+		not locked. A Task can await the response with AsyncConnection::call.
+
+		@param connection The connection to make the call on
+		@param request The request to send
+		@param callback Called with the response, or with an exception_ptr holding an
+		RpcException if the call failed
+		@param timeout How long to wait for the response
+		*/
+		template <class TRequest, class TResponse>
+		void call(ChanneledSocketConnection_p connection, const TRequest& request,
+			std::function<void(std::shared_ptr<TResponse>, std::exception_ptr)> callback,
+			std::chrono::milliseconds timeout = DEFAULT_RPC_TIMEOUT) {
+
+			this->startCall(connection, Channels::getChannelId<TRequest>(), (const NETWORK_BYTE*)&request, timeout,
+				[callback](std::shared_ptr<NETWORK_BYTE> response, std::exception_ptr error) {
+					if (error) {
+						callback(nullptr, error);
+					}
+					else {
+						callback(std::shared_ptr<TResponse>(response, reinterpret_cast<TResponse*>(response.get())), nullptr);
+					}
+				});
+		}
+
+		/**
+		Make a call on a connection, returning a future for the response. Like the callback
+		form, it must be called from the polling thread. The future is completed from
+		poll(), so it may only be waited on by another thread, such as a worker it is
+		handed to.
+
+		@param connection The connection to make the call on
+		@param request The request to send
+		@param timeout How long to wait for the response
+		@return A future for the response, which throws an RpcException if the call failed
+		*/
+		template <class TRequest, class TResponse>
+		std::future<std::shared_ptr<TResponse>> call(ChanneledSocketConnection_p connection, const TRequest& request,
+			std::chrono::milliseconds timeout = DEFAULT_RPC_TIMEOUT) {
+
+			std::shared_ptr<std::promise<std::shared_ptr<TResponse>>> promise = std::make_shared<std::promise<std::shared_ptr<TResponse>>>();
+			this->call<TRequest, TResponse>(connection, request,
+				[promise](std::shared_ptr<TResponse> response, std::exception_ptr error) {
+					if (error) {
+						promise->set_exception(error);
+					}
+					else {
+						promise->set_value(response);
+					}
+				}, timeout);
+
+			return promise->get_future();
+		}
+
+		/**
+		Serve calls made with a given request type. The handler's return value is sent back
+		as the response. Only one handler may serve a request type; serving it again replaces
+		the previous handler.
+
+		@param handler Called with the caller and the request, returning the response
+		*/
+		template <class TRequest, class TResponse>
+		void serve_calls(std::function<TResponse(ChanneledSocketConnection_p, std::shared_ptr<TRequest>)> handler) {
+			CHANNEL_ID response_channel = Channels::getChannelId<TResponse>();
+
+			this->rpc_handlers[Channels::getChannelId<TRequest>()] = (
+				[handler, response_channel](ChanneledSocketConnection_p sender, CORRELATION_ID id, std::shared_ptr<NETWORK_BYTE> data) {
+					TResponse response = handler(sender, std::shared_ptr<TRequest>(data, reinterpret_cast<TRequest*>(data.get())));
+					sender->send_rpc_frame(RPC_RESPONSE_CHANNEL_ID, RpcHeader{ response_channel, id }, (const NETWORK_BYTE*)&response);
+				}
+			);
+		}
+
+		/**
+		Stop serving calls made with a given request type. Callers will fail with RpcNoHandlerException.
+		*/
+		template <class TRequest>
+		void unserve_calls() {
+			this->rpc_handlers.erase(Channels::getChannelId<TRequest>());
+		}
+
+		/**
+		Receive streams opened with a given descriptor type. The handler is given the
+		descriptor the sender opened the stream with and the stream, on which it should
+		set callbacks for the stream's bytes and its end. Only one handler may receive a
+		descriptor type. Streams of a type nobody receives are read past without an
+		answer, so that a flood of them is not answered in kind. Their senders stall once
+		they have sent a window's worth.
+
+		@param handler Called with the sender, the descriptor and the new stream
+		*/
+		template <class TDescriptor>
+		void serve_streams(std::function<void(ChanneledSocketConnection_p, std::shared_ptr<TDescriptor>, IncomingStream_p)> handler) {
+			this->stream_handlers[Channels::getChannelId<TDescriptor>()] = (
+				[handler](ChanneledSocketConnection_p sender, std::shared_ptr<NETWORK_BYTE> data, IncomingStream_p stream) {
+					handler(sender, std::shared_ptr<TDescriptor>(data, reinterpret_cast<TDescriptor*>(data.get())), std::move(stream));
+				}
+			);
+		}
+
+		/**
+		Stop receiving new streams opened with a given descriptor type. Streams already
+		being received carry on.
+		*/
+		template <class TDescriptor>
+		void unserve_streams() {
+			this->stream_handlers.erase(Channels::getChannelId<TDescriptor>());
+		}
+
+		/**
+		Limit how many streams each connection may have open to here at once. A peer which
+		opens more is dropped, since each one holds a handler's state until it ends.
+
+		@param max_streams The most streams each connection may have open
+		*/
+		void set_max_incoming_streams(size_t max_streams) { this->max_incoming_streams = max_streams; }
+
+		/**
+		Open a stream of bytes which come from a producer, such as a replay being encoded.
+		The stream is sent a chunk at a time from poll(), interleaved with other traffic on
+		the connection, and only as fast as the receiver takes it.
+
+		@param connection The connection to send the stream on
+		@param descriptor A message describing the stream, on a registered channel
+		@param producer Called for each chunk until it returns 0
+		@param chunk_size The most bytes sent in one frame. Transports with a limit on their
+		frame size, such as UDP, need a chunk which fits in one frame
+		@return The stream, which is sent whether or not it is kept
+		@throws SendException if the stream could not be opened
+		*/
+		template <class TDescriptor>
+		OutgoingStream_p open_stream(ChanneledSocketConnection_p connection, const TDescriptor& descriptor,
+			OutgoingStream::Producer producer, NETWORK_BYTE_SIZE chunk_size = STREAM_CHUNK_SIZE) {
+
+			return this->startStream(connection, Channels::getChannelId<TDescriptor>(), (const NETWORK_BYTE*)&descriptor,
+				chunk_size, std::move(producer), -1, 0, 0);
+		}
+
+		/**
+		Open a stream of part of a file, such as a map or a mod asset. Where the transport
+		allows it, as TCP does, the file is sent without being read into memory. See
+		open_stream.
+
+		@param connection The connection to send the stream on
+		@param descriptor A message describing the stream, on a registered channel
+		@param file The file to send. The stream takes it over and closes it when it
+		finishes. The file must not shrink while it is being sent
+		@param offset Where in the file to start
+		@param length The number of bytes to send
+		@param chunk_size The most bytes sent in one frame
+		@return The stream, which is sent whether or not it is kept
+		@throws SendException if the stream could not be opened. The file is closed
+		*/
+		template <class TDescriptor>
+		OutgoingStream_p open_file_stream(ChanneledSocketConnection_p connection, const TDescriptor& descriptor,
+			int file, uint64_t offset, uint64_t length, NETWORK_BYTE_SIZE chunk_size = STREAM_CHUNK_SIZE) {
+
+			return this->startStream(connection, Channels::getChannelId<TDescriptor>(), (const NETWORK_BYTE*)&descriptor,
+				chunk_size, nullptr, file, offset, length);
+		}
+
+		/**
+		Limit how fast every stream sent from here is sent, together. Connections with
+		streams to send share what the limit allows evenly. Messages are not limited.
+
+		@param bytes_per_second The most bytes sent each second, or 0 for no limit
+		@param burst_bytes How far the streams may run ahead of the rate
+		*/
+		void set_egress_limit(uint64_t bytes_per_second, uint64_t burst_bytes) {
+			this->egress_limit.set_limit(bytes_per_second, burst_bytes);
+			this->scheduleStreamTurns();
+		}
+
+		/**
+		Limit how fast the streams opened with a given descriptor type are sent, together,
+		such as to keep asset downloads from crowding out replays.
+
+		@param bytes_per_second The most bytes sent each second, or 0 for no limit
+		@param burst_bytes How far the streams may run ahead of the rate
+		*/
+		template <typename TDescriptor>
+		void set_channel_egress_limit(uint64_t bytes_per_second, uint64_t burst_bytes) {
+			this->channel_egress_limits[Channels::getChannelId<TDescriptor>()].set_limit(bytes_per_second, burst_bytes);
+			this->scheduleStreamTurns();
+		}
+
+		/**
+		@return The number of streams being sent from here which have not finished
+		*/
+		size_t outgoing_stream_count() const { return this->outgoing_streams.size(); }
+
+		/**
+		@return The number of streams being received here which have not ended
+		*/
+		size_t incoming_stream_count() const { return this->incoming_streams.size(); }
+
+		/**
+		Wait for the next message on a channel from a connection. Waiters for the same
+		channel and connection are delivered to in the order they were added.
+
+		@param waiter The waiter, which must stay alive until it is delivered to
+		*/
+		void addChannelWaiter(ChannelWaiter* waiter);
+
+		/**
+		@return The number of calls made from here which are still waiting on a response
+		*/
+		size_t pending_call_count() const { return this->pending_calls.size(); }
 	};
 }
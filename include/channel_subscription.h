@@ -2,6 +2,7 @@
 
 #include "socketutil.h"
 #include "channeled_socket_connection.h"
+#include "metrics.h"
 
 #include <atomic>
 #include <unordered_map>
@@ -25,6 +26,13 @@ namespace SunNet {
 		@param data A buffer of the data read
 		*/
 		virtual void propagate_to_handlers(ChanneledSocketConnection_p sender, std::unique_ptr<NETWORK_BYTE[]> data) = 0;
+
+		/**
+		@param id The subscription to look up
+		@return How long the subscription's callback takes. Empty if there is no such
+		subscription or SunNet is built without SUNNET_ENABLE_METRICS.
+		*/
+		virtual HistogramSnapshot get_latency(SUBSCRIPTION_ID id) = 0;
 	};
 
 	/**
@@ -37,11 +45,17 @@ namespace SunNet {
 	template <typename TSubscriptionType>
 	class ChannelSubscription : public ChannelSubscriptionInterface {
 	private:
+		struct Subscriber {
+			std::function<void(ChanneledSocketConnection_p, std::shared_ptr<TSubscriptionType>)> callback;
+			std::unique_ptr<LatencyHistogram> latency; /** < Only allocated when metrics are enabled */
+		};
+
+		CHANNEL_ID channel_id;
 		std::atomic<SUBSCRIPTION_ID> subscription_counter;
-		std::unordered_map<SUBSCRIPTION_ID, std::function<void(ChanneledSocketConnection_p, std::shared_ptr<TSubscriptionType>)>> subscriptions;
+		std::unordered_map<SUBSCRIPTION_ID, Subscriber> subscriptions;
 
 	public:
-		ChannelSubscription() : subscription_counter(0) {}
+		ChannelSubscription(CHANNEL_ID channel_id) : channel_id(channel_id), subscription_counter(0) {}
 
 		/**
 		Associate a callback function with this channel.
@@ -50,7 +64,9 @@ namespace SunNet {
 		*/
 		SUBSCRIPTION_ID subscribe(std::function<void(ChanneledSocketConnection_p, std::shared_ptr<TSubscriptionType>)> handler) {
 			SUBSCRIPTION_ID subscription_id = this->subscription_counter++;
-			this->subscriptions[subscription_id] = handler;
+			Subscriber& subscriber = this->subscriptions[subscription_id];
+			subscriber.callback = handler;
+			SUNNET_METRICS_ONLY(subscriber.latency = std::make_unique<LatencyHistogram>());
 
 			return subscription_id;
 		}
@@ -67,7 +83,7 @@ namespace SunNet {
 
 		void propagate_to_handlers(ChanneledSocketConnection_p sender, std::unique_ptr<NETWORK_BYTE[]> data) {
 			/* Take ownership of the bytes */
-			std::shared_ptr<NETWORK_BYTE> shared_data = std::move(data);
+			std::shared_ptr<NETWORK_BYTE> shared_data(data.release(), std::default_delete<NETWORK_BYTE[]>());
 
 			/* Typecast them for our lovely subscribers */
 			auto p = reinterpret_cast<typename std::shared_ptr<TSubscriptionType>::element_type*>(shared_data.get());
@@ -78,9 +94,21 @@ namespace SunNet {
 			automatically be freed at the end of this method. However, if any of them store the ptr, the bytes
 			will remain in memory until they are finished.
 			*/
-			for (auto subscription : subscriptions) {
-				subscription.second(sender, obj);
+			for (auto& subscription : subscriptions) {
+				Subscriber& subscriber = subscription.second;
+				SUNNET_METRICS_ONLY(uint64_t start_ticks = CycleClock::now());
+				subscriber.callback(sender, obj);
+				SUNNET_METRICS_ONLY(Metrics::record_handler(this->channel_id, start_ticks, *subscriber.latency));
 			}
 		}
+
+		HistogramSnapshot get_latency(SUBSCRIPTION_ID id) {
+			auto subscription = this->subscriptions.find(id);
+			if (subscription == this->subscriptions.end() || !subscription->second.latency) {
+				return HistogramSnapshot{};
+			}
+
+			return subscription->second.latency->snapshot();
+		}
 	};
 }
@@ -3,6 +3,9 @@
 #include "client.h"
 #include "channel_subscribable.h"
 #include "channeled_socket_connection.h"
+#include "async_connection.h"
+
+#include <mutex>
 
 namespace SunNet {
 
@@ -16,7 +19,116 @@ namespace SunNet {
 	*/
 	template <typename TSocketConnection>
 	class ChanneledClient : public Client<TSocketConnection>, public ChannelSubscribable {
+	private:
+		std::chrono::milliseconds heartbeat_interval;
+		TIMER_ID heartbeat_timer;
+
+		/* The session kept across connections, once enable_sessions is called */
+		bool sessions_enabled;
+		NETWORK_BYTE_SIZE replay_limit;
+		std::chrono::milliseconds handshake_timeout;
+		Session_p session;
+
+		/*
+		Held by sends from any thread while they look at the session, and by the polling
+		thread while it replaces the session or moves it onto a connection, so that no
+		send slips in ahead of the messages a resume replays
+		*/
+		mutable std::mutex session_mutex;
+
+		/* Wait for the next part of the server's answer, or throw once the handshake has taken too long */
+		void wait_for_session_reply(ChanneledSocketConnection_p& channeled_con, std::chrono::steady_clock::time_point deadline) {
+			auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0 || !channeled_con->wait_readable(remaining)) {
+				throw ReceiveException(std::to_string(ETIMEDOUT));
+			}
+		}
+
+		/*
+		Open a new session, or resume the current one, on a connection which has just been
+		made. The server answers before it sends anything else, so the answer is waited for
+		here, up to handshake_timeout. @return Whether the session was resumed
+		*/
+		bool start_session(SessionFrameType type) {
+			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+
+			SessionHeader request{ (NETWORK_BYTE)type, 0, 0, 0 };
+			if (type == SESSION_RESUME) {
+				request.token = this->session->get_token();
+				request.received = this->session->get_received();
+				request.replay_from = this->session->get_replay_from();
+			}
+			channeled_con->send_session_frame(request);
+
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + this->handshake_timeout;
+			CHANNEL_ID channel_id;
+			do {
+				this->wait_for_session_reply(channeled_con, deadline);
+				channel_id = channeled_con->channeled_read_id();
+			} while (channel_id == HEARTBEAT_CHANNEL_ID);
+
+			if (channel_id != SESSION_CHANNEL_ID) {
+				throw Channels::BadChannelException();
+			}
+			this->wait_for_session_reply(channeled_con, deadline);
+			SessionHeader reply = channeled_con->session_read_header();
+
+			if (type == SESSION_RESUME && reply.type == SESSION_RESUMED && reply.token == request.token) {
+				std::lock_guard<std::mutex> lock(this->session_mutex);
+				this->session->acknowledge(reply.received);
+				channeled_con->set_session(this->session);
+				channeled_con->replay_session();
+				SUNNET_METRICS_ONLY(Metrics::global.resumed_sessions.add());
+				return true;
+			}
+			else if (reply.type != SESSION_ACCEPT) {
+				throw Channels::BadChannelException();
+			}
+
+			/* Whatever was kept from the old session will never be wanted now */
+			std::lock_guard<std::mutex> lock(this->session_mutex);
+			this->session = std::make_shared<Session>(reply.token, this->replay_limit);
+			channeled_con->set_session(this->session);
+			return false;
+		}
+
+		/* Send a heartbeat if nothing else has been sent to the server for an interval */
+		void send_heartbeat() {
+			if (!this->connection) {
+				return;
+			}
+
+			if (this->connection->get_last_send_time() < std::chrono::steady_clock::now() - this->heartbeat_interval) {
+				try {
+					std::static_pointer_cast<ChanneledSocketConnection>(this->connection)->send_heartbeat();
+				}
+				catch (SendException&) {
+					this->handle_client_disconnect();
+				}
+			}
+		}
+
 	protected:
+		/* Let ChannelSubscribable time out calls using the client's timers */
+		TimerWheel* getTimerWheel() {
+			return &this->get_timers();
+		}
+
+		/* Let ChannelSubscribable wait for a full connection to drain through the poll service */
+		bool waitForWritable(ChanneledSocketConnection_p connection) {
+			if (connection != this->connection) {
+				return false;
+			}
+
+			this->watchForWriting();
+			return true;
+		}
+
+		/* Handle Client's ready_to_write logic */
+		void handle_client_ready_to_write() {
+			this->handleWritable(static_cast<ChanneledSocketConnection*>(this->connection.get()));
+		}
+
 		/* Handle ChannelSubscribable's disconnection logic */
 		void handleSocketDisconnect(ChanneledSocketConnection_p socket) {
 			this->handle_client_disconnect();
@@ -37,20 +149,303 @@ namespace SunNet {
 	public:
 		template <class ... ArgTypes>
 		ChanneledClient(int poll_timeout, ArgTypes ... args) :
-      Client<TSocketConnection>(poll_timeout, args...) {}
+      Client<TSocketConnection>(poll_timeout, args...), heartbeat_interval(0), heartbeat_timer(INVALID_TIMER_ID),
+			sessions_enabled(false), replay_limit(DEFAULT_REPLAY_LIMIT), handshake_timeout(DEFAULT_SESSION_HANDSHAKE_TIMEOUT) {}
+
+		/**
+		Connect to the server, opening a new session if sessions are enabled. See Client::connect.
+
+		@param address the address to connect to
+		@param port the port to connect to
+		@throws Channels::BadChannelException if the server answered with something other than a session
+		@throws ChanneledSocketConnection::ConnectionClosedException if the server hung up instead of
+		answering, such as when it does not have sessions enabled
+		@throws ReceiveException with ETIMEDOUT if the server did not answer in time, such as
+		when it is not accepting more connections
+		*/
+		void connect(std::string address, std::string port) {
+			Client<TSocketConnection>::connect(address, port);
+			if (!this->sessions_enabled) {
+				return;
+			}
+
+			try {
+				this->start_session(SESSION_OPEN);
+			}
+			catch (...) {
+				Client<TSocketConnection>::disconnect();
+				throw;
+			}
+		}
+
+		/**
+		Disconnect from the server, ending the session if there is one so that the server
+		does not keep it. See Client::disconnect.
+		*/
+		void disconnect() {
+			Session_p session;
+			{
+				std::lock_guard<std::mutex> lock(this->session_mutex);
+				session = std::move(this->session);
+			}
+
+			if (session && this->connection) {
+				try {
+					std::static_pointer_cast<ChanneledSocketConnection>(this->connection)->send_session_frame(
+						SessionHeader{ SESSION_CLOSE, session->get_token(), session->get_received(), 0 });
+				}
+				catch (SendException&) {}
+			}
+
+			Client<TSocketConnection>::disconnect();
+		}
+
+		/**
+		Keep a session with the server which outlives the connection. Every channeled_send is
+		numbered and kept until the server acknowledges it, and the server does the same, so
+		that after the connection drops, resume_session connects again and each side resends
+		only what the other missed. Subscribers see every message once and in order, as
+		though the connection had never dropped. Calls and streams are not carried over, and
+		fail as usual.
+
+		Must be called before connect, and the server must have sessions enabled too.
+		Sessions need a transport which delivers in order, such as TCP.
+
+		@param replay_limit The most bytes of unacknowledged messages kept for resending. If
+		more than this goes unacknowledged, the session can no longer be resumed
+		@param handshake_timeout How long connect and resume_session wait for the server to
+		answer before giving up
+		*/
+		void enable_sessions(NETWORK_BYTE_SIZE replay_limit = DEFAULT_REPLAY_LIMIT,
+			std::chrono::milliseconds handshake_timeout = DEFAULT_SESSION_HANDSHAKE_TIMEOUT) {
+			this->sessions_enabled = true;
+			this->replay_limit = replay_limit;
+			this->handshake_timeout = handshake_timeout;
+		}
+
+		/**
+		Connect to the server again and carry on the session, after handle_client_disconnect
+		reported that the connection dropped. Messages sent while the connection was down are
+		kept, and sent once the session is resumed. Should be called from the polling thread,
+		such as from handle_client_disconnect, and may be called again if it throws.
+
+		@return Whether the session was carried on. If the server had let it go, or too much
+		went unacknowledged, a new session is started instead, and the client should catch
+		up as though it had just connected
+		@throws Client::InvalidStateTransitionException if sessions are not enabled
+		@throws Whatever connect throws, including when the server does not answer in time.
+		The session is kept for the next try
+		*/
+		bool resume_session() {
+			if (!this->sessions_enabled) {
+				throw typename Client<TSocketConnection>::InvalidStateTransitionException();
+			}
+
+			/* Anything sent on the old connection from here on would be numbered but never resent */
+			if (this->connection) {
+				ChanneledSocketConnection_p previous = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+				{
+					std::lock_guard<std::mutex> lock(this->session_mutex);
+					previous->set_session(nullptr);
+				}
+				this->forgetConnection(previous.get());
+			}
+
+			this->reconnect();
+			try {
+				return this->start_session(this->session ? SESSION_RESUME : SESSION_OPEN);
+			}
+			catch (...) {
+				Client<TSocketConnection>::disconnect();
+				throw;
+			}
+		}
+
+		/**
+		@return The session with the server, or nullptr if sessions are not enabled or the
+		client has not connected
+		*/
+		Session_p get_session() const {
+			std::lock_guard<std::mutex> lock(this->session_mutex);
+			return this->session;
+		}
+
+		/**
+		Keep the connection alive with heartbeats and report the connection through
+		handle_client_disconnect if the server goes silent. A heartbeat is only sent when
+		nothing else has been sent to the server for an interval.
+
+		@param interval How often to check whether the server needs a heartbeat
+		@param idle_timeout How long the server may stay silent
+		*/
+		void enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout) {
+			this->disable_heartbeat();
+
+			this->heartbeat_interval = interval;
+			this->heartbeat_timer = this->schedule_repeating_timer(interval, [this]() { this->send_heartbeat(); });
+			this->set_idle_timeout(idle_timeout);
+		}
+
+		/**
+		Stop sending heartbeats and stop watching for a silent server.
+		*/
+		void disable_heartbeat() {
+			this->cancel_timer(this->heartbeat_timer);
+			this->heartbeat_timer = INVALID_TIMER_ID;
+			this->set_idle_timeout(std::chrono::milliseconds(0));
+		}
+
+		/**
+		Ask the server to trace messages in both directions, recording per-channel
+		latencies into Metrics. See ChanneledSocketConnection::enable_tracing.
+		*/
+		void enable_tracing() {
+			std::static_pointer_cast<ChanneledSocketConnection>(this->connection)->enable_tracing();
+		}
 
 		/**
 		Send a message upon a specific channel. The channel is determined
-		by the template type.
+		by the template type. While a session is waiting to be resumed, the
+		message is kept in it and sent once it is. Any thread may send.
 
 		@param message The object to send
 		*/
 		template <class TMessageType>
 		void channeled_send(TMessageType* message) {
 			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+			if (!this->sessions_enabled) {
+				channeled_con->channeled_send<TMessageType>(message);
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(this->session_mutex);
+			if (this->session && (!channeled_con || channeled_con->get_session() != this->session)) {
+				this->session->send(Channels::getChannelId<TMessageType>(), (const NETWORK_BYTE*)message, sizeof(TMessageType), []() {});
+				return;
+			}
+
 			channeled_con->channeled_send<TMessageType>(message);
 		}
 
+		/**
+		Send large messages to the server without copying them into the kernel. See
+		SocketConnection::enable_zerocopy. The client must be connected.
+
+		@param threshold The smallest message to send without copying
+		@return Whether the platform and the connection support it
+		*/
+		bool enable_zerocopy(NETWORK_BYTE_SIZE threshold) {
+			return this->connection->enable_zerocopy(threshold);
+		}
+
+		/**
+		Send a message upon a specific channel without copying it into the kernel, if
+		zero-copy is enabled and the message is large enough. The message is released
+		from a later poll(). See ChanneledSocketConnection::channeled_send_zerocopy.
+
+		@param message The object to send, kept alive until the kernel is done with it
+		*/
+		template <class TMessageType>
+		void channeled_send_zerocopy(std::shared_ptr<TMessageType> message) {
+			/* A session keeps a copy anyway */
+			if (this->sessions_enabled) {
+				this->channeled_send(message.get());
+				return;
+			}
+
+			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+			channeled_con->channeled_send_zerocopy<TMessageType>(std::move(message));
+		}
+
+		using ChannelSubscribable::open_stream;
+		using ChannelSubscribable::open_file_stream;
+
+		/**
+		Open a stream to the server of bytes which come from a producer. See
+		ChannelSubscribable::open_stream.
+
+		@param descriptor A message describing the stream, on a registered channel
+		@param producer Called for each chunk until it returns 0
+		@param chunk_size The most bytes sent in one frame
+		*/
+		template <class TDescriptor>
+		OutgoingStream_p open_stream(const TDescriptor& descriptor, OutgoingStream::Producer producer,
+			NETWORK_BYTE_SIZE chunk_size = STREAM_CHUNK_SIZE) {
+			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+			return this->open_stream(channeled_con, descriptor, std::move(producer), chunk_size);
+		}
+
+		/**
+		Open a stream of part of a file to the server. See ChannelSubscribable::open_file_stream.
+
+		@param descriptor A message describing the stream, on a registered channel
+		@param file The file to send, which the stream closes when it finishes
+		@param offset Where in the file to start
+		@param length The number of bytes to send
+		@param chunk_size The most bytes sent in one frame
+		*/
+		template <class TDescriptor>
+		OutgoingStream_p open_file_stream(const TDescriptor& descriptor, int file, uint64_t offset, uint64_t length,
+			NETWORK_BYTE_SIZE chunk_size = STREAM_CHUNK_SIZE) {
+			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+			return this->open_file_stream(channeled_con, descriptor, file, offset, length, chunk_size);
+		}
+
+#ifdef SUNNET_HAS_COROUTINES
+		using Client<TSocketConnection>::send;
+
+		/**
+		Get a handle for awaiting messages from, sending to, and sleeping on behalf of the
+		server connection inside a Task. The task is resumed by this client's poll().
+		The client must be connected.
+		*/
+		AsyncConnection async_connection() {
+			return AsyncConnection(this, std::static_pointer_cast<ChanneledSocketConnection>(this->connection), &this->get_timers());
+		}
+
+		/**
+		co_await the next message from the server on a channel. The channel is determined by
+		the template type.
+		*/
+		template <class TMessageType>
+		RecvAwaitable<TMessageType> recv() {
+			return this->async_connection().template recv<TMessageType>();
+		}
+
+		/**
+		co_await sending a message to the server. The channel is determined by the template type.
+		*/
+		template <class TMessageType>
+		SendAwaitable<TMessageType> send(const TMessageType& message) {
+			return this->async_connection().send(message);
+		}
+
+		/**
+		co_await a duration without blocking the poll loop.
+		*/
+		SleepAwaitable sleep(std::chrono::milliseconds duration) {
+			return SleepAwaitable(&this->get_timers(), duration);
+		}
+#endif
+
+		using ChannelSubscribable::call;
+
+		/**
+		Make a call to the server, returning a future for the response. Any number of
+		calls may be in flight at once. Calls must be made from the polling thread, as
+		for ChannelSubscribable::call. The future is completed from poll(), so only
+		another thread may wait on it; a Task awaits async_connection().call instead.
+
+		@param request The request to send
+		@param timeout How long to wait for the response
+		@return A future for the response, which throws an RpcException if the call failed
+		*/
+		template <class TRequest, class TResponse>
+		std::future<std::shared_ptr<TResponse>> call(const TRequest& request, std::chrono::milliseconds timeout = DEFAULT_RPC_TIMEOUT) {
+			ChanneledSocketConnection_p channeled_con = std::static_pointer_cast<ChanneledSocketConnection>(this->connection);
+			return this->call<TRequest, TResponse>(channeled_con, request, timeout);
+		}
+
 		/**
 		Receive the channel ID from the incoming message. This will block
 		until a channel id is ready to be read.
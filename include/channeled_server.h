@@ -3,6 +3,11 @@
 #include "server.h"
 #include "channel_subscribable.h"
 #include "channeled_socket_connection.h"
+#include "async_connection.h"
+
+#include <exception>
+#include <random>
+#include <unordered_map>
 
 namespace SunNet {
 	/**
@@ -13,6 +18,195 @@ namespace SunNet {
 	*/
 	template <typename TSocketConnectionType>
 	class ChanneledServer : public Server<TSocketConnectionType>, public ChannelSubscribable {
+	private:
+		std::chrono::milliseconds heartbeat_interval;
+		TIMER_ID heartbeat_timer;
+		std::vector<SocketConnection_p> failed_heartbeats;
+
+		/* Send a heartbeat to every client which has not been sent anything for an interval */
+		void send_heartbeats() {
+			std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - this->heartbeat_interval;
+			this->for_each_client([&](const SocketConnection_p& client) {
+				if (client->get_last_send_time() < cutoff) {
+					try {
+						std::static_pointer_cast<ChanneledSocketConnection>(client)->send_heartbeat();
+					}
+					catch (SendException&) {
+						this->failed_heartbeats.push_back(client);
+					}
+				}
+			});
+
+			for (const SocketConnection_p& client : this->failed_heartbeats) {
+				this->handle_client_disconnect(client);
+			}
+			this->failed_heartbeats.clear();
+		}
+
+		/* A session, and the connection it is on. A session whose connection dropped waits on its expiry timer */
+		struct SessionEntry {
+			Session_p session;
+			ChanneledSocketConnection_p connection;
+			TIMER_ID expiry_timer;
+		};
+
+		bool sessions_enabled;
+		std::chrono::milliseconds resume_window;
+		NETWORK_BYTE_SIZE replay_limit;
+		std::unordered_map<SESSION_TOKEN, SessionEntry> sessions;
+
+		/* Tokens are drawn from the system's entropy, so that a session cannot be taken over by guessing */
+		std::random_device token_source;
+
+		SESSION_TOKEN new_session_token() {
+			SESSION_TOKEN token = 0;
+			while (token == 0 || this->sessions.count(token) > 0) {
+				token = ((SESSION_TOKEN)this->token_source() << 32) | (SESSION_TOKEN)this->token_source();
+			}
+			return token;
+		}
+
+		/* Drop a client which has not finished opening a session. The subclass never heard of it */
+		void drop_sessionless_client(ChanneledSocketConnection_p client) {
+			this->removeFromPollService(client);
+			this->forgetConnection(client.get());
+		}
+
+		/*
+		Read the frame a client starts with when sessions are enabled, and open or resume
+		the session it asks for. The subclass hears of the client only once it is in one.
+		*/
+		void start_session(ChanneledSocketConnection_p client) {
+			SessionHeader header;
+			try {
+				if (client->channeled_read_id() != SESSION_CHANNEL_ID) {
+					SUNNET_METRICS_ONLY(Metrics::global.bad_channel_frames.add());
+					this->drop_sessionless_client(client);
+					return;
+				}
+				header = client->session_read_header();
+			}
+			catch (ChanneledSocketConnection::ConnectionClosedException&) {
+				this->drop_sessionless_client(client);
+				return;
+			}
+
+			if (header.type == SESSION_RESUME && this->resume_session(client, header)) {
+				return;
+			}
+			else if (header.type != SESSION_RESUME && header.type != SESSION_OPEN) {
+				SUNNET_METRICS_ONLY(Metrics::global.bad_channel_frames.add());
+				this->drop_sessionless_client(client);
+				return;
+			}
+
+			Session_p session = std::make_shared<Session>(this->new_session_token(), this->replay_limit);
+			try {
+				client->send_session_frame(SessionHeader{ SESSION_ACCEPT, session->get_token(), 0, 0 });
+			}
+			catch (SendException&) {
+				this->drop_sessionless_client(client);
+				return;
+			}
+
+			this->sessions[session->get_token()] = SessionEntry{ session, client, INVALID_TIMER_ID };
+			client->set_session(session);
+			this->handle_channeledclient_connect(client);
+		}
+
+		/*
+		Carry a session on from the connection it was on to a client which asked to resume
+		it. @return Whether it was carried on. If not, the session is over and the client is
+		given a new one
+		*/
+		bool resume_session(ChanneledSocketConnection_p client, const SessionHeader& header) {
+			auto entry = this->sessions.find(header.token);
+			if (entry == this->sessions.end()) {
+				return false;
+			}
+
+			ChanneledSocketConnection_p previous = entry->second.connection;
+			Session_p session = entry->second.session;
+			if (entry->second.expiry_timer != INVALID_TIMER_ID) {
+				this->cancel_timer(entry->second.expiry_timer);
+				entry->second.expiry_timer = INVALID_TIMER_ID;
+			}
+			else {
+				/* The client noticed that the connection dropped before the server did */
+				this->removeFromPollService(previous);
+				this->forgetConnection(previous.get());
+			}
+			previous->set_session(nullptr);
+
+			if (session->is_closed() || !session->can_resume(header.received, header.replay_from)) {
+				this->sessions.erase(entry);
+				this->handleClientDisconnect(previous);
+				return false;
+			}
+
+			entry->second.connection = client;
+			client->set_session(session);
+			session->acknowledge(header.received);
+			try {
+				client->send_session_frame(SessionHeader{ SESSION_RESUMED, header.token, session->get_received(), 0 });
+				client->replay_session();
+			}
+			catch (SendException&) {
+				/* Kept for the client to try again */
+				this->handle_client_disconnect(client);
+				return true;
+			}
+			SUNNET_METRICS_ONLY(Metrics::global.resumed_sessions.add());
+
+			this->handleSessionResume(previous, client);
+			return true;
+		}
+
+		/*
+		Keep the session of a client which went away for the client to resume.
+		@return Whether the subclass should not hear that the client went away, because its
+		session is being kept or because it never finished opening one
+		*/
+		bool keep_session(const ChanneledSocketConnection_p& client) {
+			if (!this->sessions_enabled) {
+				return false;
+			}
+
+			/* The client has not opened a session, or its session has moved to another connection */
+			const Session_p& session = client->get_session();
+			if (!session) {
+				return true;
+			}
+
+			auto entry = this->sessions.find(session->get_token());
+			if (entry == this->sessions.end() || entry->second.connection != client) {
+				return true;
+			}
+
+			if (session->is_closed()) {
+				this->sessions.erase(entry);
+				return false;
+			}
+
+			if (entry->second.expiry_timer == INVALID_TIMER_ID) {
+				SESSION_TOKEN token = session->get_token();
+				entry->second.expiry_timer = this->schedule_timer(this->resume_window, [this, token]() { this->expire_session(token); });
+			}
+			return true;
+		}
+
+		/* Give up on a session whose client did not come back in time */
+		void expire_session(SESSION_TOKEN token) {
+			auto entry = this->sessions.find(token);
+			if (entry == this->sessions.end()) {
+				return;
+			}
+
+			ChanneledSocketConnection_p client = std::move(entry->second.connection);
+			this->sessions.erase(entry);
+			this->handleClientDisconnect(client);
+		}
+
 	protected:
 
 		/* Handler for Server's ready_to_read */
@@ -21,36 +215,101 @@ namespace SunNet {
 				std::static_pointer_cast<ChanneledSocketConnection>(client)
 			);
 
+			if (this->sessions_enabled && !channeled_socket->get_session()) {
+				this->start_session(channeled_socket);
+				return;
+			}
+
 			/* Delegate to ChannelSubscribable for parsing */
 			this->handleIncomingMessage(channeled_socket);
 		}
 
+		/* Let ChannelSubscribable time out calls using the server's timers */
+		TimerWheel* getTimerWheel() {
+			return &this->get_timers();
+		}
+
+		/* Let ChannelSubscribable wait for a full client to drain through the poll service */
+		bool waitForWritable(ChanneledSocketConnection_p connection) {
+			this->watchForWriting(connection);
+			return true;
+		}
+
+		/* Handler for Server's handle_ready_to_write */
+		void handle_ready_to_write(SocketConnection_p client) {
+			this->handleWritable(static_cast<ChanneledSocketConnection*>(client.get()));
+		}
+
 		/* Handler for when ChannelSubscribable's recv() returns 0*/
 		void handleSocketDisconnect(ChanneledSocketConnection_p socket) {
 			this->removeFromPollService(socket);
-			this->handleClientDisconnect(socket);
+			if (!this->keep_session(socket)) {
+				this->handleClientDisconnect(socket);
+			}
 		}
 
 		/* Handler for Server's handle_client_error */
 		void handle_client_error(SocketConnection_p client) {
 			this->removeFromPollService(client);
-			handle_channeledclient_error(std::static_pointer_cast<ChanneledSocketConnection>(client));
+			std::exception_ptr error;
+			try {
+				this->forgetConnection(static_cast<ChanneledSocketConnection*>(client.get()));
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+
+			ChanneledSocketConnection_p channeled_client = std::static_pointer_cast<ChanneledSocketConnection>(client);
+			if (!this->keep_session(channeled_client)) {
+				handle_channeledclient_error(channeled_client);
+			}
+			if (error) {
+				std::rethrow_exception(error);
+			}
 		}
 
-		/* Handler for when Server receivies a new connection */
+		/* Handler for when Server receivies a new connection. With sessions, the subclass hears of it once it opens one */
 		void handle_client_connect(SocketConnection_p client) {
-			handle_channeledclient_connect(std::static_pointer_cast<ChanneledSocketConnection>(client));
+			if (!this->sessions_enabled) {
+				handle_channeledclient_connect(std::static_pointer_cast<ChanneledSocketConnection>(client));
+			}
 		}
 
 		/* Handler for server's handle_client_disconnect */
 		void handle_client_disconnect(SocketConnection_p client) {
 			this->removeFromPollService(client);
-			handleClientDisconnect(std::static_pointer_cast<ChanneledSocketConnection>(client));
+			std::exception_ptr error;
+			try {
+				this->forgetConnection(static_cast<ChanneledSocketConnection*>(client.get()));
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+
+			ChanneledSocketConnection_p channeled_client = std::static_pointer_cast<ChanneledSocketConnection>(client);
+			if (!this->keep_session(channeled_client)) {
+				handleClientDisconnect(channeled_client);
+			}
+			if (error) {
+				std::rethrow_exception(error);
+			}
 		}
 
 		/**** Handlers for ChanneledServer ****/
 		virtual void handleClientDisconnect(ChanneledSocketConnection_p client) = 0;
 
+		/**
+		Called when a client whose connection dropped resumes its session on a new
+		connection. Everything known about the previous connection, such as which player it
+		was, should move over to the new one; messages sent to the previous connection from
+		here on are lost. The subclass hears nothing else about the previous connection.
+		Does nothing unless overridden.
+
+		@param previous The connection the session was on
+		@param client The connection the session is on now
+		*/
+		virtual void handleSessionResume(ChanneledSocketConnection_p, ChanneledSocketConnection_p) {}
+
 		/**** Handlers for server class ****/
 		virtual void handle_server_connection_error() = 0;
 		virtual void handle_server_disconnect() = 0;
@@ -62,6 +321,74 @@ namespace SunNet {
 
 		template <class ... ArgType>
 		ChanneledServer(std::string address, std::string port, int listen_queue_size, int poll_timeout, ArgType ... args) :
-			Server<TSocketConnectionType>(address, port, listen_queue_size, poll_timeout, args...) {}
+			Server<TSocketConnectionType>(address, port, listen_queue_size, poll_timeout, args...),
+			heartbeat_interval(0), heartbeat_timer(INVALID_TIMER_ID),
+			sessions_enabled(false), resume_window(DEFAULT_RESUME_WINDOW), replay_limit(DEFAULT_REPLAY_LIMIT) {}
+
+		/**
+		Keep a session with each client which outlives its connection. When a client's
+		connection drops, its session is kept for the resume window instead of the client
+		being reported as disconnected. Messages sent to it meanwhile are kept, and if the
+		client comes back with ChanneledClient::resume_session, each side resends only what
+		the other missed and the subclass is told through handleSessionResume. Otherwise the
+		client is reported through handleClientDisconnect once the window is up.
+
+		A client is only reported through handle_channeledclient_connect once it has opened
+		a session. Must be called before open, and every client must enable sessions too.
+
+		@param resume_window How long a dropped session is kept for its client
+		@param replay_limit The most bytes of unacknowledged messages kept for each client.
+		If more than this goes unacknowledged, the session can no longer be resumed
+		*/
+		void enable_sessions(std::chrono::milliseconds resume_window = DEFAULT_RESUME_WINDOW,
+			NETWORK_BYTE_SIZE replay_limit = DEFAULT_REPLAY_LIMIT) {
+			this->sessions_enabled = true;
+			this->resume_window = resume_window;
+			this->replay_limit = replay_limit;
+		}
+
+		/**
+		@return The number of sessions, counting those waiting for their client to come back
+		*/
+		size_t session_count() const { return this->sessions.size(); }
+
+		/**
+		Keep connections alive with heartbeats and reap clients which have gone silent.
+		A heartbeat is sent to a client only when nothing else has been sent to it for
+		an interval, and clients which send nothing for idle_timeout are disconnected
+		through handleClientDisconnect.
+
+		@param interval How often to check whether a client needs a heartbeat
+		@param idle_timeout How long a client may stay silent. This should be a few
+		times the heartbeat interval used by the clients.
+		*/
+		void enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout) {
+			this->disable_heartbeat();
+
+			this->heartbeat_interval = interval;
+			this->heartbeat_timer = this->schedule_repeating_timer(interval, [this]() { this->send_heartbeats(); });
+			this->set_idle_timeout(idle_timeout);
+		}
+
+		/**
+		Stop sending heartbeats and stop reaping idle clients.
+		*/
+		void disable_heartbeat() {
+			this->cancel_timer(this->heartbeat_timer);
+			this->heartbeat_timer = INVALID_TIMER_ID;
+			this->set_idle_timeout(std::chrono::milliseconds(0));
+		}
+
+#ifdef SUNNET_HAS_COROUTINES
+		/**
+		Get a handle for awaiting messages from, sending to, and sleeping on behalf of a
+		client inside a Task. The task is resumed by this server's poll().
+
+		@param client The client to make a handle for
+		*/
+		AsyncConnection async_connection(ChanneledSocketConnection_p client) {
+			return AsyncConnection(this, client, &this->get_timers());
+		}
+#endif
 	};
 }
@@ -1,8 +1,25 @@
 #pragma once
 #include "socket_connection.h"
 #include "channels.h"
+#include "rpc.h"
+#include "trace.h"
+#include "stream.h"
+#include "token_bucket.h"
+#include "session.h"
+
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
 
 namespace SunNet {
+	/**
+	What a connection does with a frame which breaks its ingress limits
+	*/
+	enum IngressAction {
+		INGRESS_DROP, /** < Read the frame off the wire and throw it away, without dispatching it */
+		INGRESS_DISCONNECT /** < Drop the peer, as though it had disconnected */
+	};
+
 	/**
 	A wrapper for SocketConnection which operates on channels. Users should use 
 	ChanneledSocketConnections only to interact with other ChanneledSocketConnections.
@@ -11,12 +28,194 @@ namespace SunNet {
 	methods for sending and receiving
 	*/
 	class ChanneledSocketConnection : public SocketConnection {
+	private:
+		/* Whether both sides have agreed to send traced frames */
+		std::atomic<bool> tracing;
+		std::atomic<uint32_t> next_trace_sequence;
+		uint32_t expected_trace_sequence; /** < Only touched by the polling thread */
+
+		/* The send time of the last traced frame received, and when it arrived, for echoing back */
+		std::atomic<int64_t> last_peer_send_time;
+		std::atomic<int64_t> last_peer_arrival_time;
+
+		/* Charged for every frame sent, and waited on by streams */
+		TokenBucket egress_limit;
+
+		/* Limits on what the peer sends, in bytes and in messages per channel. Only touched by the polling thread */
+		TokenBucket ingress_limit;
+		std::unordered_map<CHANNEL_ID, TokenBucket> channel_ingress_limits;
+		bool ingress_limited;
+		IngressAction ingress_action;
+		uint64_t ingress_drops;
+
+		/* The session this connection carries, if any. Set and cleared by the polling thread */
+		Session_p session;
+
+		void send_trace_control(TraceControl control) {
+			NETWORK_BYTE frame[2] = { TRACE_CONTROL_CHANNEL_ID, (NETWORK_BYTE)control };
+			this->send(frame, sizeof(frame));
+			this->count_sent(TRACE_CONTROL_CHANNEL_ID, sizeof(frame));
+		}
+
+		/* Send a message wrapped in a TraceHeader */
+		void traced_send(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size) {
+			TraceHeader header;
+			header.channel_id = channel_id;
+			header.sequence = this->next_trace_sequence++;
+			header.send_time = trace_clock_now();
+			header.echo_time = this->last_peer_send_time.load(std::memory_order_relaxed);
+			header.echo_delay = header.echo_time == 0 ? 0 :
+				header.send_time - this->last_peer_arrival_time.load(std::memory_order_relaxed);
+
+			CHANNEL_ID traced_channel_id = TRACED_CHANNEL_ID;
+			NETWORK_BYTE header_bytes[TRACE_HEADER_SIZE];
+			header.write(header_bytes);
+
+			SEND_VECTOR frame[3];
+			set_send_vector(&frame[0], &traced_channel_id, sizeof(CHANNEL_ID));
+			set_send_vector(&frame[1], header_bytes, TRACE_HEADER_SIZE);
+			set_send_vector(&frame[2], message, message_size);
+			this->send_vectored(frame, 3);
+			this->count_sent(channel_id, sizeof(CHANNEL_ID) + TRACE_HEADER_SIZE + message_size);
+		}
+
+		/* Send a message without tracing or a session */
+		void plain_send(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size) {
+			SEND_VECTOR frame[2];
+			set_send_vector(&frame[0], &channel_id, sizeof(CHANNEL_ID));
+			set_send_vector(&frame[1], message, message_size);
+			this->send_vectored(frame, 2);
+			this->count_sent(channel_id, sizeof(CHANNEL_ID) + message_size);
+		}
+
+		/*
+		Send a message numbered in the session. It is kept until the other side acknowledges
+		it, so a connection which has gone away is not an error; the message is resent when
+		the session resumes.
+		*/
+		void session_send(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size) {
+			Session_p session = this->session;
+			session->send(channel_id, message, message_size, [&]() {
+				try {
+					if (this->tracing.load(std::memory_order_relaxed)) {
+						this->traced_send(channel_id, message, message_size);
+					}
+					else {
+						this->plain_send(channel_id, message, message_size);
+					}
+				}
+				catch (SendException&) {}
+			});
+		}
+
+	protected:
+		/* Count a whole frame, channel id included, against its channel and this connection */
+		void count_sent(CHANNEL_ID channel_id, NETWORK_BYTE_SIZE frame_size) {
+			this->egress_limit.charge(frame_size);
+			SUNNET_METRICS_ONLY(
+				this->metrics.messages_sent.add();
+				Metrics::channels[channel_id].messages_sent.add();
+				Metrics::channels[channel_id].bytes_sent.add(frame_size);
+			)
+		}
+
 	public:
 		ChanneledSocketConnection(int domain, int type, int protocol) :
-			SocketConnection(domain, type, protocol) {}
+			SocketConnection(domain, type, protocol), tracing(false), next_trace_sequence(0), expected_trace_sequence(0),
+			last_peer_send_time(0), last_peer_arrival_time(0), ingress_limited(false), ingress_action(INGRESS_DROP), ingress_drops(0) {}
 
 		ChanneledSocketConnection(SOCKET socket_fd, int domain, int type, int protocol) :
-			SocketConnection(socket_fd, domain, type, protocol) {}
+			SocketConnection(socket_fd, domain, type, protocol), tracing(false), next_trace_sequence(0), expected_trace_sequence(0),
+			last_peer_send_time(0), last_peer_arrival_time(0), ingress_limited(false), ingress_action(INGRESS_DROP), ingress_drops(0) {}
+
+		/**
+		Limit how fast streams are sent on this connection. Messages are still sent right
+		away, but they count against the limit, so streams make way for them.
+
+		@param bytes_per_second The most bytes sent each second, or 0 for no limit
+		@param burst_bytes How far the connection may run ahead of the rate
+		*/
+		void set_egress_limit(uint64_t bytes_per_second, uint64_t burst_bytes) {
+			this->egress_limit.set_limit(bytes_per_second, burst_bytes);
+		}
+
+		/**
+		@return The limit set with set_egress_limit. Only the polling thread may refill it
+		*/
+		TokenBucket& get_egress_limit() { return this->egress_limit; }
+
+		/**
+		Limit how many bytes the peer may send each second in messages, calls and streams.
+		Frames over the limit are turned away before they are allocated or dispatched, as
+		set by set_ingress_action. A stream which loses a chunk this way is cancelled.
+
+		@param bytes_per_second The most bytes received each second, or 0 for no limit
+		@param burst_bytes How far the peer may run ahead of the rate
+		*/
+		void set_ingress_limit(uint64_t bytes_per_second, uint64_t burst_bytes) {
+			this->ingress_limit.set_limit(bytes_per_second, burst_bytes);
+			this->ingress_limited = this->ingress_limit.is_limited() || !this->channel_ingress_limits.empty();
+		}
+
+		/**
+		Limit how many messages and calls the peer may send each second on a channel.
+
+		@param messages_per_second The most messages received each second, or 0 for no limit
+		@param burst_messages How far the peer may run ahead of the rate
+		*/
+		template <typename TMessageType>
+		void set_channel_ingress_limit(uint64_t messages_per_second, uint64_t burst_messages) {
+			CHANNEL_ID channel_id = Channels::getChannelId<TMessageType>();
+			if (messages_per_second == 0) {
+				this->channel_ingress_limits.erase(channel_id);
+			}
+			else {
+				this->channel_ingress_limits[channel_id].set_limit(messages_per_second, burst_messages);
+			}
+			this->ingress_limited = this->ingress_limit.is_limited() || !this->channel_ingress_limits.empty();
+		}
+
+		/**
+		@param action What to do with frames over the ingress limits. Frames are dropped
+		unless told otherwise
+		*/
+		void set_ingress_action(IngressAction action) { this->ingress_action = action; }
+		IngressAction get_ingress_action() const { return this->ingress_action; }
+
+		/**
+		@return How many frames were turned away for breaking the ingress limits
+		*/
+		uint64_t get_ingress_drops() const { return this->ingress_drops; }
+
+		/**
+		Check a frame whose header has been read against the ingress limits, taking from
+		them if it is let in. Without limits this costs one branch.
+
+		@param channel_id The channel of the message in the frame
+		@param frame_size The size of the whole frame, channel id included
+		@return Whether the frame may be read in and dispatched
+		*/
+		bool admit_frame(CHANNEL_ID channel_id, NETWORK_BYTE_SIZE frame_size) {
+			if (!this->ingress_limited) {
+				return true;
+			}
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (!this->ingress_limit.try_take(frame_size, now)) {
+				this->ingress_drops++;
+				return false;
+			}
+
+			if (!this->channel_ingress_limits.empty()) {
+				auto channel_limit = this->channel_ingress_limits.find(channel_id);
+				if (channel_limit != this->channel_ingress_limits.end() && !channel_limit->second.try_take(1, now)) {
+					this->ingress_drops++;
+					return false;
+				}
+			}
+
+			return true;
+		}
 
 		/**
 		Send a message along a channel. The channel id is deduced from the template
@@ -27,11 +226,309 @@ namespace SunNet {
 		template <typename TMessageType>
 		void channeled_send(TMessageType* message) {
 			CHANNEL_ID channel_id = Channels::getChannelId<TMessageType>();
+			if (this->session) {
+				this->session_send(channel_id, (const NETWORK_BYTE*)message, sizeof(TMessageType));
+				return;
+			}
+
+			if (this->tracing.load(std::memory_order_relaxed)) {
+				this->traced_send(channel_id, (const NETWORK_BYTE*)message, sizeof(TMessageType));
+				return;
+			}
+
+			this->plain_send(channel_id, (const NETWORK_BYTE*)message, sizeof(TMessageType));
+		}
+
+		/**
+		Send a large message along a channel without copying it into the kernel, if
+		enable_zerocopy was called and the message is at least the threshold. See
+		SocketConnection::send_zerocopy. Traced messages, and messages in a session, which
+		keeps a copy anyway, are always copied.
+
+		@param message The message to send, which must not change or be freed until release is called
+		@param release Called on the polling thread once the kernel is done with the message
+		*/
+		template <typename TMessageType>
+		void channeled_send_zerocopy(const TMessageType* message, std::function<void()> release) {
+			CHANNEL_ID channel_id = Channels::getChannelId<TMessageType>();
+			if (this->session) {
+				this->session_send(channel_id, (const NETWORK_BYTE*)message, sizeof(TMessageType));
+				release();
+				return;
+			}
+
+			if (this->tracing.load(std::memory_order_relaxed)) {
+				this->traced_send(channel_id, (const NETWORK_BYTE*)message, sizeof(TMessageType));
+				release();
+				return;
+			}
+
+			this->send_zerocopy(&channel_id, sizeof(CHANNEL_ID), (const NETWORK_BYTE*)message, sizeof(TMessageType), std::move(release));
+			this->count_sent(channel_id, sizeof(CHANNEL_ID) + sizeof(TMessageType));
+		}
+
+		/**
+		Send a large message along a channel without copying it into the kernel, keeping
+		it alive until the kernel is done with it.
+
+		@param message The message to send, which must not change until it is released
+		*/
+		template <typename TMessageType>
+		void channeled_send_zerocopy(std::shared_ptr<TMessageType> message) {
+			const TMessageType* bytes = message.get();
+			this->channeled_send_zerocopy(bytes, [message]() {});
+		}
+
+		/**
+		Send a frame on one of the RPC channels. The frame carries the channel of the
+		message inside it and the correlation id that ties a response to its request.
+
+		@param rpc_channel_id Either RPC_REQUEST_CHANNEL_ID or RPC_RESPONSE_CHANNEL_ID
+		@param header The header naming the inner channel and correlation id
+		@param payload The inner message, which must be as large as its channel's message size
+		*/
+		void send_rpc_frame(CHANNEL_ID rpc_channel_id, const RpcHeader& header, const NETWORK_BYTE* payload) {
+			NETWORK_BYTE header_bytes[RPC_HEADER_SIZE];
+			header.write(header_bytes);
+
+			SEND_VECTOR frame[3];
+			set_send_vector(&frame[0], &rpc_channel_id, sizeof(CHANNEL_ID));
+			set_send_vector(&frame[1], header_bytes, RPC_HEADER_SIZE);
+			int count = 2;
+			NETWORK_BYTE_SIZE payload_size = 0;
+			if (payload != nullptr) {
+				payload_size = Channels::getChannel(header.channel_id)->getMessageSize();
+				set_send_vector(&frame[2], payload, payload_size);
+				count = 3;
+			}
+
+			this->send_vectored(frame, count);
+			this->count_sent(rpc_channel_id, sizeof(CHANNEL_ID) + RPC_HEADER_SIZE + payload_size);
+		}
+
+		/**
+		Read the header of a frame received on one of the RPC channels. The inner message
+		follows and may be read with channeled_read.
+		*/
+		RpcHeader rpc_read_header() {
+			NETWORK_BYTE header_bytes[RPC_HEADER_SIZE];
+			if (!this->receive(header_bytes, RPC_HEADER_SIZE)) {
+				throw ConnectionClosedException();
+			}
+
+			return RpcHeader::read(header_bytes);
+		}
+
+		/**
+		Send a frame on STREAM_CHANNEL_ID.
+
+		@param header The header naming the stream and what kind of frame this is
+		@param payload The header's length in bytes to send after it, or nullptr if it has none
+		*/
+		void send_stream_frame(const StreamHeader& header, const NETWORK_BYTE* payload) {
+			NETWORK_BYTE header_bytes[sizeof(CHANNEL_ID) + STREAM_HEADER_SIZE];
+			header_bytes[0] = STREAM_CHANNEL_ID;
+			header.write(header_bytes + sizeof(CHANNEL_ID));
+
+			SEND_VECTOR frame[2];
+			set_send_vector(&frame[0], header_bytes, sizeof(header_bytes));
+			int count = 1;
+			NETWORK_BYTE_SIZE payload_size = 0;
+			if (payload != nullptr) {
+				payload_size = header.length;
+				set_send_vector(&frame[1], payload, payload_size);
+				count = 2;
+			}
+
+			this->send_vectored(frame, count);
+			this->count_sent(STREAM_CHANNEL_ID, sizeof(header_bytes) + payload_size);
+		}
+
+		/**
+		Send a frame on STREAM_CHANNEL_ID whose payload is the header's length in bytes of
+		a file. See SocketConnection::send_file.
+
+		@param header The header naming the stream and what kind of frame this is
+		@param file The file to send from
+		@param offset Where in the file the payload starts
+		*/
+		void send_stream_file(const StreamHeader& header, int file, uint64_t offset) {
+			NETWORK_BYTE header_bytes[sizeof(CHANNEL_ID) + STREAM_HEADER_SIZE];
+			header_bytes[0] = STREAM_CHANNEL_ID;
+			header.write(header_bytes + sizeof(CHANNEL_ID));
+
+			this->send_file(header_bytes, sizeof(header_bytes), file, offset, header.length);
+			this->count_sent(STREAM_CHANNEL_ID, sizeof(header_bytes) + header.length);
+		}
+
+		/**
+		Read the header of a frame received on STREAM_CHANNEL_ID. Any payload follows.
+		*/
+		StreamHeader stream_read_header() {
+			NETWORK_BYTE header_bytes[STREAM_HEADER_SIZE];
+			if (!this->receive(header_bytes, STREAM_HEADER_SIZE)) {
+				throw ConnectionClosedException();
+			}
 
+			return StreamHeader::read(header_bytes);
+		}
+
+		/**
+		Send a heartbeat, which carries no payload and is never seen by subscribers.
+		Heartbeats only serve to show the other side that the connection is still alive.
+		*/
+		void send_heartbeat() {
+			CHANNEL_ID channel_id = HEARTBEAT_CHANNEL_ID;
 			this->send((NETWORK_BYTE*)&channel_id, sizeof(CHANNEL_ID));
-			this->send((NETWORK_BYTE*)message, sizeof(TMessageType));
+			this->count_sent(channel_id, sizeof(CHANNEL_ID));
+		}
+
+		/**
+		@return The session this connection carries, or nullptr if it is not in one
+		*/
+		const Session_p& get_session() const { return this->session; }
+
+		/**
+		Carry a session on this connection, numbering and keeping every channeled_send in it.
+		Only the polling thread may change the session.
+
+		@param session The session, or nullptr to leave it
+		*/
+		void set_session(Session_p session) { this->session = std::move(session); }
+
+		/**
+		Send a frame on SESSION_CHANNEL_ID.
+		*/
+		void send_session_frame(const SessionHeader& header) {
+			NETWORK_BYTE frame[sizeof(CHANNEL_ID) + SESSION_HEADER_SIZE];
+			frame[0] = SESSION_CHANNEL_ID;
+			header.write(frame + sizeof(CHANNEL_ID));
+
+			this->send(frame, sizeof(frame));
+			this->count_sent(SESSION_CHANNEL_ID, sizeof(frame));
+		}
+
+		/**
+		Read the header of a frame received on SESSION_CHANNEL_ID, which is the whole frame.
+		*/
+		SessionHeader session_read_header() {
+			NETWORK_BYTE header_bytes[SESSION_HEADER_SIZE];
+			if (!this->receive(header_bytes, SESSION_HEADER_SIZE)) {
+				throw ConnectionClosedException();
+			}
+			this->count_received(SESSION_CHANNEL_ID, sizeof(CHANNEL_ID) + SESSION_HEADER_SIZE);
+
+			return SessionHeader::read(header_bytes);
+		}
+
+		/**
+		Resend every message in the session which the other side has not acknowledged. See
+		Session::replay.
+
+		@return The number of messages resent
+		*/
+		SESSION_SEQUENCE replay_session() {
+			SESSION_SEQUENCE replayed = this->session->replay([this](SEND_VECTOR* frame, int count, NETWORK_BYTE_SIZE size) {
+				this->send_vectored(frame, count);
+				this->egress_limit.charge(size);
+			});
+			SUNNET_METRICS_ONLY(Metrics::global.replayed_messages.add(replayed));
+			return replayed;
+		}
+
+		/**
+		Count a whole frame which was received, channel id included, against its channel
+		and this connection. Called by whoever finishes reading the frame.
+		*/
+		void count_received(CHANNEL_ID channel_id, NETWORK_BYTE_SIZE frame_size) {
+			SUNNET_METRICS_ONLY(
+				this->metrics.messages_received.add();
+				Metrics::channels[channel_id].messages_received.add();
+				Metrics::channels[channel_id].bytes_received.add(frame_size);
+			)
 		}
 		
+		/**
+		Ask the other side to trace messages on this connection. Once it agrees, both sides
+		wrap every channeled_send in a TraceHeader, and the receiving side records one-way
+		and round-trip latencies per channel and counts gaps in the sequence numbers. Kernel
+		receive timestamps are used for the arrival time where the platform has them.
+
+		Both sides must be running a version of SunNet which understands tracing.
+		*/
+		void enable_tracing() {
+			this->enable_receive_timestamps();
+			this->send_trace_control(TRACE_OFFER);
+		}
+
+		/**
+		@return Whether messages sent on this connection are traced
+		*/
+		bool is_tracing() const { return this->tracing.load(std::memory_order_relaxed); }
+
+		/**
+		Read and act on a frame received on TRACE_CONTROL_CHANNEL_ID. An offer is always
+		accepted, and tracing starts in both directions.
+		*/
+		void trace_read_control() {
+			NETWORK_BYTE control;
+			if (!this->receive(&control, sizeof(control))) {
+				throw ConnectionClosedException();
+			}
+			this->count_received(TRACE_CONTROL_CHANNEL_ID, sizeof(CHANNEL_ID) + sizeof(control));
+
+			if (control == TRACE_OFFER) {
+				this->enable_receive_timestamps();
+				this->send_trace_control(TRACE_ACCEPT);
+				this->tracing = true;
+			}
+			else if (control == TRACE_ACCEPT) {
+				this->tracing = true;
+			}
+		}
+
+		/**
+		Read the header of a frame received on TRACED_CHANNEL_ID, recording its latencies
+		and any gap in the sequence numbers. The inner message follows and may be read with
+		channeled_read.
+
+		@return The header, naming the channel of the inner message
+		*/
+		TraceHeader trace_read_header() {
+			NETWORK_BYTE header_bytes[TRACE_HEADER_SIZE];
+			if (!this->receive(header_bytes, TRACE_HEADER_SIZE)) {
+				throw ConnectionClosedException();
+			}
+
+			TraceHeader header = TraceHeader::read(header_bytes);
+			int64_t arrival_time = this->get_last_kernel_receive_time();
+			if (arrival_time == 0) {
+				arrival_time = trace_clock_now();
+			}
+
+			this->last_peer_send_time.store(header.send_time, std::memory_order_relaxed);
+			this->last_peer_arrival_time.store(arrival_time, std::memory_order_relaxed);
+
+			SUNNET_METRICS_ONLY(
+				if (header.sequence != this->expected_trace_sequence) {
+					Metrics::global.trace_sequence_gaps.add((uint32_t)(header.sequence - this->expected_trace_sequence));
+				}
+
+				ChannelLatency& latency = Metrics::channel_latency(header.channel_id);
+				if (arrival_time > header.send_time) {
+					latency.one_way.record(CycleClock::from_nanoseconds((uint64_t)(arrival_time - header.send_time)));
+				}
+
+				int64_t round_trip = arrival_time - header.echo_time - header.echo_delay;
+				if (header.echo_time != 0 && round_trip > 0) {
+					latency.round_trip.record(CycleClock::from_nanoseconds((uint64_t)round_trip));
+				}
+			)
+			this->expected_trace_sequence = header.sequence + 1;
+
+			return header;
+		}
+
 		/**
 		Read the channel id from the connection.
 		*/
@@ -64,7 +561,10 @@ namespace SunNet {
 		@return A unique_ptr to the read bytes
 		*/
 		std::unique_ptr<NETWORK_BYTE[]> channeled_read(CHANNEL_ID id) {
-			std::shared_ptr<ChannelInterface> channel = Channels::getChannel(id);
+			ChannelInterface* channel = Channels::findChannel(id);
+			if (channel == nullptr) {
+				throw Channels::BadChannelException();
+			}
 			std::unique_ptr<NETWORK_BYTE[]> data = std::make_unique<NETWORK_BYTE[]>(channel->getMessageSize());
 
 			if (!this->receive(data.get(), channel->getMessageSize())) {
@@ -78,6 +578,23 @@ namespace SunNet {
 			return data;
 		}
 
+		/**
+		Read bytes off the connection and throw them away, such as a message which was
+		turned away. Nothing is allocated.
+
+		@param num_bytes How many bytes to throw away
+		*/
+		void channeled_skip(NETWORK_BYTE_SIZE num_bytes) {
+			NETWORK_BYTE discard[1024];
+			while (num_bytes > 0) {
+				NETWORK_BYTE_SIZE size = std::min<NETWORK_BYTE_SIZE>(num_bytes, sizeof(discard));
+				if (!this->receive(discard, size)) {
+					throw ConnectionClosedException();
+				}
+				num_bytes -= size;
+			}
+		}
+
 		class ConnectionClosedException : std::exception {};
 	};
 
@@ -1,6 +1,7 @@
 #pragma once
 #include "socketutil.h"
 
+#include <array>
 #include <map>
 #include <typeindex>
 #include <memory>
@@ -9,6 +10,42 @@
 namespace SunNet {
 	typedef NETWORK_BYTE CHANNEL_ID;
 
+	/**
+	Channel ids at or above this value are reserved for SunNet's own control
+	traffic and are never handed out by Channels::addNewChannel
+	*/
+	const CHANNEL_ID FIRST_RESERVED_CHANNEL_ID = 0xF0;
+
+	/**
+	The reserved channels. Messages on these channels are handled by SunNet
+	itself and are never propagated to subscriptions.
+	*/
+	enum ReservedChannel : CHANNEL_ID {
+		HEARTBEAT_CHANNEL_ID = 0xFF, /** < Keeps an otherwise quiet connection alive. Carries no payload */
+		RPC_REQUEST_CHANNEL_ID = 0xFE, /** < Carries an RPC request wrapped with its correlation id */
+		RPC_RESPONSE_CHANNEL_ID = 0xFD, /** < Carries an RPC response wrapped with its correlation id */
+		TRACED_CHANNEL_ID = 0xFC, /** < Carries a message wrapped with a sequence number and timestamps */
+		TRACE_CONTROL_CHANNEL_ID = 0xFB, /** < Negotiates whether messages on a connection are traced */
+		RELIABLE_ORDERED_CHANNEL_ID = 0xFA, /** < Wraps a frame which a datagram transport delivers once and in order */
+		RELIABLE_UNORDERED_CHANNEL_ID = 0xF9, /** < Wraps a frame which a datagram transport delivers once, in any order */
+		SEQUENCED_CHANNEL_ID = 0xF8, /** < Wraps a frame which a datagram transport drops if a newer one arrived first */
+		ACK_CHANNEL_ID = 0xF7, /** < Acknowledges reliable frames received over a datagram transport */
+		STREAM_CHANNEL_ID = 0xF6, /** < Carries a frame of a stream, or the receiver's reply to one */
+		SESSION_CHANNEL_ID = 0xF5 /** < Opens, resumes and acknowledges a session which outlives its connection */
+	};
+
+	/**
+	How messages on a channel are delivered over a datagram transport, such as UDP.
+	Stream transports, such as TCP, deliver every message once and in order whatever
+	the channel's mode.
+	*/
+	enum DeliveryMode {
+		UNRELIABLE, /** < Messages may be lost, duplicated or reordered */
+		UNRELIABLE_SEQUENCED, /** < Messages may be lost, but one older than the newest already received is dropped */
+		RELIABLE_UNORDERED, /** < Messages are resent until acknowledged and delivered once, as soon as they arrive */
+		RELIABLE_ORDERED /** < Messages are resent until acknowledged and delivered once, in the order they were sent */
+	};
+
 	template <class TData>
   class Channel;
 
@@ -23,10 +60,12 @@ namespace SunNet {
 	private:
 		NETWORK_BYTE_SIZE message_size;
 		CHANNEL_ID channel_id;
+		DeliveryMode delivery_mode;
 	public:
-		ChannelInterface(NETWORK_BYTE_SIZE size, CHANNEL_ID id);
+		ChannelInterface(NETWORK_BYTE_SIZE size, CHANNEL_ID id, DeliveryMode mode = RELIABLE_ORDERED);
 		NETWORK_BYTE_SIZE getMessageSize() { return this->message_size; }
 		CHANNEL_ID getId() { return this->channel_id; }
+		DeliveryMode getDeliveryMode() { return this->delivery_mode; }
 	};
 
 	/**
@@ -38,7 +77,8 @@ namespace SunNet {
 	*/
 	class Channels {
 	private:
-		static std::map<CHANNEL_ID, std::shared_ptr<ChannelInterface>> ids_to_channels;
+		/* Indexed by id, so that looking up the channel of every received frame is one load */
+		static std::array<std::shared_ptr<ChannelInterface>, 256> ids_to_channels;
 		static std::map<std::type_index, CHANNEL_ID> types_to_ids;
 
 		/* Used to create IDs for new channels */
@@ -72,24 +112,49 @@ namespace SunNet {
 		*/
 		static std::shared_ptr<ChannelInterface> getChannel(CHANNEL_ID id);
 
+		/**
+		Find the channel with the provided id, without throwing. Used on the receive path,
+		where a peer may send any id at all.
+
+		@param id The channel id to look up
+		@return The channel, or nullptr if there is no channel with the given id. The
+		channel lives as long as the program
+		*/
+		static ChannelInterface* findChannel(CHANNEL_ID id) {
+			return ids_to_channels[id].get();
+		}
+
 		/**
 		Get the next id and increment the counter afterwards
+
+		@throws TooManyChannelsException if every unreserved id has been used
 		*/
-		static CHANNEL_ID getNextId() { return channel_counter++; }
+		static CHANNEL_ID getNextId() {
+			CHANNEL_ID id = channel_counter++;
+			if (id >= FIRST_RESERVED_CHANNEL_ID) {
+				throw TooManyChannelsException();
+			}
+
+			return id;
+		}
 
 		/**
 		Adds a new channel with the given type, automatically adding assigning an
 		id to it and adding it to the proper maps. The type is given as a template
 		parameter.
+
+		@param mode How messages on the channel are delivered over datagram transports.
+		Both sides must add the channel with the same mode.
 		*/
 		template <class TChannelType>
-		static void addNewChannel() {
-			std::shared_ptr<ChannelInterface> channel = std::make_shared<Channel<TChannelType>>();
+		static void addNewChannel(DeliveryMode mode = RELIABLE_ORDERED) {
+			std::shared_ptr<ChannelInterface> channel = std::make_shared<Channel<TChannelType>>(mode);
 			Channels::ids_to_channels[channel->getId()] = channel;
 			Channels::types_to_ids[typeid(TChannelType)] = channel->getId();
 		}
 
 		class BadChannelException : std::exception {};
+		class TooManyChannelsException : std::exception {};
 	};
 
 
@@ -99,6 +164,6 @@ namespace SunNet {
 	template <class TData>
 	class Channel : public ChannelInterface {
 	public:
-		Channel() : ChannelInterface(sizeof(TData), Channels::getNextId()) {}
+		Channel(DeliveryMode mode = RELIABLE_ORDERED) : ChannelInterface(sizeof(TData), Channels::getNextId(), mode) {}
 	};
 }
@@ -5,6 +5,7 @@
 #include <thread>
 #include <initializer_list>
 #include <functional>
+#include <algorithm>
 
 namespace SunNet {
 	/**
@@ -66,20 +67,91 @@ namespace SunNet {
 		*/
 		std::function<SocketConnection_p()> connection_create_func;
 
-		
+		/* Where the connection was last opened to, for reconnect */
+		std::string address;
+		std::string port;
+
+		/* The most messages and bytes read from the server per readiness event, and how often that was not enough */
+		size_t read_budget_messages;
+		size_t read_budget_bytes;
+		uint64_t read_budget_exhaustions;
+
+		/*
+		Handle messages from the server until nothing is left buffered or the read budget
+		runs out, in which case the connection is marked ready for the next poll() so that
+		timers get a chance to fire in between.
+		*/
+		void read_from_server() {
+			SocketConnection_p server = this->connection;
+			ConnectionHandle handle = server->get_handle();
+			uint64_t start_bytes = server->get_bytes_received();
+
+			for (size_t messages = 1; ; messages++) {
+				this->handle_client_ready_to_read();
+
+				/* The handler may have disconnected */
+				if (this->state != CLIENT_CONNECTED || !this->poll_service.contains(handle) || server->buffered_bytes() == 0) {
+					return;
+				}
+
+				if (messages >= this->read_budget_messages ||
+					(this->read_budget_bytes > 0 && server->get_bytes_received() - start_bytes >= this->read_budget_bytes)) {
+					this->read_budget_exhaustions++;
+					SUNNET_METRICS_ONLY(Metrics::global.read_budget_exhaustions.add());
+					this->poll_service.mark_ready(handle);
+					return;
+				}
+			}
+		}
+
+		/* How long the server may stay silent before the connection is reported as disconnected */
+		std::chrono::milliseconds idle_timeout;
+		TIMER_ID idle_check_timer;
+
+		void check_idle() {
+			if (this->state != CLIENT_CONNECTED) {
+				return;
+			}
+
+			if (this->connection->get_last_receive_time() < std::chrono::steady_clock::now() - this->idle_timeout) {
+				this->handle_client_disconnect();
+			}
+		}
 
 	protected:
 		std::shared_ptr<SocketConnection> connection;
 
+		/**
+		Get the timers fired by this client's poll()
+		*/
+		TimerWheel& get_timers() {
+			return this->poll_service.get_timers();
+		}
+
+		/**
+		Report the connection through handle_client_ready_to_write once it can be sent on,
+		such as after a send found its buffer full. It is reported once per call.
+		*/
+		void watchForWriting() {
+			if (this->connection) {
+				this->poll_service.set_writing(this->connection->get_handle(), true);
+			}
+		}
+
 		/* Hooks to be implemented by the inheritor */
 		virtual void handle_client_error() = 0;
 		virtual void handle_client_ready_to_read() = 0;
 		virtual void handle_poll_timeout() = 0;
 		virtual void handle_client_disconnect() = 0;
 
+		/* Called once the connection can be sent on after watchForWriting. Does nothing unless overridden */
+		virtual void handle_client_ready_to_write() {}
+
 	public:
 		template <class ... ArgTypes>
-		Client(int poll_timeout, ArgTypes ... args) : state(CLIENT_CLOSED) {
+		Client(int poll_timeout, ArgTypes ... args) :
+			state(CLIENT_CLOSED), read_budget_messages(64), read_budget_bytes(64 * 1024), read_budget_exhaustions(0),
+			idle_timeout(0), idle_check_timer(INVALID_TIMER_ID) {
 			this->connection_create_func = [=]() { return std::make_shared<TSocketConnection>(args...); };
 			this->poll_service = PollService(poll_timeout);
 		}
@@ -122,6 +194,8 @@ namespace SunNet {
 		void connect(std::string address, std::string port) {
 			this->assert_valid_state({ CLIENT_CLOSED });
 
+			this->address = address;
+			this->port = port;
 			this->connection = this->connection_create_func();
 			this->connection->connect(address, port);
 			this->poll_service.add_socket(this->connection);
@@ -154,6 +228,22 @@ namespace SunNet {
 			this->connection.reset();
 		}
 
+		/**
+		Drop the connection, if there is one, and connect again to the address last passed
+		to connect, such as after the connection dropped. Timers carry on.
+
+		@throws InvalidStateTransitionException if the client is being destructed
+		*/
+		void reconnect() {
+			this->assert_valid_state({ CLIENT_CONNECTED, CLIENT_CLOSED });
+
+			this->poll_service.clear_sockets();
+			this->connection.reset();
+			this->state = CLIENT_CLOSED;
+
+			this->connect(this->address, this->port);
+		}
+
 		/**
 		Send data along the connection
 
@@ -189,24 +279,24 @@ namespace SunNet {
 			if (this->state != CLIENT_CONNECTED) {
 				return false;
 			}
-			SocketCollection_p ready_sockets = this->poll_service.poll();
+			const PollEventList& ready_sockets = this->poll_service.poll();
 
-			if (ready_sockets->size() == 0) {
+			if (ready_sockets.empty() && this->poll_service.get_writable().empty()) {
 				/* CHECKPOINT */
 				if (this->state == CLIENT_DESTRUCTING) return false;
 				this->handle_poll_timeout();
 				return false;
 			}
 
-			for (auto socket_iter = ready_sockets->begin(); socket_iter != ready_sockets->end(); ++socket_iter) {
+			for (const PollEvent& event : ready_sockets) {
 
-				if (socket_iter->connection == this->connection) {
-					if (socket_iter->status == SOCKET_STATUS_ERROR) {
+				if (this->connection && event.handle == this->connection->get_handle()) {
+					if (event.status == SOCKET_STATUS_ERROR) {
 						/* CHECKPOINT */
 						if (this->state == CLIENT_DESTRUCTING) return false;
 						this->handle_client_error();
 					}
-					else if (socket_iter->status == SOCKET_STATUS_DISCONNECT) {
+					else if (event.status == SOCKET_STATUS_DISCONNECT) {
 						/* CHECKPOINT */
 						if (this->state == CLIENT_DESTRUCTING) return false;
 						this->handle_client_disconnect();
@@ -214,17 +304,97 @@ namespace SunNet {
 					else {
 						/* CHECKPOINT */
 						if (this->state == CLIENT_DESTRUCTING) return false;
-						this->handle_client_ready_to_read();
+						SUNNET_METRICS_ONLY(Metrics::latency.dispatch_delay.record_since(this->poll_service.get_poll_return_ticks()));
+						this->read_from_server();
 					}
 				}
 				else {
 					throw InvalidSocketPollException();
 				}
 			}
+
+			/* After reads, so that a connection which hung up is already reported */
+			for (const ConnectionHandle& handle : this->poll_service.get_writable()) {
+				/* CHECKPOINT */
+				if (this->state == CLIENT_DESTRUCTING) return false;
+				if (this->connection && handle == this->connection->get_handle()) {
+					this->handle_client_ready_to_write();
+				}
+			}
+			SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
 			return true;
 		}
 
 
+		/**
+		Schedule a callback to fire once on the polling thread after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_timer(std::chrono::milliseconds delay, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule(delay, std::move(callback));
+		}
+
+		/**
+		Schedule a callback to fire on the polling thread every interval until it is cancelled.
+
+		@param interval How long to wait between firings
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_repeating_timer(std::chrono::milliseconds interval, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule_repeating(interval, std::move(callback));
+		}
+
+		/**
+		Cancel a timer scheduled with schedule_timer or schedule_repeating_timer.
+
+		@param id The id of the timer to cancel
+		@return Whether the timer was still pending
+		*/
+		bool cancel_timer(TIMER_ID id) {
+			return this->poll_service.get_timers().cancel(id);
+		}
+
+		/**
+		Set how much is read from the server each time it is ready. Whatever is left is
+		read on the next poll(), which does not wait.
+
+		@param max_messages The most times handle_client_ready_to_read is called per readiness. Defaults to 64.
+		@param max_bytes The most bytes received per readiness, or 0 for no limit. Defaults to 64KiB.
+		*/
+		void set_read_budget(size_t max_messages, size_t max_bytes) {
+			this->read_budget_messages = std::max(max_messages, (size_t)1);
+			this->read_budget_bytes = max_bytes;
+		}
+
+		/**
+		@return How many times the server still had data waiting after the whole read budget was used
+		*/
+		uint64_t get_read_budget_exhaustions() const {
+			return this->read_budget_exhaustions;
+		}
+
+		/**
+		Report the connection through handle_client_disconnect if the server has not
+		sent anything for the given amount of time.
+
+		@param timeout How long the server may stay silent. Zero disables idle detection.
+		*/
+		void set_idle_timeout(std::chrono::milliseconds timeout) {
+			this->cancel_timer(this->idle_check_timer);
+			this->idle_check_timer = INVALID_TIMER_ID;
+			this->idle_timeout = timeout;
+
+			if (timeout.count() > 0) {
+				std::chrono::milliseconds check_interval = std::max(timeout / 4, std::chrono::milliseconds(1));
+				this->idle_check_timer = this->schedule_repeating_timer(check_interval, [this]() { this->check_idle(); });
+			}
+		}
+
+
 		class ClientException : public std::exception {};
 		class InvalidStateTransitionException : public ClientException {};
 		class InvalidSocketPollException : public ClientException {};
@@ -0,0 +1,46 @@
+/**
+@file connection_handle.h
+@brief A compact, stable reference to a connection watched by a PollService
+*/
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace SunNet {
+
+	/**
+	Refers to a connection watched by a PollService by its slot and the generation of
+	that slot. Once the connection is removed the slot's generation changes, so an old
+	handle can be recognized as stale even after the slot is reused.
+
+	Handles are eight bytes and trivially copyable, so they can be stored instead of
+	a SocketConnection_p without keeping the connection alive.
+	*/
+	struct ConnectionHandle {
+		uint32_t index;
+		uint32_t generation; /** < Never 0 for a handle which once referred to a connection */
+
+		bool is_valid() const { return this->generation != 0; }
+
+		friend bool operator==(const ConnectionHandle& lhs, const ConnectionHandle& rhs) {
+			return lhs.index == rhs.index && lhs.generation == rhs.generation;
+		}
+
+		friend bool operator!=(const ConnectionHandle& lhs, const ConnectionHandle& rhs) {
+			return !(lhs == rhs);
+		}
+	};
+
+	/* A handle which never refers to a connection */
+	const ConnectionHandle INVALID_CONNECTION_HANDLE = { 0, 0 };
+}
+
+namespace std {
+	template <>
+	struct hash<SunNet::ConnectionHandle> {
+		std::size_t operator()(const SunNet::ConnectionHandle& handle) const {
+			return std::hash<uint64_t>()(((uint64_t)handle.generation << 32) | handle.index);
+		}
+	};
+}
@@ -0,0 +1,106 @@
+/**
+@file coroutine_task.h
+@brief A detached coroutine type for writing multi-step protocols, driven by the poll loop
+*/
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SUNNET_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef SUNNET_HAS_COROUTINES
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+
+namespace SunNet {
+
+	/**
+	Hands out memory for coroutine frames from per-thread free lists, bucketed by size.
+	Frames are recycled instead of being returned to the global heap, so a protocol that
+	keeps starting coroutines only touches the heap while the free lists warm up.
+	*/
+	class CoroutineFrameAllocator {
+	public:
+		static void* allocate(std::size_t size);
+		static void deallocate(void* frame, std::size_t size);
+	};
+
+	/**
+	Resume a suspended Task. If the task throws, the exception is rethrown from here once
+	the task's frame has been cleaned up, so errors surface from poll() like errors thrown
+	by subscription callbacks.
+
+	@param handle The task to resume
+	*/
+	void resume_task(std::coroutine_handle<> handle);
+
+	/**
+	A coroutine which runs on the polling thread once it is spawned. A Task is never
+	awaited; it runs until its first co_await inside spawn(), and is then resumed by
+	poll() whenever what it awaits is ready. Its frame is freed when it finishes.
+
+	Example:
+		SunNet::Task login(SunNet::AsyncConnection connection) {
+			std::shared_ptr<Hello> hello = co_await connection.recv<Hello>();
+			co_await connection.send(Welcome{ hello->player_id });
+		}
+
+		SunNet::spawn(login(server.async_connection(client)));
+	*/
+	class Task {
+	public:
+		struct promise_type {
+			Task get_return_object() {
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception();
+
+			static void* operator new(std::size_t size) {
+				return CoroutineFrameAllocator::allocate(size);
+			}
+
+			static void operator delete(void* frame, std::size_t size) {
+				CoroutineFrameAllocator::deallocate(frame, size);
+			}
+		};
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+
+		explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+		friend void spawn(Task task);
+
+	public:
+		Task(Task&& other) noexcept : handle(other.handle) {
+			other.handle = nullptr;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		/* A Task which was never spawned never runs */
+		~Task() {
+			if (this->handle) {
+				this->handle.destroy();
+			}
+		}
+	};
+
+	/**
+	Start running a Task. The task runs until its first suspension before this returns.
+
+	@param task The task to run
+	*/
+	void spawn(Task task);
+}
+
+#endif
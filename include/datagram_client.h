@@ -0,0 +1,242 @@
+/**
+@file datagram_client.h
+@brief A channeled client for UDP
+*/
+#pragma once
+
+#include "udp_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include "client.h"
+#include "channel_subscribable.h"
+
+namespace SunNet {
+
+	/**
+	A client for a DatagramServer. Messages are sent and subscribed to as with a
+	ChanneledClient, and each channel is delivered according to the DeliveryMode it was
+	added with.
+
+	Sends are queued, packed into as few datagrams as they fit in, and sent together
+	with sendmmsg at the end of poll(). Call flush() to send them sooner. Datagrams
+	are received UDP_BATCH_SIZE at a time with recvmmsg.
+
+	Connecting only fixes the server's address; nothing is sent until the first message.
+	The server is reported through handle_client_error if it is unreachable, and through
+	handle_client_disconnect if it goes silent for the idle timeout.
+	*/
+	class DatagramClient : public ChannelSubscribable {
+	private:
+		std::shared_ptr<UDPSocketConnection> connection;
+		UDPPeer_p server;
+
+		PollService poll_service;
+
+		ClientState state;
+
+		/* The most batches received per readiness event, and how often that was not enough */
+		size_t read_budget_batches;
+		uint64_t read_budget_exhaustions;
+
+		std::chrono::milliseconds idle_timeout;
+		TIMER_ID idle_check_timer;
+
+		std::chrono::milliseconds heartbeat_interval;
+		TIMER_ID heartbeat_timer;
+
+		/* Runs only while reliable messages are waiting for acks */
+		TIMER_ID retransmit_timer;
+
+		void state_transition(std::initializer_list<ClientState> const& valid_from_states, ClientState new_state);
+
+		/* Receive batches until the socket is empty or the read budget runs out */
+		void read_datagrams();
+
+		void check_idle();
+		void send_heartbeat();
+		void retransmit();
+
+	protected:
+		/* Let ChannelSubscribable time out calls using the client's timers */
+		TimerWheel* getTimerWheel() {
+			return &this->poll_service.get_timers();
+		}
+
+		/* A datagram never closes its peer, but pass it on if it is ever reported */
+		void handleSocketDisconnect(ChanneledSocketConnection_p) {
+			this->handle_client_disconnect();
+		}
+
+		/**
+		Get the timers fired by this client's poll()
+		*/
+		TimerWheel& get_timers() {
+			return this->poll_service.get_timers();
+		}
+
+		/**** Handlers for DatagramClient ****/
+		virtual void handle_client_error() = 0;
+		virtual void handle_client_disconnect() = 0;
+		virtual void handle_poll_timeout() = 0;
+
+	public:
+		/**
+		@param poll_timeout How long poll() waits for datagrams, in milliseconds
+		*/
+		DatagramClient(int poll_timeout);
+		virtual ~DatagramClient();
+
+		/**
+		Fix the address of the server that messages are sent to and received from.
+		@throws ConnectException if the address cannot be resolved
+		*/
+		void connect(std::string address, std::string port);
+
+		/**
+		Send anything still queued and close the socket.
+		@throws InvalidStateTransitionException if the client is not connected
+		*/
+		void disconnect();
+
+		/**
+		Wait for datagrams and handle every frame in them, then send every datagram
+		queued since the last poll().
+		@return Whether anything was received
+		*/
+		bool poll();
+
+		/**
+		Send every queued datagram now instead of at the end of poll(), along with acks
+		for any reliable frames received.
+		*/
+		void flush();
+
+		/**
+		@return The server, as the connection which subscriptions see messages come from
+		*/
+		ChanneledSocketConnection_p get_server() const {
+			return this->server;
+		}
+
+		/**
+		Send a message to the server upon a specific channel. The channel is determined
+		by the template type. The message is queued until the next flush.
+
+		@param message The object to send
+		@throws SendException with EMSGSIZE if the message does not fit in a datagram, or
+		with ENOBUFS if too many reliable messages are waiting for acks
+		*/
+		template <class TMessageType>
+		void channeled_send(TMessageType* message) {
+			this->server->channeled_send<TMessageType>(message);
+		}
+
+		using ChannelSubscribable::call;
+
+		/**
+		Make a call to the server, returning a future for the response. Since the request
+		or the response may be lost, give calls a timeout suited to the network.
+
+		@param request The request to send
+		@param timeout How long to wait for the response
+		@return A future for the response, which throws an RpcException if the call failed
+		*/
+		template <class TRequest, class TResponse>
+		std::future<std::shared_ptr<TResponse>> call(const TRequest& request, std::chrono::milliseconds timeout = DEFAULT_RPC_TIMEOUT) {
+			return this->call<TRequest, TResponse>(this->get_server(), request, timeout);
+		}
+
+		/**
+		Ask the server to trace messages in both directions. See
+		ChanneledSocketConnection::enable_tracing. Gaps in the sequence numbers count
+		lost datagrams.
+		*/
+		void enable_tracing() {
+			this->server->enable_tracing();
+		}
+
+		/**
+		Schedule a callback to fire once on the polling thread after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_timer(std::chrono::milliseconds delay, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule(delay, std::move(callback));
+		}
+
+		/**
+		Schedule a callback to fire on the polling thread every interval until it is cancelled.
+
+		@param interval How long to wait between firings
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_repeating_timer(std::chrono::milliseconds interval, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule_repeating(interval, std::move(callback));
+		}
+
+		/**
+		Cancel a timer scheduled with schedule_timer or schedule_repeating_timer.
+
+		@param id The id of the timer to cancel
+		@return Whether the timer was still pending
+		*/
+		bool cancel_timer(TIMER_ID id) {
+			return this->poll_service.get_timers().cancel(id);
+		}
+
+		/**
+		Set how many batches of datagrams are received each time the socket is ready.
+
+		@param max_batches The most batches of UDP_BATCH_SIZE datagrams. Defaults to 4.
+		*/
+		void set_read_budget(size_t max_batches) {
+			this->read_budget_batches = std::max(max_batches, (size_t)1);
+		}
+
+		/**
+		@return How many times datagrams were still waiting after the whole read budget was used
+		*/
+		uint64_t get_read_budget_exhaustions() const {
+			return this->read_budget_exhaustions;
+		}
+
+		/**
+		@return The number of datagrams which were truncated or malformed, or which could
+		not be sent
+		*/
+		uint64_t get_dropped_datagrams() const {
+			return this->connection ? this->connection->get_dropped_datagrams() : 0;
+		}
+
+		/**
+		Report the server through handle_client_disconnect once it has sent nothing for
+		the given amount of time.
+
+		@param timeout How long the server may stay silent. Zero disables idle detection.
+		*/
+		void set_idle_timeout(std::chrono::milliseconds timeout);
+
+		/**
+		Send a heartbeat whenever nothing else has been sent to the server for an interval,
+		and report the server through handle_client_disconnect if it goes silent.
+
+		@param interval How often to check whether the server needs a heartbeat
+		@param idle_timeout How long the server may stay silent
+		*/
+		void enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout);
+
+		/**
+		Stop sending heartbeats and stop watching for a silent server.
+		*/
+		void disable_heartbeat();
+
+		class ClientException : public std::exception {};
+		class InvalidStateTransitionException : public ClientException {};
+	};
+}
+
+#endif
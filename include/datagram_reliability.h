@@ -0,0 +1,241 @@
+/**
+@file datagram_reliability.h
+@brief Acknowledgement, retransmission and ordering for channels sent over datagrams
+*/
+#pragma once
+
+#include "channels.h"
+#include "socket_connection.h"
+
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace SunNet {
+
+	/* The most reliable messages of one kind which may wait for an ack on one connection */
+	const uint32_t RELIABLE_WINDOW = 1024;
+
+	/* The size of a DeliveryHeader on the wire */
+	const NETWORK_BYTE_SIZE DELIVERY_HEADER_SIZE = sizeof(CHANNEL_ID) + sizeof(uint32_t) + sizeof(uint16_t);
+
+	/* The size of an AckRecord on the wire */
+	const NETWORK_BYTE_SIZE ACK_RECORD_SIZE = 2 * sizeof(CHANNEL_ID) + 2 * sizeof(uint32_t);
+
+	/* Bounds on how long a reliable message waits for its ack before it is sent again */
+	const std::chrono::microseconds INITIAL_RETRANSMIT_TIMEOUT(200000);
+	const std::chrono::microseconds MIN_RETRANSMIT_TIMEOUT(10000);
+	const std::chrono::microseconds MAX_RETRANSMIT_TIMEOUT(2000000);
+
+	/* How often a connection with unacknowledged messages checks whether any are due */
+	const std::chrono::milliseconds RETRANSMIT_CHECK_INTERVAL(10);
+
+	/**
+	The header in front of a frame sent on RELIABLE_ORDERED_CHANNEL_ID,
+	RELIABLE_UNORDERED_CHANNEL_ID or SEQUENCED_CHANNEL_ID. The whole frame follows, so
+	that a receiver may skip or hold it without parsing it.
+	*/
+	struct DeliveryHeader {
+		CHANNEL_ID marker; /** < Which of the wrapping channels this is */
+		uint32_t id; /** < Counts up by one per message of this kind; per channel for sequenced messages */
+		uint16_t frame_size;
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = this->marker;
+			std::memcpy(bytes + sizeof(CHANNEL_ID), &this->id, sizeof(uint32_t));
+			std::memcpy(bytes + sizeof(CHANNEL_ID) + sizeof(uint32_t), &this->frame_size, sizeof(uint16_t));
+		}
+
+		static DeliveryHeader read(const NETWORK_BYTE* bytes) {
+			DeliveryHeader header;
+			header.marker = bytes[0];
+			std::memcpy(&header.id, bytes + sizeof(CHANNEL_ID), sizeof(uint32_t));
+			std::memcpy(&header.frame_size, bytes + sizeof(CHANNEL_ID) + sizeof(uint32_t), sizeof(uint16_t));
+			return header;
+		}
+	};
+
+	/**
+	A selective acknowledgement, sent on ACK_CHANNEL_ID. Every message before base has
+	been received, and bit i of bits says whether base + 1 + i has been.
+	*/
+	struct AckRecord {
+		CHANNEL_ID marker; /** < The kind of reliable message being acknowledged */
+		uint32_t base;
+		uint32_t bits;
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = ACK_CHANNEL_ID;
+			bytes[1] = this->marker;
+			std::memcpy(bytes + 2 * sizeof(CHANNEL_ID), &this->base, sizeof(uint32_t));
+			std::memcpy(bytes + 2 * sizeof(CHANNEL_ID) + sizeof(uint32_t), &this->bits, sizeof(uint32_t));
+		}
+
+		static AckRecord read(const NETWORK_BYTE* bytes) {
+			AckRecord ack;
+			ack.marker = bytes[1];
+			std::memcpy(&ack.base, bytes + 2 * sizeof(CHANNEL_ID), sizeof(uint32_t));
+			std::memcpy(&ack.bits, bytes + 2 * sizeof(CHANNEL_ID) + sizeof(uint32_t), sizeof(uint32_t));
+			return ack;
+		}
+	};
+
+	/**
+	A smoothed round-trip time and the retransmit timeout which follows from it, as
+	described in RFC 6298.
+	*/
+	class RoundTripEstimator {
+	private:
+		std::chrono::microseconds smoothed;
+		std::chrono::microseconds variation;
+		std::chrono::microseconds timeout;
+		bool has_sample;
+
+	public:
+		RoundTripEstimator();
+
+		/**
+		@param sample The time from sending a message to its ack, for a message which was
+		only sent once
+		*/
+		void record(std::chrono::microseconds sample);
+
+		/**
+		@return The smoothed round-trip time, or zero before the first sample
+		*/
+		std::chrono::microseconds get_round_trip_time() const { return this->smoothed; }
+
+		std::chrono::microseconds get_retransmit_timeout() const { return this->timeout; }
+	};
+
+	/**
+	The sending side of one kind of reliable message on a connection. Every message is
+	kept, already wrapped, until the peer acknowledges it.
+	*/
+	class ReliableSender {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+	private:
+		struct Unacked {
+			std::vector<NETWORK_BYTE> record; /** < The DeliveryHeader and frame, ready to send again */
+			Clock::time_point last_sent;
+			unsigned int transmissions;
+		};
+
+		CHANNEL_ID marker;
+		uint32_t next_id;
+		std::map<uint32_t, Unacked> unacked;
+
+		/* Forget a message, learning from its round trip if it was only sent once */
+		void forget(std::map<uint32_t, Unacked>::iterator message, Clock::time_point now, RoundTripEstimator& round_trip);
+
+	public:
+		/**
+		@param marker RELIABLE_ORDERED_CHANNEL_ID or RELIABLE_UNORDERED_CHANNEL_ID
+		*/
+		ReliableSender(CHANNEL_ID marker);
+
+		/**
+		Wrap a frame in a DeliveryHeader and keep it until it is acknowledged.
+		@param vectors The frame
+		@param count The number of buffers in the frame
+		@param now When the frame is being sent
+		@return The record to send, which stays valid until the frame is acknowledged
+		@throws SendException with ENOBUFS if RELIABLE_WINDOW messages are already waiting
+		*/
+		const std::vector<NETWORK_BYTE>& wrap(SEND_VECTOR* vectors, int count, Clock::time_point now);
+
+		/**
+		Forget every message the ack covers.
+		@return The number of messages forgotten
+		*/
+		size_t acknowledge(const AckRecord& ack, Clock::time_point now, RoundTripEstimator& round_trip);
+
+		/**
+		Send again every message which has waited too long for its ack. The wait doubles
+		with each transmission of a message, up to MAX_RETRANSMIT_TIMEOUT.
+		@param send Called with the record of each message to send again
+		@return The number of messages sent again
+		*/
+		template <class TCallback>
+		size_t retransmit(Clock::time_point now, std::chrono::microseconds timeout, TCallback send) {
+			size_t sent = 0;
+			for (auto& message : this->unacked) {
+				std::chrono::microseconds backoff = std::min(timeout * (1 << std::min(message.second.transmissions - 1, 5u)),
+					MAX_RETRANSMIT_TIMEOUT);
+				if (now - message.second.last_sent < backoff) {
+					continue;
+				}
+
+				send(message.second.record);
+				message.second.last_sent = now;
+				message.second.transmissions++;
+				sent++;
+			}
+			return sent;
+		}
+
+		/**
+		@return The number of messages waiting for an ack
+		*/
+		size_t unacked_count() const { return this->unacked.size(); }
+	};
+
+	/**
+	What to do with a reliable frame which has just arrived
+	*/
+	enum DeliveryDecision {
+		DELIVER, /** < Hand it to subscribers now */
+		HOLD, /** < Ordered, and waiting for an earlier frame. It has been copied */
+		DISCARD /** < Already received */
+	};
+
+	/**
+	The receiving side of one kind of reliable message on a connection. It filters out
+	duplicates, holds ordered frames which arrive early, and builds the acks.
+	*/
+	class ReliableReceiver {
+	private:
+		CHANNEL_ID marker;
+		uint32_t base; /** < The oldest message not yet received */
+		std::bitset<RELIABLE_WINDOW> received; /** < Indexed by id modulo the window */
+		std::map<uint32_t, std::vector<NETWORK_BYTE>> held;
+		bool ack_pending;
+
+	public:
+		/**
+		@param marker RELIABLE_ORDERED_CHANNEL_ID or RELIABLE_UNORDERED_CHANNEL_ID
+		*/
+		ReliableReceiver(CHANNEL_ID marker);
+
+		/**
+		Decide what to do with a frame which just arrived.
+		@param id The id from the frame's DeliveryHeader
+		@param frame The frame, which is copied if it must be held
+		@param frame_size The size of the frame
+		*/
+		DeliveryDecision accept(uint32_t id, const NETWORK_BYTE* frame, NETWORK_BYTE_SIZE frame_size);
+
+		/**
+		Take the next held frame which may now be delivered. Call this after delivering a
+		frame until it returns false, so that ordered frames are delivered in order.
+		@param frame Where to move the frame
+		@return Whether there was a frame to take
+		*/
+		bool release(std::vector<NETWORK_BYTE>& frame);
+
+		/**
+		@return Whether something was received since the last ack
+		*/
+		bool has_ack_pending() const { return this->ack_pending; }
+
+		/**
+		Build an ack for everything received so far.
+		*/
+		AckRecord ack();
+	};
+}
@@ -0,0 +1,282 @@
+/**
+@file datagram_server.h
+@brief A channeled server for UDP, which knows its clients by address
+*/
+#pragma once
+
+#include "udp_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include "server.h"
+#include "channel_subscribable.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace SunNet {
+
+	/* How long a DatagramServer's client may stay silent before it is forgotten unless told otherwise */
+	const std::chrono::milliseconds DEFAULT_DATAGRAM_IDLE_TIMEOUT(30000);
+
+	/* The most clients a DatagramServer knows at once unless told otherwise */
+	const size_t DEFAULT_MAX_DATAGRAM_CLIENTS = 65536;
+
+	/**
+	A server for channeled communications over UDP, for traffic such as position updates
+	where a late message is worthless and waiting for a lost one would stall everything
+	behind it. Each channel is delivered according to the DeliveryMode it was added with,
+	so lossy and reliable traffic may share a socket without the lossy traffic waiting.
+	Every message must fit in a datagram along with its framing.
+
+	There are no connections. A client is a UDPPeer, created the first time a datagram
+	arrives from its address and reported through handle_client_connect. It is forgotten
+	once it has been silent for the idle timeout, 30 seconds unless set, and reported
+	through handle_client_disconnect. Once the server knows max_clients clients,
+	datagrams from new addresses are dropped, so that a flood of forged addresses
+	cannot grow the client table without bound. Subscriptions, calls and replies work as they do with
+	ChanneledServer.
+
+	Each time the socket is ready, datagrams are received UDP_BATCH_SIZE at a time with
+	recvmmsg. Replies are queued, and every queued datagram goes out with sendmmsg at the
+	end of poll(), so one system call in each direction serves many clients.
+
+	Should only be used with a DatagramClient.
+	*/
+	class DatagramServer : public ChannelSubscribable {
+	private:
+		std::shared_ptr<UDPSocketConnection> server_connection;
+
+		PollService poll_service;
+
+		std::string address;
+		std::string port;
+		ServerState state;
+
+		std::unordered_map<UDPAddress, UDPPeer_p, UDPAddressHash> clients;
+		size_t max_clients;
+		uint64_t rejected_clients;
+
+		/* The most batches received per readiness event, and how often that was not enough */
+		size_t read_budget_batches;
+		uint64_t read_budget_exhaustions;
+
+		std::chrono::milliseconds idle_timeout;
+		TIMER_ID idle_sweep_timer;
+		std::vector<UDPPeer_p> idle_clients;
+
+		std::chrono::milliseconds heartbeat_interval;
+		TIMER_ID heartbeat_timer;
+
+		/* Clients which were sent reliable frames that have not been acked yet */
+		std::vector<UDPPeer_p> ack_pending_clients;
+
+		/* Runs only while reliable messages are waiting for acks */
+		TIMER_ID retransmit_timer;
+
+		void state_transition(std::initializer_list<ServerState> const& valid_from_states, ServerState new_state);
+
+		/* Receive batches until the socket is empty or the read budget runs out */
+		void read_datagrams();
+
+		/* Handle every frame in a datagram, dropping whatever is left of it if a frame is cut short */
+		void handle_datagram(const UDPDatagram& datagram);
+
+		void reap_idle_clients();
+		void send_heartbeats();
+		void retransmit();
+
+	protected:
+		/* Let ChannelSubscribable time out calls using the server's timers */
+		TimerWheel* getTimerWheel() {
+			return &this->poll_service.get_timers();
+		}
+
+		/* A datagram never closes its peer, but forget the client if it is ever reported */
+		void handleSocketDisconnect(ChanneledSocketConnection_p socket);
+
+		/**
+		Get the timers fired by this server's poll()
+		*/
+		TimerWheel& get_timers() {
+			return this->poll_service.get_timers();
+		}
+
+		/**** Handlers for DatagramServer ****/
+		virtual void handle_server_connection_error() = 0;
+		virtual void handle_client_connect(ChanneledSocketConnection_p client) = 0;
+		virtual void handle_client_disconnect(ChanneledSocketConnection_p client) = 0;
+		virtual void handle_poll_timeout() = 0;
+
+	public:
+		/**
+		@param address The address to bind to, or "" for every address
+		@param port The port to bind to
+		@param poll_timeout How long poll() waits for datagrams, in milliseconds
+		*/
+		DatagramServer(std::string address, std::string port, int poll_timeout);
+		virtual ~DatagramServer();
+
+		/**
+		Open the server by binding to its address and port.
+		@throws BindException if the address cannot be bound
+		*/
+		void open();
+
+		/**
+		Begin handling datagrams from poll().
+		*/
+		void serve();
+
+		/**
+		Send anything still queued and close the socket. Clients are forgotten without
+		being reported.
+		*/
+		void close();
+
+		/**
+		Wait for datagrams and handle every frame in them, then send every datagram
+		queued by the handlers and by timers.
+		@return Whether anything was received
+		*/
+		bool poll();
+
+		/**
+		Send every queued datagram now instead of at the end of poll(), along with acks
+		for any reliable frames received.
+		*/
+		void flush();
+
+		/**
+		Schedule a callback to fire once on the polling thread after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_timer(std::chrono::milliseconds delay, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule(delay, std::move(callback));
+		}
+
+		/**
+		Schedule a callback to fire on the polling thread every interval until it is cancelled.
+
+		@param interval How long to wait between firings
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_repeating_timer(std::chrono::milliseconds interval, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule_repeating(interval, std::move(callback));
+		}
+
+		/**
+		Cancel a timer scheduled with schedule_timer or schedule_repeating_timer.
+
+		@param id The id of the timer to cancel
+		@return Whether the timer was still pending
+		*/
+		bool cancel_timer(TIMER_ID id) {
+			return this->poll_service.get_timers().cancel(id);
+		}
+
+		/**
+		Look up a client by the address its datagrams come from.
+
+		@param address The client's address
+		@return The client, or nullptr if nothing has been heard from the address
+		*/
+		UDPPeer_p get_client(const UDPAddress& address) const;
+
+		/**
+		@return The number of clients heard from within the idle timeout
+		*/
+		size_t client_count() const {
+			return this->clients.size();
+		}
+
+		/**
+		Call a function for every client. The function may send to clients, but must not
+		cause any to be added or removed.
+		*/
+		template <class TCallback>
+		void for_each_client(TCallback callback) {
+			for (const auto& client : this->clients) {
+				callback(client.second);
+			}
+		}
+
+		/**
+		Set how many batches of datagrams are received each time the socket is ready.
+		Anything left is received on the next poll(), once timers have had a chance to fire.
+
+		@param max_batches The most batches of UDP_BATCH_SIZE datagrams. Defaults to 4.
+		*/
+		void set_read_budget(size_t max_batches) {
+			this->read_budget_batches = std::max(max_batches, (size_t)1);
+		}
+
+		/**
+		@return How many times datagrams were still waiting after the whole read budget was used
+		*/
+		uint64_t get_read_budget_exhaustions() const {
+			return this->read_budget_exhaustions;
+		}
+
+		/**
+		@return The number of datagrams which were truncated or malformed, or which could
+		not be sent
+		*/
+		uint64_t get_dropped_datagrams() const {
+			return this->server_connection ? this->server_connection->get_dropped_datagrams() : 0;
+		}
+
+		/**
+		Set the most clients known at once. Datagrams from a new address are dropped while
+		there are this many, until idle clients are forgotten.
+
+		@param max_clients The most clients, or 0 for no limit. Defaults to 65536.
+		*/
+		void set_max_clients(size_t max_clients) {
+			this->max_clients = max_clients;
+		}
+
+		/**
+		@return How many datagrams from new addresses were dropped because the server
+		already knew max_clients clients
+		*/
+		uint64_t get_rejected_clients() const {
+			return this->rejected_clients;
+		}
+
+		/**
+		Forget clients which have not sent anything for the given amount of time. Since UDP
+		has no hangup, this is the only way clients go away. Idle clients are looked for in
+		bulk a few times per timeout and are reported through handle_client_disconnect.
+
+		@param timeout How long a client may stay silent. Defaults to 30 seconds. Zero keeps
+		clients forever, so that only set_max_clients bounds how many are known.
+		*/
+		void set_idle_timeout(std::chrono::milliseconds timeout);
+
+		/**
+		Send heartbeats to clients which have not been sent anything for an interval,
+		which also keeps NAT mappings open, and forget clients which send nothing for
+		idle_timeout.
+
+		@param interval How often to check whether a client needs a heartbeat
+		@param idle_timeout How long a client may stay silent. This should be a few
+		times the heartbeat interval used by the clients.
+		*/
+		void enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout);
+
+		/**
+		Stop sending heartbeats, and go back to the default idle timeout.
+		*/
+		void disable_heartbeat();
+
+		class ServerException : public std::exception {};
+		class InvalidStateTransitionException : public ServerException {};
+	};
+}
+
+#endif
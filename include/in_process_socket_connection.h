@@ -0,0 +1,101 @@
+/**
+@file in_process_socket_connection.h
+@brief A SocketConnection which connects endpoints in the same process without the kernel
+*/
+#pragma once
+
+#include "channeled_socket_connection.h"
+
+#ifdef __linux__
+#define SUNNET_HAS_IN_PROCESS_TRANSPORT 1
+#endif
+
+#ifdef SUNNET_HAS_IN_PROCESS_TRANSPORT
+
+#include <memory>
+
+namespace SunNet {
+
+	/* The bytes each direction of an in-process connection can hold before a send waits */
+	const std::size_t IN_PROCESS_RING_SIZE = 256 * 1024;
+
+	class InProcessDoorbell;
+	class InProcessRing;
+	struct InProcessListenQueue;
+
+	/**
+	A connection to another InProcessSocketConnection in the same process. Bytes are
+	copied straight into a lock-free single-producer, single-consumer ring owned by the
+	pair of connections, so sending and receiving are plain memory copies.
+
+	Each connection has an eventfd which PollService watches in place of a socket. The
+	sender only writes to it when the ring goes from empty to non-empty, so a reader
+	which keeps up costs no system calls beyond its usual poll().
+
+	Servers bind and clients connect by port alone. The address is ignored, so a client
+	connecting to "127.0.0.1" reaches a server bound to "0.0.0.0" on the same port. Ports
+	are separate from TCP ports.
+
+	Like any SocketConnection, each direction may be used by one sending thread and one
+	receiving thread at a time. A send to a full ring waits for the peer to receive, so a
+	single thread polling both ends must not send more than IN_PROCESS_RING_SIZE without
+	polling the peer in between.
+
+	Example:
+		ChanneledServer<InProcessSocketConnection> server("0.0.0.0", "9876", 16, 0);
+		ChanneledClient<InProcessSocketConnection> client(0);
+		client.connect("127.0.0.1", "9876");
+	*/
+	class InProcessSocketConnection : public ChanneledSocketConnection {
+	private:
+		std::shared_ptr<InProcessDoorbell> doorbell; /** < Rung when there is something to receive or accept */
+		std::shared_ptr<InProcessRing> inbound;
+		std::shared_ptr<InProcessRing> outbound;
+
+		/* Set while this connection is bound, and the port it is bound to */
+		std::shared_ptr<InProcessListenQueue> listen_queue;
+		std::string bound_port;
+
+		InProcessSocketConnection(std::shared_ptr<InProcessDoorbell> doorbell);
+
+	protected:
+		bool consume_wakeup();
+
+	public:
+		/**
+		Create an unconnected endpoint, which may then connect or bind
+		*/
+		InProcessSocketConnection();
+
+		/**
+		Take ownership of a connection accepted by accept_descriptor
+		@throws CreateException if the descriptor did not come from accept_descriptor
+		*/
+		InProcessSocketConnection(SOCKET descriptor);
+
+		/**
+		Close both directions. The peer receives whatever is still in its ring and then sees
+		the connection close; its sends fail from now on.
+		*/
+		~InProcessSocketConnection();
+
+		/** @throws SendException with EPIPE if the peer has closed */
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		NETWORK_BYTE_SIZE buffered_bytes() const;
+
+		/** @throws ConnectException with ECONNREFUSED if nothing is listening on the port */
+		void connect(std::string address, std::string port);
+
+		/** @throws BindException with EADDRINUSE if another endpoint is bound to the port */
+		void bind(std::string port, std::string address = "");
+		void listen(int queue) const;
+		SOCKET accept_descriptor(struct sockaddr_storage* address, SOCKET_LEN* address_len) const;
+
+		/** In-process connections never block on the kernel, so this does nothing */
+		void set_nonblocking(bool nonblocking);
+	};
+}
+
+#endif
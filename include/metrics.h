@@ -0,0 +1,366 @@
+/**
+@file metrics.h
+@brief Counters for messages, bytes and poll activity, with a snapshot and a Prometheus text dump
+*/
+#pragma once
+
+#include "channels.h"
+#include "cycle_clock.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+Counting only happens when SunNet is built with SUNNET_ENABLE_METRICS. Without it,
+every SUNNET_METRICS_ONLY statement compiles away and the counters stay at zero.
+*/
+#ifdef SUNNET_ENABLE_METRICS
+#define SUNNET_METRICS_ONLY(statement) statement
+#else
+#define SUNNET_METRICS_ONLY(statement)
+#endif
+
+namespace SunNet {
+
+	/* The size of a cache line. Counters written by different threads are kept this far apart */
+	const std::size_t CACHE_LINE_SIZE = 64;
+
+	/* The number of possible channel ids, reserved ones included */
+	const std::size_t CHANNEL_ID_COUNT = 256;
+
+	/**
+	A monotonically increasing count. Counters are relaxed atomics, so they may be bumped
+	from any thread and read from any other without locking.
+	*/
+	class MetricCounter {
+	private:
+		std::atomic<uint64_t> value;
+
+	public:
+		MetricCounter() : value(0) {}
+
+		void add(uint64_t amount = 1) { this->value.fetch_add(amount, std::memory_order_relaxed); }
+		uint64_t get() const { return this->value.load(std::memory_order_relaxed); }
+		void reset() { this->value.store(0, std::memory_order_relaxed); }
+	};
+
+	/* A value which goes up and down, such as how long the last poll cycle took */
+	class MetricGauge {
+	private:
+		std::atomic<uint64_t> value;
+
+	public:
+		MetricGauge() : value(0) {}
+
+		void set(uint64_t value) { this->value.store(value, std::memory_order_relaxed); }
+		uint64_t get() const { return this->value.load(std::memory_order_relaxed); }
+	};
+
+	/* A summary of a LatencyHistogram, in nanoseconds */
+	struct HistogramSnapshot {
+		uint64_t count;
+		uint64_t sum;
+		uint64_t max;
+		uint64_t p50;
+		uint64_t p90;
+		uint64_t p99;
+		uint64_t p999;
+	};
+
+	/**
+	A histogram of durations measured in CycleClock ticks. Buckets are log-linear like an
+	HDR histogram: every power of two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so
+	any value is kept to within about 6% across the whole range. Recording is a couple of
+	shifts and a relaxed atomic add, cheap enough to leave on in production.
+
+	Values are converted to nanoseconds only when the histogram is read.
+	*/
+	class LatencyHistogram {
+	public:
+		static const unsigned SUB_BUCKET_BITS = 4;
+		static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+		/* Durations of 2^MAX_EXPONENT ticks or more (days) all land in the last bucket */
+		static const unsigned MAX_EXPONENT = 48;
+		static const std::size_t BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	private:
+		std::atomic<uint64_t> buckets[BUCKET_COUNT];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
+
+		static std::size_t bucket_of(uint64_t ticks) {
+			if (ticks < SUB_BUCKETS) {
+				return (std::size_t)ticks;
+			}
+			if (ticks >= ((uint64_t)1 << MAX_EXPONENT)) {
+				return BUCKET_COUNT - 1;
+			}
+
+			unsigned exponent = 63 - count_leading_zeros(ticks);
+			return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + ((ticks >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+		}
+
+		/* The largest value which lands in a bucket */
+		static uint64_t bucket_limit(std::size_t bucket) {
+			if (bucket < SUB_BUCKETS) {
+				return bucket;
+			}
+
+			unsigned exponent = (unsigned)(bucket / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+			uint64_t width = (uint64_t)1 << (exponent - SUB_BUCKET_BITS);
+			return (SUB_BUCKETS + bucket % SUB_BUCKETS) * width + width - 1;
+		}
+
+		static unsigned count_leading_zeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+			return (unsigned)__builtin_clzll(value);
+#else
+			unsigned zeros = 0;
+			for (uint64_t bit = (uint64_t)1 << 63; (value & bit) == 0; bit >>= 1) {
+				zeros++;
+			}
+			return zeros;
+#endif
+		}
+
+	public:
+		LatencyHistogram() {
+			this->reset();
+		}
+
+		/**
+		Record a duration.
+		@param ticks The duration in CycleClock ticks
+		*/
+		void record(uint64_t ticks) {
+			this->buckets[bucket_of(ticks)].fetch_add(1, std::memory_order_relaxed);
+			this->count.fetch_add(1, std::memory_order_relaxed);
+			this->sum.fetch_add(ticks, std::memory_order_relaxed);
+
+			uint64_t current_max = this->max.load(std::memory_order_relaxed);
+			while (ticks > current_max && !this->max.compare_exchange_weak(current_max, ticks, std::memory_order_relaxed)) {}
+		}
+
+		/**
+		Record the time since a CycleClock::now() reading.
+		@param start_ticks When the measured operation started
+		@return The duration which was recorded, in ticks
+		*/
+		uint64_t record_since(uint64_t start_ticks) {
+			uint64_t elapsed = CycleClock::now() - start_ticks;
+			this->record(elapsed);
+			return elapsed;
+		}
+
+		/**
+		@param quantile The quantile to find, between 0 and 1
+		@return The smallest recorded duration at or above the quantile, in nanoseconds
+		*/
+		uint64_t percentile(double quantile) const;
+
+		HistogramSnapshot snapshot() const;
+
+		void reset();
+	};
+
+	/* Traffic on one channel, across every connection. Padded so neighbouring channels never share a line */
+	struct alignas(CACHE_LINE_SIZE) ChannelMetrics {
+		MetricCounter messages_received;
+		MetricCounter bytes_received;
+		MetricCounter messages_sent;
+		MetricCounter bytes_sent;
+	};
+
+	/* Traffic on one connection, kept inside its SocketConnection */
+	struct alignas(CACHE_LINE_SIZE) ConnectionMetrics {
+		MetricCounter messages_received;
+		MetricCounter messages_sent;
+		MetricCounter bytes_sent;
+		MetricCounter receive_calls; /** < Receive system calls */
+		MetricCounter send_calls; /** < Send system calls */
+	};
+
+	/* What the poll loop has been doing, across every server and client */
+	struct alignas(CACHE_LINE_SIZE) GlobalMetrics {
+		MetricCounter poll_iterations; /** < Calls to PollService::poll */
+		MetricCounter ready_events; /** < Sockets reported ready by poll */
+		MetricCounter dispatch_errors; /** < Exceptions which escaped while dispatching a message */
+		MetricCounter unhandled_messages; /** < Messages which arrived on a channel nobody was listening to */
+		MetricCounter read_budget_exhaustions; /** < Connections which still had data after using their read budget */
+		MetricCounter accepted_connections;
+		MetricCounter deferred_accepts; /** < Times accepting was put off by a connection cap or accept rate */
+		MetricCounter rejected_connections; /** < Connections closed for going over the per-address cap, or UDP clients over the client cap */
+		MetricCounter receive_calls; /** < Receive system calls, across every connection */
+		MetricCounter send_calls; /** < Send system calls, across every connection */
+		MetricCounter trace_sequence_gaps; /** < Traced frames which never arrived, judging by sequence numbers */
+		MetricCounter dropped_datagrams; /** < Datagrams which were truncated or malformed, or which the kernel refused to send */
+		MetricCounter retransmissions; /** < Reliable messages sent again because they were not acknowledged in time */
+		MetricCounter zerocopy_sends; /** < Payloads sent with MSG_ZEROCOPY instead of being copied into the kernel */
+		MetricCounter zerocopy_copies; /** < Zero-copy sends which the kernel reported it had to copy after all */
+		MetricCounter ingress_drops; /** < Frames turned away for breaking their connection's ingress limits */
+		MetricCounter bad_channel_frames; /** < Frames on a channel id nobody registered, or which broke the protocol, whose peers were dropped */
+		MetricCounter resumed_sessions; /** < Sessions carried on over a new connection */
+		MetricCounter replayed_messages; /** < Unacknowledged messages resent when a session was resumed */
+	};
+
+	/* Where the polling thread spends its time. Durations are in CycleClock ticks */
+	struct LatencyMetrics {
+		LatencyHistogram poll_time; /** < Time spent inside the OS poll call */
+		LatencyHistogram dispatch_delay; /** < Time from poll returning to a ready socket being handled */
+		MetricGauge loop_lag; /** < How long the last poll cycle spent handling sockets before it could poll again */
+		MetricGauge max_loop_lag;
+		MetricCounter slow_handlers; /** < Subscription callbacks which took longer than the threshold */
+		MetricGauge last_slow_channel; /** < The channel of the most recent slow subscription callback */
+		MetricGauge slow_handler_threshold; /** < In ticks. 0 means nothing is flagged */
+	};
+
+	/* Latency of traced messages on one channel. Durations are in CycleClock ticks */
+	struct ChannelLatency {
+		LatencyHistogram one_way; /** < From the sender's clock to this host's, so only as good as their agreement */
+		LatencyHistogram round_trip; /** < Does not depend on the clocks agreeing */
+	};
+
+	struct ChannelMetricsSnapshot {
+		CHANNEL_ID channel_id;
+		uint64_t messages_received;
+		uint64_t bytes_received;
+		uint64_t messages_sent;
+		uint64_t bytes_sent;
+		HistogramSnapshot one_way_latency; /** < Empty unless the channel's messages were traced */
+		HistogramSnapshot round_trip_latency;
+	};
+
+	struct ConnectionMetricsSnapshot {
+		uint64_t messages_received;
+		uint64_t bytes_received;
+		uint64_t messages_sent;
+		uint64_t bytes_sent;
+		uint64_t receive_calls;
+		uint64_t send_calls;
+	};
+
+	struct MetricsSnapshot {
+		uint64_t poll_iterations;
+		uint64_t ready_events;
+		uint64_t dispatch_errors;
+		uint64_t unhandled_messages;
+		uint64_t read_budget_exhaustions;
+		uint64_t accepted_connections;
+		uint64_t deferred_accepts;
+		uint64_t rejected_connections;
+		uint64_t receive_calls;
+		uint64_t send_calls;
+		uint64_t trace_sequence_gaps;
+		uint64_t dropped_datagrams;
+		uint64_t retransmissions;
+		uint64_t zerocopy_sends;
+		uint64_t zerocopy_copies;
+		uint64_t ingress_drops;
+		uint64_t bad_channel_frames;
+		uint64_t resumed_sessions;
+		uint64_t replayed_messages;
+		std::vector<ChannelMetricsSnapshot> channels; /** < Only the channels which have seen traffic */
+
+		HistogramSnapshot poll_time;
+		HistogramSnapshot dispatch_delay;
+		uint64_t loop_lag; /** < In nanoseconds */
+		uint64_t max_loop_lag; /** < In nanoseconds */
+		uint64_t slow_handlers;
+		CHANNEL_ID last_slow_channel;
+	};
+
+	/**
+	A static class which holds the process-wide counters. The library bumps these as it
+	works; users read them through snapshot() or prometheus().
+	*/
+	class Metrics {
+	private:
+		static std::atomic<ChannelLatency*> channel_latencies[CHANNEL_ID_COUNT];
+
+		static ChannelLatency& allocate_channel_latency(CHANNEL_ID channel_id);
+
+	public:
+		static ChannelMetrics channels[CHANNEL_ID_COUNT];
+		static GlobalMetrics global;
+		static LatencyMetrics latency;
+
+		/**
+		Get the latency histograms for traced messages on a channel. They are allocated the
+		first time a channel is traced and live until the program exits.
+		*/
+		static ChannelLatency& channel_latency(CHANNEL_ID channel_id) {
+			ChannelLatency* latency = Metrics::channel_latencies[channel_id].load(std::memory_order_acquire);
+			return latency != nullptr ? *latency : Metrics::allocate_channel_latency(channel_id);
+		}
+
+		/**
+		@return Whether SunNet was built to count anything
+		*/
+		static constexpr bool enabled() {
+#ifdef SUNNET_ENABLE_METRICS
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		/**
+		Copy every counter. Counters are read one at a time, so a snapshot taken while
+		another thread is busy may be slightly inconsistent between counters.
+		*/
+		static MetricsSnapshot snapshot();
+
+		/**
+		Render every counter in the Prometheus text exposition format.
+		*/
+		static std::string prometheus();
+
+		/**
+		Set every process-wide counter back to zero.
+		*/
+		static void reset();
+
+		/**
+		Flag subscription callbacks which run longer than a threshold. Each one is counted in
+		LatencyMetrics::slow_handlers and its channel is kept in last_slow_channel.
+
+		@param threshold How long a callback may run. Zero stops flagging callbacks.
+		*/
+		static void set_slow_handler_threshold(std::chrono::nanoseconds threshold) {
+			Metrics::latency.slow_handler_threshold.set(CycleClock::from_nanoseconds((uint64_t)threshold.count()));
+		}
+
+		/**
+		Record how long a handler on the polling thread took, and flag it if it was slow.
+
+		@param channel_id The channel the handler was handling
+		@param start_ticks When the handler started
+		@param histogram Where to record the duration
+		*/
+		static void record_handler(CHANNEL_ID channel_id, uint64_t start_ticks, LatencyHistogram& histogram) {
+			uint64_t elapsed = histogram.record_since(start_ticks);
+			uint64_t threshold = Metrics::latency.slow_handler_threshold.get();
+			if (threshold != 0 && elapsed > threshold) {
+				Metrics::latency.slow_handlers.add();
+				Metrics::latency.last_slow_channel.set(channel_id);
+			}
+		}
+
+		/**
+		Record how long a poll cycle spent handling sockets after poll returned.
+
+		@param poll_return_ticks When poll returned
+		*/
+		static void record_loop_lag(uint64_t poll_return_ticks) {
+			uint64_t lag = CycleClock::now() - poll_return_ticks;
+			Metrics::latency.loop_lag.set(lag);
+			if (lag > Metrics::latency.max_loop_lag.get()) {
+				Metrics::latency.max_loop_lag.set(lag);
+			}
+		}
+	};
+}
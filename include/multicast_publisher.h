@@ -0,0 +1,170 @@
+/**
+@file multicast_publisher.h
+@brief Sends channel frames once to a UDP multicast group, however many subscribe
+*/
+#pragma once
+
+#include "multicast_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include "server.h"
+#include "pollservice.h"
+
+namespace SunNet {
+
+	/**
+	Publishes channel frames to a UDP multicast group, for state which every machine on
+	a LAN needs, such as world snapshots. Each frame is sent once whatever the number of
+	subscribers, so the publisher's bandwidth does not grow with them.
+
+	Frames are packed into records of up to MULTICAST_MAX_PAYLOAD bytes, and larger
+	frames are split across several records and joined up again by each
+	MulticastSubscriber. A subscriber which misses records asks for them with a NACK, and
+	the publisher sends them again to that subscriber alone, as long as they are among
+	the last history_size records. Only lost records cost extra bandwidth.
+
+	Sends are queued and go out together at the end of poll(), which also answers NACKs
+	and fires timers. Call flush() to send sooner.
+	*/
+	class MulticastPublisher {
+	private:
+		std::shared_ptr<UDPSocketConnection> connection;
+		MulticastGroup_p group;
+
+		PollService poll_service;
+
+		std::string group_address;
+		std::string port;
+		std::string interface_address;
+		int ttl;
+		size_t history_size;
+		ServerState state;
+
+		TIMER_ID session_timer;
+
+		void state_transition(std::initializer_list<ServerState> const& valid_from_states, ServerState new_state);
+
+		/* Answer every NACK waiting on the socket */
+		void read_nacks();
+
+	public:
+		/**
+		@param group_address The IPv4 multicast group to publish to, such as "239.255.0.1"
+		@param port The port subscribers listen on
+		@param interface_address The address of the interface to send from, or "0.0.0.0" for the default
+		@param poll_timeout How long poll() waits for NACKs, in milliseconds
+		*/
+		MulticastPublisher(std::string group_address, std::string port, std::string interface_address, int poll_timeout);
+		virtual ~MulticastPublisher();
+
+		/**
+		Set how many routers records may cross before open(). Defaults to 1, which keeps
+		them on the local network.
+		*/
+		void set_ttl(int ttl) { this->ttl = ttl; }
+
+		/**
+		Set how many records are kept for repairs before open(). Defaults to
+		MULTICAST_DEFAULT_HISTORY. Subscribers which fall further behind lose records.
+		*/
+		void set_history_size(size_t records) { this->history_size = records; }
+
+		/**
+		Open the socket that records are sent from and NACKs arrive on.
+		@throws BindException if the interface cannot be bound
+		@throws SocketException if the multicast options cannot be set
+		*/
+		void open();
+
+		/**
+		Begin answering NACKs and announcing the session from poll().
+		*/
+		void serve();
+
+		/**
+		Send anything still queued and close the socket.
+		*/
+		void close();
+
+		/**
+		Wait for NACKs and answer them, then send every record queued since the last poll().
+		@return Whether any NACKs were received
+		*/
+		bool poll();
+
+		/**
+		Send every queued frame now instead of at the end of poll().
+		*/
+		void flush();
+
+		/**
+		Publish a message to the group upon a specific channel. The channel is determined
+		by the template type. The message is queued until the next flush.
+
+		@param message The object to send
+		*/
+		template <class TMessageType>
+		void channeled_send(TMessageType* message) {
+			this->group->channeled_send<TMessageType>(message);
+		}
+
+		/**
+		@return The group, as a connection which frames may be sent on
+		*/
+		ChanneledSocketConnection_p get_group() const {
+			return this->group;
+		}
+
+		/**
+		Schedule a callback to fire once on the polling thread after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_timer(std::chrono::milliseconds delay, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule(delay, std::move(callback));
+		}
+
+		/**
+		Schedule a callback to fire on the polling thread every interval until it is cancelled.
+
+		@param interval How long to wait between firings
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_repeating_timer(std::chrono::milliseconds interval, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule_repeating(interval, std::move(callback));
+		}
+
+		/**
+		Cancel a timer scheduled with schedule_timer or schedule_repeating_timer.
+
+		@param id The id of the timer to cancel
+		@return Whether the timer was still pending
+		*/
+		bool cancel_timer(TIMER_ID id) {
+			return this->poll_service.get_timers().cancel(id);
+		}
+
+		/**
+		@return The number of records sent to the group, not counting repairs
+		*/
+		uint64_t get_records_sent() const {
+			return this->group ? this->group->get_records_sent() : 0;
+		}
+
+		/**
+		@return The number of records sent again to subscribers which missed them
+		*/
+		uint64_t get_repairs() const {
+			return this->group ? this->group->get_repairs() : 0;
+		}
+
+		class PublisherException : public std::exception {};
+		class InvalidStateTransitionException : public PublisherException {};
+	};
+}
+
+#endif
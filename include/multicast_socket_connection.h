@@ -0,0 +1,301 @@
+/**
+@file multicast_socket_connection.h
+@brief Both ends of a stream of channel frames sent to a UDP multicast group
+*/
+#pragma once
+
+#include "udp_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include "address_table.h"
+
+#include <map>
+#include <vector>
+
+namespace SunNet {
+
+	/* The kinds of record sent by a multicast publisher and its subscribers */
+	enum MulticastRecordType : NETWORK_BYTE {
+		MULTICAST_DATA = 1, /** < Part of the publisher's stream of frames */
+		MULTICAST_SESSION = 2, /** < The publisher's next sequence number and the oldest it can still repair */
+		MULTICAST_NACK = 3 /** < A subscriber asking for a range of data records to be sent again */
+	};
+
+	/* Flags on a MULTICAST_DATA record */
+	const NETWORK_BYTE MULTICAST_STARTS_MID_FRAME = 0x1; /** < The payload begins partway through a frame */
+	const NETWORK_BYTE MULTICAST_ENDS_MID_FRAME = 0x2; /** < The payload ends partway through a frame */
+
+	/* The size of a MulticastHeader on the wire */
+	const NETWORK_BYTE_SIZE MULTICAST_HEADER_SIZE = 2 * sizeof(NETWORK_BYTE) + 2 * sizeof(uint32_t) + sizeof(uint16_t);
+
+	/* The most frame bytes carried by one data record */
+	const NETWORK_BYTE_SIZE MULTICAST_MAX_PAYLOAD = UDP_MAX_DATAGRAM_SIZE - MULTICAST_HEADER_SIZE;
+
+	/* How many data records a publisher keeps for repairs by default */
+	const size_t MULTICAST_DEFAULT_HISTORY = 4096;
+
+	/* How far past a gap a subscriber holds data records while waiting for the repair */
+	const uint32_t MULTICAST_RECEIVE_WINDOW = 4096;
+
+	/* How often a subscriber asks for a gap to be repaired, and how many times before giving up on it */
+	const std::chrono::milliseconds MULTICAST_NACK_INTERVAL(10);
+	const int MULTICAST_NACK_ATTEMPTS = 5;
+
+	/*
+	The most records a publisher sends again for one NACK, and for one host each
+	MULTICAST_NACK_INTERVAL, so that a NACK cannot have the history sent at its sender
+	*/
+	const uint32_t MULTICAST_MAX_REPAIRS_PER_NACK = 64;
+	const uint32_t MULTICAST_REPAIR_BUDGET = 256;
+
+	/* How often a publisher announces its session to the group */
+	const std::chrono::milliseconds MULTICAST_SESSION_INTERVAL(50);
+
+	/**
+	The header in front of every multicast record. Several records may share a datagram.
+	*/
+	struct MulticastHeader {
+		NETWORK_BYTE type; /** < A MulticastRecordType */
+		NETWORK_BYTE flags;
+		uint32_t session; /** < Chosen at random by the publisher when it opens, so that a restart is noticed */
+		uint32_t sequence; /** < The data record's number, the next number for a session record, or the first wanted for a NACK */
+		uint16_t length; /** < The number of bytes following the header */
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = this->type;
+			bytes[1] = this->flags;
+			std::memcpy(bytes + 2, &this->session, sizeof(uint32_t));
+			std::memcpy(bytes + 2 + sizeof(uint32_t), &this->sequence, sizeof(uint32_t));
+			std::memcpy(bytes + 2 + 2 * sizeof(uint32_t), &this->length, sizeof(uint16_t));
+		}
+
+		static MulticastHeader read(const NETWORK_BYTE* bytes) {
+			MulticastHeader header;
+			header.type = bytes[0];
+			header.flags = bytes[1];
+			std::memcpy(&header.session, bytes + 2, sizeof(uint32_t));
+			std::memcpy(&header.sequence, bytes + 2 + sizeof(uint32_t), sizeof(uint32_t));
+			std::memcpy(&header.length, bytes + 2 + 2 * sizeof(uint32_t), sizeof(uint16_t));
+			return header;
+		}
+	};
+
+	/**
+	The publishing end of a multicast stream, as the connection that frames are sent on.
+	Frames are packed into data records as they are sent, and a frame too large for one
+	record is split across several. Each finished record goes to the group through the
+	shared socket and is kept so that it can be sent again to a subscriber which missed it.
+
+	Nothing is ever received on a MulticastGroup.
+	*/
+	class MulticastGroup : public ChanneledSocketConnection {
+	private:
+		std::shared_ptr<UDPSocketConnection> socket;
+		UDPAddress group;
+		uint32_t session;
+
+		/* The record being filled, header space included */
+		mutable std::vector<NETWORK_BYTE> record;
+		mutable NETWORK_BYTE_SIZE payload_size;
+		mutable NETWORK_BYTE record_flags;
+
+		/* Every record sent recently, indexed by sequence number modulo its size */
+		mutable std::vector<std::vector<NETWORK_BYTE>> history;
+		mutable uint32_t next_sequence;
+
+		uint64_t repairs;
+
+		/* Records sent again to each host since the interval began */
+		AddressTable repairs_by_host;
+		std::chrono::steady_clock::time_point repair_interval_end;
+
+		/* The oldest record which can still be repaired */
+		uint32_t oldest_sequence() const {
+			return this->next_sequence > this->history.size() ? this->next_sequence - (uint32_t)this->history.size() : 0;
+		}
+
+		/* Send the record being filled, marking whether a frame continues in the next one */
+		void finish_record(bool ends_mid_frame) const;
+
+	public:
+		/**
+		@param socket The socket records are sent through and NACKs arrive on
+		@param group The group's address and port
+		@param history_size How many records to keep for repairs
+		*/
+		MulticastGroup(std::shared_ptr<UDPSocketConnection> socket, const UDPAddress& group, size_t history_size);
+
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+
+		/** @throws ReceiveException with EOPNOTSUPP, since a group is only sent to */
+		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		NETWORK_BYTE_SIZE buffered_bytes() const { return 0; }
+		bool is_writable() const { return true; }
+
+		/**
+		Send the record being filled, even if it has room for more.
+		*/
+		void finish() const;
+
+		/**
+		Tell the group which records it should have received and which can still be repaired.
+		@param to Where to send the announcement instead of the group, or nullptr
+		*/
+		void announce(const UDPAddress* to) const;
+
+		/**
+		Send again the records a subscriber asked for in a datagram of NACKs, up to
+		MULTICAST_MAX_REPAIRS_PER_NACK for each NACK and MULTICAST_REPAIR_BUDGET for its
+		host each interval. The subscriber asks again for the rest. Records which are no
+		longer kept are answered with an announcement, so that the subscriber stops
+		waiting for them.
+		@throws ReceiveException with EBADMSG if the datagram is malformed
+		*/
+		void handle_nacks(const UDPDatagram& datagram);
+
+		/**
+		@return Whether any record has been sent yet
+		*/
+		bool has_sent() const { return this->next_sequence > 0; }
+
+		/**
+		@return The number of data records sent to the group, not counting repairs
+		*/
+		uint64_t get_records_sent() const { return this->next_sequence; }
+
+		/**
+		@return The number of data records sent again to subscribers which missed them
+		*/
+		uint64_t get_repairs() const { return this->repairs; }
+	};
+
+	typedef std::shared_ptr<MulticastGroup> MulticastGroup_p;
+
+	/**
+	The receiving end of a multicast stream, as the connection that subscriptions see
+	frames come from. Data records are put back in order, held while an earlier one is
+	missing, and joined up into whole frames. Gaps are repaired by sending NACKs to the
+	publisher through a separate unicast socket. A gap which cannot be repaired is
+	skipped, along with the frame it cut, and counted as lost.
+
+	Frames cannot be sent back to the publisher.
+	*/
+	class MulticastSource : public ChanneledSocketConnection {
+	private:
+		struct HeldRecord {
+			NETWORK_BYTE flags;
+			std::vector<NETWORK_BYTE> payload;
+		};
+
+		/* The socket NACKs are sent from and repairs arrive on */
+		std::shared_ptr<UDPSocketConnection> repair_socket;
+		UDPAddress publisher;
+
+		bool has_session;
+		uint32_t session;
+		uint32_t expected_sequence; /** < The next record to be added to the frames */
+		uint32_t known_next_sequence; /** < One past the newest record known to exist */
+		std::map<uint32_t, HeldRecord> held;
+
+		/* Frames joined up from records. Only the bytes before complete_end are whole frames */
+		mutable std::vector<NETWORK_BYTE> frames;
+		mutable size_t read_offset;
+		size_t complete_end;
+
+		/* Whether a gap cut a frame, so records are skipped until one starts a new frame */
+		bool resynchronizing;
+
+		uint64_t lost_records;
+		uint64_t nacks_sent;
+
+		/* Start over with a new session at the given sequence number */
+		void reset(uint32_t session, uint32_t sequence);
+
+		void accept_data(const MulticastHeader& header, const NETWORK_BYTE* payload);
+		void accept_session(const MulticastHeader& header, uint32_t oldest_sequence);
+
+		/* Add a record's payload to the frames */
+		void append(NETWORK_BYTE flags, const NETWORK_BYTE* payload, NETWORK_BYTE_SIZE size);
+
+		/* Add every held record which is now next */
+		void release_held();
+
+		/* Count every record up to the given sequence number as lost, with the frame they cut */
+		void lose_to(uint32_t sequence);
+
+		/* Move past every missing record before the given sequence number, keeping the held ones */
+		void skip_to(uint32_t sequence);
+
+	public:
+		/**
+		@param repair_socket The socket NACKs are sent from and repairs arrive on
+		*/
+		MulticastSource(std::shared_ptr<UDPSocketConnection> repair_socket);
+
+		/**
+		Take in every record in a datagram from the publisher.
+		@throws ReceiveException with EBADMSG if the datagram is malformed. The records
+		before the malformed one are kept.
+		*/
+		void accept_datagram(const UDPDatagram& datagram);
+
+		/**
+		@return Whether records are missing before the newest one known to exist
+		*/
+		bool has_gap() const { return this->has_session && (int32_t)(this->known_next_sequence - this->expected_sequence) > 0; }
+
+		/**
+		Queue a NACK on the repair socket for every range of missing records.
+		*/
+		void send_nacks();
+
+		/**
+		Stop waiting for the first missing records and count them as lost.
+		*/
+		void give_up_gap();
+
+		/**
+		@return The next record to be added to the frames, which is the first missing one
+		while there is a gap
+		*/
+		uint32_t get_expected_sequence() const { return this->expected_sequence; }
+
+		/**
+		Forget the frames which have been read, so their space may be reused.
+		*/
+		void discard_read();
+
+		/** @throws SendException with EOPNOTSUPP, since the publisher is not sent to */
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+
+		/**
+		Read from the whole frames received so far.
+		@throws ReceiveException with EBADMSG if a frame runs past them. The rest of the
+		frames received are discarded.
+		*/
+		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		NETWORK_BYTE_SIZE buffered_bytes() const { return this->complete_end - this->read_offset; }
+
+		/**
+		@return The address NACKs are sent to, which is where the session being followed came from
+		*/
+		const UDPAddress& get_publisher() const { return this->publisher; }
+
+		/**
+		@return The number of data records which were given up on
+		*/
+		uint64_t get_lost_records() const { return this->lost_records; }
+
+		/**
+		@return The number of NACK records sent
+		*/
+		uint64_t get_nacks_sent() const { return this->nacks_sent; }
+	};
+
+	typedef std::shared_ptr<MulticastSource> MulticastSource_p;
+}
+
+#endif
@@ -0,0 +1,140 @@
+/**
+@file multicast_subscriber.h
+@brief Receives channel frames published to a UDP multicast group
+*/
+#pragma once
+
+#include "multicast_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include "client.h"
+#include "channel_subscribable.h"
+
+namespace SunNet {
+
+	/**
+	Receives the frames a MulticastPublisher sends to a group. Messages are subscribed to
+	as with a ChanneledClient, and arrive once each and in the order they were published.
+
+	Records which arrive out of order are held until the ones before them come. When
+	records are missing, NACKs for them go to the publisher every MULTICAST_NACK_INTERVAL
+	from a second, unicast socket, and the repairs come back on it. After
+	MULTICAST_NACK_ATTEMPTS unanswered NACKs, or once the publisher no longer has the
+	records, the gap is skipped and the frames it cut are lost.
+
+	A subscriber which joins late starts at the next whole frame. Several subscribers
+	may join the same group and port on one machine.
+	*/
+	class MulticastSubscriber : public ChannelSubscribable {
+	private:
+		std::shared_ptr<UDPSocketConnection> group_connection;
+		std::shared_ptr<UDPSocketConnection> repair_connection;
+		MulticastSource_p publisher;
+
+		PollService poll_service;
+
+		ClientState state;
+
+		TIMER_ID nack_timer;
+		int nack_attempts;
+		uint32_t nack_gap_start; /** < The first missing record when the NACKs began */
+
+		void state_transition(std::initializer_list<ClientState> const& valid_from_states, ClientState new_state);
+
+		/* Receive every datagram waiting on a socket and hand the whole frames to subscribers */
+		void read_datagrams(const std::shared_ptr<UDPSocketConnection>& connection);
+
+		/* Ask for any missing records again, or give up on them */
+		void repair_gap();
+
+	protected:
+		/* Let ChannelSubscribable time out waits using the subscriber's timers */
+		TimerWheel* getTimerWheel() {
+			return &this->poll_service.get_timers();
+		}
+
+		/*
+		The publisher is never disconnected, since the group has no connection to lose. It is
+		only dropped for sending a frame which cannot be read, so skip the frames after it
+		*/
+		void handleSocketDisconnect(ChanneledSocketConnection_p socket) {
+			socket->channeled_skip(socket->buffered_bytes());
+		}
+
+		/**
+		Get the timers fired by this subscriber's poll()
+		*/
+		TimerWheel& get_timers() {
+			return this->poll_service.get_timers();
+		}
+
+		/**** Handlers for MulticastSubscriber ****/
+		virtual void handle_subscriber_error() = 0;
+		virtual void handle_poll_timeout() = 0;
+
+	public:
+		/**
+		@param poll_timeout How long poll() waits for records, in milliseconds
+		*/
+		MulticastSubscriber(int poll_timeout);
+		virtual ~MulticastSubscriber();
+
+		/**
+		Join a group and start receiving what is published to it.
+		@param group_address The IPv4 multicast group, such as "239.255.0.1"
+		@param port The port the publisher sends to
+		@param interface_address The address of the interface to join on, or "0.0.0.0" for the default
+		@throws BindException if the port cannot be bound
+		@throws SocketException if the group cannot be joined
+		*/
+		void join(std::string group_address, std::string port, std::string interface_address = "0.0.0.0");
+
+		/**
+		Leave the group and close both sockets.
+		@throws InvalidStateTransitionException if the subscriber has not joined
+		*/
+		void leave();
+
+		/**
+		Wait for records and hand every whole frame to subscribers, then send any NACKs.
+		@return Whether anything was received
+		*/
+		bool poll();
+
+		/**
+		@return The publisher, as the connection which subscriptions see messages come from.
+		It cannot be sent to.
+		*/
+		ChanneledSocketConnection_p get_publisher() const {
+			return this->publisher;
+		}
+
+		/**
+		@return The number of records which were never received, even after NACKs
+		*/
+		uint64_t get_lost_records() const {
+			return this->publisher ? this->publisher->get_lost_records() : 0;
+		}
+
+		/**
+		@return The number of ranges of missing records which were asked for
+		*/
+		uint64_t get_nacks_sent() const {
+			return this->publisher ? this->publisher->get_nacks_sent() : 0;
+		}
+
+		/**
+		@return The number of datagrams which were truncated or malformed
+		*/
+		uint64_t get_dropped_datagrams() const {
+			return this->group_connection ?
+				this->group_connection->get_dropped_datagrams() + this->repair_connection->get_dropped_datagrams() : 0;
+		}
+
+		class SubscriberException : public std::exception {};
+		class InvalidStateTransitionException : public SubscriberException {};
+	};
+}
+
+#endif
@@ -7,8 +7,9 @@ sockets and allows action on ones which are ready to read
 
 #include "socket_connection.h"
 #include "socket_collection.h"
+#include "timer_wheel.h"
 #include <vector>
-#include <unordered_map>
+#include <iterator>
 
 namespace SunNet {
 
@@ -17,15 +18,46 @@ namespace SunNet {
 
 	Keeps track of a collection of SocketConnection objects and allows
 	operation when they are ready to be read.
+
+	Sockets are kept in a generational slot map. The poll descriptors and their
+	connections live in dense arrays which are handed straight to poll(), and removing
+	a socket swaps the last entry into its place, so adding and removing are both O(1).
+	Each socket is given a ConnectionHandle naming its slot, which stays valid until the
+	socket is removed. A socket may only be watched by one PollService at a time.
+
+	A PollService also owns a TimerWheel. The poll timeout is shortened so that
+	poll() returns in time for the next timer, and timer callbacks are fired from
+	within poll() on the polling thread.
 	*/
 	class PollService {
 	private:
 		int timeout; /** < How long to wait before declaring no socket can be read */
 
+		/* A slot in the slot map, pointing at the socket's entry in the dense arrays */
+		struct Slot {
+			uint32_t dense_index; /** < Index into the dense arrays, or the next free slot if this slot is free */
+			uint32_t generation; /** < Bumped whenever the slot is freed, so that old handles become stale */
+		};
+
 		std::vector<POLL_DESCRIPTOR> descriptors; /** < The corresponding poll() descriptors */
-		std::unordered_map<SOCKET, std::pair<int, SocketConnection_p>> poll_descriptor_map; /** < Points to elements in descriptors for fast updating */
+		std::vector<SocketConnection_p> connections; /** < The socket for each entry in descriptors */
+		std::vector<uint32_t> dense_slots; /** < The slot for each entry in descriptors */
+
+		std::vector<Slot> slots;
+		uint32_t free_slot_head;
+
+		/* Find the dense index of a handle. @return The index, or descriptors.size() if the handle is stale */
+		size_t find_dense_index(ConnectionHandle handle) const;
+
+		void remove_at(size_t dense_index);
+
+		PollEventList events; /** < Reused by every poll(), so polling does not allocate once it has grown */
+		std::vector<ConnectionHandle> marked_ready; /** < Sockets to report on the next poll() whether or not the kernel does */
+		std::vector<ConnectionHandle> writable; /** < Sockets watched for writing which the last poll() found writable */
+
+		TimerWheel timers; /** < Timers which are fired from poll() */
 
-		std::shared_ptr<SocketCollection> results;
+		uint64_t poll_return_ticks; /** < When the OS poll call last returned, in CycleClock ticks */
 	public:
 
 		PollService(int timeout = 10);
@@ -43,7 +75,13 @@ namespace SunNet {
 			this->add_sockets(begin, end);
 		}
 
-		void add_socket(const SocketConnection_p socket);
+		/**
+		Start watching a socket. Adding a socket which is already watched does nothing.
+
+		@param socket The socket to watch
+		@return The handle of the socket
+		*/
+		ConnectionHandle add_socket(const SocketConnection_p socket);
 
 		/**
 		Adds a collection of sockets to the poll's collection of sockets.
@@ -52,25 +90,126 @@ namespace SunNet {
 		*/
 		template <class Iter>
 		void add_sockets(Iter& begin, Iter& end) {
+			size_t count = this->descriptors.size() + std::distance(begin, end);
+			this->descriptors.reserve(count);
+			this->connections.reserve(count);
+			this->dense_slots.reserve(count);
 			for (auto it = begin; it != end; ++it) {
 				this->add_socket(*it);
 			}
 		}
 
+		/**
+		Stop watching a socket. Removing a socket which is not watched does nothing.
+
+		@param socket The socket to stop watching
+		*/
 		void remove_socket(const SocketConnection_p socket);
 
+		/**
+		Stop watching the socket with the given handle. Stale handles are ignored.
+
+		@param handle The handle of the socket to stop watching
+		*/
+		void remove_socket(ConnectionHandle handle);
+
 		void clear_sockets();
 
 		/**
-		Poll all sockets, returning those ready to be read
+		Look up a watched socket by its handle.
+
+		@param handle The handle of the socket
+		@return The socket, or nullptr if the handle is stale
+		*/
+		SocketConnection_p get_socket(ConnectionHandle handle) const;
+
+		/**
+		@return Whether the handle refers to a socket which is still being watched
+		*/
+		bool contains(ConnectionHandle handle) const {
+			return this->find_dense_index(handle) != this->descriptors.size();
+		}
+
+		/**
+		@return The number of watched sockets
+		*/
+		size_t size() const { return this->descriptors.size(); }
+
+		/**
+		Call a function for every watched socket. The function must not add or remove
+		sockets from this poll service.
+
+		@param callback Called with each watched SocketConnection_p
+		*/
+		template <class TCallback>
+		void for_each_socket(TCallback callback) const {
+			for (const SocketConnection_p& socket : this->connections) {
+				callback(socket);
+			}
+		}
+
+		/**
+		Report a socket as ready to read on the next poll(), even if the kernel has nothing
+		new for it, and don't let that poll() wait. Used when a reader stops before it has
+		received everything buffered in a connection. A socket is reported at most once
+		per poll() however many times it is marked.
+
+		@param handle The handle of the socket. Stale handles are ignored.
+		*/
+		void mark_ready(ConnectionHandle handle) {
+			this->marked_ready.push_back(handle);
+		}
+
+		/**
+		Stop or start watching a socket for reading. A socket which is not being read
+		stays watched, and is still reported if it errors or hangs up. Used to leave
+		work queued in the kernel, such as connections waiting to be accepted.
+
+		@param handle The handle of the socket. Stale handles are ignored.
+		@param reading Whether to report the socket when it is ready to read
+		*/
+		void set_reading(ConnectionHandle handle, bool reading);
+
+		/**
+		Stop or start watching a socket for writing. Once a poll() finds the socket
+		writable, it is listed in get_writable and no longer watched for writing. Used to
+		wait for room in a full send buffer without trying again on a timer.
+
+		@param handle The handle of the socket. Stale handles are ignored.
+		@param writing Whether to report the socket when it is ready to write
+		*/
+		void set_writing(ConnectionHandle handle, bool writing);
+
+		/**
+		@return The sockets watched for writing which the last poll() found writable. The
+		list is reused, so it is only valid until the next poll().
+		*/
+		const std::vector<ConnectionHandle>& get_writable() const { return this->writable; }
+
+		/**
+		Get the timers driven by this poll service. Timers may be scheduled and
+		cancelled from any callback running on the polling thread.
+		*/
+		TimerWheel& get_timers() { return this->timers; }
+
+		/**
+		@return When the OS poll call last returned, in CycleClock ticks. Only kept up to date
+		when SunNet is built with SUNNET_ENABLE_METRICS.
+		*/
+		uint64_t get_poll_return_ticks() const { return this->poll_return_ticks; }
+
+		/**
+		Poll all sockets, returning those ready to be read. Any timers which expire
+		while polling are fired before this returns.
 
 		@throws PollException if there was an error with the OS level poll()
 		@throws PollReturnEventException if a specific socket encountered an error
 		@throws InvalidSocketConnectionException if a watched socket's 
 		corresponding descriptor could not be found
-		@return A collection of sockets ready to be read
+		@return The sockets which are ready, in the order the kernel reported them.
+		The list is reused, so it is only valid until the next poll().
 		*/
-		SocketCollection_p poll();
+		const PollEventList& poll();
 	};
 
 	class PollException : public SocketException {
@@ -0,0 +1,69 @@
+/**
+@file rpc.h
+@brief Wire format and errors for request/response calls made over channels
+*/
+#pragma once
+
+#include "channels.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace SunNet {
+	typedef uint32_t CORRELATION_ID;
+
+	/* How long a call waits for its response unless told otherwise */
+	const std::chrono::milliseconds DEFAULT_RPC_TIMEOUT(5000);
+
+	/* The size of an RpcHeader on the wire */
+	const NETWORK_BYTE_SIZE RPC_HEADER_SIZE = sizeof(CHANNEL_ID) + sizeof(CORRELATION_ID);
+
+	/**
+	The header which follows RPC_REQUEST_CHANNEL_ID or RPC_RESPONSE_CHANNEL_ID on the wire.
+	It names the channel of the message that follows and the call it belongs to.
+
+	A response naming RPC_REQUEST_CHANNEL_ID as its channel carries no message and means
+	that the receiver had nothing serving the request.
+	*/
+	struct RpcHeader {
+		CHANNEL_ID channel_id;
+		CORRELATION_ID correlation_id;
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = this->channel_id;
+			std::memcpy(bytes + sizeof(CHANNEL_ID), &this->correlation_id, sizeof(CORRELATION_ID));
+		}
+
+		static RpcHeader read(const NETWORK_BYTE* bytes) {
+			RpcHeader header;
+			header.channel_id = bytes[0];
+			std::memcpy(&header.correlation_id, bytes + sizeof(CHANNEL_ID), sizeof(CORRELATION_ID));
+			return header;
+		}
+	};
+
+	class RpcException : public std::runtime_error {
+	public:
+		RpcException(std::string msg) : std::runtime_error(msg) {};
+	};
+
+	/* Thrown from a call's future when no response arrived in time */
+	class RpcTimeoutException : public RpcException {
+	public:
+		RpcTimeoutException() : RpcException("RPC timed out") {};
+	};
+
+	/* Thrown from a call's future when its connection closed before the response arrived */
+	class RpcDisconnectedException : public RpcException {
+	public:
+		RpcDisconnectedException() : RpcException("RPC connection closed") {};
+	};
+
+	/* Thrown from a call's future when the other side does not serve the request's channel */
+	class RpcNoHandlerException : public RpcException {
+	public:
+		RpcNoHandlerException() : RpcException("RPC request has no handler") {};
+	};
+}
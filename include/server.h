@@ -1,10 +1,14 @@
 #pragma once
 #include "socket_collection.h"
 #include "pollservice.h"
+#include "token_bucket.h"
+#include "address_table.h"
 
 #include <thread>
 #include <mutex>
 #include <functional>
+#include <algorithm>
+#include <vector>
 
 namespace SunNet {
 	/**
@@ -68,8 +72,119 @@ namespace SunNet {
 		*/
 		std::function<SocketConnection_p()> connection_create_func;
 
+		/* The most connections accepted per readiness event, and the connections accepted by the current one with their address keys */
+		int accept_batch_size;
+		std::vector<SocketConnection_p> accepted_clients;
+		std::vector<uint64_t> accepted_address_keys;
 
+		/*
+		Admission control. Connections over the cap or the accept rate are left in the
+		listen queue by not reading the listening socket, while connections from an
+		address which already has its share are accepted and closed right away.
+		*/
+		size_t max_connections;
+		TokenBucket accept_limit;
+		uint32_t max_connections_per_address;
+		bool accepting;
+		TIMER_ID accept_resume_timer;
+		uint64_t deferred_accepts;
+		uint64_t rejected_connections;
+
+		/* The address key of each client, by the slot of its handle, or 0 if it is not counted */
+		AddressTable client_addresses;
+		std::vector<uint64_t> client_address_keys;
+
+		/* Stop reading the listening socket, picking up again after the given wait or once a client leaves */
+		void defer_accepting(std::chrono::nanoseconds wait) {
+			if (this->accepting) {
+				this->accepting = false;
+				this->deferred_accepts++;
+				SUNNET_METRICS_ONLY(Metrics::global.deferred_accepts.add());
+				this->poll_service.set_reading(this->server_connection->get_handle(), false);
+			}
+
+			if (wait.count() > 0 && this->accept_resume_timer == INVALID_TIMER_ID) {
+				this->accept_resume_timer = this->schedule_timer(std::chrono::ceil<std::chrono::milliseconds>(wait), [this]() {
+					this->accept_resume_timer = INVALID_TIMER_ID;
+					this->resume_accepting();
+				});
+			}
+		}
+
+		void resume_accepting() {
+			if (!this->accepting && this->server_connection) {
+				this->accepting = true;
+				this->poll_service.set_reading(this->server_connection->get_handle(), true);
+			}
+		}
+
+		/* Stop counting a client against its address */
+		void forget_client_address(ConnectionHandle handle) {
+			if (handle.index < this->client_address_keys.size() && this->client_address_keys[handle.index] != 0) {
+				this->client_addresses.decrement(this->client_address_keys[handle.index]);
+				this->client_address_keys[handle.index] = 0;
+			}
+		}
+
+		/* The most messages and bytes read from one client per readiness event, and how often a client used it all */
+		size_t read_budget_messages;
+		size_t read_budget_bytes;
+		uint64_t read_budget_exhaustions;
+
+		/*
+		Handle messages from a ready client until nothing is left buffered or its read
+		budget runs out. A client which still has data when its budget runs out is marked
+		ready, so it is served again on the next poll() after everyone else has had a turn.
+		*/
+		void read_from_client(const SocketConnection_p& client) {
+			ConnectionHandle handle = client->get_handle();
+			uint64_t start_bytes = client->get_bytes_received();
+
+			for (size_t messages = 1; ; messages++) {
+				this->handle_ready_to_read(client);
+
+				/* The handler may have closed the server or removed the client */
+				if (this->state != SERVE || !this->poll_service.contains(handle) || client->buffered_bytes() == 0) {
+					return;
+				}
+
+				if (messages >= this->read_budget_messages ||
+					(this->read_budget_bytes > 0 && client->get_bytes_received() - start_bytes >= this->read_budget_bytes)) {
+					this->read_budget_exhaustions++;
+					SUNNET_METRICS_ONLY(Metrics::global.read_budget_exhaustions.add());
+					this->poll_service.mark_ready(handle);
+					return;
+				}
+			}
+		}
+
+		/* How long a client may stay silent before it is reaped, and the timer which reaps it */
+		std::chrono::milliseconds idle_timeout;
+		TIMER_ID idle_sweep_timer;
+		std::vector<SocketConnection_p> idle_clients;
+
+		/*
+		Disconnect every client which has not sent anything within the idle timeout.
+		Runs a few times per timeout from a timer, so that idle clients are found in
+		one pass instead of tracking a timer per client.
+		*/
+		void reap_idle_clients() {
+			if (this->state != SERVE) {
+				return;
+			}
+
+			std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - this->idle_timeout;
+			this->for_each_client([&](const SocketConnection_p& client) {
+				if (client->get_last_receive_time() < cutoff) {
+					this->idle_clients.push_back(client);
+				}
+			});
 
+			for (const SocketConnection_p& client : this->idle_clients) {
+				this->handle_client_disconnect(client);
+			}
+			this->idle_clients.clear();
+		}
 
 
 	protected:
@@ -83,24 +198,134 @@ namespace SunNet {
 		/**
 		Removes a socket from the poll service, esp. useful when a client disconnects */
 		void removeFromPollService(SocketConnection_p socket) {
+			ConnectionHandle handle = socket->get_handle();
+			if (this->poll_service.contains(handle)) {
+				this->forget_client_address(handle);
+			}
 			this->poll_service.remove_socket(socket);
+
+			/* A client leaving makes room under the cap. The accept rate has its own timer */
+			if (this->accept_resume_timer == INVALID_TIMER_ID) {
+				this->resume_accepting();
+			}
+		}
+
+		/**
+		Report a client through handle_ready_to_write once it can be sent on, such as after
+		a send found its buffer full. It is reported once per call.
+		*/
+		void watchForWriting(SocketConnection_p socket) {
+			this->poll_service.set_writing(socket->get_handle(), true);
 		}
 
 		void clearPollService() {
 			this->poll_service.clear_sockets();
+			this->client_addresses.clear();
+			this->client_address_keys.clear();
+		}
+
+		/**
+		Get the timers fired by this server's poll()
+		*/
+		TimerWheel& get_timers() {
+			return this->poll_service.get_timers();
+		}
+
+		/**
+		Call a function for every connected client. The function must not add or
+		remove clients from the poll service.
+		*/
+		template <class TCallback>
+		void for_each_client(TCallback callback) {
+			this->poll_service.for_each_socket([&](const SocketConnection_p& socket) {
+				if (socket != this->server_connection) {
+					callback(socket);
+				}
+			});
 		}
 
 		/**
 		The default implementation for when a new connection request comes in.
 		This can be overriden by users, but chances are they'd like to perform
-		the default behavior, which simply adds the connection to the
-		poll service and delegates to another "hook"
+		the default behavior, which accepts every waiting connection (up to the
+		accept batch size) as a TSocketConnection, adds them all to the poll
+		service, and delegates each to another "hook"
 		*/
 		virtual void handle_connection_request() {
-			SocketConnection_p new_client = this->server_connection->accept();
+			struct sockaddr_storage address;
+			SOCKET_LEN address_len;
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			size_t connected = this->client_count();
+
+			for (int accepted = 0; accepted < this->accept_batch_size; accepted++) {
+				if (this->max_connections > 0 && connected + this->accepted_clients.size() >= this->max_connections) {
+					this->defer_accepting(std::chrono::nanoseconds(0));
+					break;
+				}
+
+				if (this->accept_limit.is_limited()) {
+					this->accept_limit.refill(now);
+					std::chrono::nanoseconds wait = this->accept_limit.time_until_available();
+					if (wait.count() > 0) {
+						this->defer_accepting(wait);
+						break;
+					}
+				}
+
+				SOCKET descriptor = this->server_connection->accept_descriptor(&address, &address_len);
+				if (descriptor == INVALID_SOCKET) {
+					break;
+				}
 
-			this->addToPollService(new_client);
-			this->handle_client_connect(new_client);
+				/* Every accept counts against the rate, so that rejected peers cannot accept faster than it */
+				this->accept_limit.charge(1);
+
+				uint64_t address_key = 0;
+				if (this->max_connections_per_address > 0) {
+					address_key = AddressTable::key_of(address);
+					if (address_key != 0 && this->client_addresses.count(address_key) >= this->max_connections_per_address) {
+						close_socket(descriptor);
+						this->rejected_connections++;
+						SUNNET_METRICS_ONLY(Metrics::global.rejected_connections.add());
+						continue;
+					}
+				}
+
+				/* Some transports finish a handshake while taking over the socket. A peer which fails it is closed */
+				SocketConnection_p new_client;
+				try {
+					new_client = std::make_shared<TSocketConnection>(descriptor);
+				}
+				catch (CreateException&) {
+					continue;
+				}
+
+				/* Only counted once it is a client, so that nothing is left to undo */
+				if (address_key != 0) {
+					this->client_addresses.increment(address_key);
+				}
+				this->accepted_clients.push_back(std::move(new_client));
+				this->accepted_address_keys.push_back(address_key);
+			}
+			SUNNET_METRICS_ONLY(Metrics::global.accepted_connections.add(this->accepted_clients.size()));
+
+			auto begin = this->accepted_clients.begin();
+			auto end = this->accepted_clients.end();
+			this->poll_service.add_sockets(begin, end);
+
+			for (size_t index = 0; index < this->accepted_clients.size(); index++) {
+				uint32_t slot = this->accepted_clients[index]->get_handle().index;
+				if (slot >= this->client_address_keys.size()) {
+					this->client_address_keys.resize(slot + 1, 0);
+				}
+				this->client_address_keys[slot] = this->accepted_address_keys[index];
+			}
+
+			for (const SocketConnection_p& new_client : this->accepted_clients) {
+				this->handle_client_connect(new_client);
+			}
+			this->accepted_clients.clear();
+			this->accepted_address_keys.clear();
 		}
 
 		/* Handlers for an inheritor to implement */
@@ -112,10 +337,17 @@ namespace SunNet {
 		virtual void handle_client_disconnect(SocketConnection_p client) = 0;
 		virtual void handle_poll_timeout() = 0;
 
+		/* Called for a client passed to watchForWriting once it can be sent on. Does nothing unless overridden */
+		virtual void handle_ready_to_write(SocketConnection_p) {}
+
 	public:
 		template <class ... ArgType>
 		Server(std::string address, std::string port, int listen_queue_size, int poll_timeout, ArgType ... args) : 
-			address(address), port(port), listen_queue_size(listen_queue_size), poll_timeout(poll_timeout), state(CLOSED) {
+			address(address), port(port), listen_queue_size(listen_queue_size), poll_timeout(poll_timeout), state(CLOSED),
+			accept_batch_size(64), max_connections(0), max_connections_per_address(0), accepting(true),
+			accept_resume_timer(INVALID_TIMER_ID), deferred_accepts(0), rejected_connections(0),
+			read_budget_messages(64), read_budget_bytes(64 * 1024), read_budget_exhaustions(0),
+			idle_timeout(0), idle_sweep_timer(INVALID_TIMER_ID) {
 
 			/* Bind the template arguments to a function we can use to re-create the connection */
 			this->connection_create_func = [=]() { return std::make_shared<TSocketConnection>(args...);  };
@@ -155,23 +387,24 @@ namespace SunNet {
 			if (this->state != SERVE) {
 				return false;
 			}
-			SocketCollection_p ready_sockets = this->poll_service.poll();
+			const PollEventList& ready_sockets = this->poll_service.poll();
 
-			if (ready_sockets->size() == 0) {
+			if (ready_sockets.empty() && this->poll_service.get_writable().empty()) {
 				/* CHECKPOINT */
 				if (this->state == DESTRUCTING) return false;
 				this->handle_poll_timeout();
 				return false;
 			}
 
-			for (auto socket_it = ready_sockets->begin(); socket_it != ready_sockets->end(); ++socket_it) {
-				if (socket_it->connection == this->server_connection) {
-					if (socket_it->status == SOCKET_STATUS_ERROR) {
+			ConnectionHandle server_handle = this->server_connection->get_handle();
+			for (const PollEvent& event : ready_sockets) {
+				if (event.handle == server_handle) {
+					if (event.status == SOCKET_STATUS_ERROR) {
 						/* CHECKPOINT */
 						if (this->state == DESTRUCTING) return false;
 						this->handle_server_connection_error();
 					}
-					else if (socket_it->status == SOCKET_STATUS_DISCONNECT) {
+					else if (event.status == SOCKET_STATUS_DISCONNECT) {
 						/* CHECKPOINT */
 						if (this->state == DESTRUCTING) return false;
 						this->handle_server_disconnect();
@@ -183,27 +416,193 @@ namespace SunNet {
 					}
 				}
 				else {
-					if (socket_it->status == SOCKET_STATUS_ERROR) {
+					/* An earlier handler may have removed this client */
+					SocketConnection_p client = this->poll_service.get_socket(event.handle);
+					if (!client) {
+						continue;
+					}
+
+					if (event.status == SOCKET_STATUS_ERROR) {
 						/* CHECKPOINT */
 						if (this->state == DESTRUCTING) return false;
-						this->handle_client_error(socket_it->connection);
+						this->handle_client_error(client);
 					}
-					else if (socket_it->status == SOCKET_STATUS_DISCONNECT) {
+					else if (event.status == SOCKET_STATUS_DISCONNECT) {
 
 						/* CHECKPOINT */
 						if (this->state == DESTRUCTING) return false;
-						this->handle_client_disconnect(socket_it->connection);
+						this->handle_client_disconnect(client);
 					}
 					else {
 						/* CHECKPOINT */
 						if (this->state == DESTRUCTING) return false;
-						this->handle_ready_to_read(socket_it->connection);
+						SUNNET_METRICS_ONLY(Metrics::latency.dispatch_delay.record_since(this->poll_service.get_poll_return_ticks()));
+						this->read_from_client(client);
 					}
 				}
 			}
+
+			/* After reads, so that a client which hung up is already gone */
+			for (const ConnectionHandle& handle : this->poll_service.get_writable()) {
+				SocketConnection_p client = this->poll_service.get_socket(handle);
+				if (!client) {
+					continue;
+				}
+
+				/* CHECKPOINT */
+				if (this->state == DESTRUCTING) return false;
+				this->handle_ready_to_write(client);
+			}
+			SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
 			return true;
 		}
 
+		/**
+		Schedule a callback to fire once on the polling thread after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_timer(std::chrono::milliseconds delay, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule(delay, std::move(callback));
+		}
+
+		/**
+		Schedule a callback to fire on the polling thread every interval until it is cancelled.
+
+		@param interval How long to wait between firings
+		@param callback The callback to fire
+		@return An id which may be passed to cancel_timer
+		*/
+		TIMER_ID schedule_repeating_timer(std::chrono::milliseconds interval, std::function<void()> callback) {
+			return this->poll_service.get_timers().schedule_repeating(interval, std::move(callback));
+		}
+
+		/**
+		Cancel a timer scheduled with schedule_timer or schedule_repeating_timer.
+
+		@param id The id of the timer to cancel
+		@return Whether the timer was still pending
+		*/
+		bool cancel_timer(TIMER_ID id) {
+			return this->poll_service.get_timers().cancel(id);
+		}
+
+		/**
+		Look up a connected client by its handle. Handles are cheaper to store than
+		SocketConnection_p, do not keep the client alive, and can be checked for staleness.
+
+		@param handle The handle of the client, from SocketConnection::get_handle
+		@return The client, or nullptr if it has since been removed
+		*/
+		SocketConnection_p get_client(ConnectionHandle handle) const {
+			return this->poll_service.get_socket(handle);
+		}
+
+		/**
+		@return The number of connected clients
+		*/
+		size_t client_count() const {
+			return this->server_connection ? this->poll_service.size() - 1 : 0;
+		}
+
+		/**
+		Set the most connections accepted each time the listening socket is ready.
+		Any connections left waiting are accepted on the next poll(), so that a flood
+		of new connections cannot stall existing clients.
+
+		@param batch_size The most connections to accept at once. Defaults to 64.
+		*/
+		void set_accept_batch_size(int batch_size) {
+			this->accept_batch_size = std::max(batch_size, 1);
+		}
+
+		/**
+		Cap how many clients may be connected at once. Connections over the cap are not
+		accepted, but left in the listen queue until a client leaves. Once the queue is
+		full, the kernel turns new connections away, and their clients retry.
+
+		@param max_clients The most clients connected at once, or 0 for no cap
+		*/
+		void set_max_connections(size_t max_clients) {
+			this->max_connections = max_clients;
+			this->resume_accepting();
+		}
+
+		/**
+		Limit how fast connections are accepted, so that a storm of reconnecting clients is
+		let in at a pace the server can log in. Connections over the rate wait in the
+		listen queue. Connections closed by the per-address cap count against the rate too.
+
+		@param connections_per_second The most connections accepted each second, or 0 for no limit
+		@param burst How many connections may be accepted at once after a quiet spell
+		*/
+		void set_accept_rate(uint64_t connections_per_second, uint64_t burst) {
+			this->accept_limit.set_limit(connections_per_second, burst);
+			this->resume_accepting();
+		}
+
+		/**
+		Cap how many clients may be connected from one address, counting IPv6 addresses by
+		their /64 prefix. Connections over the cap are accepted and closed straight away,
+		since they cannot be told apart while still queued. Only connections accepted
+		while the cap is set are counted.
+
+		@param max_clients The most clients from one address, or 0 for no cap
+		*/
+		void set_max_connections_per_address(uint32_t max_clients) {
+			this->max_connections_per_address = max_clients;
+		}
+
+		/**
+		@return How many times accepting was put off by the connection cap or the accept rate
+		*/
+		uint64_t get_deferred_accepts() const { return this->deferred_accepts; }
+
+		/**
+		@return How many connections were closed for going over the per-address cap
+		*/
+		uint64_t get_rejected_connections() const { return this->rejected_connections; }
+
+		/**
+		Set how much is read from one client each time it is ready. A client which sends
+		faster than this is served again on the next poll(), after the other ready clients,
+		so heavy clients are drained in bulk without starving everyone else.
+
+		@param max_messages The most times handle_ready_to_read is called per readiness. Defaults to 64.
+		@param max_bytes The most bytes received per readiness, or 0 for no limit. Defaults to 64KiB.
+		*/
+		void set_read_budget(size_t max_messages, size_t max_bytes) {
+			this->read_budget_messages = std::max(max_messages, (size_t)1);
+			this->read_budget_bytes = max_bytes;
+		}
+
+		/**
+		@return How many times a client still had data waiting after using its whole read budget
+		*/
+		uint64_t get_read_budget_exhaustions() const {
+			return this->read_budget_exhaustions;
+		}
+
+		/**
+		Disconnect clients which have not sent anything for the given amount of time.
+		Idle clients are looked for in bulk a few times per timeout and are reported
+		through handle_client_disconnect, just like clients which hung up.
+
+		@param timeout How long a client may stay silent. Zero disables idle detection.
+		*/
+		void set_idle_timeout(std::chrono::milliseconds timeout) {
+			this->cancel_timer(this->idle_sweep_timer);
+			this->idle_sweep_timer = INVALID_TIMER_ID;
+			this->idle_timeout = timeout;
+
+			if (timeout.count() > 0) {
+				std::chrono::milliseconds sweep_interval = std::max(timeout / 4, std::chrono::milliseconds(1));
+				this->idle_sweep_timer = this->schedule_repeating_timer(sweep_interval, [this]() { this->reap_idle_clients(); });
+			}
+		}
+
 		/**
 		Opens the server by binding and listening on the given port and
 		address.
@@ -219,6 +618,10 @@ namespace SunNet {
 			this->server_connection->bind(this->port, this->address);
 			this->server_connection->listen(this->listen_queue_size);
 
+			/* Accept until the queue is empty instead of blocking on it */
+			this->server_connection->set_nonblocking(true);
+			this->accepting = true;
+
 			this->state = OPEN;
 		}
 
@@ -247,6 +650,8 @@ namespace SunNet {
 			The user is properly closing us, so let's take our sweet time :)
 			*/
 			this->clearPollService();
+			this->cancel_timer(this->accept_resume_timer);
+			this->accept_resume_timer = INVALID_TIMER_ID;
 
 			/* KILL THE CONNECTION! */
 			this->server_connection.reset();
@@ -0,0 +1,222 @@
+/**
+@file session.h
+@brief Sessions which carry a client's messages across a dropped connection
+*/
+#pragma once
+
+#include "channels.h"
+#include "socketutil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace SunNet {
+	typedef uint64_t SESSION_TOKEN;
+	typedef uint64_t SESSION_SEQUENCE;
+
+	/* How many bytes of unacknowledged messages a session keeps for resending unless told otherwise */
+	const NETWORK_BYTE_SIZE DEFAULT_REPLAY_LIMIT = 1024 * 1024;
+
+	/* How long a server keeps a dropped session for its client to resume unless told otherwise */
+	const std::chrono::milliseconds DEFAULT_RESUME_WINDOW(30000);
+
+	/* How long a client waits for the server to answer a new or resumed session unless told otherwise */
+	const std::chrono::milliseconds DEFAULT_SESSION_HANDSHAKE_TIMEOUT(5000);
+
+	/* A receiver acknowledges once it has taken this many messages, or this many bytes of them */
+	const uint32_t SESSION_ACK_MESSAGES = 32;
+	const NETWORK_BYTE_SIZE SESSION_ACK_BYTES = 16 * 1024;
+
+	/**
+	The kinds of frame sent on SESSION_CHANNEL_ID. A client sends SESSION_OPEN or
+	SESSION_RESUME as the first frame on a connection, and the server answers with
+	SESSION_ACCEPT or SESSION_RESUMED before sending anything else.
+	*/
+	enum SessionFrameType : NETWORK_BYTE {
+		SESSION_OPEN = 1, /** < Asks for a new session */
+		SESSION_RESUME = 2, /** < Asks to carry on the session named by the token on this connection */
+		SESSION_ACCEPT = 3, /** < A new session was started, named by the token */
+		SESSION_RESUMED = 4, /** < The session was carried on, and the sender's unacknowledged messages follow */
+		SESSION_ACK = 5, /** < Says how many messages the sender has received */
+		SESSION_CLOSE = 6 /** < The client is leaving, so the session should not wait for it to come back */
+	};
+
+	/* The size of a SessionHeader on the wire */
+	const NETWORK_BYTE_SIZE SESSION_HEADER_SIZE = sizeof(NETWORK_BYTE) + sizeof(SESSION_TOKEN) + 2 * sizeof(SESSION_SEQUENCE);
+
+	/**
+	The header which follows SESSION_CHANNEL_ID on the wire.
+	*/
+	struct SessionHeader {
+		NETWORK_BYTE type; /** < A SessionFrameType */
+		SESSION_TOKEN token;
+		SESSION_SEQUENCE received; /** < How many messages the sender has received in the session */
+		SESSION_SEQUENCE replay_from; /** < For SESSION_RESUME, the first message the sender can still resend */
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = this->type;
+			std::memcpy(bytes + 1, &this->token, sizeof(SESSION_TOKEN));
+			std::memcpy(bytes + 1 + sizeof(SESSION_TOKEN), &this->received, sizeof(SESSION_SEQUENCE));
+			std::memcpy(bytes + 1 + sizeof(SESSION_TOKEN) + sizeof(SESSION_SEQUENCE), &this->replay_from, sizeof(SESSION_SEQUENCE));
+		}
+
+		static SessionHeader read(const NETWORK_BYTE* bytes) {
+			SessionHeader header;
+			header.type = bytes[0];
+			std::memcpy(&header.token, bytes + 1, sizeof(SESSION_TOKEN));
+			std::memcpy(&header.received, bytes + 1 + sizeof(SESSION_TOKEN), sizeof(SESSION_SEQUENCE));
+			std::memcpy(&header.replay_from, bytes + 1 + sizeof(SESSION_TOKEN) + sizeof(SESSION_SEQUENCE), sizeof(SESSION_SEQUENCE));
+			return header;
+		}
+	};
+
+	/**
+	One side of a session: the channel messages it has sent which the other side has
+	not acknowledged yet, and how many it has received. Messages are numbered from 1 in
+	the order they are sent, so on an ordered transport neither side has to put a number
+	on the wire; a count of what was received says exactly what was not.
+
+	Unacknowledged messages are kept back to back in a ring, and a resume sends the whole
+	ring in one go. The ring grows as messages go unacknowledged, up to the replay limit,
+	so a session whose peer keeps up never holds more than a little. Once the ring is at
+	the limit the oldest messages are let go, and a resume which needs them fails.
+
+	Any thread may send, but only the polling thread may receive, acknowledge or resume.
+	*/
+	class Session {
+	private:
+		SESSION_TOKEN token;
+
+		/* Held while a message is kept and sent, so that messages go out in the order they are numbered */
+		std::mutex mutex;
+
+		std::vector<NETWORK_BYTE> replay_buffer;
+		NETWORK_BYTE_SIZE replay_limit; /** < The size the ring may grow to */
+		size_t replay_start;
+		size_t replay_size;
+
+		SESSION_SEQUENCE sent; /** < The number of the last message sent */
+		SESSION_SEQUENCE replay_from; /** < The number of the oldest message kept, or sent + 1 if none are */
+
+		/* Only touched by the polling thread */
+		SESSION_SEQUENCE received;
+		uint32_t unacked_messages;
+		NETWORK_BYTE_SIZE unacked_bytes;
+
+		std::atomic<bool> closed;
+
+		void record(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size);
+		void copy_in(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes);
+		void grow(size_t needed);
+		void drop_oldest();
+
+	public:
+		/**
+		@param token The token naming the session
+		@param replay_limit The most bytes of unacknowledged messages kept for resending
+		*/
+		Session(SESSION_TOKEN token, NETWORK_BYTE_SIZE replay_limit);
+
+		SESSION_TOKEN get_token() const { return this->token; }
+
+		/**
+		Number and keep a message, then send it while nothing else may be sent in the
+		session. The message is kept even if sending throws.
+
+		@param channel_id The channel of the message
+		@param message The message, as large as its channel's message size
+		@param send Sends the message
+		*/
+		template <class TSend>
+		void send(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size, TSend send) {
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->record(channel_id, message, message_size);
+			send();
+		}
+
+		/**
+		Let go of every message the other side has received.
+
+		@param peer_received How many messages the other side has received
+		*/
+		void acknowledge(SESSION_SEQUENCE peer_received);
+
+		/**
+		Check whether both sides can fill in what the other missed.
+
+		@param peer_received How many messages the other side has received
+		@param peer_replay_from The oldest message the other side can still resend
+		*/
+		bool can_resume(SESSION_SEQUENCE peer_received, SESSION_SEQUENCE peer_replay_from);
+
+		/**
+		Resend every message which has not been acknowledged, in order, while nothing
+		else may be sent in the session. Call acknowledge with what the other side has
+		received first.
+
+		@param send Called with the kept frames, in at most two pieces, and their total size
+		@return The number of messages resent
+		*/
+		template <class TSend>
+		SESSION_SEQUENCE replay(TSend send) {
+			std::lock_guard<std::mutex> lock(this->mutex);
+			if (this->replay_size == 0) {
+				return 0;
+			}
+
+			SEND_VECTOR frame[2];
+			size_t first_size = std::min(this->replay_size, this->replay_buffer.size() - this->replay_start);
+			set_send_vector(&frame[0], this->replay_buffer.data() + this->replay_start, first_size);
+			int count = 1;
+			if (first_size < this->replay_size) {
+				set_send_vector(&frame[1], this->replay_buffer.data(), this->replay_size - first_size);
+				count = 2;
+			}
+
+			send(frame, count, (NETWORK_BYTE_SIZE)this->replay_size);
+			return this->sent - this->replay_from + 1;
+		}
+
+		/**
+		Count a message received in the session.
+
+		@param frame_size The size of the frame it came in
+		@return Whether the other side should be sent an acknowledgement now
+		*/
+		bool count_received(NETWORK_BYTE_SIZE frame_size);
+
+		/**
+		@return How many messages have been received in the session
+		*/
+		SESSION_SEQUENCE get_received() const { return this->received; }
+
+		/**
+		@return The number of the last message sent in the session
+		*/
+		SESSION_SEQUENCE get_sent();
+
+		/**
+		@return The oldest message which can still be resent
+		*/
+		SESSION_SEQUENCE get_replay_from();
+
+		/**
+		@return The bytes of unacknowledged messages being kept
+		*/
+		size_t get_replay_size();
+
+		/**
+		Mark the session as ended on purpose, so that it is not kept when its connection closes.
+		*/
+		void close() { this->closed = true; }
+		bool is_closed() const { return this->closed; }
+	};
+
+	typedef std::shared_ptr<Session> Session_p;
+}
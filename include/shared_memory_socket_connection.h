@@ -0,0 +1,98 @@
+/**
+@file shared_memory_socket_connection.h
+@brief A SocketConnection which moves data between processes through shared memory
+*/
+#pragma once
+
+#include "unix_socket_connection.h"
+
+#ifdef __linux__
+#define SUNNET_HAS_SHARED_MEMORY_TRANSPORT 1
+#endif
+
+#ifdef SUNNET_HAS_SHARED_MEMORY_TRANSPORT
+
+namespace SunNet {
+
+	/* The bytes each direction of a shared memory connection can hold before a send waits */
+	const std::size_t SHARED_MEMORY_RING_SIZE = 4 * 1024 * 1024;
+
+	struct SharedMemoryHeader;
+	struct SharedMemoryRing;
+
+	/**
+	A connection to another process on the same host through a pair of single-producer,
+	single-consumer rings in shared memory. Sending and receiving are memory copies into
+	and out of the rings, so bulk data moves at memory bandwidth.
+
+	Connections are made over a Unix domain socket, so addresses work as they do for
+	UnixSocketConnection. The connecting side creates the shared memory and passes it to
+	the accepting side. The socket then stays open as the doorbell. A sender writes a
+	byte to it only when it publishes into an empty ring, and PollService watches it like
+	any socket. A peer which crashes without closing its rings is therefore still seen as
+	a hangup.
+
+	A send to a full ring sleeps briefly until the peer makes room. The rings are large,
+	so this only happens when the receiver falls behind.
+
+	Example:
+		ChanneledServer<SharedMemorySocketConnection> server("@simulation", "", 16, 10);
+		ChanneledClient<SharedMemorySocketConnection> client(10);
+		client.connect("@simulation", "");
+	*/
+	class SharedMemorySocketConnection : public UnixSocketConnection {
+	private:
+		SharedMemoryHeader* header; /** < The mapped shared memory, or nullptr until connected */
+		std::size_t mapping_size;
+
+		SharedMemoryRing* inbound;
+		SharedMemoryRing* outbound;
+		NETWORK_BYTE* inbound_data; /** < Where the inbound ring's bytes start, from the local layout */
+		NETWORK_BYTE* outbound_data;
+
+		/* Set once the doorbell socket reports that the peer has gone */
+		mutable bool peer_closed;
+
+		void map(SOCKET memory_descriptor, std::size_t size);
+		void ring_doorbell() const;
+		void drain_doorbell() const;
+		bool peer_hung_up() const;
+
+	protected:
+		bool consume_wakeup();
+
+	public:
+		/**
+		Create an unconnected endpoint, which may then connect or bind
+		*/
+		SharedMemorySocketConnection();
+
+		/**
+		Take over an accepted socket and wait for the peer to hand over its shared memory.
+		The wait is short, since the peer sends it as part of connecting.
+		@throws CreateException if the peer sends no shared memory in time, or memory which
+		is not laid out as expected. The socket is closed
+		*/
+		SharedMemorySocketConnection(SOCKET descriptor);
+
+		/**
+		Close both rings and unmap them. The peer receives whatever is still in its ring
+		and then sees the connection close.
+		*/
+		~SharedMemorySocketConnection();
+
+		/** @throws SendException with EPIPE if the peer has closed */
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		NETWORK_BYTE_SIZE buffered_bytes() const;
+
+		/**
+		Connect to a listening SharedMemorySocketConnection and hand it the shared memory.
+		@throws ConnectException if the connection or the shared memory cannot be set up
+		*/
+		void connect(std::string address, std::string port);
+	};
+}
+
+#endif
@@ -1,6 +1,6 @@
 #pragma once
 #include "socket_connection.h"
-#include <unordered_set>
+#include <vector>
 
 namespace SunNet {
 	enum SocketStatus {
@@ -9,21 +9,17 @@ namespace SunNet {
 		SOCKET_STATUS_ERROR
 	};
 
-	struct SocketCollectionEntry {
-		SocketConnection_p connection;
+	/**
+	A socket which poll() found ready, named by its handle in the PollService. Events
+	are plain values, so collecting them does not touch any reference counts. The
+	handle may have gone stale by the time the event is handled if an earlier event
+	caused the socket to be removed.
+	*/
+	struct PollEvent {
+		ConnectionHandle handle;
 		SocketStatus status;
-
-		friend bool operator==(const SocketCollectionEntry& lhs, const SocketCollectionEntry& rhs) {
-			return (lhs.connection == rhs.connection);
-		}
-	};
-
-	struct SocketCollectionEntry_hash {
-		std::size_t operator()(const SocketCollectionEntry& collection_entry) const {
-			return std::hash<SOCKET>()(collection_entry.connection->socket_descriptor);
-		}
 	};
 
-	typedef std::unordered_set<SocketCollectionEntry, SocketCollectionEntry_hash> SocketCollection;
-	typedef std::shared_ptr<SocketCollection> SocketCollection_p;
-}
\ No newline at end of file
+	/* The ready sockets from one poll(), in the order the kernel reported them */
+	typedef std::vector<PollEvent> PollEventList;
+}
@@ -4,14 +4,25 @@
 */
 #pragma once
 #include "socketutil.h"
+#include "connection_handle.h"
+#include "metrics.h"
 
 #include <cstdint>
 #include <stdexcept>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
 
 namespace SunNet {
 
+	/* How much receive() reads from the socket at once. Larger reads go straight into the caller's buffer */
+	const NETWORK_BYTE_SIZE RECEIVE_BUFFER_SIZE = 8192;
+
+	/* The largest header which may go in front of a zero-copy payload */
+	const NETWORK_BYTE_SIZE ZEROCOPY_MAX_HEADER_SIZE = 64;
 
 	/**
 	A struct used to hold pointers to struct addrinfo types. 
@@ -40,16 +51,58 @@ namespace SunNet {
 	 An abstraction layer over sockets which supports modern C++ constructs
 	 as well as memory management. All operations in the SocketConnection
 	 class are synchronous. 
+
+	 The I/O operations are virtual, so that a transport which does not go through
+	 the kernel's sockets can stand in for one. Such a transport still needs a pollable
+	 descriptor to signal PollService with.
 	 */
 	class SocketConnection {
 
-	friend struct SocketCollectionEntry_hash;
 	friend class PollService;
 
 	private:
 		SOCKET socket_descriptor; /** < The underlying OS socket descriptor */
 		std::unique_ptr<struct addrinfo_data, addrinfo_delete> address_info; 
 
+		/** When data was last received from and sent on this connection, used to detect idle connections */
+		mutable std::chrono::steady_clock::time_point last_receive_time;
+		mutable std::chrono::steady_clock::time_point last_send_time;
+
+		/** The slot this connection occupies in the PollService watching it */
+		ConnectionHandle poll_handle;
+
+		/**
+		Bytes read from the socket which receive() has not handed out yet. Small reads are
+		served from here, so a burst of small messages costs one system call instead of two
+		per message. The buffer is only allocated once something small is received.
+		*/
+		mutable std::unique_ptr<NETWORK_BYTE[]> receive_buffer;
+		mutable NETWORK_BYTE_SIZE receive_begin;
+		mutable NETWORK_BYTE_SIZE receive_end;
+
+		/** The size of receive_buffer, and whether every read must go through it to keep packets whole */
+		NETWORK_BYTE_SIZE receive_buffer_size;
+		bool whole_packets;
+
+		/** The total number of bytes handed out by receive() */
+		mutable uint64_t bytes_received;
+
+		/** Whether the kernel timestamps receives, and when it last received data, in ns since the Unix epoch */
+		bool receive_timestamps;
+		mutable int64_t last_kernel_receive_time;
+
+		/** A payload the kernel may still be reading, and the header sent with it */
+		struct ZerocopySend {
+			uint32_t last_id; /** < The number of the last send it took */
+			std::function<void()> release;
+			NETWORK_BYTE header[ZEROCOPY_MAX_HEADER_SIZE]; /** < Kept here, since the kernel reads it late too */
+		};
+
+		/** The smallest payload sent with MSG_ZEROCOPY, or 0 if it is not enabled */
+		NETWORK_BYTE_SIZE zerocopy_threshold;
+		mutable uint32_t next_zerocopy_id;
+		mutable std::deque<ZerocopySend> zerocopy_pending; /** < Oldest first. A deque, so that headers never move */
+
 		/** Keep track of the amount of open connections to automatically call initialize_socket_api
 		and quit_socket_api */
 		static std::atomic_uint open_connection_count;
@@ -58,6 +111,84 @@ namespace SunNet {
 		void set_socket_info(std::string, std::string address, int flag);
 		void initialize_api();
 
+	protected:
+		/*
+		Called after a send or receive fails. Retries interrupted calls and waits for
+		non-blocking sockets to become ready, so that send and receive always complete
+		synchronously. Any other error is thrown as TException.
+		*/
+		template <class TException>
+		void wait_after_error(short events) const {
+			int error = get_previous_error_code();
+			if (is_interrupted_error(error)) {
+				return;
+			}
+
+			if (!is_would_block_error(error) || wait_for_socket(this->socket_descriptor, events, -1) == SOCKET_ERROR) {
+				throw TException(std::to_string(error));
+			}
+		}
+
+		/** @return The underlying OS socket descriptor */
+		SOCKET get_descriptor() const { return this->socket_descriptor; }
+
+		/** Traffic on this connection. Only counted when SUNNET_ENABLE_METRICS is defined */
+		mutable ConnectionMetrics metrics;
+
+		/** Account for bytes handed out by a receive which did not go through the socket */
+		void record_receive(NETWORK_BYTE_SIZE num_bytes) const {
+			this->bytes_received += num_bytes;
+			this->last_receive_time = std::chrono::steady_clock::now();
+		}
+
+		/** Account for bytes sent by a send which did not go through the socket */
+		void record_send(NETWORK_BYTE_SIZE num_bytes) const {
+			SUNNET_METRICS_ONLY(this->metrics.bytes_sent.add(num_bytes));
+			this->last_send_time = std::chrono::steady_clock::now();
+		}
+
+		/**
+		Called by PollService when the descriptor polls readable, before the connection is
+		reported as ready. Connections whose descriptor is only a wakeup signal use this to
+		reset the signal and to filter out wakeups for data which has already been read.
+		@return Whether the connection really has something to receive or accept
+		*/
+		virtual bool consume_wakeup() { return true; }
+
+		/**
+		Called by PollService when the descriptor reports an error. Reads the completions
+		of zero-copy sends from the error queue and releases the payloads they cover.
+		@return Whether the completions were all there was, so the connection is fine
+		*/
+		bool reap_error_queue();
+
+		/**
+		Send a header and then part of a file with sendfile, so the file's bytes go from
+		the page cache to the socket without passing through user memory. Only for
+		transports whose descriptor is the stream itself, which opt in by overriding
+		send_file with it. Files sendfile cannot read are copied instead.
+		*/
+		void send_file_direct(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+			int file, uint64_t offset, NETWORK_BYTE_SIZE length) const;
+
+		/**
+		Make one read from the socket for receive(). Transports which need more than the
+		plain system call, such as collecting ancillary data, override this.
+		@return The number of bytes read, 0 if the peer closed, or SOCKET_ERROR
+		*/
+		virtual int read_socket(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+
+		/**
+		Read every packet whole into the receive buffer, for sockets which keep message
+		boundaries and would drop whatever did not fit in a read. Must be called before
+		anything is received.
+		@param max_packet_size The largest packet the peer may send
+		*/
+		void receive_whole_packets(NETWORK_BYTE_SIZE max_packet_size) {
+			this->receive_buffer_size = max_packet_size;
+			this->whole_packets = true;
+		}
+
 	public:
 		/**
 		 Construct a SocketConnection instance with domain, type, and protocol
@@ -92,15 +223,89 @@ namespace SunNet {
 		 @param num_bytes The number of bytes to send
 		 @throws SendException if an error occurred while sending
 		 */
-		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		virtual void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+
+		/**
+		 Sends several buffers onto the wire as if they were one contiguous buffer,
+		 using as few system calls as possible.
+		 @param vectors The buffers to send. These are modified as bytes are sent.
+		 @param count The number of buffers
+		 @throws SendException if an error occurred while sending
+		 */
+		virtual void send_vectored(SEND_VECTOR* vectors, int count) const;
+
+		/**
+		 Send a header and a payload. Once enable_zerocopy has been called, a payload of
+		 at least the threshold is sent with MSG_ZEROCOPY: the kernel reads it from the
+		 caller's memory as it transmits, so it must not change or be freed until release
+		 is called. That happens on the polling thread once the PollService watching this
+		 connection reads the completion. Smaller payloads, and every payload on a
+		 connection without zero-copy, are sent as usual and released before this returns.
+		 @param header Bytes to send first, which are copied. At most ZEROCOPY_MAX_HEADER_SIZE
+		 @param header_size The number of bytes in the header
+		 @param payload The bytes to send without copying
+		 @param payload_size The number of bytes in the payload
+		 @param release Called once the payload may be changed or freed
+		 @throws SendException if an error occurred while sending. The payload is then
+		 released when the connection is destroyed
+		 */
+		virtual void send_zerocopy(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+			const NETWORK_BYTE* payload, NETWORK_BYTE_SIZE payload_size, std::function<void()> release) const;
 
 		/**
-		 Reads the number of bytes from the wire into the provided buffer
+		 Send a header followed by part of a file. This copies the file through memory,
+		 but transports which can do better, such as TCP, send it straight from the file.
+		 @param header Bytes to send first
+		 @param header_size The number of bytes in the header
+		 @param file The file to send from. Its position is not changed
+		 @param offset Where in the file to start
+		 @param length The number of bytes of the file to send
+		 @throws SendException if an error occurred while sending, or with EIO if the
+		 file could not be read or ended early
+		 */
+		virtual void send_file(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+			int file, uint64_t offset, NETWORK_BYTE_SIZE length) const;
+
+		/**
+		 @return Whether a send could start right away, without waiting for the peer to
+		 make room. Used to hold back bulk data that would otherwise delay other sends.
+		 */
+		virtual bool is_writable() const;
+
+		/**
+		 Reads the number of bytes from the wire into the provided buffer. More may be
+		 read from the socket than was asked for; the rest is kept for the next receive.
 		 @param buffer The buffer to read into
 		 @param num_bytes The number of bytes to read
 		 @throws ReceiveException if an error occurred while receiving
 		 */
-		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		virtual bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+
+		/**
+		 @return The number of bytes already read from the socket and waiting to be
+		 received. poll() does not report a socket whose data is all buffered, so a
+		 reader should keep receiving while this is non-zero.
+		 */
+		virtual NETWORK_BYTE_SIZE buffered_bytes() const { return this->receive_end - this->receive_begin; }
+
+		/**
+		 Wait until something arrives, without receiving it. Used to bound a wait for a
+		 reply which a blocking receive would otherwise wait on forever.
+		 @param timeout How long to wait at most
+		 @return Whether something can be received, or the peer hung up
+		 */
+		bool wait_readable(std::chrono::milliseconds timeout) const;
+
+		/**
+		 @return The total number of bytes received on this connection
+		 */
+		uint64_t get_bytes_received() const { return this->bytes_received; }
+
+		/**
+		 @return A copy of this connection's counters. Everything but the bytes received
+		 stays at zero unless SunNet is built with SUNNET_ENABLE_METRICS.
+		 */
+		ConnectionMetricsSnapshot get_metrics() const;
 
 		/**
 		Connect the socket to a remote socket
@@ -108,7 +313,7 @@ namespace SunNet {
 		@param port The port of the remote socket
 		@throws 
 		*/
-		void connect(std::string address, std::string port);
+		virtual void connect(std::string address, std::string port);
 
 		/**
 		Bind the socket to a specific port and address to make it ready for receiving.
@@ -117,7 +322,7 @@ namespace SunNet {
 		to 0.0.0.0
 		@throws BindException if there is an error binding
 		*/
-		void bind(std::string port, std::string address="");
+		virtual void bind(std::string port, std::string address="");
 
 		/**
 		Begin listening for connections, enqueueing them until they are
@@ -125,7 +330,7 @@ namespace SunNet {
 		@param queue The queue size for incoming connections
 		@throws ListenException if there is an error listening
 		*/
-		void listen(int queue) const;
+		virtual void listen(int queue) const;
 
 		/**
 		Pop a waiting connection off the queue and accept it.
@@ -133,6 +338,74 @@ namespace SunNet {
 		@throws AcceptException if there is an error accepting
 		*/
 		std::shared_ptr<SocketConnection> accept() const;
+
+		/**
+		Pop a waiting connection off the queue without blocking. The accepted socket is
+		non-blocking and close-on-exec, and should be wrapped in a SocketConnection by
+		the caller.
+		@param address Where to store the address of the accepted connection
+		@param address_len Where to store the length of the address
+		@return The accepted socket, or INVALID_SOCKET if no connection was waiting
+		@throws AcceptException if there is an error accepting
+		*/
+		virtual SOCKET accept_descriptor(struct sockaddr_storage* address, SOCKET_LEN* address_len) const;
+
+		/**
+		Switch the socket between blocking and non-blocking mode. send and receive
+		still complete synchronously on a non-blocking socket.
+		@throws SocketException if the mode could not be changed
+		*/
+		virtual void set_nonblocking(bool nonblocking);
+
+		/**
+		Ask the kernel to timestamp data as it arrives on this connection. The timestamps
+		are taken before the data waits in the socket buffer, so they exclude any time
+		spent waiting for the poll loop to get around to this connection.
+
+		@return Whether the platform supports receive timestamps
+		*/
+		bool enable_receive_timestamps();
+
+		/**
+		Send payloads of at least the threshold through send_zerocopy without copying them
+		into the kernel. This saves CPU and memory bandwidth for payloads of hundreds of
+		KB, but pinning the memory and reading the completion costs more than copying a
+		small payload. Where the kernel copies anyway, as it does over loopback, the
+		copies are counted in Metrics::global.zerocopy_copies.
+
+		@param threshold The smallest payload to send without copying
+		@return Whether the platform and the socket support zero-copy sends
+		*/
+		bool enable_zerocopy(NETWORK_BYTE_SIZE threshold);
+
+		/**
+		@return The number of zero-copy payloads which the kernel may still be reading
+		*/
+		size_t get_pending_zerocopy_count() const { return this->zerocopy_pending.size(); }
+
+		/**
+		@return When the kernel received the data most recently read from the socket, in
+		nanoseconds since the Unix epoch, or 0 if receive timestamps are not enabled
+		*/
+		int64_t get_last_kernel_receive_time() const { return this->last_kernel_receive_time; }
+
+		/**
+		@return When data was last received on this connection, or when it was created if
+		nothing has been received yet
+		*/
+		std::chrono::steady_clock::time_point get_last_receive_time() const { return this->last_receive_time; }
+
+		/**
+		@return When data was last sent on this connection, or when it was created if
+		nothing has been sent yet
+		*/
+		std::chrono::steady_clock::time_point get_last_send_time() const { return this->last_send_time; }
+
+		/**
+		@return The handle of this connection in the PollService watching it, or
+		INVALID_CONNECTION_HANDLE if no PollService is watching it
+		*/
+		ConnectionHandle get_handle() const { return this->poll_handle; }
 	};
 
 	class ApiInitializationException : public std::runtime_error {
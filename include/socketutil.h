@@ -6,6 +6,8 @@ Windows/Linux in utilizing sockets and WinSock APIs
 */
 #pragma once
 
+#include <cstdint>
+
 #ifdef _WIN32
 #include <WinSock2.h>
 #include <WS2tcpip.h>
@@ -19,6 +21,7 @@ typedef char NETWORK_BYTE;
 typedef int NETWORK_BYTE_SIZE;
 typedef WSAPOLLFD POLL_DESCRIPTOR;
 typedef ULONG NUM_POLL_DESCRIPTORS;
+typedef WSABUF SEND_VECTOR;
 
 #else
 #include <sys/socket.h>
@@ -28,6 +31,8 @@ typedef ULONG NUM_POLL_DESCRIPTORS;
 #include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #define SOCKET_API_NOT_INITIALIZED -1
 
@@ -39,6 +44,15 @@ typedef unsigned char NETWORK_BYTE;
 typedef size_t NETWORK_BYTE_SIZE;
 typedef struct pollfd POLL_DESCRIPTOR;
 typedef nfds_t NUM_POLL_DESCRIPTORS;
+typedef struct iovec SEND_VECTOR;
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define SUNNET_HAS_ZEROCOPY 1
+#endif
+
+#ifdef __linux__
+#define SUNNET_HAS_SENDFILE 1
 #endif
 
 namespace SunNet {
@@ -110,6 +124,50 @@ namespace SunNet {
 	*/
 	SOCKET accept_socket(SOCKET socket, struct sockaddr* addr, SOCKET_LEN* len);
 
+	/**
+	Accepts a queued connection, making the accepted socket non-blocking and
+	close-on-exec in the same call where the platform allows it.
+
+	@param socket The socket to accept the connection on
+	@param addr A pointer to where the accepted connection's info will be stored
+	@param len A pointer to where the length of the acception connection's
+	address length will be stored
+	@return A SOCKET which is the accepted connection. INVALID_SOCKET if an error
+	occurred, including when no connection was waiting on a non-blocking socket.
+	*/
+	SOCKET accept_socket_nonblocking(SOCKET socket, struct sockaddr* addr, SOCKET_LEN* len);
+
+	/**
+	Switches a socket between blocking and non-blocking mode.
+
+	@param socket The socket to change
+	@param nonblocking Whether operations on the socket should fail instead of blocking
+	@return A status integer. SOCKET_ERROR if an error occured
+	*/
+	int set_socket_nonblocking(SOCKET socket, bool nonblocking);
+
+	/**
+	Waits until a single socket is ready for the given events.
+
+	@param socket The socket to wait on
+	@param events The poll() events to wait for, such as POLLIN or POLLOUT
+	@param timeout How long to wait, in ms. Negative waits forever.
+	@return The number of sockets ready; 0 on timeout; SOCKET_ERROR if error
+	*/
+	int wait_for_socket(SOCKET socket, short events, int timeout);
+
+	/**
+	@param error_code An error code from get_previous_error_code
+	@return Whether the error means a non-blocking operation would have blocked
+	*/
+	bool is_would_block_error(int error_code);
+
+	/**
+	@param error_code An error code from get_previous_error_code
+	@return Whether the error means the call was interrupted and should be retried
+	*/
+	bool is_interrupted_error(int error_code);
+
 	/**
 	Connects a socket to a remote socket so that it may write and read from the
 	remote socket.
@@ -133,6 +191,60 @@ namespace SunNet {
 	*/
 	int socket_send(SOCKET socket, const NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags);
 
+	/**
+	Point a SEND_VECTOR at a buffer.
+
+	@param vector The vector to fill in
+	@param buffer The bytes the vector refers to
+	@param len The number of bytes the vector refers to
+	*/
+	void set_send_vector(SEND_VECTOR* vector, const NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len);
+
+	/**
+	Sends several buffers through the socket with a single call, as if they
+	were one contiguous buffer. Like send(), this may send fewer bytes than
+	requested.
+
+	@param socket The socket to send from
+	@param vectors The buffers to send, in order
+	@param count The number of buffers
+	@param flags Flags that will be sent to the underlying sockets send call
+	@return The number of bytes sent. SOCKET_ERROR if an error occured.
+	*/
+	int socket_send_vectored(SOCKET socket, SEND_VECTOR* vectors, int count, int flags);
+
+	/**
+	Sends bytes from a file through the socket without copying them through user
+	memory. Like send(), this may send fewer bytes than requested.
+
+	@param socket The socket to send from
+	@param file The file to read from, which must support mmap-like reads
+	@param offset Where in the file to start reading
+	@param len The number of bytes to send
+	@return The number of bytes sent. SOCKET_ERROR if an error occured or the
+	platform cannot send files
+	*/
+	int socket_send_file(SOCKET socket, int file, uint64_t offset, NETWORK_BYTE_SIZE len);
+
+	/**
+	Reads bytes from a file at an offset, without moving the file's position.
+
+	@param file The file to read from
+	@param buffer The buffer to write into
+	@param len The most bytes to read
+	@param offset Where in the file to start reading
+	@return The number of bytes read, 0 at the end of the file, or SOCKET_ERROR
+	*/
+	int read_file_at(int file, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, uint64_t offset);
+
+	/**
+	Closes a file, such as one given to a stream to send.
+
+	@param file The file to close
+	@return A status integer. SOCKET_ERROR if an error occured
+	*/
+	int close_file(int file);
+
 	/**
 	Receives bytes from the socket. This function will block until the
 	entirety of the bytes are received.
@@ -146,6 +258,59 @@ namespace SunNet {
 	*/
 	int socket_receive(SOCKET socket, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags);
 
+	/**
+	Asks the kernel to timestamp every packet received on the socket, so that
+	socket_receive_timestamped can report when data really arrived.
+
+	@param socket The socket to timestamp
+	@return A status integer. SOCKET_ERROR if the platform cannot timestamp receives
+	*/
+	int enable_receive_timestamps(SOCKET socket);
+
+	/**
+	Lets sends on the socket use MSG_ZEROCOPY, so that the kernel reads the sender's
+	memory as it transmits instead of copying it first.
+
+	@param socket The socket to enable zero-copy sends on
+	@return A status integer. SOCKET_ERROR if the platform or socket does not support it
+	*/
+	int enable_zerocopy(SOCKET socket);
+
+	/**
+	Read one completion of zero-copy sends from the socket's error queue. Every
+	successful send with MSG_ZEROCOPY is numbered, counting up from 0, and a
+	completion covers a range of them.
+
+	@param socket The socket to read from
+	@param first Set to the number of the first send completed
+	@param last Set to the number of the last send completed
+	@param copied Set to whether the kernel copied the data after all
+	@return 1 if a completion was read, 0 if there were none, or SOCKET_ERROR
+	*/
+	int read_zerocopy_completion(SOCKET socket, uint32_t* first, uint32_t* last, bool* copied);
+
+	/**
+	Take the error pending on the socket, if any, clearing it.
+
+	@param socket The socket to check
+	@return The pending error code, or 0 if there is none
+	*/
+	int take_socket_error(SOCKET socket);
+
+	/**
+	Receives bytes like socket_receive, also reporting when the kernel received the
+	last of them.
+
+	@param socket The socket to receive from
+	@param buffer The buffer to write into
+	@param len The number of bytes to read
+	@param flags Flags that will be sent to the underlying sockets recvmsg() call
+	@param timestamp Set to the kernel's receive time, in nanoseconds since the Unix
+	epoch, or left alone if the kernel did not report one
+	@return The same as socket_receive
+	*/
+	int socket_receive_timestamped(SOCKET socket, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags, int64_t* timestamp);
+
 	/**
 	Polls for the status of one or more sockets (blocking if necessary) to perform
 	synchronous IO
@@ -0,0 +1,72 @@
+/**
+@file stream.h
+@brief Wire format for streams of bytes sent alongside channel messages
+*/
+#pragma once
+
+#include "channels.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace SunNet {
+	typedef uint32_t STREAM_ID;
+
+	/* The most bytes a stream sends in one data frame unless told otherwise */
+	const NETWORK_BYTE_SIZE STREAM_CHUNK_SIZE = 64 * 1024;
+
+	/* The largest data frame a receiver accepts */
+	const NETWORK_BYTE_SIZE STREAM_MAX_CHUNK_SIZE = 1024 * 1024;
+
+	/* How many bytes a sender may send before the receiver has taken any of them */
+	const uint32_t STREAM_WINDOW = 1024 * 1024;
+
+	/* The most streams one connection may have open to a receiver at once unless told otherwise */
+	const size_t STREAM_MAX_INCOMING = 64;
+
+	/* The most bytes one stream sends each time it gets a turn, so that other traffic is not held up for long */
+	const NETWORK_BYTE_SIZE STREAM_TURN_SIZE = 256 * 1024;
+
+	/**
+	The kinds of frame sent on STREAM_CHANNEL_ID. The first four go from the sender of a
+	stream to its receiver, and the last two go back.
+	*/
+	enum StreamFrameType : NETWORK_BYTE {
+		STREAM_OPEN = 1, /** < Starts a stream, carrying a message which describes it */
+		STREAM_DATA = 2, /** < Carries the next bytes of a stream */
+		STREAM_END = 3, /** < Every byte of the stream has been sent */
+		STREAM_ABORT = 4, /** < The sender gave up on the stream */
+		STREAM_CREDIT = 5, /** < The receiver took some bytes, so that as many more may be sent */
+		STREAM_CANCEL = 6 /** < The receiver does not want the rest of the stream */
+	};
+
+	/* The size of a StreamHeader on the wire */
+	const NETWORK_BYTE_SIZE STREAM_HEADER_SIZE = sizeof(STREAM_ID) + 2 * sizeof(NETWORK_BYTE) + sizeof(uint32_t);
+
+	/**
+	The header which follows STREAM_CHANNEL_ID on the wire. Streams are numbered by their
+	sender, so the same number may be used by a stream going each way.
+	*/
+	struct StreamHeader {
+		STREAM_ID stream_id;
+		NETWORK_BYTE type; /** < A StreamFrameType */
+		CHANNEL_ID channel_id; /** < For STREAM_OPEN, the channel of the message describing the stream */
+		uint32_t length; /** < The number of bytes following the header, or the bytes taken for STREAM_CREDIT */
+
+		void write(NETWORK_BYTE* bytes) const {
+			std::memcpy(bytes, &this->stream_id, sizeof(STREAM_ID));
+			bytes[sizeof(STREAM_ID)] = this->type;
+			bytes[sizeof(STREAM_ID) + 1] = this->channel_id;
+			std::memcpy(bytes + sizeof(STREAM_ID) + 2, &this->length, sizeof(uint32_t));
+		}
+
+		static StreamHeader read(const NETWORK_BYTE* bytes) {
+			StreamHeader header;
+			std::memcpy(&header.stream_id, bytes, sizeof(STREAM_ID));
+			header.type = bytes[sizeof(STREAM_ID)];
+			header.channel_id = bytes[sizeof(STREAM_ID) + 1];
+			std::memcpy(&header.length, bytes + sizeof(STREAM_ID) + 2, sizeof(uint32_t));
+			return header;
+		}
+	};
+}
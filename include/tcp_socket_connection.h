@@ -4,18 +4,28 @@
 */
 #pragma once
 
-#include "socket_connection.h"
+#include "channeled_socket_connection.h"
 
 namespace SunNet {
 
-	class TCPSocketConnection : public SocketConnection {
+	/**
+	A TCP connection. It is channeled so that it may be used with ChanneledServer and
+	ChanneledClient, but it may also be used as a plain SocketConnection.
+	*/
+	class TCPSocketConnection : public ChanneledSocketConnection {
 
 	public:
 		TCPSocketConnection() :
-			SocketConnection(AF_INET, SOCK_STREAM, IPPROTO_TCP) {}
+			ChanneledSocketConnection(AF_INET, SOCK_STREAM, IPPROTO_TCP) {}
 
-		TCPSocketConnection(int descriptor) :
-			SocketConnection(descriptor, AF_INET, SOCK_STREAM, IPPROTO_TCP) {}
+		TCPSocketConnection(SOCKET descriptor) :
+			ChanneledSocketConnection(descriptor, AF_INET, SOCK_STREAM, IPPROTO_TCP) {}
+
+		/* Files go straight from the page cache to the socket */
+		void send_file(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+			int file, uint64_t offset, NETWORK_BYTE_SIZE length) const {
+			this->send_file_direct(header, header_size, file, offset, length);
+		}
 
 	};
 }
\ No newline at end of file
@@ -0,0 +1,143 @@
+/**
+@file timer_wheel.h
+@brief Definitions for TimerWheel, a hierarchical timing wheel used to drive
+timers from the poll loop
+*/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace SunNet {
+	typedef uint64_t TIMER_ID;
+
+	/* A TIMER_ID which never refers to a scheduled timer */
+	const TIMER_ID INVALID_TIMER_ID = 0;
+
+	/**
+	A hierarchical timing wheel with a resolution of one millisecond.
+
+	Timers are kept in four levels of 256 slots each, which covers roughly 49 days.
+	Longer delays are cut to that.
+	Each timer lives in an intrusive list inside a pooled node, so scheduling and
+	cancelling a timer are both O(1) and do not allocate once the pool has warmed up.
+	Timers in the higher levels are cascaded down as the wheel turns.
+
+	The wheel is not thread safe. It is meant to be owned by a PollService and turned
+	from the thread which calls poll(), which is also the thread that callbacks fire on.
+	*/
+	class TimerWheel {
+	public:
+		typedef std::function<void()> TimerCallback;
+		typedef std::chrono::steady_clock Clock;
+
+		static const unsigned int LEVELS = 4;
+		static const unsigned int SLOT_BITS = 8;
+		static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+	private:
+		static const uint32_t NIL = UINT32_MAX;
+
+		struct TimerNode {
+			uint64_t expiry; /** < The tick at which the timer fires */
+			uint64_t interval; /** < Ticks between firings for repeating timers; 0 for one-shot timers */
+			uint32_t generation; /** < Bumped every time the node is released, used to detect stale ids */
+			uint32_t next;
+			uint32_t prev;
+			uint16_t slot; /** < Index into slots, or past the end for overflowed and unlinked nodes */
+			bool active;
+			TimerCallback callback;
+		};
+
+		Clock::time_point epoch;
+		uint64_t current_tick; /** < The last tick which has been processed */
+
+		std::vector<TimerNode> nodes;
+		uint32_t free_head;
+		size_t active_count;
+
+		uint32_t slots[LEVELS * SLOTS];
+		uint32_t overflow; /** < Timers too far out for the top level, relinked when it wraps */
+		uint64_t occupied[LEVELS][SLOTS / 64]; /** < One bit per slot, used to skip empty slots quickly */
+
+		uint64_t tick_of(Clock::time_point time) const;
+
+		uint32_t allocate_node();
+		void release_node(uint32_t index);
+
+		void link(uint32_t index);
+		void unlink(uint32_t index);
+
+		void cascade(unsigned int level);
+		size_t fire_slot(unsigned int digit);
+
+		/**
+		Find the first occupied slot at the given level strictly after the given digit.
+		@return The digit of the occupied slot, or SLOTS if there is none
+		*/
+		unsigned int next_occupied(unsigned int level, unsigned int digit) const;
+
+		TIMER_ID insert(uint64_t delay, uint64_t interval, TimerCallback callback);
+
+	public:
+		TimerWheel();
+
+		/**
+		Schedule a callback to run once after the given delay.
+
+		@param delay How long to wait before firing the callback
+		@param callback The callback to fire
+		@return An id which may be used to cancel the timer
+		*/
+		TIMER_ID schedule(std::chrono::milliseconds delay, TimerCallback callback);
+
+		/**
+		Schedule a callback to run every interval until it is cancelled.
+
+		@param interval How long to wait between firings. Intervals under one millisecond
+		are rounded up to one millisecond.
+		@param callback The callback to fire
+		@return An id which may be used to cancel the timer
+		*/
+		TIMER_ID schedule_repeating(std::chrono::milliseconds interval, TimerCallback callback);
+
+		/**
+		Cancel a pending timer. Cancelling a timer from within its own callback is allowed.
+
+		@param id The id returned when the timer was scheduled
+		@return Whether the timer was still pending
+		*/
+		bool cancel(TIMER_ID id);
+
+		/**
+		@return The number of pending timers
+		*/
+		size_t size() const { return this->active_count; }
+
+		/**
+		Work out how long a poll() may block without missing a timer.
+
+		@param max_timeout The longest the caller is willing to block (in ms). A negative
+		value means the caller is willing to block forever.
+		@return The number of ms until the next timer is due, capped at max_timeout
+		*/
+		int next_timeout(int max_timeout) const;
+
+		/**
+		Fire every timer which has expired by now.
+
+		@return The number of callbacks fired
+		*/
+		size_t advance();
+
+		/**
+		Fire every timer which has expired by the given time.
+
+		@param now The time to turn the wheel up to
+		@return The number of callbacks fired
+		*/
+		size_t advance_to(Clock::time_point now);
+	};
+}
@@ -0,0 +1,82 @@
+/**
+@file token_bucket.h
+@brief A rate limit which allows short bursts
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace SunNet {
+
+	/**
+	A token bucket holding an allowance, such as of bytes or of messages. It fills at a
+	steady rate up to its burst size, and sending takes from it. The bucket may go into debt, so that a send is never
+	split just to fit the allowance; the next send then waits until the debt is paid off.
+
+	The bucket is read and filled by the polling thread, but any thread may charge it.
+	*/
+	class TokenBucket {
+	private:
+		uint64_t rate; /** < Tokens added each second, or 0 for no limit */
+		double burst;
+		double tokens;
+		std::chrono::steady_clock::time_point last_refill;
+
+		/* Bytes charged since the last refill, which may come from other threads */
+		std::atomic<uint64_t> charged;
+
+	public:
+		TokenBucket();
+
+		/**
+		@param tokens_per_second The rate the bucket fills at, or 0 to remove the limit
+		@param burst_tokens How much the bucket holds. At least one second's worth is
+		usually right
+		*/
+		void set_limit(uint64_t tokens_per_second, uint64_t burst_tokens);
+
+		/**
+		@return Whether the bucket limits anything
+		*/
+		bool is_limited() const { return this->rate > 0; }
+
+		/**
+		Add the tokens earned since the last refill and take whatever was charged.
+		@param now The current time
+		*/
+		void refill(std::chrono::steady_clock::time_point now);
+
+		/**
+		Take tokens from the bucket. They are taken at the next refill.
+		*/
+		void charge(uint64_t num_tokens) {
+			if (this->rate > 0) {
+				this->charged.fetch_add(num_tokens, std::memory_order_relaxed);
+			}
+		}
+
+		/**
+		Refill the bucket and take from it, unless it is already in debt. Used to turn
+		away what arrives over the limit, which then costs nothing.
+
+		@param num_tokens How many tokens to take, which may put the bucket into debt
+		@param now The current time
+		@return Whether the tokens were taken. Always true for a bucket with no limit
+		*/
+		bool try_take(uint64_t num_tokens, std::chrono::steady_clock::time_point now);
+
+		/**
+		@return How long until the bucket is out of debt, as of the last refill. 0 if it
+		has tokens to spend or no limit
+		*/
+		std::chrono::nanoseconds time_until_available() const;
+
+		/**
+		@return The tokens in the bucket as of the last refill, which is negative while
+		it is in debt
+		*/
+		double get_tokens() const { return this->tokens; }
+	};
+}
@@ -0,0 +1,76 @@
+/**
+@file trace.h
+@brief Wire format for messages which carry timestamps for measuring latency
+*/
+#pragma once
+
+#include "channels.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+namespace SunNet {
+
+	/* The single byte which follows TRACE_CONTROL_CHANNEL_ID on the wire */
+	enum TraceControl : NETWORK_BYTE {
+		TRACE_OFFER = 1, /** < The sender understands traced frames and would like the receiver to send them */
+		TRACE_ACCEPT = 2 /** < The sender understands traced frames and will send them from now on */
+	};
+
+	/* The size of a TraceHeader on the wire */
+	const NETWORK_BYTE_SIZE TRACE_HEADER_SIZE = sizeof(CHANNEL_ID) + sizeof(uint32_t) + 3 * sizeof(int64_t);
+
+	/**
+	The header which follows TRACED_CHANNEL_ID on the wire. It names the channel of the
+	message that follows and carries what the receiver needs to measure latency.
+
+	Times are nanoseconds since the Unix epoch. The one-way latency, arrival minus
+	send_time, is only as good as the clock synchronization between the two hosts. The
+	round-trip latency does not depend on the clocks agreeing: echo_time is the send_time
+	of the last traced frame received from the other side, and echo_delay is how long
+	ago that frame arrived, so that the other side can subtract the time this side held it.
+	*/
+	struct TraceHeader {
+		CHANNEL_ID channel_id;
+		uint32_t sequence; /** < Counts up by one for every traced frame sent on the connection */
+		int64_t send_time;
+		int64_t echo_time; /** < 0 if nothing has been received yet */
+		int64_t echo_delay;
+
+		void write(NETWORK_BYTE* bytes) const {
+			bytes[0] = this->channel_id;
+			NETWORK_BYTE* field = bytes + sizeof(CHANNEL_ID);
+			std::memcpy(field, &this->sequence, sizeof(uint32_t));
+			field += sizeof(uint32_t);
+			std::memcpy(field, &this->send_time, sizeof(int64_t));
+			field += sizeof(int64_t);
+			std::memcpy(field, &this->echo_time, sizeof(int64_t));
+			field += sizeof(int64_t);
+			std::memcpy(field, &this->echo_delay, sizeof(int64_t));
+		}
+
+		static TraceHeader read(const NETWORK_BYTE* bytes) {
+			TraceHeader header;
+			header.channel_id = bytes[0];
+			const NETWORK_BYTE* field = bytes + sizeof(CHANNEL_ID);
+			std::memcpy(&header.sequence, field, sizeof(uint32_t));
+			field += sizeof(uint32_t);
+			std::memcpy(&header.send_time, field, sizeof(int64_t));
+			field += sizeof(int64_t);
+			std::memcpy(&header.echo_time, field, sizeof(int64_t));
+			field += sizeof(int64_t);
+			std::memcpy(&header.echo_delay, field, sizeof(int64_t));
+			return header;
+		}
+	};
+
+	/**
+	@return The current time in nanoseconds since the Unix epoch, the clock that traced
+	frames and kernel receive timestamps both use
+	*/
+	inline int64_t trace_clock_now() {
+		return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+}
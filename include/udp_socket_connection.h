@@ -0,0 +1,342 @@
+/**
+@file udp_socket_connection.h
+@brief A SocketConnection for UDP which moves datagrams in batches
+*/
+#pragma once
+
+#include "channeled_socket_connection.h"
+#include "datagram_reliability.h"
+
+#ifdef __linux__
+#define SUNNET_HAS_UDP_TRANSPORT 1
+#endif
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include <sys/socket.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace SunNet {
+
+	/* The largest datagram sent or received. It fits in one Ethernet frame, so datagrams are never fragmented */
+	const NETWORK_BYTE_SIZE UDP_MAX_DATAGRAM_SIZE = 1472;
+
+	/* The most datagrams moved by one system call */
+	const int UDP_BATCH_SIZE = 32;
+
+	/**
+	The address of a UDP peer, usable as a key in hash maps.
+	*/
+	struct UDPAddress {
+		struct sockaddr_storage storage;
+		SOCKET_LEN length;
+
+		bool operator==(const UDPAddress& other) const;
+
+		/**
+		@return The address as "host:port", for logging
+		*/
+		std::string to_string() const;
+
+		/**
+		Look up a numeric or named IPv4 address.
+		@throws GetAddrInfoException if it cannot be resolved
+		*/
+		static UDPAddress resolve(std::string address, std::string port);
+	};
+
+	struct UDPAddressHash {
+		std::size_t operator()(const UDPAddress& address) const;
+	};
+
+	/**
+	A datagram received by UDPSocketConnection::receive_datagrams. The bytes are only
+	valid until the next call to receive_datagrams.
+	*/
+	struct UDPDatagram {
+		const NETWORK_BYTE* bytes;
+		NETWORK_BYTE_SIZE size;
+		const UDPAddress* sender;
+		bool truncated; /** < Whether the datagram was larger than UDP_MAX_DATAGRAM_SIZE and lost its end */
+	};
+
+	/**
+	A UDP socket which receives with recvmmsg and sends with sendmmsg, so that one system
+	call moves up to UDP_BATCH_SIZE datagrams.
+
+	Datagrams are not a byte stream, so this is not used with ChanneledServer and
+	ChanneledClient. DatagramServer and DatagramClient receive a batch each time the
+	socket is ready and hand every datagram to the UDPPeer it came from. Sends through a
+	UDPPeer are queued here, and frames for the same peer are packed into one datagram
+	while they fit. The queue is flushed once per poll, or as soon as it is full.
+	*/
+	class UDPSocketConnection : public SocketConnection {
+	private:
+		/* Whether connect() fixed the peer, so that sends carry no address */
+		bool connected;
+
+		std::unique_ptr<NETWORK_BYTE[]> receive_slots;
+		struct mmsghdr receive_headers[UDP_BATCH_SIZE];
+		struct iovec receive_vectors[UDP_BATCH_SIZE];
+		UDPAddress receive_addresses[UDP_BATCH_SIZE];
+		int received_count;
+
+		std::unique_ptr<NETWORK_BYTE[]> send_slots;
+		struct mmsghdr send_headers[UDP_BATCH_SIZE];
+		struct iovec send_vectors[UDP_BATCH_SIZE];
+		UDPAddress send_addresses[UDP_BATCH_SIZE];
+		int queued_count;
+
+		uint64_t dropped_datagrams;
+		uint64_t unacked_messages;
+
+	public:
+		UDPSocketConnection();
+
+		/**
+		Connect to a single peer. Datagrams from anyone else are dropped by the kernel.
+		@throws ConnectException if the address cannot be resolved or connected to
+		*/
+		void connect(std::string address, std::string port);
+
+		/**
+		Let other sockets bind the same port, as every subscriber to a multicast group
+		on one machine must. Call before bind().
+		@throws SocketException if the option could not be set
+		*/
+		void set_reuse_address(bool reuse);
+
+		/**
+		Receive datagrams sent to a multicast group.
+		@param group The group's IPv4 address
+		@param interface_address The address of the interface to join on, or "0.0.0.0" for the default
+		@throws SocketException if the group could not be joined
+		*/
+		void join_group(std::string group, std::string interface_address);
+
+		/**
+		Choose the interface that datagrams to multicast groups are sent from.
+		@throws SocketException if the option could not be set
+		*/
+		void set_multicast_interface(std::string interface_address);
+
+		/**
+		Set how many routers datagrams to multicast groups may cross. 1 keeps them on the local network.
+		@throws SocketException if the option could not be set
+		*/
+		void set_multicast_ttl(int ttl);
+
+		/**
+		Choose whether datagrams sent to a multicast group are also received by members on
+		this machine.
+		@throws SocketException if the option could not be set
+		*/
+		void set_multicast_loopback(bool loopback);
+
+		/**
+		Receive every datagram waiting on the socket, up to UDP_BATCH_SIZE, without blocking.
+		@return The number of datagrams received, which may be read with get_datagram
+		@throws ReceiveException if the socket reported an error, such as an unreachable peer
+		*/
+		int receive_datagrams();
+
+		/**
+		@param index Which of the datagrams from the last receive_datagrams to get
+		*/
+		UDPDatagram get_datagram(int index) const;
+
+		/**
+		Queue bytes to be sent in one datagram. They are packed onto the last datagram
+		queued for the same peer if there is room, which is always safe since each frame
+		is whole within its datagram.
+		@param address Where to send the datagram, or nullptr if the socket is connected
+		@param prefix Bytes to send in front of the buffers, such as a header
+		@param prefix_size The number of bytes in the prefix
+		@param vectors The bytes to send
+		@param count The number of buffers
+		@throws SendException with EMSGSIZE if the bytes would not fit in one datagram
+		*/
+		void queue_datagram(const UDPAddress* address, const NETWORK_BYTE* prefix, NETWORK_BYTE_SIZE prefix_size,
+			SEND_VECTOR* vectors, int count);
+
+		/**
+		Send every queued datagram. UDP is best effort, so a datagram which the kernel
+		refuses is dropped instead of failing the others.
+		*/
+		void flush();
+
+		/**
+		@return The number of datagrams waiting for flush()
+		*/
+		int queued_datagram_count() const { return this->queued_count; }
+
+		/**
+		@return The number of datagrams which were truncated or malformed when received,
+		or refused when sent
+		*/
+		uint64_t get_dropped_datagrams() const { return this->dropped_datagrams; }
+
+		/**
+		Count a datagram which was dropped, such as one which could not be parsed.
+		*/
+		void count_dropped_datagram() {
+			this->dropped_datagrams++;
+			SUNNET_METRICS_ONLY(Metrics::global.dropped_datagrams.add());
+		}
+
+		bool is_connected() const { return this->connected; }
+
+		/**
+		Keep count of the reliable messages sent through this socket which are waiting for
+		an ack, so that whoever polls it knows to keep retransmitting.
+		*/
+		void count_unacked(int64_t change) { this->unacked_messages += change; }
+
+		/**
+		@return The number of reliable messages sent through this socket's peers which are
+		waiting for an ack
+		*/
+		uint64_t get_unacked_count() const { return this->unacked_messages; }
+	};
+
+	/**
+	One peer of a UDPSocketConnection, known by its address. A UDPPeer is a
+	ChanneledSocketConnection, so it is handed to subscriptions and may be replied to
+	with channeled_send, just like a TCP client.
+
+	Each frame is sent according to its channel's DeliveryMode. Reliable frames are kept
+	until the peer acknowledges them and are sent again by retransmit() if it does not.
+	Acks are packed into the same datagrams as whatever is sent next, or go out on their
+	own from send_acks() if nothing is. Frames which are not plain UNRELIABLE carry a
+	DeliveryHeader, so their messages must be DELIVERY_HEADER_SIZE bytes smaller to fit.
+
+	Received frames are taken one at a time with next_frame(), which skips duplicates
+	and stale frames and holds ordered frames until the ones before them arrive. A frame
+	must not cross the end of its datagram. Sending queues the frame on the socket, which
+	sends it on the next flush. Send and receive never block.
+	*/
+	class UDPPeer : public ChanneledSocketConnection {
+	private:
+		std::shared_ptr<UDPSocketConnection> socket;
+		UDPAddress address;
+
+		mutable const NETWORK_BYTE* datagram;
+		mutable NETWORK_BYTE_SIZE datagram_remaining;
+
+		/* The frame being read, unless it is read straight from the datagram */
+		mutable const NETWORK_BYTE* frame;
+		mutable NETWORK_BYTE_SIZE frame_remaining;
+		bool reading_datagram;
+		std::vector<NETWORK_BYTE> released_frame;
+
+		mutable ReliableSender ordered_sender;
+		mutable ReliableSender unordered_sender;
+		mutable ReliableReceiver ordered_receiver;
+		mutable ReliableReceiver unordered_receiver;
+		RoundTripEstimator round_trip;
+		uint64_t retransmissions;
+
+		/* The next sequence number sent and the newest received, per channel */
+		mutable std::unordered_map<CHANNEL_ID, uint32_t> sent_sequences;
+		std::unordered_map<CHANNEL_ID, uint32_t> received_sequences;
+
+		const UDPAddress* destination() const { return this->socket->is_connected() ? nullptr : &this->address; }
+
+		/* Act on an ack from the peer */
+		void acknowledge(const AckRecord& ack);
+
+		/* How a frame about to be sent should be delivered, from the channel it is sent on */
+		DeliveryMode delivery_mode_of(SEND_VECTOR* vectors, int count) const;
+
+		/* Forget the rest of the datagram and report it as malformed */
+		void reject_datagram() const;
+
+	public:
+		/**
+		@param socket The socket the peer is reached through
+		@param address The peer's address, or nullptr if the socket is connected to it
+		*/
+		UDPPeer(std::shared_ptr<UDPSocketConnection> socket, const UDPAddress* address);
+		~UDPPeer();
+
+		/**
+		Start reading from a datagram this peer sent.
+		*/
+		void begin_datagram(const UDPDatagram& datagram);
+
+		/**
+		Move to the next frame which should be delivered, acting on any acks along the way.
+		@return Whether there is a frame to receive
+		@throws ReceiveException with EBADMSG if the datagram is malformed. The rest of the
+		datagram is discarded.
+		*/
+		bool next_frame();
+
+		/**
+		Forget whatever is left of the current datagram.
+		*/
+		void discard_datagram() const;
+
+		/**
+		@throws SendException with EMSGSIZE if the frame would not fit in one datagram, or
+		with ENOBUFS if RELIABLE_WINDOW messages on the frame's channel are unacknowledged
+		*/
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+
+		/**
+		Read from the current frame.
+		@throws ReceiveException with EBADMSG if the frame ends first. The rest of the
+		datagram is discarded.
+		*/
+		bool receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+		NETWORK_BYTE_SIZE buffered_bytes() const { return this->frame_remaining + this->datagram_remaining; }
+
+		/** Sends are only queued, but bulk data waits once half the ordered window is unacknowledged */
+		bool is_writable() const { return this->ordered_sender.unacked_count() < RELIABLE_WINDOW / 2; }
+
+		/**
+		@return Whether reliable frames have arrived which the peer has not been sent an ack for
+		*/
+		bool has_ack_pending() const {
+			return this->ordered_receiver.has_ack_pending() || this->unordered_receiver.has_ack_pending();
+		}
+
+		/**
+		Queue acks for every reliable frame received, if any have not been acked yet.
+		*/
+		void send_acks() const;
+
+		/**
+		Send again every reliable message which has waited longer than the retransmit
+		timeout for its ack.
+		*/
+		void retransmit();
+
+		/**
+		@return The number of reliable messages waiting for an ack
+		*/
+		size_t unacked_count() const { return this->ordered_sender.unacked_count() + this->unordered_sender.unacked_count(); }
+
+		/**
+		@return The smoothed round-trip time, measured from acks, or zero before the first ack
+		*/
+		std::chrono::microseconds get_round_trip_time() const { return this->round_trip.get_round_trip_time(); }
+
+		/**
+		@return The number of reliable messages which have been sent again
+		*/
+		uint64_t get_retransmissions() const { return this->retransmissions; }
+
+		/**
+		@return Where this peer's datagrams come from and are sent to
+		*/
+		const UDPAddress& get_address() const { return this->address; }
+	};
+
+	typedef std::shared_ptr<UDPPeer> UDPPeer_p;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/**
+@file unix_socket_connection.h
+@brief A SocketConnection implementation for Unix domain sockets.
+*/
+#pragma once
+
+#include "channeled_socket_connection.h"
+
+#ifndef _WIN32
+#define SUNNET_HAS_UNIX_SOCKETS 1
+#endif
+
+#ifdef SUNNET_HAS_UNIX_SOCKETS
+
+#include <deque>
+
+namespace SunNet {
+
+	/* The largest packet a SOCK_SEQPACKET connection sends or receives */
+	const NETWORK_BYTE_SIZE UNIX_MAX_PACKET_SIZE = 64 * 1024;
+
+	/* The most descriptors which may be passed with one send */
+	const int UNIX_MAX_PASSED_DESCRIPTORS = 64;
+
+	/* The most passed descriptors a connection holds before they are taken; more are closed on arrival */
+	const size_t UNIX_MAX_QUEUED_DESCRIPTORS = 256;
+
+	enum UnixSocketType {
+		UNIX_STREAM = SOCK_STREAM, /** < A byte stream, like TCP */
+		UNIX_SEQPACKET = SOCK_SEQPACKET /** < Reliable, ordered packets. Each send arrives as one packet */
+	};
+
+	/**
+	A Unix domain socket connection, for services on the same host. It skips the TCP/IP
+	stack entirely, so it is cheaper than a loopback TCPSocketConnection.
+
+	The address is a path on the filesystem, or a name in Linux's abstract namespace if it
+	starts with '@'. Abstract names need no cleanup and disappear with the last socket
+	using them. The port is ignored.
+
+	Open descriptors, such as files or other sockets, may be passed along with a message.
+	They arrive as new descriptors in the receiving process and are queued on the
+	connection in the order they arrive; take them with take_descriptor() from the
+	callback for the message they were sent with. At most UNIX_MAX_QUEUED_DESCRIPTORS
+	wait on a connection, and any beyond that are closed as they arrive. A message whose
+	descriptors did not fit the receive buffer is a ReceiveException.
+
+	Example:
+		ChanneledServer<UnixSocketConnection> server("@matchmaker", "", 64, 10, UNIX_SEQPACKET);
+		ChanneledClient<UnixSocketConnection> client(10, UNIX_SEQPACKET);
+		client.connect("@matchmaker", "");
+	*/
+	class UnixSocketConnection : public ChanneledSocketConnection {
+	private:
+		UnixSocketType type;
+
+		/* Set to the path this socket is bound to, so that it can be removed on close */
+		std::string bound_path;
+
+		mutable std::deque<SOCKET> passed_descriptors;
+
+		void check_packet_size(NETWORK_BYTE_SIZE num_bytes) const;
+
+	protected:
+		int read_socket(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const;
+
+	public:
+		UnixSocketConnection(UnixSocketType type = UNIX_STREAM);
+
+		/**
+		Wrap an accepted socket. Its type is asked of the kernel.
+		*/
+		UnixSocketConnection(SOCKET descriptor);
+
+		/**
+		Close the socket, any passed descriptors which were never taken, and the socket
+		file if this socket bound one.
+		*/
+		~UnixSocketConnection();
+
+		/** @throws SendException with EMSGSIZE if a packet would be larger than UNIX_MAX_PACKET_SIZE */
+		void send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const;
+		void send_vectored(SEND_VECTOR* vectors, int count) const;
+
+		/**
+		Connect to a listening Unix socket.
+		@param address The socket's path, or '@' followed by an abstract name
+		@param port Ignored
+		@throws ConnectException if the connection fails
+		*/
+		void connect(std::string address, std::string port);
+
+		/**
+		Bind to a path or abstract name. A socket file left behind by an earlier process
+		is replaced; any other file at the path is left alone and the bind fails.
+		@param port Ignored
+		@param address The path to bind to, or '@' followed by an abstract name
+		@throws BindException if the bind fails
+		*/
+		void bind(std::string port, std::string address = "");
+
+		/**
+		@return The type this socket was created with
+		*/
+		UnixSocketType get_type() const { return this->type; }
+
+		/**
+		Send bytes along with open descriptors. The receiver gets its own copies of the
+		descriptors; the sender's stay open.
+		@param bytes The bytes to send. At least one is needed to carry the descriptors.
+		@param num_bytes The number of bytes to send
+		@param descriptors The descriptors to pass
+		@param count The number of descriptors, at most UNIX_MAX_PASSED_DESCRIPTORS
+		@throws SendException if an error occurred while sending
+		*/
+		void send_with_descriptors(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes, const SOCKET* descriptors, int count) const;
+
+		/**
+		Like send_with_descriptors, but the bytes are gathered from several buffers.
+		@param vectors The buffers to send. These are modified as bytes are sent.
+		@param vector_count The number of buffers
+		@param descriptors The descriptors to pass
+		@param descriptor_count The number of descriptors, at most UNIX_MAX_PASSED_DESCRIPTORS
+		*/
+		void send_vectored_with_descriptors(SEND_VECTOR* vectors, int vector_count, const SOCKET* descriptors, int descriptor_count) const;
+
+		/**
+		Send a message along a channel together with open descriptors. The channel id
+		is deduced from the template parameter.
+		@param message The message to send
+		@param descriptors The descriptors to pass
+		@param count The number of descriptors, at most UNIX_MAX_PASSED_DESCRIPTORS
+		*/
+		template <typename TMessageType>
+		void channeled_send_with_descriptors(const TMessageType* message, const SOCKET* descriptors, int count) {
+			CHANNEL_ID channel_id = Channels::getChannelId<TMessageType>();
+
+			SEND_VECTOR frame[2];
+			set_send_vector(&frame[0], &channel_id, sizeof(CHANNEL_ID));
+			set_send_vector(&frame[1], (const NETWORK_BYTE*)message, sizeof(TMessageType));
+			this->send_vectored_with_descriptors(frame, 2, descriptors, count);
+			this->count_sent(channel_id, sizeof(CHANNEL_ID) + sizeof(TMessageType));
+		}
+
+		/**
+		Take the oldest descriptor passed by the peer. The caller owns it and must close it.
+		@return The descriptor, or INVALID_SOCKET if none is waiting
+		*/
+		SOCKET take_descriptor();
+
+		/**
+		@return The number of passed descriptors waiting to be taken
+		*/
+		size_t passed_descriptor_count() const { return this->passed_descriptors.size(); }
+	};
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "address_table.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace SunNet {
+
+	/* Keys are mixed before use, since addresses from one network differ only in their low bits */
+	static size_t hash_key(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return (size_t)key;
+	}
+
+	AddressTable::AddressTable() : entries(64, Entry{ 0, 0 }), used(0) {}
+
+	uint64_t AddressTable::key_of(const struct sockaddr_storage& address) {
+		if (address.ss_family == AF_INET) {
+			const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)&address;
+			uint32_t bytes;
+			std::memcpy(&bytes, &ipv4->sin_addr, sizeof(bytes));
+			return (1ULL << 32) | bytes;
+		}
+		else if (address.ss_family == AF_INET6) {
+			const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*)&address;
+			const unsigned char* bytes = (const unsigned char*)&ipv6->sin6_addr;
+
+			/* An IPv4 address mapped into IPv6 is counted as the IPv4 address it is */
+			static const unsigned char mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+			if (std::memcmp(bytes, mapped_prefix, sizeof(mapped_prefix)) == 0) {
+				uint32_t ipv4;
+				std::memcpy(&ipv4, bytes + sizeof(mapped_prefix), sizeof(ipv4));
+				return (1ULL << 32) | ipv4;
+			}
+
+			uint64_t prefix;
+			std::memcpy(&prefix, bytes, sizeof(prefix));
+			return prefix == 0 ? 1 : prefix;
+		}
+
+		return 0;
+	}
+
+	size_t AddressTable::index_of(uint64_t key) const {
+		size_t mask = this->entries.size() - 1;
+		size_t index = hash_key(key) & mask;
+		while (this->entries[index].key != 0 && this->entries[index].key != key) {
+			index = (index + 1) & mask;
+		}
+		return index;
+	}
+
+	void AddressTable::grow() {
+		std::vector<Entry> old_entries(this->entries.size() * 2, Entry{ 0, 0 });
+		old_entries.swap(this->entries);
+
+		for (const Entry& entry : old_entries) {
+			if (entry.key != 0) {
+				this->entries[this->index_of(entry.key)] = entry;
+			}
+		}
+	}
+
+	uint32_t AddressTable::count(uint64_t key) const {
+		return this->entries[this->index_of(key)].count;
+	}
+
+	uint32_t AddressTable::increment(uint64_t key) {
+		/* Keep the table at most half full, so probes stay short */
+		if ((this->used + 1) * 2 > this->entries.size()) {
+			this->grow();
+		}
+
+		Entry& entry = this->entries[this->index_of(key)];
+		if (entry.key == 0) {
+			entry.key = key;
+			this->used++;
+		}
+		return ++entry.count;
+	}
+
+	void AddressTable::decrement(uint64_t key) {
+		size_t index = this->index_of(key);
+		if (this->entries[index].key == 0 || --this->entries[index].count > 0) {
+			return;
+		}
+
+		/* Shift later entries back into the hole, so that every entry stays reachable from its home */
+		size_t mask = this->entries.size() - 1;
+		size_t hole = index;
+		for (size_t next = (hole + 1) & mask; this->entries[next].key != 0; next = (next + 1) & mask) {
+			size_t home = hash_key(this->entries[next].key) & mask;
+			if (((next - home) & mask) >= ((next - hole) & mask)) {
+				this->entries[hole] = this->entries[next];
+				hole = next;
+			}
+		}
+
+		this->entries[hole] = Entry{ 0, 0 };
+		this->used--;
+	}
+
+	void AddressTable::clear() {
+		std::fill(this->entries.begin(), this->entries.end(), Entry{ 0, 0 });
+		this->used = 0;
+	}
+}
@@ -0,0 +1,163 @@
+#include "channel_stream.h"
+#include "channel_subscribable.h"
+
+#include <algorithm>
+
+namespace SunNet {
+
+	IncomingStream::IncomingStream(ChannelSubscribable* owner, ChanneledSocketConnection_p connection, STREAM_ID stream_id) :
+		owner(owner), connection(connection), stream_id(stream_id), finished(false), bytes_received(0), untaken_bytes(0),
+		window(STREAM_WINDOW), paused(false) {}
+
+	void IncomingStream::deliver(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) {
+		this->bytes_received += num_bytes;
+		this->untaken_bytes += (uint32_t)num_bytes;
+		this->window -= num_bytes;
+		if (this->data_callback) {
+			this->data_callback(bytes, num_bytes);
+		}
+
+		/* The callback may have paused or cancelled the stream */
+		this->send_credit(false);
+	}
+
+	void IncomingStream::send_credit(bool force) {
+		if (this->finished || this->paused || this->untaken_bytes == 0) {
+			return;
+		}
+
+		/* Credit goes back in batches, so that the sender is not sent a frame for every chunk */
+		ChanneledSocketConnection_p connection = this->connection.lock();
+		if (!connection || (!force && this->untaken_bytes < STREAM_WINDOW / 4)) {
+			return;
+		}
+
+		connection->send_stream_frame(StreamHeader{ this->stream_id, STREAM_CREDIT, 0, this->untaken_bytes }, nullptr);
+		this->window += this->untaken_bytes;
+		this->untaken_bytes = 0;
+	}
+
+	void IncomingStream::end(bool complete) {
+		if (this->finished) {
+			return;
+		}
+
+		this->finished = true;
+		EndCallback callback = std::move(this->end_callback);
+		this->data_callback = nullptr;
+		if (callback) {
+			callback(complete);
+		}
+	}
+
+	void IncomingStream::resume() {
+		this->paused = false;
+		this->send_credit(true);
+	}
+
+	void IncomingStream::cancel() {
+		if (this->finished) {
+			return;
+		}
+
+		/* Forgetting the stream may destroy it, so only locals are used after that */
+		ChanneledSocketConnection_p connection = this->connection.lock();
+		ChannelSubscribable* owner = this->owner;
+		STREAM_ID stream_id = this->stream_id;
+
+		this->end(false);
+		if (owner != nullptr) {
+			owner->forgetIncomingStream(connection.get(), stream_id);
+		}
+
+		if (connection) {
+			connection->send_stream_frame(StreamHeader{ stream_id, STREAM_CANCEL, 0, 0 }, nullptr);
+		}
+	}
+
+	OutgoingStream::OutgoingStream(ChannelSubscribable* owner, ChanneledSocketConnection_p connection, STREAM_ID stream_id, CHANNEL_ID channel_id,
+		NETWORK_BYTE_SIZE chunk_size, Producer producer, int file, uint64_t file_offset, uint64_t file_length) :
+		owner(owner), connection(connection), stream_id(stream_id), channel_id(channel_id), finished(false), chunk_size(chunk_size),
+		producer(std::move(producer)), file(file), file_offset(file_offset), file_remaining(file_length),
+		credit(STREAM_WINDOW), bytes_sent(0) {}
+
+	OutgoingStream::~OutgoingStream() {
+		if (this->file != -1) {
+			close_file(this->file);
+		}
+	}
+
+	NETWORK_BYTE_SIZE OutgoingStream::send_chunk(const ChanneledSocketConnection_p& connection, std::vector<NETWORK_BYTE>& buffer, NETWORK_BYTE_SIZE limit) {
+		NETWORK_BYTE_SIZE size = std::min(this->chunk_size, limit);
+		StreamHeader header{ this->stream_id, STREAM_DATA, 0, 0 };
+
+		if (this->file != -1) {
+			size = (NETWORK_BYTE_SIZE)std::min<uint64_t>(size, this->file_remaining);
+			if (size > 0) {
+				header.length = (uint32_t)size;
+				connection->send_stream_file(header, this->file, this->file_offset);
+				this->file_offset += size;
+				this->file_remaining -= size;
+			}
+		}
+		else {
+			if (buffer.size() < size) {
+				buffer.resize(size);
+			}
+
+			size = std::min(this->producer(buffer.data(), size), size);
+			if (size > 0) {
+				header.length = (uint32_t)size;
+				connection->send_stream_frame(header, buffer.data());
+			}
+		}
+
+		if (size == 0) {
+			connection->send_stream_frame(StreamHeader{ this->stream_id, STREAM_END, 0, 0 }, nullptr);
+			this->finish(true);
+			return 0;
+		}
+
+		this->credit -= size;
+		this->bytes_sent += size;
+		return size;
+	}
+
+	void OutgoingStream::finish(bool complete) {
+		if (this->finished) {
+			return;
+		}
+
+		this->finished = true;
+		this->producer = nullptr;
+		if (this->file != -1) {
+			close_file(this->file);
+			this->file = -1;
+		}
+
+		FinishCallback callback = std::move(this->finish_callback);
+		if (callback) {
+			callback(complete);
+		}
+	}
+
+	void OutgoingStream::cancel() {
+		if (this->finished) {
+			return;
+		}
+
+		/* Forgetting the stream may destroy it, so only locals are used after that */
+		ChanneledSocketConnection_p connection = this->connection.lock();
+		ChannelSubscribable* owner = this->owner;
+		STREAM_ID stream_id = this->stream_id;
+
+		this->finish(false);
+		if (owner != nullptr) {
+			owner->forgetOutgoingStream(stream_id);
+		}
+
+		if (connection) {
+			connection->send_stream_frame(StreamHeader{ stream_id, STREAM_ABORT, 0, 0 }, nullptr);
+		}
+	}
+}
@@ -1,24 +1,737 @@
 #include "channel_subscribable.h"
 
+#include <algorithm>
+#include <exception>
+#include <vector>
+
 namespace SunNet {
 
 	ChannelSubscribable::~ChannelSubscribable() {
 		this->subscriptions.clear();
+
+		/* Streams the user still holds must not reach back into here */
+		for (auto& stream : this->incoming_streams) {
+			stream.second->owner = nullptr;
+		}
+		for (auto& stream : this->outgoing_streams) {
+			stream.second->owner = nullptr;
+		}
 	}
 
 	void ChannelSubscribable::handleIncomingMessage(ChanneledSocketConnection_p socket) {
 		try {
 			CHANNEL_ID channel_id = socket->channeled_read_id();
+			if (channel_id == HEARTBEAT_CHANNEL_ID) {
+				/* Receiving the heartbeat already refreshed the connection's activity time */
+				socket->count_received(channel_id, sizeof(CHANNEL_ID));
+				return;
+			}
+			else if (channel_id == RPC_REQUEST_CHANNEL_ID) {
+				this->handleRpcRequest(socket);
+				return;
+			}
+			else if (channel_id == RPC_RESPONSE_CHANNEL_ID) {
+				this->handleRpcResponse(socket);
+				return;
+			}
+			else if (channel_id == TRACE_CONTROL_CHANNEL_ID) {
+				socket->trace_read_control();
+				return;
+			}
+			else if (channel_id == STREAM_CHANNEL_ID) {
+				this->handleStreamFrame(socket);
+				return;
+			}
+			else if (channel_id == SESSION_CHANNEL_ID) {
+				this->handleSessionFrame(socket);
+				return;
+			}
+
+			/* A traced message is handled like any other once its header is off */
+			NETWORK_BYTE_SIZE frame_overhead = sizeof(CHANNEL_ID);
+			if (channel_id == TRACED_CHANNEL_ID) {
+				channel_id = socket->trace_read_header().channel_id;
+				frame_overhead += TRACE_HEADER_SIZE;
+			}
+
+			ChannelInterface* channel = Channels::findChannel(channel_id);
+			if (channel == nullptr) {
+				this->dropBadChannel(socket);
+				return;
+			}
+
+			/* Frames over the connection's limits never get as far as being allocated */
+			NETWORK_BYTE_SIZE frame_size = frame_overhead + channel->getMessageSize();
+			if (!socket->admit_frame(channel_id, frame_size)) {
+				/* A message turned away was still received, as far as the sender's session is concerned */
+				if (this->refuseFrame(socket, channel->getMessageSize())) {
+					this->countSessionMessage(socket, frame_size);
+				}
+				return;
+			}
 
 			std::unique_ptr<NETWORK_BYTE[]> data = socket->channeled_read(channel_id);
+			socket->count_received(channel_id, frame_size);
+			this->countSessionMessage(socket, frame_size);
+			if (!this->waiters.empty() && this->deliverToWaiter(socket.get(), channel_id, data)) {
+				return;
+			}
 
 			auto channel_subs = subscriptions.find(channel_id);
 			if (channel_subs != this->subscriptions.end()) {
 				channel_subs->second->propagate_to_handlers(socket, std::move(data));
 			}
+			else {
+				SUNNET_METRICS_ONLY(Metrics::global.unhandled_messages.add());
+			}
 		}
 		catch (ChanneledSocketConnection::ConnectionClosedException&) {
-			this->handleSocketDisconnect(socket);
+			this->dropConnection(socket);
+		}
+		catch (...) {
+			SUNNET_METRICS_ONLY(Metrics::global.dispatch_errors.add());
+			throw;
+		}
+	}
+
+	void ChannelSubscribable::dropConnection(ChanneledSocketConnection_p socket) {
+		/* The subclass still hears of the disconnect if something waiting on the connection throws */
+		std::exception_ptr error;
+		try {
+			this->forgetConnection(socket.get());
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+
+		this->handleSocketDisconnect(socket);
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	void ChannelSubscribable::dropBadChannel(ChanneledSocketConnection_p socket) {
+		/* Nothing says how long the frame is, so nothing more the peer sent can be read */
+		SUNNET_METRICS_ONLY(Metrics::global.bad_channel_frames.add());
+		this->dropConnection(std::move(socket));
+	}
+
+	bool ChannelSubscribable::refuseFrame(ChanneledSocketConnection_p socket, NETWORK_BYTE_SIZE message_size) {
+		SUNNET_METRICS_ONLY(Metrics::global.ingress_drops.add());
+		if (socket->get_ingress_action() == INGRESS_DISCONNECT) {
+			this->dropConnection(std::move(socket));
+			return false;
+		}
+
+		socket->channeled_skip(message_size);
+		return true;
+	}
+
+	void ChannelSubscribable::countSessionMessage(const ChanneledSocketConnection_p& socket, NETWORK_BYTE_SIZE frame_size) {
+		const Session_p& session = socket->get_session();
+		if (!session || !session->count_received(frame_size)) {
+			return;
+		}
+
+		try {
+			socket->send_session_frame(SessionHeader{ SESSION_ACK, session->get_token(), session->get_received(), 0 });
+		}
+		catch (SendException&) {
+			/* The connection is gone, which poll finds out, and the next acknowledgement covers this one */
+		}
+	}
+
+	void ChannelSubscribable::handleSessionFrame(ChanneledSocketConnection_p socket) {
+		SessionHeader header = socket->session_read_header();
+
+		/* Sessions are opened and resumed by the client and server before anything reaches here */
+		const Session_p& session = socket->get_session();
+		if (!session || header.token != session->get_token()) {
+			this->dropBadChannel(std::move(socket));
+			return;
+		}
+
+		if (header.type == SESSION_ACK) {
+			session->acknowledge(header.received);
+		}
+		else if (header.type == SESSION_CLOSE) {
+			session->close();
+		}
+		else {
+			this->dropBadChannel(std::move(socket));
+		}
+	}
+
+	void ChannelSubscribable::handleRpcRequest(ChanneledSocketConnection_p socket) {
+		RpcHeader header = socket->rpc_read_header();
+		ChannelInterface* channel = Channels::findChannel(header.channel_id);
+		if (channel == nullptr) {
+			this->dropBadChannel(socket);
+			return;
+		}
+
+		NETWORK_BYTE_SIZE frame_size = sizeof(CHANNEL_ID) + RPC_HEADER_SIZE + channel->getMessageSize();
+		if (!socket->admit_frame(header.channel_id, frame_size)) {
+			/* The caller is left to time out, so that a flood is not answered in kind */
+			this->refuseFrame(socket, channel->getMessageSize());
+			return;
+		}
+
+		std::shared_ptr<NETWORK_BYTE> data(socket->channeled_read(header.channel_id).release(), std::default_delete<NETWORK_BYTE[]>());
+		socket->count_received(RPC_REQUEST_CHANNEL_ID, frame_size);
+
+		auto handler = this->rpc_handlers.find(header.channel_id);
+		if (handler == this->rpc_handlers.end()) {
+			/* Let the caller fail right away instead of waiting for its timeout */
+			socket->send_rpc_frame(RPC_RESPONSE_CHANNEL_ID, RpcHeader{ RPC_REQUEST_CHANNEL_ID, header.correlation_id }, nullptr);
+			return;
+		}
+
+		handler->second(socket, header.correlation_id, std::move(data));
+	}
+
+	void ChannelSubscribable::handleRpcResponse(ChanneledSocketConnection_p socket) {
+		RpcHeader header = socket->rpc_read_header();
+		if (header.channel_id == RPC_REQUEST_CHANNEL_ID) {
+			socket->count_received(RPC_RESPONSE_CHANNEL_ID, sizeof(CHANNEL_ID) + RPC_HEADER_SIZE);
+			this->completeCall(header.correlation_id, nullptr, std::make_exception_ptr(RpcNoHandlerException()));
+			return;
+		}
+
+		ChannelInterface* channel = Channels::findChannel(header.channel_id);
+		if (channel == nullptr) {
+			this->dropBadChannel(socket);
+			return;
+		}
+
+		/* Always read the response off the wire, even if the call has already timed out */
+		std::shared_ptr<NETWORK_BYTE> data(socket->channeled_read(header.channel_id).release(), std::default_delete<NETWORK_BYTE[]>());
+		socket->count_received(RPC_RESPONSE_CHANNEL_ID, sizeof(CHANNEL_ID) + RPC_HEADER_SIZE + channel->getMessageSize());
+		this->completeCall(header.correlation_id, std::move(data), nullptr);
+	}
+
+	void ChannelSubscribable::completeCall(CORRELATION_ID id, std::shared_ptr<NETWORK_BYTE> response, std::exception_ptr error) {
+		auto pending = this->pending_calls.find(id);
+		if (pending == this->pending_calls.end()) {
+			return;
+		}
+
+		RpcCompletion complete = std::move(pending->second.complete);
+		TimerWheel* timers = this->getTimerWheel();
+		if (timers != nullptr) {
+			timers->cancel(pending->second.timeout_timer);
+		}
+		this->pending_calls.erase(pending);
+
+		complete(std::move(response), error);
+	}
+
+	void ChannelSubscribable::startCall(ChanneledSocketConnection_p connection, CHANNEL_ID request_channel,
+		const NETWORK_BYTE* request, std::chrono::milliseconds timeout, RpcCompletion complete) {
+
+		CORRELATION_ID id = this->next_correlation_id++;
+
+		TIMER_ID timeout_timer = INVALID_TIMER_ID;
+		TimerWheel* timers = this->getTimerWheel();
+		if (timers != nullptr) {
+			timeout_timer = timers->schedule(timeout, [this, id]() {
+				this->completeCall(id, nullptr, std::make_exception_ptr(RpcTimeoutException()));
+			});
+		}
+
+		this->pending_calls[id] = PendingCall{ connection.get(), timeout_timer, std::move(complete) };
+
+		try {
+			connection->send_rpc_frame(RPC_REQUEST_CHANNEL_ID, RpcHeader{ request_channel, id }, request);
+		}
+		catch (SendException&) {
+			this->completeCall(id, nullptr, std::make_exception_ptr(RpcDisconnectedException()));
+		}
+	}
+
+	void ChannelSubscribable::handleStreamFrame(ChanneledSocketConnection_p socket) {
+		StreamHeader header = socket->stream_read_header();
+		NETWORK_BYTE_SIZE frame_size = sizeof(CHANNEL_ID) + STREAM_HEADER_SIZE;
+
+		switch (header.type) {
+		case STREAM_OPEN:
+			this->handleStreamOpen(socket, header);
+			return;
+
+		case STREAM_DATA: {
+			if (header.length > STREAM_MAX_CHUNK_SIZE) {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+
+			if (!socket->admit_frame(STREAM_CHANNEL_ID, frame_size + header.length)) {
+				if (!this->refuseFrame(socket, header.length)) {
+					return;
+				}
+
+				/* A stream with a chunk missing is no use, so the receiver is told to stop */
+				auto stream = this->incoming_streams.find(std::make_pair(socket.get(), header.stream_id));
+				if (stream != this->incoming_streams.end()) {
+					IncomingStream_p receiver = stream->second;
+					receiver->cancel();
+				}
+				return;
+			}
+
+			auto stream = this->incoming_streams.find(std::make_pair(socket.get(), header.stream_id));
+			if (stream != this->incoming_streams.end() && header.length > stream->second->window) {
+				/* The sender ran past the credit it was given */
+				this->dropBadChannel(socket);
+				return;
+			}
+
+			/* Always read the chunk off the wire, even if the stream has been cancelled */
+			if (this->stream_buffer.size() < header.length) {
+				this->stream_buffer.resize(header.length);
+			}
+			if (!socket->receive(this->stream_buffer.data(), header.length)) {
+				throw ChanneledSocketConnection::ConnectionClosedException();
+			}
+			socket->count_received(STREAM_CHANNEL_ID, frame_size + header.length);
+
+			if (stream != this->incoming_streams.end()) {
+				IncomingStream_p receiver = stream->second;
+				receiver->deliver(this->stream_buffer.data(), header.length);
+			}
+			return;
+		}
+
+		case STREAM_END:
+		case STREAM_ABORT: {
+			socket->count_received(STREAM_CHANNEL_ID, frame_size);
+
+			auto stream = this->incoming_streams.find(std::make_pair(socket.get(), header.stream_id));
+			if (stream != this->incoming_streams.end()) {
+				IncomingStream_p receiver = std::move(stream->second);
+				this->incoming_streams.erase(stream);
+				receiver->end(header.type == STREAM_END);
+			}
+			return;
+		}
+
+		case STREAM_CREDIT:
+		case STREAM_CANCEL: {
+			socket->count_received(STREAM_CHANNEL_ID, frame_size);
+
+			auto stream = this->outgoing_streams.find(header.stream_id);
+			if (stream == this->outgoing_streams.end() || stream->second->connection.lock() != socket) {
+				return;
+			}
+
+			if (header.type == STREAM_CREDIT) {
+				stream->second->credit += header.length;
+				this->scheduleStreamTurns();
+			}
+			else {
+				OutgoingStream_p sender = std::move(stream->second);
+				this->outgoing_streams.erase(stream);
+				sender->finish(false);
+			}
+			return;
+		}
+
+		default:
+			throw ReceiveException(std::to_string(EBADMSG));
+		}
+	}
+
+	void ChannelSubscribable::handleStreamOpen(ChanneledSocketConnection_p socket, const StreamHeader& header) {
+		ChannelInterface* channel = Channels::findChannel(header.channel_id);
+		if (channel == nullptr) {
+			this->dropBadChannel(socket);
+			return;
+		}
+		if (header.length != channel->getMessageSize()) {
+			throw ReceiveException(std::to_string(EBADMSG));
+		}
+
+		/* Like a refused call, a refused or unserved open is left unanswered, so that a flood of them is not answered in kind */
+		NETWORK_BYTE_SIZE frame_size = sizeof(CHANNEL_ID) + STREAM_HEADER_SIZE + header.length;
+		if (!socket->admit_frame(header.channel_id, frame_size)) {
+			this->refuseFrame(socket, header.length);
+			return;
+		}
+
+		auto handler = this->stream_handlers.find(header.channel_id);
+		if (handler == this->stream_handlers.end()) {
+			socket->channeled_skip(header.length);
+			socket->count_received(STREAM_CHANNEL_ID, frame_size);
+			SUNNET_METRICS_ONLY(Metrics::global.unhandled_messages.add());
+			return;
+		}
+
+		/* A reused number replaces its stream, so only a new one counts against the cap */
+		std::pair<ChanneledSocketConnection*, STREAM_ID> key = std::make_pair(socket.get(), header.stream_id);
+		if (this->incoming_streams.find(key) == this->incoming_streams.end()) {
+			size_t open_streams = 0;
+			auto open = this->incoming_streams.lower_bound(std::make_pair(socket.get(), (STREAM_ID)0));
+			while (open != this->incoming_streams.end() && open->first.first == socket.get() && open_streams < this->max_incoming_streams) {
+				open_streams++;
+				++open;
+			}
+
+			if (open_streams >= this->max_incoming_streams) {
+				this->dropBadChannel(socket);
+				return;
+			}
+		}
+
+		std::shared_ptr<NETWORK_BYTE> descriptor(socket->channeled_read(header.channel_id).release(), std::default_delete<NETWORK_BYTE[]>());
+		socket->count_received(STREAM_CHANNEL_ID, frame_size);
+
+		IncomingStream_p stream = std::make_shared<IncomingStream>(this, socket, header.stream_id);
+		IncomingStream_p& slot = this->incoming_streams[key];
+		if (slot) {
+			/* The sender reused a number, so the stream it had must be over */
+			slot->end(false);
+		}
+		slot = stream;
+
+		handler->second(socket, std::move(descriptor), std::move(stream));
+	}
+
+	OutgoingStream_p ChannelSubscribable::startStream(ChanneledSocketConnection_p connection, CHANNEL_ID descriptor_channel,
+		const NETWORK_BYTE* descriptor, NETWORK_BYTE_SIZE chunk_size, OutgoingStream::Producer producer,
+		int file, uint64_t offset, uint64_t length) {
+
+		STREAM_ID stream_id = this->next_stream_id++;
+		chunk_size = std::max<NETWORK_BYTE_SIZE>(1, std::min(chunk_size, STREAM_MAX_CHUNK_SIZE));
+		OutgoingStream_p stream = std::make_shared<OutgoingStream>(
+			this, connection, stream_id, descriptor_channel, chunk_size, std::move(producer), file, offset, length);
+
+		NETWORK_BYTE_SIZE descriptor_size = Channels::getChannel(descriptor_channel)->getMessageSize();
+		connection->send_stream_frame(StreamHeader{ stream_id, STREAM_OPEN, descriptor_channel, (uint32_t)descriptor_size }, descriptor);
+
+		this->outgoing_streams[stream_id] = stream;
+
+		auto lane = std::find_if(this->stream_lanes.begin(), this->stream_lanes.end(),
+			[&connection](const StreamLane_p& lane) { return lane->connection.lock() == connection; });
+		if (lane == this->stream_lanes.end()) {
+			StreamLane_p created = std::make_shared<StreamLane>();
+			created->connection = connection;
+			lane = this->stream_lanes.insert(this->stream_lanes.end(), std::move(created));
+		}
+		(*lane)->streams.push_back(stream);
+
+		this->scheduleStreamTurns();
+		return stream;
+	}
+
+	void ChannelSubscribable::scheduleStreamTurns(std::chrono::nanoseconds wait) {
+		TimerWheel* timers = this->getTimerWheel();
+		if (timers == nullptr) {
+			return;
+		}
+
+		/* A sooner turn replaces a later one, such as when credit arrives while waiting on a limit */
+		std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + wait;
+		if (this->stream_turn_timer != INVALID_TIMER_ID) {
+			if (due >= this->stream_turn_due) {
+				return;
+			}
+			timers->cancel(this->stream_turn_timer);
+		}
+
+		this->stream_turn_due = due;
+		this->stream_turn_timer = timers->schedule(std::chrono::ceil<std::chrono::milliseconds>(wait), [this]() { this->takeStreamTurns(); });
+	}
+
+	void ChannelSubscribable::takeStreamTurns() {
+		this->stream_turn_timer = INVALID_TIMER_ID;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		this->egress_limit.refill(now);
+		for (auto& limit : this->channel_egress_limits) {
+			limit.second.refill(now);
+		}
+
+		/*
+		A finishing stream's callback may open or cancel streams, so take turns from a copy.
+		The first lane moves along every time, so that no connection always goes first.
+		*/
+		size_t num_lanes = this->stream_lanes.size();
+		for (size_t i = 0; i < num_lanes; i++) {
+			this->lane_turns.push_back(this->stream_lanes[(this->next_lane + i) % num_lanes]);
+		}
+		this->next_lane = num_lanes > 0 ? (this->next_lane + 1) % num_lanes : 0;
+
+		std::chrono::nanoseconds wait = std::chrono::nanoseconds::max();
+		for (const StreamLane_p& lane : this->lane_turns) {
+			wait = std::min(wait, this->takeLaneTurn(*lane, now));
+		}
+		this->lane_turns.clear();
+
+		/* Let go of the streams which finished, and the lanes left with none */
+		for (const StreamLane_p& lane : this->stream_lanes) {
+			for (const OutgoingStream_p& stream : lane->streams) {
+				if (!stream->is_finished()) {
+					continue;
+				}
+
+				auto entry = this->outgoing_streams.find(stream->stream_id);
+				if (entry != this->outgoing_streams.end() && entry->second == stream) {
+					this->outgoing_streams.erase(entry);
+				}
+			}
+
+			lane->streams.erase(std::remove_if(lane->streams.begin(), lane->streams.end(),
+				[](const OutgoingStream_p& stream) { return stream->is_finished(); }), lane->streams.end());
+		}
+		this->stream_lanes.erase(std::remove_if(this->stream_lanes.begin(), this->stream_lanes.end(),
+			[](const StreamLane_p& lane) { return lane->streams.empty(); }), this->stream_lanes.end());
+
+		if (wait != std::chrono::nanoseconds::max()) {
+			this->scheduleStreamTurns(wait);
+		}
+	}
+
+	void ChannelSubscribable::handleWritable(ChanneledSocketConnection* socket) {
+		for (const StreamLane_p& lane : this->stream_lanes) {
+			if (lane->parked && lane->connection.lock().get() == socket) {
+				lane->parked = false;
+				this->scheduleStreamTurns();
+			}
+		}
+	}
+
+	std::chrono::nanoseconds ChannelSubscribable::takeLaneTurn(StreamLane& lane, std::chrono::steady_clock::time_point now) {
+		ChanneledSocketConnection_p connection = lane.connection.lock();
+		if (!connection) {
+			for (size_t i = 0; i < lane.streams.size(); i++) {
+				OutgoingStream_p stream = lane.streams[i];
+				stream->finish(false);
+			}
+			return std::chrono::nanoseconds::max();
+		}
+
+		/* handleWritable gives a parked lane its turns back */
+		if (lane.parked) {
+			return std::chrono::nanoseconds::max();
+		}
+
+		TokenBucket& connection_limit = connection->get_egress_limit();
+		connection_limit.refill(now);
+		lane.deficit += STREAM_TURN_SIZE;
+
+		/* Streams opened by a callback during the turn wait for the next one */
+		size_t num_streams = lane.streams.size();
+		size_t passed = 0;
+		while (passed < num_streams && lane.deficit > 0) {
+			OutgoingStream_p stream = lane.streams[lane.next_stream % num_streams];
+			lane.next_stream = (lane.next_stream + 1) % num_streams;
+
+			if (!stream->can_send() || this->egressWait(*stream, connection_limit).count() > 0) {
+				passed++;
+				continue;
+			}
+			if (!connection->is_writable()) {
+				break;
+			}
+
+			NETWORK_BYTE_SIZE sent;
+			try {
+				NETWORK_BYTE_SIZE limit = (NETWORK_BYTE_SIZE)std::min<uint64_t>(stream->credit, lane.deficit);
+				sent = stream->send_chunk(connection, this->stream_buffer, limit);
+			}
+			catch (SendException&) {
+				/* The connection's owner finds out it is broken from poll() */
+				stream->finish(false);
+				passed++;
+				continue;
+			}
+
+			/* The connection's limit was charged by the send, and is refilled to take it */
+			uint64_t frame_size = sizeof(CHANNEL_ID) + STREAM_HEADER_SIZE + sent;
+			this->egress_limit.charge(frame_size);
+			this->egress_limit.refill(now);
+			auto channel_limit = this->channel_egress_limits.find(stream->channel_id);
+			if (channel_limit != this->channel_egress_limits.end()) {
+				channel_limit->second.charge(frame_size);
+				channel_limit->second.refill(now);
+			}
+			connection_limit.refill(now);
+
+			lane.deficit -= std::min(lane.deficit, sent);
+			passed = 0;
+		}
+
+		std::chrono::nanoseconds wait = std::chrono::nanoseconds::max();
+		bool writable = connection->is_writable();
+		for (const OutgoingStream_p& stream : lane.streams) {
+			if (stream->can_send()) {
+				wait = std::min(wait, writable ? this->egressWait(*stream, connection_limit) : std::chrono::nanoseconds(0));
+			}
+		}
+
+		/* Only a connection which was cut short keeps what it did not get to send */
+		if (wait.count() > 0) {
+			lane.deficit = 0;
+		}
+		lane.deficit = std::min(lane.deficit, STREAM_TURN_SIZE);
+
+		/* A full connection waits for room instead of being tried again on every tick */
+		if (!writable && wait.count() == 0 && this->waitForWritable(connection)) {
+			lane.parked = true;
+			return std::chrono::nanoseconds::max();
+		}
+		return wait;
+	}
+
+	std::chrono::nanoseconds ChannelSubscribable::egressWait(const OutgoingStream& stream, const TokenBucket& connection_limit) const {
+		std::chrono::nanoseconds wait = std::max(this->egress_limit.time_until_available(), connection_limit.time_until_available());
+
+		auto channel_limit = this->channel_egress_limits.find(stream.channel_id);
+		if (channel_limit != this->channel_egress_limits.end()) {
+			wait = std::max(wait, channel_limit->second.time_until_available());
+		}
+		return wait;
+	}
+
+	void ChannelSubscribable::addChannelWaiter(ChannelWaiter* waiter) {
+		waiter->next = nullptr;
+
+		ChannelWaiter*& head = this->waiters[waiter->connection];
+		ChannelWaiter** tail = &head;
+		while (*tail != nullptr) {
+			tail = &(*tail)->next;
+		}
+		*tail = waiter;
+	}
+
+	bool ChannelSubscribable::deliverToWaiter(ChanneledSocketConnection* socket, CHANNEL_ID channel_id, std::unique_ptr<NETWORK_BYTE[]>& data) {
+		auto connection_waiters = this->waiters.find(socket);
+		if (connection_waiters == this->waiters.end()) {
+			return false;
+		}
+
+		for (ChannelWaiter** link = &connection_waiters->second; *link != nullptr; link = &(*link)->next) {
+			ChannelWaiter* waiter = *link;
+			if (waiter->channel_id != channel_id) {
+				continue;
+			}
+
+			/*
+			Unlink before delivering, since delivering may add new waiters or destroy this one.
+			The connection's entry is kept even when empty, since it is likely to be waited on again.
+			*/
+			*link = waiter->next;
+
+			waiter->deliver(std::shared_ptr<NETWORK_BYTE>(data.release(), std::default_delete<NETWORK_BYTE[]>()));
+			return true;
+		}
+
+		return false;
+	}
+
+	void ChannelSubscribable::forgetConnection(ChanneledSocketConnection* socket) {
+		/*
+		Waiters, streams and calls may resume coroutines which throw. Everything is still
+		let go of, and the first exception is rethrown once the connection is forgotten.
+		*/
+		std::exception_ptr first_error;
+
+		auto connection_waiters = this->waiters.find(socket);
+		if (connection_waiters != this->waiters.end()) {
+			ChannelWaiter* waiter = connection_waiters->second;
+			this->waiters.erase(connection_waiters);
+
+			while (waiter != nullptr) {
+				ChannelWaiter* next = waiter->next;
+				try {
+					waiter->deliver(nullptr);
+				}
+				catch (...) {
+					if (!first_error) {
+						first_error = std::current_exception();
+					}
+				}
+				waiter = next;
+			}
+		}
+
+		try {
+			this->forgetStreams(socket);
+		}
+		catch (...) {
+			if (!first_error) {
+				first_error = std::current_exception();
+			}
+		}
+
+		std::vector<CORRELATION_ID> failed;
+		for (const auto& pending : this->pending_calls) {
+			if (pending.second.connection == socket) {
+				failed.push_back(pending.first);
+			}
+		}
+
+		for (CORRELATION_ID id : failed) {
+			try {
+				this->completeCall(id, nullptr, std::make_exception_ptr(RpcDisconnectedException()));
+			}
+			catch (...) {
+				if (!first_error) {
+					first_error = std::current_exception();
+				}
+			}
+		}
+
+		if (first_error) {
+			std::rethrow_exception(first_error);
+		}
+	}
+
+	void ChannelSubscribable::forgetStreams(ChanneledSocketConnection* socket) {
+		std::vector<IncomingStream_p> ended;
+		auto incoming = this->incoming_streams.lower_bound(std::make_pair(socket, (STREAM_ID)0));
+		while (incoming != this->incoming_streams.end() && incoming->first.first == socket) {
+			ended.push_back(std::move(incoming->second));
+			incoming = this->incoming_streams.erase(incoming);
+		}
+
+		this->stream_lanes.erase(std::remove_if(this->stream_lanes.begin(), this->stream_lanes.end(),
+			[socket](const StreamLane_p& lane) { return lane->connection.lock().get() == socket; }), this->stream_lanes.end());
+
+		std::vector<OutgoingStream_p> finished;
+		for (auto outgoing = this->outgoing_streams.begin(); outgoing != this->outgoing_streams.end(); ) {
+			if (outgoing->second->connection.lock().get() == socket) {
+				finished.push_back(std::move(outgoing->second));
+				outgoing = this->outgoing_streams.erase(outgoing);
+			}
+			else {
+				++outgoing;
+			}
+		}
+
+		/* Like forgetConnection, end every stream even if one throws */
+		std::exception_ptr first_error;
+		for (const IncomingStream_p& stream : ended) {
+			try {
+				stream->end(false);
+			}
+			catch (...) {
+				if (!first_error) {
+					first_error = std::current_exception();
+				}
+			}
+		}
+		for (const OutgoingStream_p& stream : finished) {
+			try {
+				stream->finish(false);
+			}
+			catch (...) {
+				if (!first_error) {
+					first_error = std::current_exception();
+				}
+			}
+		}
+
+		if (first_error) {
+			std::rethrow_exception(first_error);
 		}
 	}
 }
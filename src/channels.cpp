@@ -1,20 +1,20 @@
 #include "channels.h"
 
 namespace SunNet {
-	std::map<CHANNEL_ID, std::shared_ptr<ChannelInterface>> Channels::ids_to_channels;
+	std::array<std::shared_ptr<ChannelInterface>, 256> Channels::ids_to_channels;
 	std::map<std::type_index, CHANNEL_ID> Channels::types_to_ids;
 	std::atomic<CHANNEL_ID> Channels::channel_counter(0);
 
-	ChannelInterface::ChannelInterface(NETWORK_BYTE_SIZE size, CHANNEL_ID id) :
-		message_size(size), channel_id(id) {}
+	ChannelInterface::ChannelInterface(NETWORK_BYTE_SIZE size, CHANNEL_ID id, DeliveryMode mode) :
+		message_size(size), channel_id(id), delivery_mode(mode) {}
 
 	std::shared_ptr<ChannelInterface> Channels::getChannel(CHANNEL_ID id) {
-		const auto& channel_it = ids_to_channels.find(id);
-		if (channel_it == ids_to_channels.end()) {
+		const std::shared_ptr<ChannelInterface>& channel = ids_to_channels[id];
+		if (!channel) {
 			throw BadChannelException();
 		}
 		else {
-			return channel_it->second;
+			return channel;
 		}
 	}
 }
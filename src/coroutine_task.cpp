@@ -0,0 +1,97 @@
+#include "coroutine_task.h"
+
+#ifdef SUNNET_HAS_COROUTINES
+
+#include <new>
+#include <utility>
+
+namespace SunNet {
+
+	/* Frames are rounded up to a multiple of this, and each multiple gets its own free list */
+	static const std::size_t FRAME_SIZE_STEP = 64;
+	static const std::size_t FRAME_SIZE_CLASSES = 64;
+
+	/* Keep at most this many free frames per size class on each thread */
+	static const std::size_t MAX_CACHED_FRAMES = 4096;
+
+	struct FreeFrame {
+		FreeFrame* next;
+	};
+
+	struct FrameFreeLists {
+		FreeFrame* heads[FRAME_SIZE_CLASSES] = {};
+		std::size_t counts[FRAME_SIZE_CLASSES] = {};
+
+		~FrameFreeLists() {
+			for (std::size_t size_class = 0; size_class < FRAME_SIZE_CLASSES; size_class++) {
+				while (this->heads[size_class] != nullptr) {
+					FreeFrame* frame = this->heads[size_class];
+					this->heads[size_class] = frame->next;
+					::operator delete(frame);
+				}
+			}
+		}
+	};
+
+	static thread_local FrameFreeLists free_lists;
+
+	/* The exception thrown by the most recently resumed task on this thread, if any */
+	static thread_local std::exception_ptr task_exception;
+
+	static std::size_t size_class_of(std::size_t size) {
+		return (size + FRAME_SIZE_STEP - 1) / FRAME_SIZE_STEP;
+	}
+
+	void* CoroutineFrameAllocator::allocate(std::size_t size) {
+		std::size_t size_class = size_class_of(size);
+		if (size_class >= FRAME_SIZE_CLASSES) {
+			return ::operator new(size);
+		}
+
+		FreeFrame* frame = free_lists.heads[size_class];
+		if (frame != nullptr) {
+			free_lists.heads[size_class] = frame->next;
+			free_lists.counts[size_class]--;
+			return frame;
+		}
+
+		return ::operator new(size_class * FRAME_SIZE_STEP);
+	}
+
+	void CoroutineFrameAllocator::deallocate(void* memory, std::size_t size) {
+		std::size_t size_class = size_class_of(size);
+		if (size_class >= FRAME_SIZE_CLASSES || free_lists.counts[size_class] >= MAX_CACHED_FRAMES) {
+			::operator delete(memory);
+			return;
+		}
+
+		FreeFrame* frame = static_cast<FreeFrame*>(memory);
+		frame->next = free_lists.heads[size_class];
+		free_lists.heads[size_class] = frame;
+		free_lists.counts[size_class]++;
+	}
+
+	void Task::promise_type::unhandled_exception() {
+		/* Let the frame finish normally and rethrow from whoever resumed it */
+		task_exception = std::current_exception();
+	}
+
+	void resume_task(std::coroutine_handle<> handle) {
+		handle.resume();
+
+		if (task_exception) {
+			std::exception_ptr error = std::move(task_exception);
+			task_exception = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	void spawn(Task task) {
+		std::coroutine_handle<> handle = task.handle;
+		task.handle = nullptr;
+
+		resume_task(handle);
+	}
+}
+
+#endif
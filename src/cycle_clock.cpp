@@ -0,0 +1,47 @@
+#include "cycle_clock.h"
+
+#include <atomic>
+
+namespace SunNet {
+
+	/* Once this much time has passed since start up, the tick rate is known well enough to stop measuring */
+	static const std::chrono::seconds SETTLED_CALIBRATION(1);
+
+	/* Never calibrate over less than this */
+	static const std::chrono::milliseconds MIN_CALIBRATION(1);
+
+	struct CalibrationPoint {
+		std::chrono::steady_clock::time_point time;
+		uint64_t ticks;
+
+		CalibrationPoint() : time(std::chrono::steady_clock::now()), ticks(CycleClock::now()) {}
+	};
+
+	static const CalibrationPoint start_point;
+	static std::atomic<double> settled_nanoseconds_per_tick(0.0);
+
+	double CycleClock::nanoseconds_per_tick() {
+#ifdef SUNNET_HAS_TSC
+		double settled = settled_nanoseconds_per_tick.load(std::memory_order_relaxed);
+		if (settled != 0.0) {
+			return settled;
+		}
+
+		/* Measure against the longest interval there is: everything since start up */
+		CalibrationPoint current;
+		while (current.time - start_point.time < MIN_CALIBRATION) {
+			current = CalibrationPoint();
+		}
+
+		double elapsed = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(current.time - start_point.time).count();
+		double ratio = elapsed / (double)(current.ticks - start_point.ticks);
+		if (current.time - start_point.time >= SETTLED_CALIBRATION) {
+			settled_nanoseconds_per_tick.store(ratio, std::memory_order_relaxed);
+		}
+
+		return ratio;
+#else
+		return 1.0;
+#endif
+	}
+}
@@ -0,0 +1,206 @@
+#include "datagram_client.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+namespace SunNet {
+
+	DatagramClient::DatagramClient(int poll_timeout) :
+		poll_service(poll_timeout), state(CLIENT_CLOSED), read_budget_batches(4), read_budget_exhaustions(0),
+		idle_timeout(0), idle_check_timer(INVALID_TIMER_ID), heartbeat_interval(0), heartbeat_timer(INVALID_TIMER_ID),
+		retransmit_timer(INVALID_TIMER_ID) {}
+
+	DatagramClient::~DatagramClient() {
+		this->state = CLIENT_DESTRUCTING;
+		this->server.reset();
+		this->connection.reset();
+	}
+
+	void DatagramClient::state_transition(std::initializer_list<ClientState> const& valid_from_states, ClientState new_state) {
+		for (const ClientState& valid_from_state : valid_from_states) {
+			if (this->state == valid_from_state) {
+				this->state = new_state;
+				return;
+			}
+		}
+
+		throw InvalidStateTransitionException();
+	}
+
+	void DatagramClient::connect(std::string address, std::string port) {
+		if (this->state != CLIENT_CLOSED) {
+			throw InvalidStateTransitionException();
+		}
+
+		std::shared_ptr<UDPSocketConnection> connection = std::make_shared<UDPSocketConnection>();
+		connection->connect(address, port);
+		connection->set_nonblocking(true);
+
+		this->connection = connection;
+		this->server = std::make_shared<UDPPeer>(connection, nullptr);
+		this->poll_service.add_socket(this->connection);
+
+		this->state_transition({ CLIENT_CLOSED }, CLIENT_CONNECTED);
+	}
+
+	void DatagramClient::disconnect() {
+		this->state_transition({ CLIENT_CONNECTED, CLIENT_CLOSED }, CLIENT_CLOSED);
+
+		this->flush();
+		this->cancel_timer(this->retransmit_timer);
+		this->retransmit_timer = INVALID_TIMER_ID;
+		if (this->server) {
+			this->forgetConnection(this->server.get());
+		}
+
+		this->poll_service.clear_sockets();
+		this->server.reset();
+		this->connection.reset();
+	}
+
+	bool DatagramClient::poll() {
+		if (this->state != CLIENT_CONNECTED) {
+			return false;
+		}
+		const PollEventList& ready_sockets = this->poll_service.poll();
+
+		bool received = false;
+		for (const PollEvent& event : ready_sockets) {
+			/* A handler or timer may have disconnected */
+			if (this->state != CLIENT_CONNECTED) {
+				return false;
+			}
+
+			/* An error, such as the server's port being closed, is read and reported by the receive */
+			SUNNET_METRICS_ONLY(Metrics::latency.dispatch_delay.record_since(this->poll_service.get_poll_return_ticks()));
+			this->read_datagrams();
+			received = received || event.status == SOCKET_STATUS_NORMAL;
+		}
+
+		if (ready_sockets.empty() && this->state == CLIENT_CONNECTED) {
+			this->handle_poll_timeout();
+		}
+
+		this->flush();
+		SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
+		return received;
+	}
+
+	void DatagramClient::flush() {
+		if (!this->connection) {
+			return;
+		}
+
+		this->server->send_acks();
+		this->connection->flush();
+
+		if (this->connection->get_unacked_count() > 0 && this->retransmit_timer == INVALID_TIMER_ID) {
+			this->retransmit_timer = this->schedule_repeating_timer(RETRANSMIT_CHECK_INTERVAL, [this]() { this->retransmit(); });
+		}
+	}
+
+	void DatagramClient::retransmit() {
+		if (!this->server || this->server->unacked_count() == 0) {
+			this->cancel_timer(this->retransmit_timer);
+			this->retransmit_timer = INVALID_TIMER_ID;
+			return;
+		}
+
+		this->server->retransmit();
+	}
+
+	void DatagramClient::read_datagrams() {
+		for (size_t batches = 1; ; batches++) {
+			int count;
+			try {
+				count = this->connection->receive_datagrams();
+			}
+			catch (ReceiveException&) {
+				this->handle_client_error();
+				return;
+			}
+
+			for (int index = 0; index < count; index++) {
+				UDPDatagram datagram = this->connection->get_datagram(index);
+				if (datagram.truncated) {
+					this->connection->count_dropped_datagram();
+					continue;
+				}
+
+				this->server->begin_datagram(datagram);
+				try {
+					while (this->server->next_frame()) {
+						this->handleIncomingMessage(this->server);
+
+						/* The handler may have disconnected */
+						if (this->state != CLIENT_CONNECTED) {
+							return;
+						}
+					}
+				}
+				catch (ReceiveException&) {
+					/* The datagram was malformed, and the rest of it is gone */
+					this->connection->count_dropped_datagram();
+				}
+			}
+
+			/* A short batch means the socket is empty */
+			if (count < UDP_BATCH_SIZE) {
+				return;
+			}
+
+			if (batches >= this->read_budget_batches) {
+				this->read_budget_exhaustions++;
+				SUNNET_METRICS_ONLY(Metrics::global.read_budget_exhaustions.add());
+				this->poll_service.mark_ready(this->connection->get_handle());
+				return;
+			}
+		}
+	}
+
+	void DatagramClient::check_idle() {
+		if (this->state != CLIENT_CONNECTED) {
+			return;
+		}
+
+		if (this->server->get_last_receive_time() < std::chrono::steady_clock::now() - this->idle_timeout) {
+			this->handle_client_disconnect();
+		}
+	}
+
+	void DatagramClient::send_heartbeat() {
+		if (!this->server) {
+			return;
+		}
+
+		if (this->server->get_last_send_time() < std::chrono::steady_clock::now() - this->heartbeat_interval) {
+			this->server->send_heartbeat();
+		}
+	}
+
+	void DatagramClient::set_idle_timeout(std::chrono::milliseconds timeout) {
+		this->cancel_timer(this->idle_check_timer);
+		this->idle_check_timer = INVALID_TIMER_ID;
+		this->idle_timeout = timeout;
+
+		if (timeout.count() > 0) {
+			std::chrono::milliseconds check_interval = std::max(timeout / 4, std::chrono::milliseconds(1));
+			this->idle_check_timer = this->schedule_repeating_timer(check_interval, [this]() { this->check_idle(); });
+		}
+	}
+
+	void DatagramClient::enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout) {
+		this->disable_heartbeat();
+
+		this->heartbeat_interval = interval;
+		this->heartbeat_timer = this->schedule_repeating_timer(interval, [this]() { this->send_heartbeat(); });
+		this->set_idle_timeout(idle_timeout);
+	}
+
+	void DatagramClient::disable_heartbeat() {
+		this->cancel_timer(this->heartbeat_timer);
+		this->heartbeat_timer = INVALID_TIMER_ID;
+		this->set_idle_timeout(std::chrono::milliseconds(0));
+	}
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "datagram_reliability.h"
+
+#include <algorithm>
+
+namespace SunNet {
+
+	RoundTripEstimator::RoundTripEstimator() :
+		smoothed(0), variation(0), timeout(INITIAL_RETRANSMIT_TIMEOUT), has_sample(false) {}
+
+	void RoundTripEstimator::record(std::chrono::microseconds sample) {
+		if (!this->has_sample) {
+			this->smoothed = sample;
+			this->variation = sample / 2;
+			this->has_sample = true;
+		}
+		else {
+			std::chrono::microseconds error = this->smoothed > sample ? this->smoothed - sample : sample - this->smoothed;
+			this->variation = (3 * this->variation + error) / 4;
+			this->smoothed = (7 * this->smoothed + sample) / 8;
+		}
+
+		this->timeout = std::clamp(this->smoothed + 4 * this->variation, MIN_RETRANSMIT_TIMEOUT, MAX_RETRANSMIT_TIMEOUT);
+	}
+
+	ReliableSender::ReliableSender(CHANNEL_ID marker) : marker(marker), next_id(0) {}
+
+	const std::vector<NETWORK_BYTE>& ReliableSender::wrap(SEND_VECTOR* vectors, int count, Clock::time_point now) {
+		if (this->unacked.size() >= RELIABLE_WINDOW) {
+			throw SendException(std::to_string(ENOBUFS));
+		}
+
+		NETWORK_BYTE_SIZE frame_size = 0;
+		for (int index = 0; index < count; index++) {
+			frame_size += vectors[index].iov_len;
+		}
+
+		Unacked& message = this->unacked[this->next_id];
+		message.record.resize(DELIVERY_HEADER_SIZE + frame_size);
+		message.last_sent = now;
+		message.transmissions = 1;
+
+		DeliveryHeader{ this->marker, this->next_id, (uint16_t)frame_size }.write(message.record.data());
+		NETWORK_BYTE* frame = message.record.data() + DELIVERY_HEADER_SIZE;
+		for (int index = 0; index < count; index++) {
+			std::memcpy(frame, vectors[index].iov_base, vectors[index].iov_len);
+			frame += vectors[index].iov_len;
+		}
+
+		this->next_id++;
+		return message.record;
+	}
+
+	void ReliableSender::forget(std::map<uint32_t, Unacked>::iterator message, Clock::time_point now, RoundTripEstimator& round_trip) {
+		/* A message sent more than once cannot tell which transmission was acknowledged */
+		if (message->second.transmissions == 1) {
+			round_trip.record(std::chrono::duration_cast<std::chrono::microseconds>(now - message->second.last_sent));
+		}
+		this->unacked.erase(message);
+	}
+
+	size_t ReliableSender::acknowledge(const AckRecord& ack, Clock::time_point now, RoundTripEstimator& round_trip) {
+		size_t acknowledged = 0;
+
+		/* Ids only count up, so everything below the base is at the front of the map */
+		while (!this->unacked.empty() && (int32_t)(this->unacked.begin()->first - ack.base) < 0) {
+			this->forget(this->unacked.begin(), now, round_trip);
+			acknowledged++;
+		}
+
+		for (uint32_t bit = 0; bit < 32; bit++) {
+			if ((ack.bits >> bit) & 1) {
+				auto message = this->unacked.find(ack.base + 1 + bit);
+				if (message != this->unacked.end()) {
+					this->forget(message, now, round_trip);
+					acknowledged++;
+				}
+			}
+		}
+
+		return acknowledged;
+	}
+
+	ReliableReceiver::ReliableReceiver(CHANNEL_ID marker) : marker(marker), base(0), ack_pending(false) {}
+
+	DeliveryDecision ReliableReceiver::accept(uint32_t id, const NETWORK_BYTE* frame, NETWORK_BYTE_SIZE frame_size) {
+		uint32_t offset = id - this->base;
+		if (offset >= RELIABLE_WINDOW) {
+			/* An old message was sent again because its ack was lost, so ack it again */
+			this->ack_pending = this->ack_pending || (int32_t)offset < 0;
+			return DISCARD;
+		}
+
+		this->ack_pending = true;
+		if (this->received[id % RELIABLE_WINDOW]) {
+			return DISCARD;
+		}
+		this->received[id % RELIABLE_WINDOW] = true;
+
+		if (this->marker == RELIABLE_ORDERED_CHANNEL_ID && id != this->base) {
+			this->held[id].assign(frame, frame + frame_size);
+			return HOLD;
+		}
+
+		while (this->received[this->base % RELIABLE_WINDOW]) {
+			this->received[this->base % RELIABLE_WINDOW] = false;
+			this->base++;
+		}
+		return DELIVER;
+	}
+
+	bool ReliableReceiver::release(std::vector<NETWORK_BYTE>& frame) {
+		if (this->held.empty() || (int32_t)(this->held.begin()->first - this->base) >= 0) {
+			return false;
+		}
+
+		frame = std::move(this->held.begin()->second);
+		this->held.erase(this->held.begin());
+		return true;
+	}
+
+	AckRecord ReliableReceiver::ack() {
+		AckRecord ack{ this->marker, this->base, 0 };
+		for (uint32_t bit = 0; bit < 32; bit++) {
+			if (this->received[(this->base + 1 + bit) % RELIABLE_WINDOW]) {
+				ack.bits |= (uint32_t)1 << bit;
+			}
+		}
+
+		this->ack_pending = false;
+		return ack;
+	}
+}
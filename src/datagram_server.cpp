@@ -0,0 +1,273 @@
+#include "datagram_server.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+namespace SunNet {
+
+	DatagramServer::DatagramServer(std::string address, std::string port, int poll_timeout) :
+		poll_service(poll_timeout), address(address), port(port), state(CLOSED), max_clients(DEFAULT_MAX_DATAGRAM_CLIENTS),
+		rejected_clients(0), read_budget_batches(4), read_budget_exhaustions(0), idle_timeout(0),
+		idle_sweep_timer(INVALID_TIMER_ID), heartbeat_interval(0), heartbeat_timer(INVALID_TIMER_ID),
+		retransmit_timer(INVALID_TIMER_ID) {
+
+		this->set_idle_timeout(DEFAULT_DATAGRAM_IDLE_TIMEOUT);
+	}
+
+	DatagramServer::~DatagramServer() {
+		this->state = DESTRUCTING;
+		this->clients.clear();
+		this->server_connection.reset();
+	}
+
+	void DatagramServer::state_transition(std::initializer_list<ServerState> const& valid_from_states, ServerState new_state) {
+		for (const ServerState& valid_from_state : valid_from_states) {
+			if (this->state == valid_from_state) {
+				this->state = new_state;
+				return;
+			}
+		}
+
+		throw InvalidStateTransitionException();
+	}
+
+	void DatagramServer::open() {
+		this->state_transition({ CLOSED }, OPEN);
+
+		this->server_connection = std::make_shared<UDPSocketConnection>();
+		this->server_connection->bind(this->port, this->address);
+		this->server_connection->set_nonblocking(true);
+		this->poll_service.add_socket(this->server_connection);
+	}
+
+	void DatagramServer::serve() {
+		this->state_transition({ OPEN }, SERVE);
+	}
+
+	void DatagramServer::close() {
+		this->state_transition({ SERVE, OPEN, CLOSED }, CLOSED);
+
+		this->flush();
+		this->cancel_timer(this->retransmit_timer);
+		this->retransmit_timer = INVALID_TIMER_ID;
+		for (const auto& client : this->clients) {
+			this->forgetConnection(client.second.get());
+		}
+		this->clients.clear();
+
+		this->poll_service.clear_sockets();
+		this->server_connection.reset();
+	}
+
+	bool DatagramServer::poll() {
+		if (this->state != SERVE) {
+			return false;
+		}
+		const PollEventList& ready_sockets = this->poll_service.poll();
+
+		bool received = false;
+		for (const PollEvent& event : ready_sockets) {
+			/* A handler or timer may have closed the server */
+			if (this->state != SERVE) {
+				return false;
+			}
+
+			if (event.status == SOCKET_STATUS_NORMAL) {
+				SUNNET_METRICS_ONLY(Metrics::latency.dispatch_delay.record_since(this->poll_service.get_poll_return_ticks()));
+				this->read_datagrams();
+				received = true;
+			}
+			else {
+				this->handle_server_connection_error();
+			}
+		}
+
+		if (ready_sockets.empty() && this->state == SERVE) {
+			this->handle_poll_timeout();
+		}
+
+		/* Replies from handlers and timers all go out together */
+		this->flush();
+		SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
+		return received;
+	}
+
+	void DatagramServer::flush() {
+		for (const UDPPeer_p& client : this->ack_pending_clients) {
+			client->send_acks();
+		}
+		this->ack_pending_clients.clear();
+
+		if (!this->server_connection) {
+			return;
+		}
+		this->server_connection->flush();
+
+		if (this->server_connection->get_unacked_count() > 0 && this->retransmit_timer == INVALID_TIMER_ID) {
+			this->retransmit_timer = this->schedule_repeating_timer(RETRANSMIT_CHECK_INTERVAL, [this]() { this->retransmit(); });
+		}
+	}
+
+	void DatagramServer::retransmit() {
+		if (!this->server_connection || this->server_connection->get_unacked_count() == 0) {
+			this->cancel_timer(this->retransmit_timer);
+			this->retransmit_timer = INVALID_TIMER_ID;
+			return;
+		}
+
+		for (const auto& client : this->clients) {
+			if (client.second->unacked_count() > 0) {
+				client.second->retransmit();
+			}
+		}
+	}
+
+	void DatagramServer::read_datagrams() {
+		for (size_t batches = 1; ; batches++) {
+			int count;
+			try {
+				count = this->server_connection->receive_datagrams();
+			}
+			catch (ReceiveException&) {
+				this->handle_server_connection_error();
+				return;
+			}
+
+			for (int index = 0; index < count; index++) {
+				this->handle_datagram(this->server_connection->get_datagram(index));
+
+				/* The handler may have closed the server */
+				if (this->state != SERVE) {
+					return;
+				}
+			}
+
+			/* A short batch means the socket is empty */
+			if (count < UDP_BATCH_SIZE) {
+				return;
+			}
+
+			if (batches >= this->read_budget_batches) {
+				this->read_budget_exhaustions++;
+				SUNNET_METRICS_ONLY(Metrics::global.read_budget_exhaustions.add());
+				this->poll_service.mark_ready(this->server_connection->get_handle());
+				return;
+			}
+		}
+	}
+
+	void DatagramServer::handle_datagram(const UDPDatagram& datagram) {
+		if (datagram.truncated) {
+			this->server_connection->count_dropped_datagram();
+			return;
+		}
+
+		UDPPeer_p client;
+		auto existing = this->clients.find(*datagram.sender);
+		if (existing != this->clients.end()) {
+			client = existing->second;
+		}
+		else {
+			if (this->max_clients > 0 && this->clients.size() >= this->max_clients) {
+				this->rejected_clients++;
+				SUNNET_METRICS_ONLY(Metrics::global.rejected_connections.add());
+				return;
+			}
+
+			client = std::make_shared<UDPPeer>(this->server_connection, datagram.sender);
+			this->clients.emplace(*datagram.sender, client);
+			this->handle_client_connect(client);
+			if (this->state != SERVE) {
+				return;
+			}
+		}
+
+		bool ack_was_pending = client->has_ack_pending();
+		client->begin_datagram(datagram);
+		try {
+			while (client->next_frame()) {
+				this->handleIncomingMessage(client);
+				if (this->state != SERVE) {
+					return;
+				}
+			}
+		}
+		catch (ReceiveException&) {
+			/* The datagram was malformed, and the rest of it is gone */
+			this->server_connection->count_dropped_datagram();
+		}
+
+		/* Acks wait for the end of poll(), so that one covers every frame in the batch */
+		if (!ack_was_pending && client->has_ack_pending()) {
+			this->ack_pending_clients.push_back(client);
+		}
+	}
+
+	void DatagramServer::handleSocketDisconnect(ChanneledSocketConnection_p socket) {
+		UDPPeer_p client = std::static_pointer_cast<UDPPeer>(socket);
+		client->discard_datagram();
+		if (this->clients.erase(client->get_address()) > 0) {
+			this->handle_client_disconnect(client);
+		}
+	}
+
+	UDPPeer_p DatagramServer::get_client(const UDPAddress& address) const {
+		auto client = this->clients.find(address);
+		return client == this->clients.end() ? nullptr : client->second;
+	}
+
+	void DatagramServer::reap_idle_clients() {
+		if (this->state != SERVE) {
+			return;
+		}
+
+		std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - this->idle_timeout;
+		for (const auto& client : this->clients) {
+			if (client.second->get_last_receive_time() < cutoff) {
+				this->idle_clients.push_back(client.second);
+			}
+		}
+
+		for (const UDPPeer_p& client : this->idle_clients) {
+			this->clients.erase(client->get_address());
+			this->forgetConnection(client.get());
+			this->handle_client_disconnect(client);
+		}
+		this->idle_clients.clear();
+	}
+
+	void DatagramServer::send_heartbeats() {
+		std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - this->heartbeat_interval;
+		for (const auto& client : this->clients) {
+			if (client.second->get_last_send_time() < cutoff) {
+				client.second->send_heartbeat();
+			}
+		}
+	}
+
+	void DatagramServer::set_idle_timeout(std::chrono::milliseconds timeout) {
+		this->cancel_timer(this->idle_sweep_timer);
+		this->idle_sweep_timer = INVALID_TIMER_ID;
+		this->idle_timeout = timeout;
+
+		if (timeout.count() > 0) {
+			std::chrono::milliseconds sweep_interval = std::max(timeout / 4, std::chrono::milliseconds(1));
+			this->idle_sweep_timer = this->schedule_repeating_timer(sweep_interval, [this]() { this->reap_idle_clients(); });
+		}
+	}
+
+	void DatagramServer::enable_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds idle_timeout) {
+		this->disable_heartbeat();
+
+		this->heartbeat_interval = interval;
+		this->heartbeat_timer = this->schedule_repeating_timer(interval, [this]() { this->send_heartbeats(); });
+		this->set_idle_timeout(idle_timeout);
+	}
+
+	void DatagramServer::disable_heartbeat() {
+		this->cancel_timer(this->heartbeat_timer);
+		this->heartbeat_timer = INVALID_TIMER_ID;
+		this->set_idle_timeout(DEFAULT_DATAGRAM_IDLE_TIMEOUT);
+	}
+}
+
+#endif
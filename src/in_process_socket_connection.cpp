@@ -0,0 +1,405 @@
+#include "in_process_socket_connection.h"
+
+#ifdef SUNNET_HAS_IN_PROCESS_TRANSPORT
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace SunNet {
+
+	static_assert((IN_PROCESS_RING_SIZE & (IN_PROCESS_RING_SIZE - 1)) == 0, "IN_PROCESS_RING_SIZE must be a power of two");
+
+	/* An eventfd. It polls readable from ring() until clear() */
+	class InProcessDoorbell {
+	private:
+		SOCKET descriptor;
+
+	public:
+		InProcessDoorbell() {
+			this->descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (this->descriptor == INVALID_SOCKET) {
+				throw CreateException(std::to_string(errno));
+			}
+		}
+
+		~InProcessDoorbell() {
+			::close(this->descriptor);
+		}
+
+		void ring() {
+			uint64_t one = 1;
+			while (::write(this->descriptor, &one, sizeof(one)) == -1 && errno == EINTR) {}
+		}
+
+		void clear() {
+			uint64_t count;
+			while (::read(this->descriptor, &count, sizeof(count)) == -1 && errno == EINTR) {}
+		}
+
+		/* Block until the doorbell is rung. It is not cleared */
+		void wait() {
+			wait_for_socket(this->descriptor, POLLIN, -1);
+		}
+
+		/* A second descriptor for the same doorbell, for a SocketConnection to own and close */
+		SOCKET duplicate() {
+			SOCKET duplicate = fcntl(this->descriptor, F_DUPFD_CLOEXEC, 0);
+			if (duplicate == INVALID_SOCKET) {
+				throw CreateException(std::to_string(errno));
+			}
+			return duplicate;
+		}
+	};
+
+	/*
+	One direction of a connection: a single-producer, single-consumer byte ring.
+
+	The producer rings the consumer's doorbell only when it publishes into an empty ring,
+	and the consumer only goes back to waiting once it has seen the ring empty. Both sides
+	store their own position and then load the other's with sequential consistency, so at
+	least one of them sees the other's update and a wakeup is never lost.
+	*/
+	class InProcessRing {
+	private:
+		std::unique_ptr<NETWORK_BYTE[]> data;
+
+		/* Each position is written by one side only, so they get their own cache lines */
+		alignas(64) std::atomic<uint64_t> head; /** < Bytes consumed */
+		alignas(64) std::atomic<uint64_t> tail; /** < Bytes published */
+		uint64_t unpublished_tail; /** < Bytes written by the producer, published or not */
+
+		alignas(64) std::atomic<bool> closed;
+		std::atomic<bool> writer_waiting;
+
+		std::shared_ptr<InProcessDoorbell> readable; /** < The consumer's doorbell */
+		InProcessDoorbell writable; /** < Rung for a producer waiting for space */
+
+	public:
+		InProcessRing(std::shared_ptr<InProcessDoorbell> readable) :
+			data(new NETWORK_BYTE[IN_PROCESS_RING_SIZE]), head(0), tail(0), unpublished_tail(0),
+			closed(false), writer_waiting(false), readable(readable) {}
+
+		bool is_closed() const {
+			return this->closed.load();
+		}
+
+		/* Close the ring from either end, waking both */
+		void close() {
+			this->closed.store(true);
+			this->readable->ring();
+			this->writable.ring();
+		}
+
+		/* @return The bytes the consumer may read */
+		std::size_t available() const {
+			return (std::size_t)(this->tail.load() - this->head.load(std::memory_order_relaxed));
+		}
+
+		/* Consume up to size bytes. @return How many were consumed */
+		std::size_t read(NETWORK_BYTE* buffer, std::size_t size) {
+			uint64_t position = this->head.load(std::memory_order_relaxed);
+			std::size_t count = std::min(size, this->available());
+			if (count == 0) {
+				return 0;
+			}
+
+			std::size_t offset = (std::size_t)(position & (IN_PROCESS_RING_SIZE - 1));
+			std::size_t first = std::min(count, IN_PROCESS_RING_SIZE - offset);
+			std::memcpy(buffer, this->data.get() + offset, first);
+			std::memcpy(buffer + first, this->data.get(), count - first);
+			this->head.store(position + count);
+
+			if (this->writer_waiting.load() && this->writer_waiting.exchange(false)) {
+				this->writable.ring();
+			}
+			return count;
+		}
+
+		/* Wait until the ring has something to read or is closed. The consumer's doorbell is cleared */
+		void wait_readable() {
+			this->readable->clear();
+			if (this->available() == 0 && !this->is_closed()) {
+				this->readable->wait();
+			}
+		}
+
+		/*
+		Copy up to size bytes in without publishing them.
+		@return How many were copied, which is 0 if the ring is full
+		@throws SendException if the ring is closed
+		*/
+		std::size_t write(const NETWORK_BYTE* bytes, std::size_t size) {
+			if (this->is_closed()) {
+				throw SendException(std::to_string(EPIPE));
+			}
+
+			uint64_t position = this->unpublished_tail;
+			std::size_t space = IN_PROCESS_RING_SIZE - (std::size_t)(position - this->head.load(std::memory_order_acquire));
+			std::size_t count = std::min(size, space);
+
+			std::size_t offset = (std::size_t)(position & (IN_PROCESS_RING_SIZE - 1));
+			std::size_t first = std::min(count, IN_PROCESS_RING_SIZE - offset);
+			std::memcpy(this->data.get() + offset, bytes, first);
+			std::memcpy(this->data.get(), bytes + first, count - first);
+			this->unpublished_tail = position + count;
+			return count;
+		}
+
+		/* Make everything written visible to the consumer, waking it if the ring was empty */
+		void publish() {
+			uint64_t published = this->tail.load(std::memory_order_relaxed);
+			if (published == this->unpublished_tail) {
+				return;
+			}
+
+			this->tail.store(this->unpublished_tail);
+			if (this->head.load() == published) {
+				this->readable->ring();
+			}
+		}
+
+		/* Wait until the consumer makes space or the ring is closed */
+		void wait_writable() {
+			this->writer_waiting.store(true);
+			if (this->unpublished_tail - this->head.load() < IN_PROCESS_RING_SIZE || this->is_closed()) {
+				this->writer_waiting.store(false);
+				return;
+			}
+
+			this->writable.wait();
+			this->writable.clear();
+			this->writer_waiting.store(false);
+		}
+	};
+
+	/* The server's end of a connection which has not been accepted yet */
+	struct InProcessEndpoint {
+		std::shared_ptr<InProcessDoorbell> doorbell;
+		std::shared_ptr<InProcessRing> inbound;
+		std::shared_ptr<InProcessRing> outbound;
+	};
+
+	struct InProcessListenQueue {
+		std::shared_ptr<InProcessDoorbell> doorbell; /** < The listener's doorbell, rung on each connect */
+		std::deque<InProcessEndpoint> pending;
+		std::size_t backlog; /** < 0 until the listener calls listen() */
+	};
+
+	/* Every bound port, and every accepted endpoint waiting for its SocketConnection */
+	struct InProcessRegistry {
+		std::mutex mutex;
+		std::unordered_map<std::string, std::shared_ptr<InProcessListenQueue>> listeners;
+		std::unordered_map<SOCKET, InProcessEndpoint> accepted;
+	};
+
+	/* Never destroyed, so connections which outlive main() can still unregister */
+	static InProcessRegistry& get_registry() {
+		static InProcessRegistry* registry = new InProcessRegistry();
+		return *registry;
+	}
+
+	InProcessSocketConnection::InProcessSocketConnection(std::shared_ptr<InProcessDoorbell> doorbell) :
+		ChanneledSocketConnection(doorbell->duplicate(), AF_UNIX, SOCK_STREAM, 0), doorbell(doorbell) {}
+
+	InProcessSocketConnection::InProcessSocketConnection() :
+		InProcessSocketConnection(std::make_shared<InProcessDoorbell>()) {}
+
+	InProcessSocketConnection::InProcessSocketConnection(SOCKET descriptor) :
+		ChanneledSocketConnection(descriptor, AF_UNIX, SOCK_STREAM, 0) {
+
+		InProcessRegistry& registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		auto endpoint = registry.accepted.find(descriptor);
+		if (endpoint == registry.accepted.end()) {
+			throw CreateException(std::to_string(EBADF));
+		}
+
+		this->doorbell = endpoint->second.doorbell;
+		this->inbound = endpoint->second.inbound;
+		this->outbound = endpoint->second.outbound;
+		registry.accepted.erase(endpoint);
+	}
+
+	InProcessSocketConnection::~InProcessSocketConnection() {
+		if (this->inbound) {
+			this->inbound->close();
+			this->outbound->close();
+		}
+
+		if (this->listen_queue) {
+			InProcessRegistry& registry = get_registry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.listeners.erase(this->bound_port);
+
+			/* Connections nobody accepted are closed, as a kernel would reset them */
+			for (InProcessEndpoint& endpoint : this->listen_queue->pending) {
+				endpoint.inbound->close();
+				endpoint.outbound->close();
+			}
+			this->listen_queue->pending.clear();
+		}
+	}
+
+	bool InProcessSocketConnection::consume_wakeup() {
+		if (this->listen_queue) {
+			/* Connects ring under the lock, so the doorbell can be left set while any are waiting */
+			std::lock_guard<std::mutex> lock(get_registry().mutex);
+			if (this->listen_queue->pending.empty()) {
+				this->doorbell->clear();
+				return false;
+			}
+			return true;
+		}
+
+		/* Clear before looking, so that anything published from now on rings again */
+		this->doorbell->clear();
+		return this->inbound && (this->inbound->available() > 0 || this->inbound->is_closed());
+	}
+
+	void InProcessSocketConnection::send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const {
+		SEND_VECTOR vector;
+		set_send_vector(&vector, bytes, num_bytes);
+		this->send_vectored(&vector, 1);
+	}
+
+	void InProcessSocketConnection::send_vectored(SEND_VECTOR* vectors, int count) const {
+		if (!this->outbound) {
+			throw SendException(std::to_string(ENOTCONN));
+		}
+
+		/* The whole frame is published at once unless it does not fit */
+		NETWORK_BYTE_SIZE num_bytes_sent = 0;
+		for (int index = 0; index < count; index++) {
+			const NETWORK_BYTE* bytes = (const NETWORK_BYTE*)vectors[index].iov_base;
+			std::size_t remaining = vectors[index].iov_len;
+
+			while (remaining > 0) {
+				std::size_t written = this->outbound->write(bytes, remaining);
+				if (written == 0) {
+					this->outbound->publish();
+					this->outbound->wait_writable();
+					continue;
+				}
+
+				bytes += written;
+				remaining -= written;
+			}
+			num_bytes_sent += vectors[index].iov_len;
+		}
+
+		this->outbound->publish();
+		this->record_send(num_bytes_sent);
+	}
+
+	bool InProcessSocketConnection::receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		if (!this->inbound) {
+			throw ReceiveException(std::to_string(ENOTCONN));
+		}
+
+		NETWORK_BYTE_SIZE num_bytes_recvd = 0;
+		while (num_bytes_recvd < num_bytes) {
+			std::size_t read = this->inbound->read(buffer + num_bytes_recvd, num_bytes - num_bytes_recvd);
+			if (read > 0) {
+				num_bytes_recvd += read;
+				continue;
+			}
+
+			/* The peer may have published its last bytes just before closing */
+			if (this->inbound->is_closed()) {
+				if (this->inbound->available() == 0) {
+					return false;
+				}
+				continue;
+			}
+
+			this->inbound->wait_readable();
+		}
+
+		this->record_receive(num_bytes);
+		return true;
+	}
+
+	NETWORK_BYTE_SIZE InProcessSocketConnection::buffered_bytes() const {
+		return this->inbound ? this->inbound->available() : 0;
+	}
+
+	void InProcessSocketConnection::connect(std::string, std::string port) {
+		InProcessRegistry& registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		auto listener = registry.listeners.find(port);
+		if (listener == registry.listeners.end() || listener->second->pending.size() >= listener->second->backlog) {
+			throw ConnectException(std::to_string(ECONNREFUSED));
+		}
+
+		InProcessEndpoint peer;
+		peer.doorbell = std::make_shared<InProcessDoorbell>();
+		this->inbound = std::make_shared<InProcessRing>(this->doorbell);
+		this->outbound = std::make_shared<InProcessRing>(peer.doorbell);
+		peer.inbound = this->outbound;
+		peer.outbound = this->inbound;
+
+		listener->second->pending.push_back(peer);
+		listener->second->doorbell->ring();
+	}
+
+	void InProcessSocketConnection::bind(std::string port, std::string) {
+		InProcessRegistry& registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		if (this->listen_queue || registry.listeners.count(port) != 0) {
+			throw BindException(std::to_string(EADDRINUSE));
+		}
+
+		this->listen_queue = std::make_shared<InProcessListenQueue>();
+		this->listen_queue->doorbell = this->doorbell;
+		this->listen_queue->backlog = 0;
+		this->bound_port = port;
+		registry.listeners[port] = this->listen_queue;
+	}
+
+	void InProcessSocketConnection::listen(int queue) const {
+		if (!this->listen_queue) {
+			throw ListenException(std::to_string(EINVAL));
+		}
+
+		std::lock_guard<std::mutex> lock(get_registry().mutex);
+		this->listen_queue->backlog = (std::size_t)std::max(queue, 1);
+	}
+
+	SOCKET InProcessSocketConnection::accept_descriptor(struct sockaddr_storage* address, SOCKET_LEN* address_len) const {
+		if (!this->listen_queue) {
+			throw AcceptException(std::to_string(EINVAL));
+		}
+
+		InProcessRegistry& registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		if (this->listen_queue->pending.empty()) {
+			return INVALID_SOCKET;
+		}
+
+		InProcessEndpoint endpoint = this->listen_queue->pending.front();
+		this->listen_queue->pending.pop_front();
+
+		SOCKET descriptor = endpoint.doorbell->duplicate();
+		registry.accepted[descriptor] = endpoint;
+
+		std::memset(address, 0, sizeof(struct sockaddr_storage));
+		address->ss_family = AF_UNIX;
+		*address_len = sizeof(address->ss_family);
+		return descriptor;
+	}
+
+	void InProcessSocketConnection::set_nonblocking(bool) {}
+}
+
+#endif
@@ -0,0 +1,270 @@
+#include "metrics.h"
+
+#include <sstream>
+
+namespace SunNet {
+	ChannelMetrics Metrics::channels[CHANNEL_ID_COUNT];
+	GlobalMetrics Metrics::global;
+	LatencyMetrics Metrics::latency;
+	std::atomic<ChannelLatency*> Metrics::channel_latencies[CHANNEL_ID_COUNT];
+
+	uint64_t LatencyHistogram::percentile(double quantile) const {
+		uint64_t total = this->count.load(std::memory_order_relaxed);
+		if (total == 0) {
+			return 0;
+		}
+
+		uint64_t rank = (uint64_t)(quantile * (double)total);
+		if (rank >= total) {
+			rank = total - 1;
+		}
+
+		uint64_t seen = 0;
+		for (std::size_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+			seen += this->buckets[bucket].load(std::memory_order_relaxed);
+			if (seen > rank) {
+				/* Never report more than the largest value actually recorded */
+				uint64_t limit = bucket_limit(bucket);
+				uint64_t recorded_max = this->max.load(std::memory_order_relaxed);
+				return CycleClock::to_nanoseconds(limit < recorded_max ? limit : recorded_max);
+			}
+		}
+
+		return CycleClock::to_nanoseconds(this->max.load(std::memory_order_relaxed));
+	}
+
+	HistogramSnapshot LatencyHistogram::snapshot() const {
+		return HistogramSnapshot{
+			this->count.load(std::memory_order_relaxed),
+			CycleClock::to_nanoseconds(this->sum.load(std::memory_order_relaxed)),
+			CycleClock::to_nanoseconds(this->max.load(std::memory_order_relaxed)),
+			this->percentile(0.5),
+			this->percentile(0.9),
+			this->percentile(0.99),
+			this->percentile(0.999)
+		};
+	}
+
+	void LatencyHistogram::reset() {
+		for (std::atomic<uint64_t>& bucket : this->buckets) {
+			bucket.store(0, std::memory_order_relaxed);
+		}
+		this->count.store(0, std::memory_order_relaxed);
+		this->sum.store(0, std::memory_order_relaxed);
+		this->max.store(0, std::memory_order_relaxed);
+	}
+
+	ChannelLatency& Metrics::allocate_channel_latency(CHANNEL_ID channel_id) {
+		ChannelLatency* latency = new ChannelLatency();
+		ChannelLatency* existing = nullptr;
+
+		/* Another thread may have got there first */
+		if (!Metrics::channel_latencies[channel_id].compare_exchange_strong(existing, latency, std::memory_order_acq_rel)) {
+			delete latency;
+			return *existing;
+		}
+
+		return *latency;
+	}
+
+	MetricsSnapshot Metrics::snapshot() {
+		MetricsSnapshot snapshot;
+		snapshot.poll_iterations = Metrics::global.poll_iterations.get();
+		snapshot.ready_events = Metrics::global.ready_events.get();
+		snapshot.dispatch_errors = Metrics::global.dispatch_errors.get();
+		snapshot.unhandled_messages = Metrics::global.unhandled_messages.get();
+		snapshot.read_budget_exhaustions = Metrics::global.read_budget_exhaustions.get();
+		snapshot.accepted_connections = Metrics::global.accepted_connections.get();
+		snapshot.deferred_accepts = Metrics::global.deferred_accepts.get();
+		snapshot.rejected_connections = Metrics::global.rejected_connections.get();
+		snapshot.receive_calls = Metrics::global.receive_calls.get();
+		snapshot.send_calls = Metrics::global.send_calls.get();
+		snapshot.trace_sequence_gaps = Metrics::global.trace_sequence_gaps.get();
+		snapshot.dropped_datagrams = Metrics::global.dropped_datagrams.get();
+		snapshot.retransmissions = Metrics::global.retransmissions.get();
+		snapshot.zerocopy_sends = Metrics::global.zerocopy_sends.get();
+		snapshot.zerocopy_copies = Metrics::global.zerocopy_copies.get();
+		snapshot.ingress_drops = Metrics::global.ingress_drops.get();
+		snapshot.bad_channel_frames = Metrics::global.bad_channel_frames.get();
+		snapshot.resumed_sessions = Metrics::global.resumed_sessions.get();
+		snapshot.replayed_messages = Metrics::global.replayed_messages.get();
+
+		for (std::size_t id = 0; id < CHANNEL_ID_COUNT; id++) {
+			const ChannelMetrics& channel = Metrics::channels[id];
+			ChannelMetricsSnapshot channel_snapshot{
+				(CHANNEL_ID)id,
+				channel.messages_received.get(),
+				channel.bytes_received.get(),
+				channel.messages_sent.get(),
+				channel.bytes_sent.get(),
+				HistogramSnapshot{},
+				HistogramSnapshot{}
+			};
+
+			ChannelLatency* latency = Metrics::channel_latencies[id].load(std::memory_order_acquire);
+			if (latency != nullptr) {
+				channel_snapshot.one_way_latency = latency->one_way.snapshot();
+				channel_snapshot.round_trip_latency = latency->round_trip.snapshot();
+			}
+
+			if (channel_snapshot.messages_received != 0 || channel_snapshot.messages_sent != 0) {
+				snapshot.channels.push_back(channel_snapshot);
+			}
+		}
+
+		snapshot.poll_time = Metrics::latency.poll_time.snapshot();
+		snapshot.dispatch_delay = Metrics::latency.dispatch_delay.snapshot();
+		snapshot.loop_lag = CycleClock::to_nanoseconds(Metrics::latency.loop_lag.get());
+		snapshot.max_loop_lag = CycleClock::to_nanoseconds(Metrics::latency.max_loop_lag.get());
+		snapshot.slow_handlers = Metrics::latency.slow_handlers.get();
+		snapshot.last_slow_channel = (CHANNEL_ID)Metrics::latency.last_slow_channel.get();
+
+		return snapshot;
+	}
+
+	static void write_counter(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " counter\n";
+		out << name << " " << value << "\n";
+	}
+
+	static void write_channel_counter(std::ostringstream& out, const MetricsSnapshot& snapshot, const char* name,
+		const char* help, uint64_t ChannelMetricsSnapshot::* field) {
+
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " counter\n";
+		for (const ChannelMetricsSnapshot& channel : snapshot.channels) {
+			out << name << "{channel=\"" << (unsigned)channel.channel_id << "\"} " << channel.*field << "\n";
+		}
+	}
+
+	static void write_gauge_seconds(std::ostringstream& out, const char* name, const char* help, uint64_t nanoseconds) {
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " gauge\n";
+		out << name << " " << nanoseconds / 1e9 << "\n";
+	}
+
+	/* Histograms are exposed as summaries, since their buckets are too fine to be worth exporting */
+	static void write_summary_seconds(std::ostringstream& out, const char* name, const char* help, const HistogramSnapshot& histogram) {
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " summary\n";
+		out << name << "{quantile=\"0.5\"} " << histogram.p50 / 1e9 << "\n";
+		out << name << "{quantile=\"0.9\"} " << histogram.p90 / 1e9 << "\n";
+		out << name << "{quantile=\"0.99\"} " << histogram.p99 / 1e9 << "\n";
+		out << name << "{quantile=\"0.999\"} " << histogram.p999 / 1e9 << "\n";
+		out << name << "_sum " << histogram.sum / 1e9 << "\n";
+		out << name << "_count " << histogram.count << "\n";
+	}
+
+	static void write_channel_summary_seconds(std::ostringstream& out, const MetricsSnapshot& snapshot, const char* name,
+		const char* help, HistogramSnapshot ChannelMetricsSnapshot::* field) {
+
+		out << "# HELP " << name << " " << help << "\n";
+		out << "# TYPE " << name << " summary\n";
+		for (const ChannelMetricsSnapshot& channel : snapshot.channels) {
+			const HistogramSnapshot& histogram = channel.*field;
+			if (histogram.count == 0) {
+				continue;
+			}
+
+			unsigned channel_id = channel.channel_id;
+			out << name << "{channel=\"" << channel_id << "\",quantile=\"0.5\"} " << histogram.p50 / 1e9 << "\n";
+			out << name << "{channel=\"" << channel_id << "\",quantile=\"0.99\"} " << histogram.p99 / 1e9 << "\n";
+			out << name << "{channel=\"" << channel_id << "\",quantile=\"0.999\"} " << histogram.p999 / 1e9 << "\n";
+			out << name << "_sum{channel=\"" << channel_id << "\"} " << histogram.sum / 1e9 << "\n";
+			out << name << "_count{channel=\"" << channel_id << "\"} " << histogram.count << "\n";
+		}
+	}
+
+	std::string Metrics::prometheus() {
+		MetricsSnapshot snapshot = Metrics::snapshot();
+		std::ostringstream out;
+
+		write_counter(out, "sunnet_poll_iterations_total", "Calls to poll", snapshot.poll_iterations);
+		write_counter(out, "sunnet_ready_events_total", "Sockets reported ready by poll", snapshot.ready_events);
+		write_counter(out, "sunnet_dispatch_errors_total", "Exceptions which escaped while dispatching a message", snapshot.dispatch_errors);
+		write_counter(out, "sunnet_unhandled_messages_total", "Messages on channels with no subscriber", snapshot.unhandled_messages);
+		write_counter(out, "sunnet_read_budget_exhaustions_total", "Connections with data left after their read budget", snapshot.read_budget_exhaustions);
+		write_counter(out, "sunnet_accepted_connections_total", "Connections accepted", snapshot.accepted_connections);
+		write_counter(out, "sunnet_deferred_accepts_total", "Times accepting was put off by admission control", snapshot.deferred_accepts);
+		write_counter(out, "sunnet_rejected_connections_total", "Connections closed by the per-address cap, or UDP clients refused by the client cap", snapshot.rejected_connections);
+		write_counter(out, "sunnet_receive_calls_total", "Receive system calls", snapshot.receive_calls);
+		write_counter(out, "sunnet_send_calls_total", "Send system calls", snapshot.send_calls);
+		write_counter(out, "sunnet_trace_sequence_gaps_total", "Traced frames missing from the sequence", snapshot.trace_sequence_gaps);
+		write_counter(out, "sunnet_dropped_datagrams_total", "Datagrams dropped while receiving or sending", snapshot.dropped_datagrams);
+		write_counter(out, "sunnet_retransmissions_total", "Reliable messages sent again after going unacknowledged", snapshot.retransmissions);
+		write_counter(out, "sunnet_zerocopy_sends_total", "Payloads sent without copying them into the kernel", snapshot.zerocopy_sends);
+		write_counter(out, "sunnet_zerocopy_copies_total", "Zero-copy sends the kernel copied after all", snapshot.zerocopy_copies);
+		write_counter(out, "sunnet_ingress_drops_total", "Frames turned away by ingress limits", snapshot.ingress_drops);
+		write_counter(out, "sunnet_bad_channel_frames_total", "Frames on unregistered channel ids or which broke the protocol", snapshot.bad_channel_frames);
+		write_counter(out, "sunnet_resumed_sessions_total", "Sessions carried on over a new connection", snapshot.resumed_sessions);
+		write_counter(out, "sunnet_replayed_messages_total", "Messages resent when a session was resumed", snapshot.replayed_messages);
+
+		write_channel_counter(out, snapshot, "sunnet_channel_messages_received_total", "Messages received per channel",
+			&ChannelMetricsSnapshot::messages_received);
+		write_channel_counter(out, snapshot, "sunnet_channel_bytes_received_total", "Bytes received per channel, framing included",
+			&ChannelMetricsSnapshot::bytes_received);
+		write_channel_counter(out, snapshot, "sunnet_channel_messages_sent_total", "Messages sent per channel",
+			&ChannelMetricsSnapshot::messages_sent);
+		write_channel_counter(out, snapshot, "sunnet_channel_bytes_sent_total", "Bytes sent per channel, framing included",
+			&ChannelMetricsSnapshot::bytes_sent);
+
+		write_channel_summary_seconds(out, snapshot, "sunnet_channel_one_way_latency_seconds",
+			"One-way latency of traced messages per channel", &ChannelMetricsSnapshot::one_way_latency);
+		write_channel_summary_seconds(out, snapshot, "sunnet_channel_round_trip_latency_seconds",
+			"Round-trip latency of traced messages per channel", &ChannelMetricsSnapshot::round_trip_latency);
+
+		write_summary_seconds(out, "sunnet_poll_seconds", "Time spent inside the OS poll call", snapshot.poll_time);
+		write_summary_seconds(out, "sunnet_dispatch_delay_seconds", "Time from poll returning to a ready socket being handled",
+			snapshot.dispatch_delay);
+		write_gauge_seconds(out, "sunnet_loop_lag_seconds", "Time the last poll cycle spent handling sockets", snapshot.loop_lag);
+		write_gauge_seconds(out, "sunnet_max_loop_lag_seconds", "The longest any poll cycle spent handling sockets", snapshot.max_loop_lag);
+		write_counter(out, "sunnet_slow_handlers_total", "Subscription callbacks slower than the threshold", snapshot.slow_handlers);
+
+		return out.str();
+	}
+
+	void Metrics::reset() {
+		for (ChannelMetrics& channel : Metrics::channels) {
+			channel.messages_received.reset();
+			channel.bytes_received.reset();
+			channel.messages_sent.reset();
+			channel.bytes_sent.reset();
+		}
+
+		Metrics::global.poll_iterations.reset();
+		Metrics::global.ready_events.reset();
+		Metrics::global.dispatch_errors.reset();
+		Metrics::global.unhandled_messages.reset();
+		Metrics::global.read_budget_exhaustions.reset();
+		Metrics::global.accepted_connections.reset();
+		Metrics::global.deferred_accepts.reset();
+		Metrics::global.rejected_connections.reset();
+		Metrics::global.receive_calls.reset();
+		Metrics::global.send_calls.reset();
+		Metrics::global.trace_sequence_gaps.reset();
+		Metrics::global.dropped_datagrams.reset();
+		Metrics::global.retransmissions.reset();
+		Metrics::global.zerocopy_sends.reset();
+		Metrics::global.zerocopy_copies.reset();
+		Metrics::global.ingress_drops.reset();
+		Metrics::global.bad_channel_frames.reset();
+		Metrics::global.resumed_sessions.reset();
+		Metrics::global.replayed_messages.reset();
+
+		Metrics::latency.poll_time.reset();
+		Metrics::latency.dispatch_delay.reset();
+		Metrics::latency.loop_lag.set(0);
+		Metrics::latency.max_loop_lag.set(0);
+		Metrics::latency.slow_handlers.reset();
+		Metrics::latency.last_slow_channel.set(0);
+
+		for (std::atomic<ChannelLatency*>& latency : Metrics::channel_latencies) {
+			ChannelLatency* histograms = latency.load(std::memory_order_acquire);
+			if (histograms != nullptr) {
+				histograms->one_way.reset();
+				histograms->round_trip.reset();
+			}
+		}
+	}
+}
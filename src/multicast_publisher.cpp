@@ -0,0 +1,126 @@
+#include "multicast_publisher.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+namespace SunNet {
+
+	MulticastPublisher::MulticastPublisher(std::string group_address, std::string port, std::string interface_address, int poll_timeout) :
+		poll_service(poll_timeout), group_address(group_address), port(port), interface_address(interface_address), ttl(1),
+		history_size(MULTICAST_DEFAULT_HISTORY), state(CLOSED), session_timer(INVALID_TIMER_ID) {}
+
+	MulticastPublisher::~MulticastPublisher() {
+		this->state = DESTRUCTING;
+		this->group.reset();
+		this->connection.reset();
+	}
+
+	void MulticastPublisher::state_transition(std::initializer_list<ServerState> const& valid_from_states, ServerState new_state) {
+		for (const ServerState& valid_from_state : valid_from_states) {
+			if (this->state == valid_from_state) {
+				this->state = new_state;
+				return;
+			}
+		}
+
+		throw InvalidStateTransitionException();
+	}
+
+	void MulticastPublisher::open() {
+		this->state_transition({ CLOSED }, OPEN);
+
+		std::shared_ptr<UDPSocketConnection> connection = std::make_shared<UDPSocketConnection>();
+		connection->bind("0", this->interface_address);
+		connection->set_multicast_interface(this->interface_address);
+		connection->set_multicast_ttl(this->ttl);
+		connection->set_multicast_loopback(true);
+		connection->set_nonblocking(true);
+
+		this->connection = connection;
+		this->group = std::make_shared<MulticastGroup>(connection, UDPAddress::resolve(this->group_address, this->port), this->history_size);
+		this->poll_service.add_socket(this->connection);
+	}
+
+	void MulticastPublisher::serve() {
+		this->state_transition({ OPEN }, SERVE);
+
+		/* Lets subscribers notice records lost at the end of a burst, when nothing follows them */
+		this->session_timer = this->schedule_repeating_timer(MULTICAST_SESSION_INTERVAL, [this]() {
+			if (this->group->has_sent()) {
+				this->group->announce(nullptr);
+			}
+		});
+	}
+
+	void MulticastPublisher::close() {
+		this->state_transition({ SERVE, OPEN, CLOSED }, CLOSED);
+
+		this->flush();
+		this->cancel_timer(this->session_timer);
+		this->session_timer = INVALID_TIMER_ID;
+
+		this->poll_service.clear_sockets();
+		this->group.reset();
+		this->connection.reset();
+	}
+
+	bool MulticastPublisher::poll() {
+		if (this->state != SERVE) {
+			return false;
+		}
+		const PollEventList& ready_sockets = this->poll_service.poll();
+
+		bool received = false;
+		for (const PollEvent& event : ready_sockets) {
+			if (this->state != SERVE) {
+				return false;
+			}
+
+			/* An error is a subscriber's repair port refusing a repair, which concerns nobody else */
+			this->read_nacks();
+			received = received || event.status == SOCKET_STATUS_NORMAL;
+		}
+
+		this->flush();
+		SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
+		return received;
+	}
+
+	void MulticastPublisher::flush() {
+		if (this->group) {
+			this->group->finish();
+			this->connection->flush();
+		}
+	}
+
+	void MulticastPublisher::read_nacks() {
+		while (true) {
+			int count;
+			try {
+				count = this->connection->receive_datagrams();
+			}
+			catch (ReceiveException&) {
+				continue;
+			}
+
+			for (int index = 0; index < count; index++) {
+				UDPDatagram datagram = this->connection->get_datagram(index);
+				try {
+					if (datagram.truncated) {
+						throw ReceiveException(std::to_string(EMSGSIZE));
+					}
+					this->group->handle_nacks(datagram);
+				}
+				catch (ReceiveException&) {
+					this->connection->count_dropped_datagram();
+				}
+			}
+
+			/* A short batch means the socket is empty */
+			if (count < UDP_BATCH_SIZE) {
+				return;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,351 @@
+#include "multicast_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include <random>
+
+namespace SunNet {
+
+	MulticastGroup::MulticastGroup(std::shared_ptr<UDPSocketConnection> socket, const UDPAddress& group, size_t history_size) :
+		ChanneledSocketConnection(INVALID_SOCKET, AF_INET, SOCK_DGRAM, IPPROTO_UDP), socket(socket), group(group),
+		session(std::random_device()()), record(MULTICAST_HEADER_SIZE + MULTICAST_MAX_PAYLOAD), payload_size(0),
+		record_flags(0), history(std::max(history_size, (size_t)1)), next_sequence(0), repairs(0) {}
+
+	void MulticastGroup::finish_record(bool ends_mid_frame) const {
+		if (ends_mid_frame) {
+			this->record_flags |= MULTICAST_ENDS_MID_FRAME;
+		}
+
+		MulticastHeader header{ MULTICAST_DATA, this->record_flags, this->session, this->next_sequence, (uint16_t)this->payload_size };
+		header.write(this->record.data());
+
+		std::vector<NETWORK_BYTE>& kept = this->history[this->next_sequence % this->history.size()];
+		kept.assign(this->record.begin(), this->record.begin() + MULTICAST_HEADER_SIZE + this->payload_size);
+		this->socket->queue_datagram(&this->group, kept.data(), kept.size(), nullptr, 0);
+
+		this->next_sequence++;
+		this->payload_size = 0;
+		this->record_flags = ends_mid_frame ? MULTICAST_STARTS_MID_FRAME : 0;
+	}
+
+	void MulticastGroup::finish() const {
+		if (this->payload_size > 0) {
+			this->finish_record(false);
+		}
+	}
+
+	void MulticastGroup::send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const {
+		SEND_VECTOR vector;
+		set_send_vector(&vector, bytes, num_bytes);
+		this->send_vectored(&vector, 1);
+	}
+
+	void MulticastGroup::send_vectored(SEND_VECTOR* vectors, int count) const {
+		NETWORK_BYTE_SIZE num_bytes = 0;
+		for (int index = 0; index < count; index++) {
+			num_bytes += vectors[index].iov_len;
+		}
+
+		/* A frame which fits in one record is never split, so a lost record only costs the frames in it */
+		if (this->payload_size + num_bytes > MULTICAST_MAX_PAYLOAD && num_bytes <= MULTICAST_MAX_PAYLOAD) {
+			this->finish();
+		}
+
+		for (int index = 0; index < count; index++) {
+			const NETWORK_BYTE* bytes = (const NETWORK_BYTE*)vectors[index].iov_base;
+			NETWORK_BYTE_SIZE remaining = vectors[index].iov_len;
+			while (remaining > 0) {
+				if (this->payload_size == MULTICAST_MAX_PAYLOAD) {
+					this->finish_record(true);
+				}
+
+				NETWORK_BYTE_SIZE chunk = std::min(remaining, MULTICAST_MAX_PAYLOAD - this->payload_size);
+				std::memcpy(this->record.data() + MULTICAST_HEADER_SIZE + this->payload_size, bytes, chunk);
+				this->payload_size += chunk;
+				bytes += chunk;
+				remaining -= chunk;
+			}
+		}
+
+		this->record_send(num_bytes);
+	}
+
+	bool MulticastGroup::receive(NETWORK_BYTE*, NETWORK_BYTE_SIZE) const {
+		throw ReceiveException(std::to_string(EOPNOTSUPP));
+	}
+
+	void MulticastGroup::announce(const UDPAddress* to) const {
+		NETWORK_BYTE announcement[MULTICAST_HEADER_SIZE + sizeof(uint32_t)];
+		MulticastHeader{ MULTICAST_SESSION, 0, this->session, this->next_sequence, sizeof(uint32_t) }.write(announcement);
+		uint32_t oldest = this->oldest_sequence();
+		std::memcpy(announcement + MULTICAST_HEADER_SIZE, &oldest, sizeof(uint32_t));
+		this->socket->queue_datagram(to == nullptr ? &this->group : to, announcement, sizeof(announcement), nullptr, 0);
+	}
+
+	void MulticastGroup::handle_nacks(const UDPDatagram& datagram) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now >= this->repair_interval_end) {
+			this->repairs_by_host.clear();
+			this->repair_interval_end = now + MULTICAST_NACK_INTERVAL;
+		}
+		uint64_t host = AddressTable::key_of(datagram.sender->storage);
+
+		const NETWORK_BYTE* bytes = datagram.bytes;
+		NETWORK_BYTE_SIZE remaining = datagram.size;
+		while (remaining > 0) {
+			if (remaining < MULTICAST_HEADER_SIZE + sizeof(uint32_t)) {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+			MulticastHeader header = MulticastHeader::read(bytes);
+			if (header.type != MULTICAST_NACK || header.length != sizeof(uint32_t)) {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+
+			uint32_t count;
+			std::memcpy(&count, bytes + MULTICAST_HEADER_SIZE, sizeof(uint32_t));
+			bytes += MULTICAST_HEADER_SIZE + sizeof(uint32_t);
+			remaining -= MULTICAST_HEADER_SIZE + sizeof(uint32_t);
+
+			/* A NACK from before a restart cannot be answered */
+			if (header.session != this->session) {
+				this->announce(datagram.sender);
+				continue;
+			}
+
+			uint32_t first = header.sequence;
+			uint32_t last = first + std::min(count, (uint32_t)this->history.size());
+			if ((int32_t)(first - this->oldest_sequence()) < 0) {
+				this->announce(datagram.sender);
+				first = this->oldest_sequence();
+			}
+			if ((int32_t)(last - this->next_sequence) > 0) {
+				last = this->next_sequence;
+			}
+
+			uint32_t allowed = MULTICAST_MAX_REPAIRS_PER_NACK;
+			if (host != 0) {
+				allowed = std::min(allowed, MULTICAST_REPAIR_BUDGET - std::min(MULTICAST_REPAIR_BUDGET, this->repairs_by_host.count(host)));
+			}
+
+			for (uint32_t sequence = first; (int32_t)(last - sequence) > 0 && allowed > 0; sequence++, allowed--) {
+				const std::vector<NETWORK_BYTE>& kept = this->history[sequence % this->history.size()];
+				this->socket->queue_datagram(datagram.sender, kept.data(), kept.size(), nullptr, 0);
+				if (host != 0) {
+					this->repairs_by_host.increment(host);
+				}
+				this->repairs++;
+				SUNNET_METRICS_ONLY(Metrics::global.retransmissions.add());
+			}
+		}
+	}
+
+	MulticastSource::MulticastSource(std::shared_ptr<UDPSocketConnection> repair_socket) :
+		ChanneledSocketConnection(INVALID_SOCKET, AF_INET, SOCK_DGRAM, IPPROTO_UDP), repair_socket(repair_socket),
+		has_session(false), session(0), expected_sequence(0), known_next_sequence(0), read_offset(0), complete_end(0),
+		resynchronizing(true), lost_records(0), nacks_sent(0) {
+
+		std::memset(&this->publisher, 0, sizeof(this->publisher));
+	}
+
+	void MulticastSource::reset(uint32_t session, uint32_t sequence) {
+		this->has_session = true;
+		this->session = session;
+		this->expected_sequence = sequence;
+		this->known_next_sequence = sequence;
+		this->held.clear();
+		this->frames.resize(this->complete_end);
+		this->resynchronizing = true;
+	}
+
+	void MulticastSource::accept_datagram(const UDPDatagram& datagram) {
+		const NETWORK_BYTE* bytes = datagram.bytes;
+		NETWORK_BYTE_SIZE remaining = datagram.size;
+		while (remaining > 0) {
+			if (remaining < MULTICAST_HEADER_SIZE) {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+			MulticastHeader header = MulticastHeader::read(bytes);
+			if (remaining - MULTICAST_HEADER_SIZE < header.length) {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+
+			/* Only the source of a session being joined becomes the publisher, so that stray records cannot redirect NACKs */
+			const NETWORK_BYTE* payload = bytes + MULTICAST_HEADER_SIZE;
+			bool joining = !this->has_session || header.session != this->session;
+			if (header.type == MULTICAST_DATA) {
+				this->accept_data(header, payload);
+			}
+			else if (header.type == MULTICAST_SESSION) {
+				if (header.length != sizeof(uint32_t)) {
+					throw ReceiveException(std::to_string(EBADMSG));
+				}
+
+				uint32_t oldest_sequence;
+				std::memcpy(&oldest_sequence, payload, sizeof(uint32_t));
+				this->accept_session(header, oldest_sequence);
+			}
+			else {
+				throw ReceiveException(std::to_string(EBADMSG));
+			}
+
+			if (joining) {
+				this->publisher = *datagram.sender;
+			}
+			bytes += MULTICAST_HEADER_SIZE + header.length;
+			remaining -= MULTICAST_HEADER_SIZE + header.length;
+			this->record_receive(MULTICAST_HEADER_SIZE);
+		}
+	}
+
+	void MulticastSource::accept_data(const MulticastHeader& header, const NETWORK_BYTE* payload) {
+		/* Join a new or restarted publisher wherever it is now */
+		if (!this->has_session || header.session != this->session) {
+			this->reset(header.session, header.sequence);
+		}
+
+		uint32_t offset = header.sequence - this->expected_sequence;
+		if ((int32_t)offset < 0) {
+			return;
+		}
+		if (offset >= MULTICAST_RECEIVE_WINDOW) {
+			/* Too far behind to catch up, so give up on everything missing */
+			this->skip_to(header.sequence);
+			offset = 0;
+		}
+
+		if ((int32_t)(header.sequence + 1 - this->known_next_sequence) > 0) {
+			this->known_next_sequence = header.sequence + 1;
+		}
+
+		if (offset == 0) {
+			this->append(header.flags, payload, header.length);
+			this->expected_sequence++;
+			this->release_held();
+		}
+		else if (this->held.find(header.sequence) == this->held.end()) {
+			HeldRecord& record = this->held[header.sequence];
+			record.flags = header.flags;
+			record.payload.assign(payload, payload + header.length);
+		}
+	}
+
+	void MulticastSource::accept_session(const MulticastHeader& header, uint32_t oldest_sequence) {
+		if (!this->has_session || header.session != this->session) {
+			this->reset(header.session, header.sequence);
+			return;
+		}
+
+		/* Records sent since the last one received were all lost, which only the announcement shows */
+		if ((int32_t)(header.sequence - this->known_next_sequence) > 0) {
+			this->known_next_sequence = header.sequence;
+		}
+		if ((int32_t)(oldest_sequence - this->expected_sequence) > 0) {
+			this->skip_to(oldest_sequence);
+		}
+	}
+
+	void MulticastSource::append(NETWORK_BYTE flags, const NETWORK_BYTE* payload, NETWORK_BYTE_SIZE size) {
+		if (this->resynchronizing) {
+			if (flags & MULTICAST_STARTS_MID_FRAME) {
+				return;
+			}
+			this->resynchronizing = false;
+		}
+
+		this->frames.insert(this->frames.end(), payload, payload + size);
+		this->record_receive(size);
+		if (!(flags & MULTICAST_ENDS_MID_FRAME)) {
+			this->complete_end = this->frames.size();
+		}
+	}
+
+	void MulticastSource::release_held() {
+		while (!this->held.empty() && this->held.begin()->first == this->expected_sequence) {
+			HeldRecord& record = this->held.begin()->second;
+			this->append(record.flags, record.payload.data(), record.payload.size());
+			this->held.erase(this->held.begin());
+			this->expected_sequence++;
+		}
+	}
+
+	void MulticastSource::lose_to(uint32_t sequence) {
+		this->lost_records += sequence - this->expected_sequence;
+		this->expected_sequence = sequence;
+
+		/* The frame the gap cut is lost with it */
+		this->frames.resize(this->complete_end);
+		this->resynchronizing = true;
+	}
+
+	void MulticastSource::skip_to(uint32_t sequence) {
+		/* Records held from before the skip were received, so only the holes between them are lost */
+		while (!this->held.empty() && (int32_t)(this->held.begin()->first - sequence) < 0) {
+			if (this->held.begin()->first != this->expected_sequence) {
+				this->lose_to(this->held.begin()->first);
+			}
+			this->release_held();
+		}
+
+		if (this->expected_sequence != sequence && (int32_t)(sequence - this->expected_sequence) > 0) {
+			this->lose_to(sequence);
+		}
+		if ((int32_t)(sequence - this->known_next_sequence) > 0) {
+			this->known_next_sequence = sequence;
+		}
+		this->release_held();
+	}
+
+	void MulticastSource::give_up_gap() {
+		if (this->has_gap()) {
+			this->skip_to(this->held.empty() ? this->known_next_sequence : this->held.begin()->first);
+		}
+	}
+
+	void MulticastSource::send_nacks() {
+		uint32_t first = this->expected_sequence;
+		auto nack = [this](uint32_t first, uint32_t count) {
+			NETWORK_BYTE record[MULTICAST_HEADER_SIZE + sizeof(uint32_t)];
+			MulticastHeader{ MULTICAST_NACK, 0, this->session, first, sizeof(uint32_t) }.write(record);
+			std::memcpy(record + MULTICAST_HEADER_SIZE, &count, sizeof(uint32_t));
+			this->repair_socket->queue_datagram(&this->publisher, record, sizeof(record), nullptr, 0);
+			this->nacks_sent++;
+		};
+
+		for (const auto& held : this->held) {
+			if (held.first != first) {
+				nack(first, held.first - first);
+			}
+			first = held.first + 1;
+		}
+		if ((int32_t)(this->known_next_sequence - first) > 0) {
+			nack(first, this->known_next_sequence - first);
+		}
+	}
+
+	void MulticastSource::discard_read() {
+		this->frames.erase(this->frames.begin(), this->frames.begin() + this->read_offset);
+		this->complete_end -= this->read_offset;
+		this->read_offset = 0;
+	}
+
+	void MulticastSource::send(const NETWORK_BYTE*, NETWORK_BYTE_SIZE) const {
+		throw SendException(std::to_string(EOPNOTSUPP));
+	}
+
+	void MulticastSource::send_vectored(SEND_VECTOR*, int) const {
+		throw SendException(std::to_string(EOPNOTSUPP));
+	}
+
+	bool MulticastSource::receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		if (num_bytes > this->buffered_bytes()) {
+			this->read_offset = this->complete_end;
+			throw ReceiveException(std::to_string(EBADMSG));
+		}
+
+		std::memcpy(buffer, this->frames.data() + this->read_offset, num_bytes);
+		this->read_offset += num_bytes;
+		return true;
+	}
+}
+
+#endif
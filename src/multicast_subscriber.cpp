@@ -0,0 +1,192 @@
+#include "multicast_subscriber.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+namespace SunNet {
+
+	MulticastSubscriber::MulticastSubscriber(int poll_timeout) :
+		poll_service(poll_timeout), state(CLIENT_CLOSED), nack_timer(INVALID_TIMER_ID), nack_attempts(0), nack_gap_start(0) {}
+
+	MulticastSubscriber::~MulticastSubscriber() {
+		this->state = CLIENT_DESTRUCTING;
+		this->publisher.reset();
+		this->group_connection.reset();
+		this->repair_connection.reset();
+	}
+
+	void MulticastSubscriber::state_transition(std::initializer_list<ClientState> const& valid_from_states, ClientState new_state) {
+		for (const ClientState& valid_from_state : valid_from_states) {
+			if (this->state == valid_from_state) {
+				this->state = new_state;
+				return;
+			}
+		}
+
+		throw InvalidStateTransitionException();
+	}
+
+	void MulticastSubscriber::join(std::string group_address, std::string port, std::string interface_address) {
+		if (this->state != CLIENT_CLOSED) {
+			throw InvalidStateTransitionException();
+		}
+
+		/* Binding the group's address keeps out datagrams sent to other groups on the same port */
+		std::shared_ptr<UDPSocketConnection> group_connection = std::make_shared<UDPSocketConnection>();
+		group_connection->set_reuse_address(true);
+		group_connection->bind(port, group_address);
+		group_connection->join_group(group_address, interface_address);
+		group_connection->set_nonblocking(true);
+
+		std::shared_ptr<UDPSocketConnection> repair_connection = std::make_shared<UDPSocketConnection>();
+		repair_connection->bind("0", interface_address);
+		repair_connection->set_nonblocking(true);
+
+		this->group_connection = group_connection;
+		this->repair_connection = repair_connection;
+		this->publisher = std::make_shared<MulticastSource>(repair_connection);
+		this->poll_service.add_socket(this->group_connection);
+		this->poll_service.add_socket(this->repair_connection);
+
+		this->state_transition({ CLIENT_CLOSED }, CLIENT_CONNECTED);
+	}
+
+	void MulticastSubscriber::leave() {
+		this->state_transition({ CLIENT_CONNECTED, CLIENT_CLOSED }, CLIENT_CLOSED);
+
+		this->poll_service.get_timers().cancel(this->nack_timer);
+		this->nack_timer = INVALID_TIMER_ID;
+		if (this->publisher) {
+			this->forgetConnection(this->publisher.get());
+		}
+
+		this->poll_service.clear_sockets();
+		this->publisher.reset();
+		this->group_connection.reset();
+		this->repair_connection.reset();
+	}
+
+	bool MulticastSubscriber::poll() {
+		if (this->state != CLIENT_CONNECTED) {
+			return false;
+		}
+		const PollEventList& ready_sockets = this->poll_service.poll();
+
+		bool received = false;
+		for (const PollEvent& event : ready_sockets) {
+			/* A handler or timer may have left the group */
+			if (this->state != CLIENT_CONNECTED) {
+				return false;
+			}
+
+			SUNNET_METRICS_ONLY(Metrics::latency.dispatch_delay.record_since(this->poll_service.get_poll_return_ticks()));
+			this->read_datagrams(event.handle == this->group_connection->get_handle() ? this->group_connection : this->repair_connection);
+			received = received || event.status == SOCKET_STATUS_NORMAL;
+		}
+
+		if (this->state != CLIENT_CONNECTED) {
+			return false;
+		}
+		if (ready_sockets.empty()) {
+			this->handle_poll_timeout();
+		}
+
+		/* The first NACK waits an interval, since the missing records may only be reordered */
+		if (this->state == CLIENT_CONNECTED && this->publisher->has_gap() && this->nack_timer == INVALID_TIMER_ID) {
+			this->nack_attempts = 0;
+			this->nack_gap_start = this->publisher->get_expected_sequence();
+			this->nack_timer = this->poll_service.get_timers().schedule_repeating(MULTICAST_NACK_INTERVAL, [this]() { this->repair_gap(); });
+		}
+
+		if (this->repair_connection) {
+			this->repair_connection->flush();
+		}
+		SUNNET_METRICS_ONLY(Metrics::record_loop_lag(this->poll_service.get_poll_return_ticks()));
+		return received;
+	}
+
+	void MulticastSubscriber::repair_gap() {
+		if (this->state != CLIENT_CONNECTED || !this->publisher->has_gap()) {
+			this->poll_service.get_timers().cancel(this->nack_timer);
+			this->nack_timer = INVALID_TIMER_ID;
+			return;
+		}
+
+		/* Each gap gets its own attempts */
+		if (this->publisher->get_expected_sequence() != this->nack_gap_start) {
+			this->nack_attempts = 0;
+			this->nack_gap_start = this->publisher->get_expected_sequence();
+		}
+
+		if (this->nack_attempts == MULTICAST_NACK_ATTEMPTS) {
+			this->publisher->give_up_gap();
+			this->nack_attempts = 0;
+			this->nack_gap_start = this->publisher->get_expected_sequence();
+
+			/* Frames held behind the gap are now whole */
+			while (this->publisher->buffered_bytes() > 0 && this->state == CLIENT_CONNECTED) {
+				try {
+					this->handleIncomingMessage(this->publisher);
+				}
+				catch (ReceiveException&) {
+					this->group_connection->count_dropped_datagram();
+				}
+			}
+			if (this->state == CLIENT_CONNECTED) {
+				this->publisher->discard_read();
+			}
+			return;
+		}
+
+		this->publisher->send_nacks();
+		this->nack_attempts++;
+	}
+
+	void MulticastSubscriber::read_datagrams(const std::shared_ptr<UDPSocketConnection>& connection) {
+		while (true) {
+			int count;
+			try {
+				count = connection->receive_datagrams();
+			}
+			catch (ReceiveException&) {
+				this->handle_subscriber_error();
+				return;
+			}
+
+			for (int index = 0; index < count; index++) {
+				UDPDatagram datagram = connection->get_datagram(index);
+				try {
+					if (datagram.truncated) {
+						throw ReceiveException(std::to_string(EMSGSIZE));
+					}
+					this->publisher->accept_datagram(datagram);
+				}
+				catch (ReceiveException&) {
+					connection->count_dropped_datagram();
+				}
+
+				while (this->publisher->buffered_bytes() > 0) {
+					try {
+						this->handleIncomingMessage(this->publisher);
+					}
+					catch (ReceiveException&) {
+						/* A frame ran past what was received, so the rest of it cannot be trusted */
+						connection->count_dropped_datagram();
+					}
+
+					/* The handler may have left the group */
+					if (this->state != CLIENT_CONNECTED) {
+						return;
+					}
+				}
+				this->publisher->discard_read();
+			}
+
+			/* A short batch means the socket is empty */
+			if (count < UDP_BATCH_SIZE) {
+				return;
+			}
+		}
+	}
+}
+
+#endif
@@ -5,89 +5,215 @@
 
 namespace SunNet {
 
-	PollService::PollService(int timeout) : timeout(timeout) {
-		this->results = std::make_shared<SocketCollection>();
-	}
+	/* Marks the end of the free slot list */
+	static const uint32_t NO_FREE_SLOT = UINT32_MAX;
+
+	PollService::PollService(int timeout) : timeout(timeout), free_slot_head(NO_FREE_SLOT), poll_return_ticks(0) {}
 
 	PollService::PollService(const SocketConnection_p socket, int timeout) : PollService(timeout) {
 		this->add_socket(socket);
 	}
 
-	void PollService::add_socket(const SocketConnection_p socket) {
+	size_t PollService::find_dense_index(ConnectionHandle handle) const {
+		if (handle.index >= this->slots.size() || this->slots[handle.index].generation != handle.generation) {
+			return this->descriptors.size();
+		}
+
+		return this->slots[handle.index].dense_index;
+	}
+
+	ConnectionHandle PollService::add_socket(const SocketConnection_p socket) {
+		size_t existing = this->find_dense_index(socket->poll_handle);
+		if (existing != this->descriptors.size() && this->connections[existing] == socket) {
+			return socket->poll_handle;
+		}
+
+		uint32_t slot_index;
+		if (this->free_slot_head != NO_FREE_SLOT) {
+			slot_index = this->free_slot_head;
+			this->free_slot_head = this->slots[slot_index].dense_index;
+		}
+		else {
+			slot_index = (uint32_t)this->slots.size();
+			this->slots.push_back(Slot{ 0, 1 });
+		}
+
 		POLL_DESCRIPTOR poll_descriptor;
 		poll_descriptor.events = POLLIN;
+		poll_descriptor.revents = 0;
 		poll_descriptor.fd = socket->socket_descriptor;
 
+		this->slots[slot_index].dense_index = (uint32_t)this->descriptors.size();
 		this->descriptors.push_back(poll_descriptor);
-		this->poll_descriptor_map[socket->socket_descriptor] = std::make_pair((int) this->descriptors.size() - 1, socket);
+		this->connections.push_back(socket);
+		this->dense_slots.push_back(slot_index);
+		this->events.reserve(this->descriptors.size());
+
+		socket->poll_handle = ConnectionHandle{ slot_index, this->slots[slot_index].generation };
+		return socket->poll_handle;
+	}
+
+	void PollService::remove_at(size_t dense_index) {
+		uint32_t slot_index = this->dense_slots[dense_index];
+		this->connections[dense_index]->poll_handle = INVALID_CONNECTION_HANDLE;
+
+		/* Move the last entry into the hole, so the dense arrays stay packed */
+		size_t last = this->descriptors.size() - 1;
+		if (dense_index != last) {
+			this->descriptors[dense_index] = this->descriptors[last];
+			this->connections[dense_index] = std::move(this->connections[last]);
+			this->dense_slots[dense_index] = this->dense_slots[last];
+			this->slots[this->dense_slots[dense_index]].dense_index = (uint32_t)dense_index;
+		}
+
+		this->descriptors.pop_back();
+		this->connections.pop_back();
+		this->dense_slots.pop_back();
+
+		/* Free the slot, invalidating every handle which refers to it */
+		Slot& slot = this->slots[slot_index];
+		if (++slot.generation == 0) {
+			slot.generation = 1;
+		}
+		slot.dense_index = this->free_slot_head;
+		this->free_slot_head = slot_index;
 	}
 
 	void PollService::remove_socket(const SocketConnection_p socket) {
-		const auto& info = this->poll_descriptor_map.find(socket->socket_descriptor);
-		if (info == this->poll_descriptor_map.end()) {
+		size_t dense_index = this->find_dense_index(socket->poll_handle);
+		if (dense_index == this->descriptors.size() || this->connections[dense_index] != socket) {
 			/* Socket is already gone! */
 			return;
 		}
 
-		int index = info->second.first;
-
-		/* Step 1: Erase the element from the descriptors, which will cause all elements to shift down */
-		this->descriptors.erase(this->descriptors.begin() + index);
-		this->poll_descriptor_map.erase(info);
+		this->remove_at(dense_index);
+	}
 
-		/* Step 2: Change the indices of all elements in poll_descritor_map after this one*/
-		for (int i = index; i < this->descriptors.size(); i++) {
-			this->poll_descriptor_map[this->descriptors[i].fd].first = i;
+	void PollService::remove_socket(ConnectionHandle handle) {
+		size_t dense_index = this->find_dense_index(handle);
+		if (dense_index != this->descriptors.size()) {
+			this->remove_at(dense_index);
 		}
 	}
 
 	void PollService::clear_sockets() {
-		this->descriptors.clear();
-		this->poll_descriptor_map.clear();
+		while (!this->descriptors.empty()) {
+			this->remove_at(this->descriptors.size() - 1);
+		}
+	}
+
+	void PollService::set_reading(ConnectionHandle handle, bool reading) {
+		size_t dense_index = this->find_dense_index(handle);
+		if (dense_index != this->descriptors.size()) {
+			short& events = this->descriptors[dense_index].events;
+			events = (short)(reading ? (events | POLLIN) : (events & ~POLLIN));
+		}
 	}
 
-	SocketCollection_p PollService::poll() {
-		this->results->clear();
-		int poll_return = socket_poll(this->descriptors.data(), (NUM_POLL_DESCRIPTORS) this->descriptors.size(), this->timeout);
+	void PollService::set_writing(ConnectionHandle handle, bool writing) {
+		size_t dense_index = this->find_dense_index(handle);
+		if (dense_index != this->descriptors.size()) {
+			short& events = this->descriptors[dense_index].events;
+			events = (short)(writing ? (events | POLLOUT) : (events & ~POLLOUT));
+		}
+	}
+
+	SocketConnection_p PollService::get_socket(ConnectionHandle handle) const {
+		size_t dense_index = this->find_dense_index(handle);
+		if (dense_index == this->descriptors.size()) {
+			return nullptr;
+		}
+
+		return this->connections[dense_index];
+	}
+
+	const PollEventList& PollService::poll() {
+		this->events.clear();
+		this->writable.clear();
+		int poll_timeout = this->marked_ready.empty() ? this->timers.next_timeout(this->timeout) : 0;
+		SUNNET_METRICS_ONLY(uint64_t poll_start_ticks = CycleClock::now());
+		int poll_return = socket_poll(this->descriptors.data(), (NUM_POLL_DESCRIPTORS) this->descriptors.size(), poll_timeout);
+		SUNNET_METRICS_ONLY(this->poll_return_ticks = CycleClock::now(); Metrics::latency.poll_time.record(this->poll_return_ticks - poll_start_ticks));
 
 		if (poll_return == SOCKET_ERROR) {
 			throw PollException(std::to_string(get_previous_error_code()));
 		}
-		else if (poll_return > 0) {
-			for (auto poll_iter = this->descriptors.begin(); poll_iter != this->descriptors.end(); ++poll_iter) {
-				if (poll_iter->revents & (POLLIN | POLLERR | POLLNVAL | POLLHUP)) {
-					const auto& socket_iter = this->poll_descriptor_map.find(poll_iter->fd);
-					if (socket_iter == this->poll_descriptor_map.end()) {
-						/* 
-						Something weird has happened. We've encountered something for a socket we are not keeping track of anymore.
-						Maybe it's not a big deal? Let's just skip over it.
-						*/
-						continue;
-					}
 
+		this->timers.advance();
+
+		if (poll_return > 0) {
+			size_t remaining = (size_t)poll_return;
+			for (size_t index = 0; index < this->descriptors.size() && remaining > 0; index++) {
+				const POLL_DESCRIPTOR* poll_iter = &this->descriptors[index];
+				if (poll_iter->revents == 0) {
+					continue;
+				}
+
+				/* poll() counts every descriptor with events, so stop once they have all been seen */
+				remaining--;
 
-					SocketConnection_p ready_socket = socket_iter->second.second;
+				/* Writing is watched for once, by whoever is waiting for room to send */
+				if (poll_iter->revents & POLLOUT) {
+					this->descriptors[index].events &= ~POLLOUT;
+					uint32_t slot_index = this->dense_slots[index];
+					this->writable.push_back(ConnectionHandle{ slot_index, this->slots[slot_index].generation });
+				}
 
-					if (!ready_socket) {
+				if (poll_iter->revents & (POLLIN | POLLERR | POLLNVAL | POLLHUP)) {
+					if (!this->connections[index]) {
 						throw InvalidSocketConnectionException("Invalid socket descriptor", poll_iter->fd);
 					}
 
+					/* Completions of zero-copy sends also arrive as an error. Take them and carry on */
+					if ((poll_iter->revents & POLLERR) && this->connections[index]->reap_error_queue()) {
+						this->descriptors[index].revents &= ~POLLERR;
+						if (!(poll_iter->revents & (POLLIN | POLLNVAL | POLLHUP))) {
+							this->descriptors[index].revents = 0;
+							continue;
+						}
+					}
+
 					SocketStatus status;
 					if (poll_iter->revents & (POLLERR | POLLNVAL)) {
 						status = SOCKET_STATUS_ERROR;
 					}
 					else if (poll_iter->revents & (POLLHUP)) {
-						status = SOCKET_STATUS_DISCONNECT;
+						/* Let the reader drain whatever the peer sent before hanging up */
+						status = this->connections[index]->buffered_bytes() > 0 ? SOCKET_STATUS_NORMAL : SOCKET_STATUS_DISCONNECT;
 					}
-					else {
+					else if (this->connections[index]->consume_wakeup()) {
 						status = SOCKET_STATUS_NORMAL;
 					}
+					else {
+						/* A stale wakeup. Forget it, so that a mark_ready for this socket still counts */
+						this->descriptors[index].revents = 0;
+						continue;
+					}
 
-					this->results->insert(SocketCollectionEntry{ ready_socket, status });
+					uint32_t slot_index = this->dense_slots[index];
+					this->events.push_back(PollEvent{ ConnectionHandle{ slot_index, this->slots[slot_index].generation }, status });
 				}
 			}
 		}
 
-		return this->results;
+		/* Marked sockets go after the ones the kernel reported, unless the kernel reported them too */
+		for (const ConnectionHandle& handle : this->marked_ready) {
+			size_t dense_index = this->find_dense_index(handle);
+			if (dense_index == this->descriptors.size()) {
+				continue;
+			}
+
+			POLL_DESCRIPTOR& descriptor = this->descriptors[dense_index];
+			if (descriptor.revents & (POLLIN | POLLERR | POLLNVAL | POLLHUP)) {
+				continue;
+			}
+
+			descriptor.revents |= POLLIN;
+			this->events.push_back(PollEvent{ handle, SOCKET_STATUS_NORMAL });
+		}
+		this->marked_ready.clear();
+
+		SUNNET_METRICS_ONLY(Metrics::global.poll_iterations.add(); Metrics::global.ready_events.add(this->events.size()));
+		return this->events;
 	}
 }
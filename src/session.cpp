@@ -0,0 +1,107 @@
+#include "session.h"
+
+namespace SunNet {
+
+	Session::Session(SESSION_TOKEN token, NETWORK_BYTE_SIZE replay_limit) :
+		token(token), replay_limit(std::max<NETWORK_BYTE_SIZE>(replay_limit, 1)), replay_start(0), replay_size(0),
+		sent(0), replay_from(1), received(0), unacked_messages(0), unacked_bytes(0), closed(false) {}
+
+	void Session::record(CHANNEL_ID channel_id, const NETWORK_BYTE* message, NETWORK_BYTE_SIZE message_size) {
+		this->sent++;
+
+		NETWORK_BYTE_SIZE frame_size = sizeof(CHANNEL_ID) + message_size;
+		if (frame_size > this->replay_limit) {
+			/* Nothing sent up to here can be resent in order any more */
+			this->replay_start = 0;
+			this->replay_size = 0;
+			this->replay_from = this->sent + 1;
+			return;
+		}
+
+		if (this->replay_size + frame_size > this->replay_buffer.size() && this->replay_buffer.size() < this->replay_limit) {
+			this->grow(this->replay_size + frame_size);
+		}
+		while (this->replay_size + frame_size > this->replay_buffer.size()) {
+			this->drop_oldest();
+		}
+
+		this->copy_in(&channel_id, sizeof(CHANNEL_ID));
+		this->copy_in(message, message_size);
+	}
+
+	void Session::copy_in(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) {
+		size_t capacity = this->replay_buffer.size();
+		size_t end = (this->replay_start + this->replay_size) % capacity;
+		size_t first_size = std::min<size_t>(num_bytes, capacity - end);
+
+		std::memcpy(this->replay_buffer.data() + end, bytes, first_size);
+		std::memcpy(this->replay_buffer.data(), bytes + first_size, num_bytes - first_size);
+		this->replay_size += num_bytes;
+	}
+
+	void Session::grow(size_t needed) {
+		/* Doubling keeps the copying to a constant per byte kept. An acknowledgement's worth is kept from the start */
+		size_t capacity = std::min<size_t>(this->replay_limit, std::max<size_t>({ needed, 2 * this->replay_buffer.size(), SESSION_ACK_BYTES }));
+		std::vector<NETWORK_BYTE> grown(capacity);
+
+		/* The kept frames move to the start of the new ring, in order */
+		if (this->replay_size > 0) {
+			size_t first_size = std::min(this->replay_size, this->replay_buffer.size() - this->replay_start);
+			std::memcpy(grown.data(), this->replay_buffer.data() + this->replay_start, first_size);
+			std::memcpy(grown.data() + first_size, this->replay_buffer.data(), this->replay_size - first_size);
+		}
+
+		this->replay_buffer.swap(grown);
+		this->replay_start = 0;
+	}
+
+	void Session::drop_oldest() {
+		/* Frames are not delimited, but every message on a channel is the same size */
+		CHANNEL_ID channel_id = this->replay_buffer[this->replay_start];
+		size_t frame_size = sizeof(CHANNEL_ID) + Channels::getChannel(channel_id)->getMessageSize();
+
+		this->replay_start = (this->replay_start + frame_size) % this->replay_buffer.size();
+		this->replay_size -= frame_size;
+		this->replay_from++;
+	}
+
+	void Session::acknowledge(SESSION_SEQUENCE peer_received) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		while (this->replay_size > 0 && this->replay_from <= peer_received) {
+			this->drop_oldest();
+		}
+	}
+
+	bool Session::can_resume(SESSION_SEQUENCE peer_received, SESSION_SEQUENCE peer_replay_from) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return peer_received + 1 >= this->replay_from && peer_received <= this->sent && peer_replay_from <= this->received + 1;
+	}
+
+	bool Session::count_received(NETWORK_BYTE_SIZE frame_size) {
+		this->received++;
+		this->unacked_messages++;
+		this->unacked_bytes += frame_size;
+		if (this->unacked_messages < SESSION_ACK_MESSAGES && this->unacked_bytes < SESSION_ACK_BYTES) {
+			return false;
+		}
+
+		this->unacked_messages = 0;
+		this->unacked_bytes = 0;
+		return true;
+	}
+
+	SESSION_SEQUENCE Session::get_sent() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->sent;
+	}
+
+	SESSION_SEQUENCE Session::get_replay_from() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->replay_from;
+	}
+
+	size_t Session::get_replay_size() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->replay_size;
+	}
+}
@@ -0,0 +1,337 @@
+#include "shared_memory_socket_connection.h"
+
+#ifdef SUNNET_HAS_SHARED_MEMORY_TRANSPORT
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace SunNet {
+
+	static_assert((SHARED_MEMORY_RING_SIZE & (SHARED_MEMORY_RING_SIZE - 1)) == 0, "SHARED_MEMORY_RING_SIZE must be a power of two");
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory rings need lock-free 64-bit atomics");
+
+	/* Identifies memory laid out by this version of SunNet */
+	static const uint32_t SHARED_MEMORY_MAGIC = 0x534e4d31;
+
+	/* How long a sender sleeps between checks while the peer's ring is full */
+	static const std::chrono::microseconds FULL_RING_BACKOFF(50);
+
+	/*
+	How long an accepted connection waits for its peer's shared memory. The peer sends it
+	as part of connecting, so it is almost always there already; the wait only bounds how
+	long a peer which sends nothing can hold up the server's poll().
+	*/
+	static const std::chrono::milliseconds HANDSHAKE_TIMEOUT(250);
+
+	/*
+	The positions of one ring, which live in shared memory. The producer and consumer are
+	in different processes, so each position gets its own cache line. As with in-process
+	rings, each side stores its own position and loads the other's with sequential
+	consistency, so a doorbell for a ring which just became non-empty is never missed.
+	*/
+	struct SharedMemoryRing {
+		alignas(64) std::atomic<uint64_t> head; /** < Bytes consumed */
+		alignas(64) std::atomic<uint64_t> tail; /** < Bytes published */
+		alignas(64) std::atomic<uint32_t> closed;
+		uint64_t data_offset; /** < Where the ring's bytes start, from the start of the mapping */
+	};
+
+	/* The start of the mapping. The connecting side produces into rings[0] */
+	struct SharedMemoryHeader {
+		uint32_t magic;
+		uint64_t ring_size;
+		SharedMemoryRing rings[2];
+	};
+
+	static std::size_t data_offset(std::size_t ring) {
+		std::size_t header_size = (sizeof(SharedMemoryHeader) + 4095) & ~(std::size_t)4095;
+		return header_size + ring * SHARED_MEMORY_RING_SIZE;
+	}
+
+	SharedMemorySocketConnection::SharedMemorySocketConnection() :
+		UnixSocketConnection(UNIX_STREAM), header(nullptr), mapping_size(0), inbound(nullptr), outbound(nullptr),
+		inbound_data(nullptr), outbound_data(nullptr), peer_closed(false) {}
+
+	SharedMemorySocketConnection::SharedMemorySocketConnection(SOCKET descriptor) :
+		UnixSocketConnection(descriptor), header(nullptr), mapping_size(0), inbound(nullptr), outbound(nullptr),
+		inbound_data(nullptr), outbound_data(nullptr), peer_closed(false) {
+
+		/*
+		The peer sends one byte carrying the shared memory straight after connecting. Only
+		that byte is read, so any doorbells sent after it are left for poll() to see.
+		*/
+		NETWORK_BYTE handshake;
+		int received;
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + HANDSHAKE_TIMEOUT;
+		while ((received = this->read_socket(&handshake, sizeof(handshake))) != 1) {
+			if (received == 0) {
+				throw CreateException(std::to_string(ECONNRESET));
+			}
+
+			int error = get_previous_error_code();
+			if (is_interrupted_error(error)) {
+				continue;
+			}
+			if (!is_would_block_error(error)) {
+				throw CreateException(std::to_string(error));
+			}
+
+			auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0 || wait_for_socket(this->get_descriptor(), POLLIN, (int)remaining.count()) <= 0) {
+				throw CreateException(std::to_string(ETIMEDOUT));
+			}
+		}
+
+		SOCKET memory_descriptor = this->take_descriptor();
+		if (memory_descriptor == INVALID_SOCKET) {
+			throw CreateException(std::to_string(EPROTO));
+		}
+
+		struct stat memory_status;
+		int status = fstat(memory_descriptor, &memory_status);
+		if (status == 0 && (std::size_t)memory_status.st_size == data_offset(2)) {
+			this->map(memory_descriptor, (std::size_t)memory_status.st_size);
+		}
+		close(memory_descriptor);
+
+		if (this->header == nullptr || this->header->magic != SHARED_MEMORY_MAGIC || this->header->ring_size != SHARED_MEMORY_RING_SIZE ||
+			this->header->rings[0].data_offset != data_offset(0) || this->header->rings[1].data_offset != data_offset(1)) {
+			throw CreateException(std::to_string(EPROTO));
+		}
+
+		/* The layout is fixed, so the peer's copy of it is never trusted after this check */
+		this->inbound = &this->header->rings[0];
+		this->outbound = &this->header->rings[1];
+		this->inbound_data = reinterpret_cast<NETWORK_BYTE*>(this->header) + data_offset(0);
+		this->outbound_data = reinterpret_cast<NETWORK_BYTE*>(this->header) + data_offset(1);
+	}
+
+	SharedMemorySocketConnection::~SharedMemorySocketConnection() {
+		if (this->header != nullptr) {
+			this->inbound->closed.store(1);
+			this->outbound->closed.store(1);
+			munmap(this->header, this->mapping_size);
+		}
+	}
+
+	void SharedMemorySocketConnection::map(SOCKET memory_descriptor, std::size_t size) {
+		void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_descriptor, 0);
+		if (memory != MAP_FAILED) {
+			this->header = static_cast<SharedMemoryHeader*>(memory);
+			this->mapping_size = size;
+		}
+	}
+
+	void SharedMemorySocketConnection::connect(std::string address, std::string port) {
+		UnixSocketConnection::connect(address, port);
+
+		SOCKET memory_descriptor = memfd_create("sunnet", MFD_CLOEXEC);
+		if (memory_descriptor == INVALID_SOCKET) {
+			throw ConnectException(std::to_string(errno));
+		}
+
+		if (ftruncate(memory_descriptor, (off_t)data_offset(2)) == 0) {
+			this->map(memory_descriptor, data_offset(2));
+		}
+
+		if (this->header == nullptr) {
+			int error = errno;
+			close(memory_descriptor);
+			throw ConnectException(std::to_string(error));
+		}
+
+		/* Fresh memory is zeroed, which is already an open, empty ring */
+		new (this->header) SharedMemoryHeader();
+		this->header->magic = SHARED_MEMORY_MAGIC;
+		this->header->ring_size = SHARED_MEMORY_RING_SIZE;
+		this->header->rings[0].data_offset = data_offset(0);
+		this->header->rings[1].data_offset = data_offset(1);
+		this->outbound = &this->header->rings[0];
+		this->inbound = &this->header->rings[1];
+		this->outbound_data = reinterpret_cast<NETWORK_BYTE*>(this->header) + data_offset(0);
+		this->inbound_data = reinterpret_cast<NETWORK_BYTE*>(this->header) + data_offset(1);
+
+		NETWORK_BYTE handshake = 0;
+		try {
+			this->send_with_descriptors(&handshake, sizeof(handshake), &memory_descriptor, 1);
+		}
+		catch (SendException& error) {
+			close(memory_descriptor);
+			throw ConnectException(error.what());
+		}
+		close(memory_descriptor);
+	}
+
+	void SharedMemorySocketConnection::ring_doorbell() const {
+		/* A full socket buffer already holds plenty of wakeups, so a failed send is fine */
+		NETWORK_BYTE doorbell = 0;
+		socket_send(this->get_descriptor(), &doorbell, sizeof(doorbell), MSG_DONTWAIT);
+	}
+
+	bool SharedMemorySocketConnection::peer_hung_up() const {
+		POLL_DESCRIPTOR descriptor;
+		descriptor.fd = this->get_descriptor();
+		descriptor.events = 0;
+		descriptor.revents = 0;
+		return socket_poll(&descriptor, 1, 0) > 0 && (descriptor.revents & (POLLHUP | POLLERR)) != 0;
+	}
+
+	void SharedMemorySocketConnection::drain_doorbell() const {
+		NETWORK_BYTE doorbells[64];
+		while (true) {
+			int received = socket_receive(this->get_descriptor(), doorbells, sizeof(doorbells), MSG_DONTWAIT);
+			if (received == 0) {
+				this->peer_closed = true;
+				return;
+			}
+			if (received == SOCKET_ERROR) {
+				int error = get_previous_error_code();
+				if (!is_interrupted_error(error)) {
+					this->peer_closed = this->peer_closed || !is_would_block_error(error);
+					return;
+				}
+			}
+		}
+	}
+
+	bool SharedMemorySocketConnection::consume_wakeup() {
+		if (this->header == nullptr) {
+			return UnixSocketConnection::consume_wakeup();
+		}
+
+		/* Drain before looking, so that anything published from now on rings again */
+		this->drain_doorbell();
+		return this->buffered_bytes() > 0 || this->peer_closed || this->inbound->closed.load() != 0;
+	}
+
+	NETWORK_BYTE_SIZE SharedMemorySocketConnection::buffered_bytes() const {
+		if (this->header == nullptr) {
+			return UnixSocketConnection::buffered_bytes();
+		}
+
+		return (NETWORK_BYTE_SIZE)(this->inbound->tail.load() - this->inbound->head.load(std::memory_order_relaxed));
+	}
+
+	void SharedMemorySocketConnection::send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const {
+		SEND_VECTOR vector;
+		set_send_vector(&vector, bytes, num_bytes);
+		this->send_vectored(&vector, 1);
+	}
+
+	void SharedMemorySocketConnection::send_vectored(SEND_VECTOR* vectors, int count) const {
+		if (this->header == nullptr) {
+			throw SendException(std::to_string(ENOTCONN));
+		}
+
+		SharedMemoryRing* ring = this->outbound;
+		NETWORK_BYTE* data = this->outbound_data;
+		uint64_t published = ring->tail.load(std::memory_order_relaxed);
+		uint64_t position = published;
+
+		/* Publish the whole frame at once unless it does not fit */
+		NETWORK_BYTE_SIZE num_bytes_sent = 0;
+		for (int index = 0; index < count; index++) {
+			const NETWORK_BYTE* bytes = (const NETWORK_BYTE*)vectors[index].iov_base;
+			std::size_t remaining = vectors[index].iov_len;
+
+			while (remaining > 0) {
+				if (ring->closed.load() != 0 || this->peer_closed) {
+					throw SendException(std::to_string(EPIPE));
+				}
+
+				/* The peer owns head, so a value which claims more than the ring holds is refused */
+				std::size_t used = (std::size_t)(position - ring->head.load(std::memory_order_acquire));
+				if (used > SHARED_MEMORY_RING_SIZE) {
+					throw SendException(std::to_string(EPROTO));
+				}
+
+				std::size_t space = SHARED_MEMORY_RING_SIZE - used;
+				if (space == 0) {
+					/* Let the peer see what is written so far, and give it time to make room */
+					if (position != published) {
+						ring->tail.store(position);
+						if (ring->head.load() == published) {
+							this->ring_doorbell();
+						}
+						published = position;
+					}
+
+					/* The doorbell is left alone, since it also signals this connection's inbound ring */
+					std::this_thread::sleep_for(FULL_RING_BACKOFF);
+					this->peer_closed = this->peer_closed || this->peer_hung_up();
+					continue;
+				}
+
+				std::size_t chunk = std::min(remaining, space);
+				std::size_t offset = (std::size_t)(position & (SHARED_MEMORY_RING_SIZE - 1));
+				std::size_t first = std::min(chunk, SHARED_MEMORY_RING_SIZE - offset);
+				std::memcpy(data + offset, bytes, first);
+				std::memcpy(data, bytes + first, chunk - first);
+
+				position += chunk;
+				bytes += chunk;
+				remaining -= chunk;
+			}
+			num_bytes_sent += vectors[index].iov_len;
+		}
+
+		ring->tail.store(position);
+		if (ring->head.load() == published) {
+			this->ring_doorbell();
+		}
+		this->record_send(num_bytes_sent);
+	}
+
+	bool SharedMemorySocketConnection::receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		if (this->header == nullptr) {
+			throw ReceiveException(std::to_string(ENOTCONN));
+		}
+
+		SharedMemoryRing* ring = this->inbound;
+		const NETWORK_BYTE* data = this->inbound_data;
+
+		NETWORK_BYTE_SIZE num_bytes_recvd = 0;
+		while (num_bytes_recvd < num_bytes) {
+			uint64_t position = ring->head.load(std::memory_order_relaxed);
+			std::size_t available = (std::size_t)(ring->tail.load() - position);
+			if (available > SHARED_MEMORY_RING_SIZE) {
+				throw ReceiveException(std::to_string(EPROTO));
+			}
+			if (available == 0) {
+				/* The peer may have published its last bytes just before closing */
+				if (ring->closed.load() != 0 || this->peer_closed) {
+					if (ring->tail.load() == position) {
+						return false;
+					}
+					continue;
+				}
+
+				wait_for_socket(this->get_descriptor(), POLLIN, -1);
+				this->drain_doorbell();
+				continue;
+			}
+
+			std::size_t chunk = std::min((std::size_t)(num_bytes - num_bytes_recvd), available);
+			std::size_t offset = (std::size_t)(position & (SHARED_MEMORY_RING_SIZE - 1));
+			std::size_t first = std::min(chunk, SHARED_MEMORY_RING_SIZE - offset);
+			std::memcpy(buffer + num_bytes_recvd, data + offset, first);
+			std::memcpy(buffer + num_bytes_recvd + first, data, chunk - first);
+
+			ring->head.store(position + chunk);
+			num_bytes_recvd += chunk;
+		}
+
+		this->record_receive(num_bytes);
+		return true;
+	}
+}
+
+#endif
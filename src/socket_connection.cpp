@@ -2,6 +2,7 @@
 
 #include <string>
 #include <cstring>
+#include <algorithm>
 
 namespace SunNet {
 	std::atomic_uint SocketConnection::open_connection_count(0);
@@ -23,6 +24,17 @@ namespace SunNet {
 		this->address_info->info->ai_protocol = protocol;
 		this->address_info->initialized = false;
 
+		this->last_receive_time = this->last_send_time = std::chrono::steady_clock::now();
+		this->poll_handle = INVALID_CONNECTION_HANDLE;
+		this->receive_begin = this->receive_end = 0;
+		this->receive_buffer_size = RECEIVE_BUFFER_SIZE;
+		this->whole_packets = false;
+		this->bytes_received = 0;
+		this->receive_timestamps = false;
+		this->last_kernel_receive_time = 0;
+		this->zerocopy_threshold = 0;
+		this->next_zerocopy_id = 0;
+
 		SOCKET socket_response = open_socket(domain, type, protocol);
 
 		if (socket_response == INVALID_SOCKET) {
@@ -60,11 +72,29 @@ namespace SunNet {
 		this->address_info->info->ai_socktype = type;
 		this->address_info->info->ai_protocol = protocol;
 		this->address_info->initialized = false;
+
+		this->last_receive_time = this->last_send_time = std::chrono::steady_clock::now();
+		this->poll_handle = INVALID_CONNECTION_HANDLE;
+		this->receive_begin = this->receive_end = 0;
+		this->receive_buffer_size = RECEIVE_BUFFER_SIZE;
+		this->whole_packets = false;
+		this->bytes_received = 0;
+		this->receive_timestamps = false;
+		this->last_kernel_receive_time = 0;
+		this->zerocopy_threshold = 0;
+		this->next_zerocopy_id = 0;
 	}
 
 	SocketConnection::~SocketConnection() {
 		close_socket(this->socket_descriptor);
 
+		/* Nothing will report these done now, and the socket is gone, so hand them back */
+		while (!this->zerocopy_pending.empty()) {
+			std::function<void()> release = std::move(this->zerocopy_pending.front().release);
+			this->zerocopy_pending.pop_front();
+			release();
+		}
+
 		if (--SocketConnection::open_connection_count == 0) {
 			while (SocketConnection::initializations-- > 0) {
 				quit_socket_api();
@@ -90,39 +120,273 @@ namespace SunNet {
 				bytes + num_bytes_sent,
 				num_bytes - num_bytes_sent,
 				0);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
 
 			if (send_return == SOCKET_ERROR) {
-				throw SendException(std::to_string(get_previous_error_code()));
+				this->wait_after_error<SendException>(POLLOUT);
+				continue;
 			}
 
 			num_bytes_sent += (NETWORK_BYTE_SIZE)send_return;
 		}
+
+		SUNNET_METRICS_ONLY(this->metrics.bytes_sent.add(num_bytes));
+		this->last_send_time = std::chrono::steady_clock::now();
+	}
+
+	/* Skip past every buffer which was sent completely and trim the one which was sent partially */
+	static void skip_sent_vectors(SEND_VECTOR*& vectors, int& count, NETWORK_BYTE_SIZE num_bytes_sent) {
+		while (count > 0) {
+#ifdef _WIN32
+			NETWORK_BYTE_SIZE vector_size = (NETWORK_BYTE_SIZE)vectors->len;
+			NETWORK_BYTE* vector_data = (NETWORK_BYTE*)vectors->buf;
+#else
+			NETWORK_BYTE_SIZE vector_size = (NETWORK_BYTE_SIZE)vectors->iov_len;
+			NETWORK_BYTE* vector_data = (NETWORK_BYTE*)vectors->iov_base;
+#endif
+			if (num_bytes_sent < vector_size) {
+				set_send_vector(vectors, vector_data + num_bytes_sent, vector_size - num_bytes_sent);
+				return;
+			}
+
+			num_bytes_sent -= vector_size;
+			vectors++;
+			count--;
+		}
 	}
 
+	void SocketConnection::send_vectored(SEND_VECTOR* vectors, int count) const {
+		while (count > 0) {
+			int send_return = socket_send_vectored(this->socket_descriptor, vectors, count, 0);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+
+			if (send_return == SOCKET_ERROR) {
+				this->wait_after_error<SendException>(POLLOUT);
+				continue;
+			}
+
+			SUNNET_METRICS_ONLY(this->metrics.bytes_sent.add((NETWORK_BYTE_SIZE)send_return));
+			skip_sent_vectors(vectors, count, (NETWORK_BYTE_SIZE)send_return);
+		}
+
+		this->last_send_time = std::chrono::steady_clock::now();
+	}
+
+	void SocketConnection::send_file(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+		int file, uint64_t offset, NETWORK_BYTE_SIZE length) const {
+
+		std::unique_ptr<NETWORK_BYTE[]> bytes(new NETWORK_BYTE[length]);
+		NETWORK_BYTE_SIZE num_bytes_read = 0;
+		while (num_bytes_read < length) {
+			int read_return = read_file_at(file, bytes.get() + num_bytes_read, length - num_bytes_read, offset + num_bytes_read);
+			if (read_return == SOCKET_ERROR && is_interrupted_error(get_previous_error_code())) {
+				continue;
+			}
+			if (read_return <= 0) {
+				throw SendException(std::to_string(EIO));
+			}
+
+			num_bytes_read += (NETWORK_BYTE_SIZE)read_return;
+		}
+
+		SEND_VECTOR frame[2];
+		set_send_vector(&frame[0], header, header_size);
+		set_send_vector(&frame[1], bytes.get(), length);
+		this->send_vectored(frame, 2);
+	}
+
+	void SocketConnection::send_file_direct(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+		int file, uint64_t offset, NETWORK_BYTE_SIZE length) const {
+#ifdef SUNNET_HAS_SENDFILE
+		/* Hold the header back so that it leaves in the same packet as the start of the file */
+		NETWORK_BYTE_SIZE num_bytes_sent = 0;
+		while (num_bytes_sent < header_size) {
+			int send_return = socket_send(this->socket_descriptor, header + num_bytes_sent, header_size - num_bytes_sent, MSG_MORE);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+
+			if (send_return == SOCKET_ERROR) {
+				this->wait_after_error<SendException>(POLLOUT);
+				continue;
+			}
+
+			num_bytes_sent += (NETWORK_BYTE_SIZE)send_return;
+		}
+
+		num_bytes_sent = 0;
+		while (num_bytes_sent < length) {
+			int send_return = socket_send_file(this->socket_descriptor, file, offset + num_bytes_sent, length - num_bytes_sent);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+
+			if (send_return == SOCKET_ERROR) {
+				int error = get_previous_error_code();
+				if (num_bytes_sent == 0 && (error == EINVAL || error == ENOSYS)) {
+					/* Not a file sendfile can read, such as a pipe. The header is already out */
+					this->record_send(header_size);
+					this->SocketConnection::send_file(nullptr, 0, file, offset, length);
+					return;
+				}
+
+				this->wait_after_error<SendException>(POLLOUT);
+				continue;
+			}
+			if (send_return == 0) {
+				throw SendException(std::to_string(EIO));
+			}
+
+			num_bytes_sent += (NETWORK_BYTE_SIZE)send_return;
+		}
+
+		this->record_send(header_size + length);
+#else
+		this->SocketConnection::send_file(header, header_size, file, offset, length);
+#endif
+	}
+
+	bool SocketConnection::is_writable() const {
+		return wait_for_socket(this->socket_descriptor, POLLOUT, 0) > 0;
+	}
+
+	bool SocketConnection::wait_readable(std::chrono::milliseconds timeout) const {
+		if (this->buffered_bytes() > 0) {
+			return true;
+		}
+
+		return wait_for_socket(this->socket_descriptor, POLLIN, (int)std::max<int64_t>(timeout.count(), 0)) > 0;
+	}
+
+	void SocketConnection::send_zerocopy(const NETWORK_BYTE* header, NETWORK_BYTE_SIZE header_size,
+		const NETWORK_BYTE* payload, NETWORK_BYTE_SIZE payload_size, std::function<void()> release) const {
+
+		SEND_VECTOR vectors[2];
+		if (this->zerocopy_threshold == 0 || payload_size < this->zerocopy_threshold || header_size > ZEROCOPY_MAX_HEADER_SIZE) {
+			set_send_vector(&vectors[0], header, header_size);
+			set_send_vector(&vectors[1], payload, payload_size);
+			this->send_vectored(vectors, 2);
+			release();
+			return;
+		}
+
+#ifdef SUNNET_HAS_ZEROCOPY
+		ZerocopySend& pending = this->zerocopy_pending.emplace_back();
+		pending.release = std::move(release);
+		std::memcpy(pending.header, header, header_size);
+		set_send_vector(&vectors[0], pending.header, header_size);
+		set_send_vector(&vectors[1], payload, payload_size);
+
+		SEND_VECTOR* remaining = vectors;
+		int count = 2;
+		bool zerocopy = false;
+		try {
+			while (count > 0) {
+				int send_return = socket_send_vectored(this->socket_descriptor, remaining, count, MSG_ZEROCOPY);
+				SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+
+				if (send_return == SOCKET_ERROR) {
+					/* The kernel is tracking as many zero-copy sends as it will, so copy the rest */
+					if (get_previous_error_code() == ENOBUFS) {
+						SocketConnection::send_vectored(remaining, count);
+						break;
+					}
+
+					this->wait_after_error<SendException>(POLLOUT);
+					continue;
+				}
+
+				/* Every successful call is numbered, partial or not */
+				pending.last_id = this->next_zerocopy_id++;
+				zerocopy = true;
+				SUNNET_METRICS_ONLY(this->metrics.bytes_sent.add((NETWORK_BYTE_SIZE)send_return));
+				skip_sent_vectors(remaining, count, (NETWORK_BYTE_SIZE)send_return);
+			}
+		}
+		catch (...) {
+			/*
+			If the kernel took part of the payload, it may still be reading it, so the entry stays
+			until that numbered send completes. Otherwise nothing refers to the payload any more.
+			*/
+			if (!zerocopy) {
+				release = std::move(pending.release);
+				this->zerocopy_pending.pop_back();
+				release();
+			}
+			throw;
+		}
+
+		this->last_send_time = std::chrono::steady_clock::now();
+		if (!zerocopy) {
+			release = std::move(pending.release);
+			this->zerocopy_pending.pop_back();
+			release();
+			return;
+		}
+		SUNNET_METRICS_ONLY(Metrics::global.zerocopy_sends.add());
+#endif
+	}
 
 	bool SocketConnection::receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
-		NETWORK_BYTE_SIZE num_bytes_recvd = 0;
+		/* Hand out whatever an earlier receive already read */
+		NETWORK_BYTE_SIZE num_bytes_recvd = std::min(this->buffered_bytes(), num_bytes);
+		if (num_bytes_recvd > 0) {
+			std::memcpy(buffer, this->receive_buffer.get() + this->receive_begin, num_bytes_recvd);
+			this->receive_begin += num_bytes_recvd;
+		}
 
 		while (num_bytes_recvd < num_bytes) {
-			int recv_return = recv(
-				this->socket_descriptor,
-				buffer + num_bytes_recvd,
-				num_bytes - num_bytes_recvd,
-				0);
+			NETWORK_BYTE_SIZE num_bytes_wanted = num_bytes - num_bytes_recvd;
+			bool read_directly = num_bytes_wanted >= this->receive_buffer_size && !this->whole_packets;
+			if (!read_directly && !this->receive_buffer) {
+				this->receive_buffer.reset(new NETWORK_BYTE[this->receive_buffer_size]);
+			}
+
+			NETWORK_BYTE* target = read_directly ? buffer + num_bytes_recvd : this->receive_buffer.get();
+			NETWORK_BYTE_SIZE target_size = read_directly ? num_bytes_wanted : this->receive_buffer_size;
+			int recv_return = this->read_socket(target, target_size);
+			SUNNET_METRICS_ONLY(this->metrics.receive_calls.add(); Metrics::global.receive_calls.add());
 
 			if (recv_return == SOCKET_ERROR) {
-				throw ReceiveException(std::to_string(get_previous_error_code()));
+				this->wait_after_error<ReceiveException>(POLLIN);
+				continue;
 			}
 			else if (recv_return == 0) {
 				return false;
 			}
 
-			num_bytes_recvd += (NETWORK_BYTE_SIZE)recv_return;
+			this->last_receive_time = std::chrono::steady_clock::now();
+
+			if (read_directly) {
+				num_bytes_recvd += (NETWORK_BYTE_SIZE)recv_return;
+				continue;
+			}
+
+			NETWORK_BYTE_SIZE num_bytes_copied = std::min((NETWORK_BYTE_SIZE)recv_return, num_bytes_wanted);
+			std::memcpy(buffer + num_bytes_recvd, this->receive_buffer.get(), num_bytes_copied);
+			this->receive_begin = num_bytes_copied;
+			this->receive_end = (NETWORK_BYTE_SIZE)recv_return;
+			num_bytes_recvd += num_bytes_copied;
 		}
 
+		this->bytes_received += num_bytes;
 		return true;
 	}
 
+	int SocketConnection::read_socket(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		if (this->receive_timestamps) {
+			return socket_receive_timestamped(this->socket_descriptor, buffer, num_bytes, 0, &this->last_kernel_receive_time);
+		}
+
+		return socket_receive(this->socket_descriptor, buffer, num_bytes, 0);
+	}
+
+	ConnectionMetricsSnapshot SocketConnection::get_metrics() const {
+		return ConnectionMetricsSnapshot{
+			this->metrics.messages_received.get(),
+			this->bytes_received,
+			this->metrics.messages_sent.get(),
+			this->metrics.bytes_sent.get(),
+			this->metrics.receive_calls.get(),
+			this->metrics.send_calls.get()
+		};
+	}
 
 	void SocketConnection::bind(std::string port, std::string address) {
 		this->set_socket_info(port, address, AI_PASSIVE);
@@ -156,6 +420,77 @@ namespace SunNet {
 		}
 	}
 
+	SOCKET SocketConnection::accept_descriptor(struct sockaddr_storage* address, SOCKET_LEN* address_len) const {
+		while (true) {
+			*address_len = sizeof(struct sockaddr_storage);
+			SOCKET connected_socket = accept_socket_nonblocking(this->socket_descriptor, (struct sockaddr*)address, address_len);
+			if (connected_socket != INVALID_SOCKET) {
+				return connected_socket;
+			}
+
+			int error = get_previous_error_code();
+			if (is_would_block_error(error)) {
+				return INVALID_SOCKET;
+			}
+#ifndef _WIN32
+			/* The client gave up while waiting in the queue. Move on to the next one */
+			if (error == ECONNABORTED) {
+				continue;
+			}
+#endif
+			if (!is_interrupted_error(error)) {
+				throw AcceptException(std::to_string(error));
+			}
+		}
+	}
+
+	bool SocketConnection::enable_receive_timestamps() {
+		if (!this->receive_timestamps && SunNet::enable_receive_timestamps(this->socket_descriptor) != SOCKET_ERROR) {
+			this->receive_timestamps = true;
+		}
+
+		return this->receive_timestamps;
+	}
+
+	bool SocketConnection::enable_zerocopy(NETWORK_BYTE_SIZE threshold) {
+		if (SunNet::enable_zerocopy(this->socket_descriptor) == SOCKET_ERROR) {
+			return false;
+		}
+
+		this->zerocopy_threshold = std::max(threshold, (NETWORK_BYTE_SIZE)1);
+		return true;
+	}
+
+	bool SocketConnection::reap_error_queue() {
+		if (this->zerocopy_threshold == 0) {
+			return false;
+		}
+
+		uint32_t first;
+		uint32_t last;
+		bool copied;
+		while (read_zerocopy_completion(this->socket_descriptor, &first, &last, &copied) > 0) {
+			if (copied) {
+				SUNNET_METRICS_ONLY(Metrics::global.zerocopy_copies.add(last - first + 1));
+			}
+
+			/* A stream socket completes its sends in order */
+			while (!this->zerocopy_pending.empty() && (int32_t)(this->zerocopy_pending.front().last_id - last) <= 0) {
+				std::function<void()> release = std::move(this->zerocopy_pending.front().release);
+				this->zerocopy_pending.pop_front();
+				release();
+			}
+		}
+
+		return take_socket_error(this->socket_descriptor) == 0;
+	}
+
+	void SocketConnection::set_nonblocking(bool nonblocking) {
+		if (set_socket_nonblocking(this->socket_descriptor, nonblocking) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
 	SocketConnection_p SocketConnection::accept() const {
 		struct sockaddr connection_info;
 		SOCKET_LEN info_size = sizeof(connection_info);
@@ -1,5 +1,19 @@
 #include "socketutil.h"
 
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
 namespace SunNet {
 
 	int initialize_socket_api() {
@@ -34,20 +48,18 @@ namespace SunNet {
 	}
 
 	int close_socket(SOCKET socket) {
-		int status = 0;
-#ifdef _WIN32
-		status = shutdown(socket, SD_BOTH);
-		if (status == 0) {
-			status = closesocket(socket);
+		if (socket == INVALID_SOCKET) {
+			return 0;
 		}
+
+		/* Sockets which were never connected, such as UDP sockets, cannot be shut down but must still be closed */
+#ifdef _WIN32
+		shutdown(socket, SD_BOTH);
+		return closesocket(socket);
 #else
-		status = shutdown(socket, SHUT_RDWR);
-		if (status == 0) {
-			status = close(socket);
-		}
+		shutdown(socket, SHUT_RDWR);
+		return close(socket);
 #endif
-
-		return status;
 	}
 
 	int get_previous_error_code() {
@@ -70,18 +82,262 @@ namespace SunNet {
 		return accept(socket, addr, len);
 	}
 
+	SOCKET accept_socket_nonblocking(SOCKET socket, struct sockaddr* addr, SOCKET_LEN* len) {
+#if defined(__linux__)
+		SOCKET accepted = accept4(socket, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		return (accepted < 0) ? INVALID_SOCKET : accepted;
+#else
+		SOCKET accepted = accept(socket, addr, len);
+		if (accepted == INVALID_SOCKET) {
+			return INVALID_SOCKET;
+		}
+
+		set_socket_nonblocking(accepted, true);
+#ifndef _WIN32
+		fcntl(accepted, F_SETFD, FD_CLOEXEC);
+#endif
+		return accepted;
+#endif
+	}
+
+	int set_socket_nonblocking(SOCKET socket, bool nonblocking) {
+#ifdef _WIN32
+		u_long mode = nonblocking ? 1 : 0;
+		return ioctlsocket(socket, FIONBIO, &mode);
+#else
+		int flags = fcntl(socket, F_GETFL, 0);
+		if (flags < 0) {
+			return SOCKET_ERROR;
+		}
+
+		flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+		return fcntl(socket, F_SETFL, flags);
+#endif
+	}
+
+	int wait_for_socket(SOCKET socket, short events, int timeout) {
+		POLL_DESCRIPTOR descriptor;
+		descriptor.fd = socket;
+		descriptor.events = events;
+		descriptor.revents = 0;
+
+		return socket_poll(&descriptor, 1, timeout);
+	}
+
+	bool is_would_block_error(int error_code) {
+#ifdef _WIN32
+		return error_code == WSAEWOULDBLOCK;
+#else
+		return error_code == EAGAIN || error_code == EWOULDBLOCK;
+#endif
+	}
+
+	bool is_interrupted_error(int error_code) {
+#ifdef _WIN32
+		return error_code == WSAEINTR;
+#else
+		return error_code == EINTR;
+#endif
+	}
+
 	int connect_socket(SOCKET socket, const struct sockaddr* addr, SOCKET_LEN len) {
 		return connect(socket, addr, len);
 	}
 
 	int socket_send(SOCKET socket, const NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags) {
+#ifdef MSG_NOSIGNAL
+		/* Report a peer that has gone away as an error instead of raising SIGPIPE */
+		flags |= MSG_NOSIGNAL;
+#endif
 		return send(socket, buffer, len, flags);
 	}
 
+	void set_send_vector(SEND_VECTOR* vector, const NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len) {
+#ifdef _WIN32
+		vector->buf = (CHAR*)buffer;
+		vector->len = (ULONG)len;
+#else
+		vector->iov_base = (void*)buffer;
+		vector->iov_len = len;
+#endif
+	}
+
+	int socket_send_file(SOCKET socket, int file, uint64_t offset, NETWORK_BYTE_SIZE len) {
+#ifdef SUNNET_HAS_SENDFILE
+		/* sendfile has no MSG_NOSIGNAL, so hold back the SIGPIPE a vanished peer raises and take it */
+		sigset_t pipe_signal, previous_mask;
+		sigemptyset(&pipe_signal);
+		sigaddset(&pipe_signal, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipe_signal, &previous_mask);
+
+		off_t file_offset = (off_t)offset;
+		int sent = (int)sendfile(socket, file, &file_offset, len);
+		int error = errno;
+
+		if (sent == SOCKET_ERROR && error == EPIPE && !sigismember(&previous_mask, SIGPIPE)) {
+			struct timespec no_wait = { 0, 0 };
+			sigtimedwait(&pipe_signal, nullptr, &no_wait);
+		}
+		pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
+
+		errno = error;
+		return sent;
+#else
+		(void)socket; (void)file; (void)offset; (void)len;
+		return SOCKET_ERROR;
+#endif
+	}
+
+	int read_file_at(int file, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, uint64_t offset) {
+#ifdef _WIN32
+		if (_lseeki64(file, (__int64)offset, SEEK_SET) < 0) {
+			return SOCKET_ERROR;
+		}
+		return _read(file, buffer, (unsigned int)len);
+#else
+		return (int)pread(file, buffer, len, (off_t)offset);
+#endif
+	}
+
+	int close_file(int file) {
+#ifdef _WIN32
+		return _close(file);
+#else
+		return close(file);
+#endif
+	}
+
+	int socket_send_vectored(SOCKET socket, SEND_VECTOR* vectors, int count, int flags) {
+#ifdef _WIN32
+		DWORD num_bytes_sent = 0;
+		if (WSASend(socket, vectors, (DWORD)count, &num_bytes_sent, (DWORD)flags, NULL, NULL) != 0) {
+			return SOCKET_ERROR;
+		}
+
+		return (int)num_bytes_sent;
+#else
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = vectors;
+		message.msg_iovlen = count;
+
+#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+#endif
+		return (int)sendmsg(socket, &message, flags);
+#endif
+	}
+
 	int socket_receive(SOCKET socket, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags) {
 		return recv(socket, buffer, len, flags);
 	}
 
+	int enable_receive_timestamps(SOCKET socket) {
+#ifdef __linux__
+		int timestamp_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		return setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &timestamp_flags, sizeof(timestamp_flags));
+#else
+		(void)socket;
+		return SOCKET_ERROR;
+#endif
+	}
+
+	int enable_zerocopy(SOCKET socket) {
+#ifdef SUNNET_HAS_ZEROCOPY
+		int enable = 1;
+		return setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+#else
+		(void)socket;
+		return SOCKET_ERROR;
+#endif
+	}
+
+	int read_zerocopy_completion(SOCKET socket, uint32_t* first, uint32_t* last, bool* copied) {
+#ifdef SUNNET_HAS_ZEROCOPY
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_storage))];
+		struct msghdr message;
+
+		/* Anything else on the error queue is skipped. The caller learns of real errors from the socket error */
+		while (true) {
+			std::memset(&message, 0, sizeof(message));
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			if (recvmsg(socket, &message, MSG_ERRQUEUE) == SOCKET_ERROR) {
+				int error = get_previous_error_code();
+				if (is_interrupted_error(error)) {
+					continue;
+				}
+				return is_would_block_error(error) ? 0 : SOCKET_ERROR;
+			}
+
+			for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+				struct sock_extended_err error;
+				std::memcpy(&error, CMSG_DATA(header), sizeof(error));
+				if (error.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+					*first = error.ee_info;
+					*last = error.ee_data;
+					*copied = (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+					return 1;
+				}
+			}
+		}
+#else
+		(void)socket;
+		(void)first;
+		(void)last;
+		(void)copied;
+		return 0;
+#endif
+	}
+
+	int take_socket_error(SOCKET socket) {
+		int error = 0;
+		SOCKET_LEN error_size = sizeof(error);
+		if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &error_size) == SOCKET_ERROR) {
+			return get_previous_error_code();
+		}
+		return error;
+	}
+
+	int socket_receive_timestamped(SOCKET socket, NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE len, int flags, int64_t* timestamp) {
+#ifdef __linux__
+		struct iovec vector;
+		vector.iov_base = buffer;
+		vector.iov_len = len;
+
+		char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		int recv_return = (int)recvmsg(socket, &message, flags);
+		if (recv_return <= 0) {
+			return recv_return;
+		}
+
+		for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+			if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPING) {
+				struct scm_timestamping kernel_time;
+				std::memcpy(&kernel_time, CMSG_DATA(header), sizeof(kernel_time));
+
+				/* The first entry is the software timestamp */
+				if (kernel_time.ts[0].tv_sec != 0 || kernel_time.ts[0].tv_nsec != 0) {
+					*timestamp = (int64_t)kernel_time.ts[0].tv_sec * 1000000000 + kernel_time.ts[0].tv_nsec;
+				}
+			}
+		}
+
+		return recv_return;
+#else
+		(void)timestamp;
+		return socket_receive(socket, buffer, len, flags);
+#endif
+	}
+
 	int socket_poll(POLL_DESCRIPTOR* descriptors, NUM_POLL_DESCRIPTORS count, int timeout) {
 #ifdef _WIN32
 		return WSAPoll(descriptors, count, timeout);
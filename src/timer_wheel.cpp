@@ -0,0 +1,350 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace SunNet {
+
+	/* The slot index used for timers too far out for the top level */
+	static const unsigned int OVERFLOW_SLOT = TimerWheel::LEVELS * TimerWheel::SLOTS;
+
+	/* The slot index of a node which is not linked into any slot */
+	static const unsigned int UNLINKED_SLOT = OVERFLOW_SLOT + 1;
+
+	/* The longest delay the levels cover. Longer delays are cut to this */
+	static const uint64_t MAX_DELAY = (uint64_t(1) << (TimerWheel::SLOT_BITS * TimerWheel::LEVELS)) - 1;
+
+	static unsigned int count_trailing_zeros(uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (unsigned int)index;
+#else
+		return (unsigned int)__builtin_ctzll(bits);
+#endif
+	}
+
+	TimerWheel::TimerWheel() : epoch(Clock::now()), current_tick(0), free_head(NIL), active_count(0) {
+		for (unsigned int i = 0; i < LEVELS * SLOTS; i++) {
+			this->slots[i] = NIL;
+		}
+		std::memset(this->occupied, 0, sizeof(this->occupied));
+		this->overflow = NIL;
+	}
+
+	uint64_t TimerWheel::tick_of(Clock::time_point time) const {
+		if (time <= this->epoch) {
+			return 0;
+		}
+
+		return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(time - this->epoch).count();
+	}
+
+	uint32_t TimerWheel::allocate_node() {
+		uint32_t index;
+		if (this->free_head != NIL) {
+			index = this->free_head;
+			this->free_head = this->nodes[index].next;
+		}
+		else {
+			index = (uint32_t)this->nodes.size();
+			this->nodes.emplace_back();
+			this->nodes[index].generation = 1;
+		}
+
+		TimerNode& node = this->nodes[index];
+		node.next = NIL;
+		node.prev = NIL;
+		node.slot = UNLINKED_SLOT;
+		node.active = true;
+		this->active_count++;
+
+		return index;
+	}
+
+	void TimerWheel::release_node(uint32_t index) {
+		TimerNode& node = this->nodes[index];
+		node.active = false;
+		node.callback = nullptr;
+
+		/* Never hand out generation 0, so that no id is ever INVALID_TIMER_ID */
+		if (++node.generation == 0) {
+			node.generation = 1;
+		}
+
+		node.next = this->free_head;
+		this->free_head = index;
+		this->active_count--;
+	}
+
+	void TimerWheel::link(uint32_t index) {
+		TimerNode& node = this->nodes[index];
+		uint64_t difference = node.expiry ^ this->current_tick;
+
+		/* A timer goes into the level of the highest digit in which it differs from the current tick */
+		unsigned int level = 0;
+		while (level < LEVELS && (difference >> (SLOT_BITS * (level + 1))) != 0) {
+			level++;
+		}
+
+		uint32_t* head;
+		if (level == LEVELS) {
+			node.slot = OVERFLOW_SLOT;
+			head = &this->overflow;
+		}
+		else {
+			unsigned int digit = (unsigned int)(node.expiry >> (SLOT_BITS * level)) & (SLOTS - 1);
+			node.slot = (uint16_t)(level * SLOTS + digit);
+			head = &this->slots[node.slot];
+			this->occupied[level][digit / 64] |= (uint64_t(1) << (digit % 64));
+		}
+
+		node.prev = NIL;
+		node.next = *head;
+		if (*head != NIL) {
+			this->nodes[*head].prev = index;
+		}
+		*head = index;
+	}
+
+	void TimerWheel::unlink(uint32_t index) {
+		TimerNode& node = this->nodes[index];
+		uint32_t* head = (node.slot == OVERFLOW_SLOT) ? &this->overflow : &this->slots[node.slot];
+
+		if (node.prev != NIL) {
+			this->nodes[node.prev].next = node.next;
+		}
+		else {
+			*head = node.next;
+		}
+
+		if (node.next != NIL) {
+			this->nodes[node.next].prev = node.prev;
+		}
+
+		if (*head == NIL && node.slot != OVERFLOW_SLOT) {
+			unsigned int level = node.slot / SLOTS;
+			unsigned int digit = node.slot % SLOTS;
+			this->occupied[level][digit / 64] &= ~(uint64_t(1) << (digit % 64));
+		}
+
+		node.next = NIL;
+		node.prev = NIL;
+		node.slot = UNLINKED_SLOT;
+	}
+
+	void TimerWheel::cascade(unsigned int level) {
+		/*
+		Take the whole list first. A timer in the overflow list may still be too far out
+		and go straight back into it, so relinking while walking the list would never end.
+		*/
+		uint32_t index;
+		if (level == LEVELS) {
+			index = this->overflow;
+			this->overflow = NIL;
+		}
+		else {
+			unsigned int digit = (unsigned int)(this->current_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+			index = this->slots[level * SLOTS + digit];
+			this->slots[level * SLOTS + digit] = NIL;
+			this->occupied[level][digit / 64] &= ~(uint64_t(1) << (digit % 64));
+		}
+
+		/* Every timer in the slot is now close enough to move down at least one level */
+		while (index != NIL) {
+			uint32_t next = this->nodes[index].next;
+			this->nodes[index].slot = UNLINKED_SLOT;
+			this->link(index);
+			index = next;
+		}
+	}
+
+	size_t TimerWheel::fire_slot(unsigned int digit) {
+		size_t fired = 0;
+
+		/*
+		Callbacks may schedule and cancel timers (including ones in this very slot), so
+		always pop from the head rather than walking the list.
+		*/
+		while (this->slots[digit] != NIL) {
+			uint32_t index = this->slots[digit];
+			this->unlink(index);
+
+			TimerCallback callback = std::move(this->nodes[index].callback);
+			uint32_t generation = this->nodes[index].generation;
+			uint64_t interval = this->nodes[index].interval;
+
+			if (interval > 0) {
+				this->nodes[index].expiry = this->current_tick + interval;
+				this->link(index);
+			}
+			else {
+				this->release_node(index);
+			}
+
+			callback();
+			fired++;
+
+			/* Hand the callback back to a repeating timer, unless it was cancelled while firing */
+			if (interval > 0 && this->nodes[index].active && this->nodes[index].generation == generation) {
+				this->nodes[index].callback = std::move(callback);
+			}
+		}
+
+		return fired;
+	}
+
+	unsigned int TimerWheel::next_occupied(unsigned int level, unsigned int digit) const {
+		unsigned int start = digit + 1;
+		if (start >= SLOTS) {
+			return SLOTS;
+		}
+
+		unsigned int word = start / 64;
+		uint64_t bits = this->occupied[level][word] & (~uint64_t(0) << (start % 64));
+		while (true) {
+			if (bits != 0) {
+				return word * 64 + count_trailing_zeros(bits);
+			}
+
+			if (++word == SLOTS / 64) {
+				return SLOTS;
+			}
+			bits = this->occupied[level][word];
+		}
+	}
+
+	TIMER_ID TimerWheel::insert(uint64_t delay, uint64_t interval, TimerCallback callback) {
+		uint32_t index = this->allocate_node();
+		TimerNode& node = this->nodes[index];
+		delay = std::min(delay, MAX_DELAY);
+		interval = std::min(interval, MAX_DELAY);
+
+		/*
+		The wheel may lag behind the clock while poll() is blocked, so measure the delay
+		from the real time. Never schedule into a tick which has already been processed.
+		*/
+		uint64_t expiry = this->tick_of(Clock::now()) + delay;
+		node.expiry = (expiry > this->current_tick) ? expiry : this->current_tick + 1;
+		node.interval = interval;
+		node.callback = std::move(callback);
+		this->link(index);
+
+		return ((TIMER_ID)node.generation << 32) | index;
+	}
+
+	TIMER_ID TimerWheel::schedule(std::chrono::milliseconds delay, TimerCallback callback) {
+		uint64_t ticks = (delay.count() > 0) ? (uint64_t)delay.count() : 0;
+		return this->insert(ticks, 0, std::move(callback));
+	}
+
+	TIMER_ID TimerWheel::schedule_repeating(std::chrono::milliseconds interval, TimerCallback callback) {
+		uint64_t ticks = (interval.count() > 0) ? (uint64_t)interval.count() : 1;
+		return this->insert(ticks, ticks, std::move(callback));
+	}
+
+	bool TimerWheel::cancel(TIMER_ID id) {
+		uint32_t index = (uint32_t)(id & 0xFFFFFFFF);
+		uint32_t generation = (uint32_t)(id >> 32);
+
+		if (index >= this->nodes.size()) {
+			return false;
+		}
+
+		TimerNode& node = this->nodes[index];
+		if (!node.active || node.generation != generation) {
+			return false;
+		}
+
+		if (node.slot != UNLINKED_SLOT) {
+			this->unlink(index);
+		}
+		this->release_node(index);
+
+		return true;
+	}
+
+	int TimerWheel::next_timeout(int max_timeout) const {
+		if (this->active_count == 0) {
+			return max_timeout;
+		}
+
+		/*
+		Timers in a lower level always expire before timers in a higher one, so the first
+		occupied slot from the bottom up tells us when the wheel next needs to turn. For
+		the higher levels this is the tick at which the slot cascades, which is never later
+		than the timers inside it.
+		*/
+		uint64_t due = ((this->current_tick >> (SLOT_BITS * LEVELS)) + 1) << (SLOT_BITS * LEVELS);
+		for (unsigned int level = 0; level < LEVELS; level++) {
+			unsigned int shift = SLOT_BITS * level;
+			unsigned int digit = (unsigned int)(this->current_tick >> shift) & (SLOTS - 1);
+			unsigned int next = this->next_occupied(level, digit);
+
+			if (next < SLOTS) {
+				due = ((this->current_tick >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) | ((uint64_t)next << shift);
+				break;
+			}
+		}
+
+		uint64_t now = this->tick_of(Clock::now());
+		if (due <= now) {
+			return 0;
+		}
+
+		uint64_t wait = due - now;
+		if (max_timeout >= 0 && wait > (uint64_t)max_timeout) {
+			return max_timeout;
+		}
+		if (wait > (uint64_t)INT32_MAX) {
+			return INT32_MAX;
+		}
+
+		return (int)wait;
+	}
+
+	size_t TimerWheel::advance() {
+		return this->advance_to(Clock::now());
+	}
+
+	size_t TimerWheel::advance_to(Clock::time_point now) {
+		uint64_t target = this->tick_of(now);
+		size_t fired = 0;
+
+		while (this->current_tick < target) {
+			/* Skip straight to the next occupied slot in level 0, or the end of its rotation */
+			unsigned int digit = (unsigned int)this->current_tick & (SLOTS - 1);
+			unsigned int next = this->next_occupied(0, digit);
+			uint64_t next_tick = (next < SLOTS) ?
+				(this->current_tick - digit + next) :
+				((this->current_tick | (SLOTS - 1)) + 1);
+
+			if (next_tick > target) {
+				this->current_tick = target;
+				break;
+			}
+
+			this->current_tick = next_tick;
+
+			if ((this->current_tick & (SLOTS - 1)) == 0) {
+				/* Cascade every level whose rotation just completed, highest first */
+				unsigned int top = 1;
+				while (top < LEVELS && (this->current_tick & ((uint64_t(1) << (SLOT_BITS * (top + 1))) - 1)) == 0) {
+					top++;
+				}
+
+				for (unsigned int level = top; level >= 1; level--) {
+					this->cascade(level);
+				}
+			}
+
+			fired += this->fire_slot((unsigned int)this->current_tick & (SLOTS - 1));
+		}
+
+		return fired;
+	}
+}
@@ -0,0 +1,55 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace SunNet {
+
+	TokenBucket::TokenBucket() : rate(0), burst(0), tokens(0), last_refill(std::chrono::steady_clock::now()), charged(0) {}
+
+	void TokenBucket::set_limit(uint64_t tokens_per_second, uint64_t burst_tokens) {
+		this->rate = tokens_per_second;
+		this->burst = (double)std::max<uint64_t>(burst_tokens, 1);
+		this->tokens = this->burst;
+		this->last_refill = std::chrono::steady_clock::now();
+		this->charged.store(0, std::memory_order_relaxed);
+	}
+
+	void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+		if (this->rate == 0) {
+			return;
+		}
+
+		if (now > this->last_refill) {
+			double elapsed = std::chrono::duration<double>(now - this->last_refill).count();
+			this->tokens = std::min(this->burst, this->tokens + elapsed * (double)this->rate);
+			this->last_refill = now;
+		}
+
+		this->tokens -= (double)this->charged.exchange(0, std::memory_order_relaxed);
+	}
+
+	bool TokenBucket::try_take(uint64_t num_tokens, std::chrono::steady_clock::time_point now) {
+		if (this->rate == 0) {
+			return true;
+		}
+
+		this->refill(now);
+		if (this->tokens <= 0) {
+			return false;
+		}
+
+		this->tokens -= (double)num_tokens;
+		return true;
+	}
+
+	std::chrono::nanoseconds TokenBucket::time_until_available() const {
+		if (this->rate == 0 || this->tokens > 0) {
+			return std::chrono::nanoseconds(0);
+		}
+
+		/* Wait until there is at least one token, not just until the debt is gone */
+		double seconds = (1.0 - this->tokens) / (double)this->rate;
+		return std::chrono::nanoseconds((int64_t)std::ceil(seconds * 1e9));
+	}
+}
@@ -0,0 +1,498 @@
+#include "udp_socket_connection.h"
+
+#ifdef SUNNET_HAS_UDP_TRANSPORT
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include <cstring>
+
+namespace SunNet {
+
+	bool UDPAddress::operator==(const UDPAddress& other) const {
+		return this->length == other.length && std::memcmp(&this->storage, &other.storage, this->length) == 0;
+	}
+
+	std::string UDPAddress::to_string() const {
+		char host[NI_MAXHOST];
+		char port[NI_MAXSERV];
+		if (getnameinfo((const struct sockaddr*)&this->storage, this->length, host, sizeof(host), port, sizeof(port),
+			NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+			return "";
+		}
+
+		if (this->storage.ss_family == AF_INET6) {
+			return "[" + std::string(host) + "]:" + port;
+		}
+		return std::string(host) + ":" + port;
+	}
+
+	UDPAddress UDPAddress::resolve(std::string address, std::string port) {
+		struct addrinfo hints;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		struct addrinfo* result;
+		int getaddrinfo_return = getaddrinfo(address.c_str(), port.c_str(), &hints, &result);
+		if (getaddrinfo_return != 0) {
+			throw GetAddrInfoException(std::to_string(getaddrinfo_return));
+		}
+
+		UDPAddress resolved;
+		std::memset(&resolved, 0, sizeof(resolved));
+		std::memcpy(&resolved.storage, result->ai_addr, result->ai_addrlen);
+		resolved.length = (SOCKET_LEN)result->ai_addrlen;
+		freeaddrinfo(result);
+		return resolved;
+	}
+
+	/* Parse a dotted IPv4 address for the multicast socket options */
+	static struct in_addr parse_ipv4_address(const std::string& address) {
+		struct in_addr parsed;
+		if (inet_pton(AF_INET, address.c_str(), &parsed) != 1) {
+			throw SocketException(std::to_string(EINVAL));
+		}
+		return parsed;
+	}
+
+	std::size_t UDPAddressHash::operator()(const UDPAddress& address) const {
+		/* FNV-1a over the address bytes, which the kernel zeroes past the meaningful fields */
+		const unsigned char* bytes = (const unsigned char*)&address.storage;
+		std::size_t hash = 14695981039346656037ULL;
+		for (SOCKET_LEN index = 0; index < address.length; index++) {
+			hash = (hash ^ bytes[index]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	UDPSocketConnection::UDPSocketConnection() :
+		SocketConnection(AF_INET, SOCK_DGRAM, IPPROTO_UDP), connected(false),
+		receive_slots(new NETWORK_BYTE[UDP_BATCH_SIZE * UDP_MAX_DATAGRAM_SIZE]), received_count(0),
+		send_slots(new NETWORK_BYTE[UDP_BATCH_SIZE * UDP_MAX_DATAGRAM_SIZE]), queued_count(0),
+		dropped_datagrams(0), unacked_messages(0) {
+
+		/* The headers always point at the same slots, so batches only need their lengths reset */
+		std::memset(this->receive_headers, 0, sizeof(this->receive_headers));
+		std::memset(this->send_headers, 0, sizeof(this->send_headers));
+		for (int index = 0; index < UDP_BATCH_SIZE; index++) {
+			this->receive_vectors[index].iov_base = this->receive_slots.get() + index * UDP_MAX_DATAGRAM_SIZE;
+			this->receive_vectors[index].iov_len = UDP_MAX_DATAGRAM_SIZE;
+			this->receive_headers[index].msg_hdr.msg_iov = &this->receive_vectors[index];
+			this->receive_headers[index].msg_hdr.msg_iovlen = 1;
+			this->receive_headers[index].msg_hdr.msg_name = &this->receive_addresses[index].storage;
+
+			this->send_vectors[index].iov_base = this->send_slots.get() + index * UDP_MAX_DATAGRAM_SIZE;
+			this->send_vectors[index].iov_len = 0;
+			this->send_headers[index].msg_hdr.msg_iov = &this->send_vectors[index];
+			this->send_headers[index].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	void UDPSocketConnection::connect(std::string address, std::string port) {
+		SocketConnection::connect(address, port);
+		this->connected = true;
+	}
+
+	void UDPSocketConnection::set_reuse_address(bool reuse) {
+		int value = reuse ? 1 : 0;
+		if (setsockopt(this->get_descriptor(), SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	void UDPSocketConnection::join_group(std::string group, std::string interface_address) {
+		struct ip_mreq membership;
+		membership.imr_multiaddr = parse_ipv4_address(group);
+		membership.imr_interface = parse_ipv4_address(interface_address);
+		if (setsockopt(this->get_descriptor(), IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	void UDPSocketConnection::set_multicast_interface(std::string interface_address) {
+		struct in_addr address = parse_ipv4_address(interface_address);
+		if (setsockopt(this->get_descriptor(), IPPROTO_IP, IP_MULTICAST_IF, &address, sizeof(address)) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	void UDPSocketConnection::set_multicast_ttl(int ttl) {
+		unsigned char value = (unsigned char)ttl;
+		if (setsockopt(this->get_descriptor(), IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	void UDPSocketConnection::set_multicast_loopback(bool loopback) {
+		unsigned char value = loopback ? 1 : 0;
+		if (setsockopt(this->get_descriptor(), IPPROTO_IP, IP_MULTICAST_LOOP, &value, sizeof(value)) == SOCKET_ERROR) {
+			throw SocketException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	int UDPSocketConnection::receive_datagrams() {
+		for (int index = 0; index < UDP_BATCH_SIZE; index++) {
+			this->receive_headers[index].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			this->receive_headers[index].msg_hdr.msg_flags = 0;
+		}
+
+		this->received_count = 0;
+		while (true) {
+			int received = recvmmsg(this->get_descriptor(), this->receive_headers, UDP_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+			SUNNET_METRICS_ONLY(this->metrics.receive_calls.add(); Metrics::global.receive_calls.add());
+			if (received != SOCKET_ERROR) {
+				this->received_count = received;
+				break;
+			}
+
+			int error = get_previous_error_code();
+			if (is_would_block_error(error)) {
+				break;
+			}
+			if (!is_interrupted_error(error)) {
+				throw ReceiveException(std::to_string(error));
+			}
+		}
+
+		for (int index = 0; index < this->received_count; index++) {
+			this->receive_addresses[index].length = this->receive_headers[index].msg_hdr.msg_namelen;
+		}
+		return this->received_count;
+	}
+
+	UDPDatagram UDPSocketConnection::get_datagram(int index) const {
+		const struct mmsghdr& header = this->receive_headers[index];
+		return UDPDatagram{
+			this->receive_slots.get() + index * UDP_MAX_DATAGRAM_SIZE,
+			(NETWORK_BYTE_SIZE)header.msg_len,
+			&this->receive_addresses[index],
+			(header.msg_hdr.msg_flags & MSG_TRUNC) != 0
+		};
+	}
+
+	void UDPSocketConnection::queue_datagram(const UDPAddress* address, const NETWORK_BYTE* prefix,
+		NETWORK_BYTE_SIZE prefix_size, SEND_VECTOR* vectors, int count) {
+		NETWORK_BYTE_SIZE num_bytes = prefix_size;
+		for (int index = 0; index < count; index++) {
+			num_bytes += vectors[index].iov_len;
+		}
+
+		if (num_bytes > UDP_MAX_DATAGRAM_SIZE) {
+			throw SendException(std::to_string(EMSGSIZE));
+		}
+
+		/* Only the newest datagram for a peer is added to, so its frames stay in order */
+		int slot = -1;
+		for (int index = this->queued_count - 1; index >= 0; index--) {
+			if (address == nullptr || this->send_addresses[index] == *address) {
+				slot = index;
+				break;
+			}
+		}
+
+		if (slot == -1 || this->send_vectors[slot].iov_len + num_bytes > UDP_MAX_DATAGRAM_SIZE) {
+			if (this->queued_count == UDP_BATCH_SIZE) {
+				this->flush();
+			}
+
+			slot = this->queued_count++;
+			this->send_vectors[slot].iov_len = 0;
+			if (address != nullptr) {
+				this->send_addresses[slot] = *address;
+			}
+		}
+
+		NETWORK_BYTE* datagram = (NETWORK_BYTE*)this->send_vectors[slot].iov_base;
+		if (prefix_size > 0) {
+			std::memcpy(datagram + this->send_vectors[slot].iov_len, prefix, prefix_size);
+			this->send_vectors[slot].iov_len += prefix_size;
+		}
+		for (int index = 0; index < count; index++) {
+			std::memcpy(datagram + this->send_vectors[slot].iov_len, vectors[index].iov_base, vectors[index].iov_len);
+			this->send_vectors[slot].iov_len += vectors[index].iov_len;
+		}
+	}
+
+	void UDPSocketConnection::flush() {
+		for (int index = 0; index < this->queued_count; index++) {
+			struct msghdr& header = this->send_headers[index].msg_hdr;
+			header.msg_name = this->connected ? nullptr : &this->send_addresses[index].storage;
+			header.msg_namelen = this->connected ? 0 : this->send_addresses[index].length;
+		}
+
+		NETWORK_BYTE_SIZE num_bytes_sent = 0;
+		int sent_count = 0;
+		while (sent_count < this->queued_count) {
+			int sent = sendmmsg(this->get_descriptor(), this->send_headers + sent_count, this->queued_count - sent_count, 0);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+			if (sent != SOCKET_ERROR) {
+				for (int index = sent_count; index < sent_count + sent; index++) {
+					num_bytes_sent += this->send_vectors[index].iov_len;
+				}
+				sent_count += sent;
+				continue;
+			}
+
+			int error = get_previous_error_code();
+			if (is_interrupted_error(error)) {
+				continue;
+			}
+			if (is_would_block_error(error) && wait_for_socket(this->get_descriptor(), POLLOUT, -1) != SOCKET_ERROR) {
+				continue;
+			}
+
+			/* The first datagram left was refused, but the ones after it may still go */
+			this->count_dropped_datagram();
+			sent_count++;
+		}
+
+		this->queued_count = 0;
+		if (num_bytes_sent > 0) {
+			this->record_send(num_bytes_sent);
+		}
+	}
+
+	/* The byte at an offset into a frame which is split across buffers, or -1 past its end */
+	static int frame_byte(SEND_VECTOR* vectors, int count, size_t offset) {
+		for (int index = 0; index < count; index++) {
+			if (offset < vectors[index].iov_len) {
+				return ((const NETWORK_BYTE*)vectors[index].iov_base)[offset];
+			}
+			offset -= vectors[index].iov_len;
+		}
+		return -1;
+	}
+
+	/* The channel a frame belongs to, looking inside a traced frame */
+	static CHANNEL_ID frame_channel(const NETWORK_BYTE* frame, NETWORK_BYTE_SIZE frame_size) {
+		return frame[0] == TRACED_CHANNEL_ID && frame_size > 1 ? frame[1] : frame[0];
+	}
+
+	UDPPeer::UDPPeer(std::shared_ptr<UDPSocketConnection> socket, const UDPAddress* address) :
+		ChanneledSocketConnection(INVALID_SOCKET, AF_INET, SOCK_DGRAM, IPPROTO_UDP), socket(socket),
+		datagram(nullptr), datagram_remaining(0), frame(nullptr), frame_remaining(0), reading_datagram(false),
+		ordered_sender(RELIABLE_ORDERED_CHANNEL_ID), unordered_sender(RELIABLE_UNORDERED_CHANNEL_ID),
+		ordered_receiver(RELIABLE_ORDERED_CHANNEL_ID), unordered_receiver(RELIABLE_UNORDERED_CHANNEL_ID),
+		retransmissions(0) {
+
+		std::memset(&this->address, 0, sizeof(this->address));
+		if (address != nullptr) {
+			this->address = *address;
+		}
+	}
+
+	UDPPeer::~UDPPeer() {
+		this->socket->count_unacked(-(int64_t)this->unacked_count());
+	}
+
+	void UDPPeer::begin_datagram(const UDPDatagram& datagram) {
+		this->datagram = datagram.bytes;
+		this->datagram_remaining = datagram.size;
+	}
+
+	void UDPPeer::discard_datagram() const {
+		this->datagram = nullptr;
+		this->datagram_remaining = 0;
+		this->frame_remaining = 0;
+	}
+
+	void UDPPeer::reject_datagram() const {
+		this->discard_datagram();
+		throw ReceiveException(std::to_string(EBADMSG));
+	}
+
+	void UDPPeer::acknowledge(const AckRecord& ack) {
+		ReliableSender* sender;
+		if (ack.marker == RELIABLE_ORDERED_CHANNEL_ID) {
+			sender = &this->ordered_sender;
+		}
+		else if (ack.marker == RELIABLE_UNORDERED_CHANNEL_ID) {
+			sender = &this->unordered_sender;
+		}
+		else {
+			this->reject_datagram();
+			return;
+		}
+
+		size_t acknowledged = sender->acknowledge(ack, ReliableSender::Clock::now(), this->round_trip);
+		this->socket->count_unacked(-(int64_t)acknowledged);
+	}
+
+	bool UDPPeer::next_frame() {
+		/* Whatever the handler left of the last frame is skipped */
+		this->frame_remaining = 0;
+		this->reading_datagram = false;
+
+		if (this->ordered_receiver.release(this->released_frame)) {
+			this->frame = this->released_frame.data();
+			this->frame_remaining = this->released_frame.size();
+			return true;
+		}
+
+		while (this->datagram_remaining > 0) {
+			CHANNEL_ID marker = this->datagram[0];
+			if (marker == ACK_CHANNEL_ID) {
+				if (this->datagram_remaining < ACK_RECORD_SIZE) {
+					this->reject_datagram();
+				}
+
+				AckRecord ack = AckRecord::read(this->datagram);
+				this->datagram += ACK_RECORD_SIZE;
+				this->datagram_remaining -= ACK_RECORD_SIZE;
+				this->record_receive(ACK_RECORD_SIZE);
+				this->acknowledge(ack);
+				continue;
+			}
+
+			if (marker != RELIABLE_ORDERED_CHANNEL_ID && marker != RELIABLE_UNORDERED_CHANNEL_ID && marker != SEQUENCED_CHANNEL_ID) {
+				/* A plain frame, which is read straight from the datagram */
+				this->reading_datagram = true;
+				return true;
+			}
+
+			if (this->datagram_remaining < DELIVERY_HEADER_SIZE) {
+				this->reject_datagram();
+			}
+			DeliveryHeader header = DeliveryHeader::read(this->datagram);
+			if (header.frame_size == 0 || this->datagram_remaining - DELIVERY_HEADER_SIZE < header.frame_size) {
+				this->reject_datagram();
+			}
+
+			const NETWORK_BYTE* frame = this->datagram + DELIVERY_HEADER_SIZE;
+			this->datagram += DELIVERY_HEADER_SIZE + header.frame_size;
+			this->datagram_remaining -= DELIVERY_HEADER_SIZE + header.frame_size;
+			this->record_receive(DELIVERY_HEADER_SIZE);
+
+			bool deliver;
+			if (marker == SEQUENCED_CHANNEL_ID) {
+				/* Sequence numbers are per channel, so a busy channel does not make a quiet one look stale */
+				CHANNEL_ID channel_id = frame_channel(frame, header.frame_size);
+				auto newest = this->received_sequences.find(channel_id);
+				deliver = newest == this->received_sequences.end() || (int32_t)(header.id - newest->second) > 0;
+				if (deliver) {
+					this->received_sequences[channel_id] = header.id;
+				}
+			}
+			else {
+				ReliableReceiver& receiver = marker == RELIABLE_ORDERED_CHANNEL_ID ? this->ordered_receiver : this->unordered_receiver;
+				deliver = receiver.accept(header.id, frame, header.frame_size) == DELIVER;
+			}
+
+			if (deliver) {
+				this->frame = frame;
+				this->frame_remaining = header.frame_size;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	DeliveryMode UDPPeer::delivery_mode_of(SEND_VECTOR* vectors, int count) const {
+		int channel_id = frame_byte(vectors, count, 0);
+		switch (channel_id) {
+		case HEARTBEAT_CHANNEL_ID:
+			return UNRELIABLE;
+		case RPC_REQUEST_CHANNEL_ID:
+		case RPC_RESPONSE_CHANNEL_ID:
+		case TRACE_CONTROL_CHANNEL_ID:
+			return RELIABLE_UNORDERED;
+		case STREAM_CHANNEL_ID:
+			return RELIABLE_ORDERED;
+		case TRACED_CHANNEL_ID:
+			channel_id = frame_byte(vectors, count, sizeof(CHANNEL_ID));
+			break;
+		}
+
+		if (channel_id < 0) {
+			return UNRELIABLE;
+		}
+		return Channels::getChannel((CHANNEL_ID)channel_id)->getDeliveryMode();
+	}
+
+	void UDPPeer::send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const {
+		SEND_VECTOR vector;
+		set_send_vector(&vector, bytes, num_bytes);
+		this->send_vectored(&vector, 1);
+	}
+
+	void UDPPeer::send_vectored(SEND_VECTOR* vectors, int count) const {
+		NETWORK_BYTE_SIZE num_bytes = 0;
+		for (int index = 0; index < count; index++) {
+			num_bytes += vectors[index].iov_len;
+		}
+
+		/* Acks go first, so that they ride in the same datagram as the frame */
+		this->send_acks();
+
+		DeliveryMode mode = this->delivery_mode_of(vectors, count);
+		if (mode == UNRELIABLE) {
+			this->socket->queue_datagram(this->destination(), nullptr, 0, vectors, count);
+		}
+		else if (num_bytes + DELIVERY_HEADER_SIZE > UDP_MAX_DATAGRAM_SIZE) {
+			throw SendException(std::to_string(EMSGSIZE));
+		}
+		else if (mode == UNRELIABLE_SEQUENCED) {
+			CHANNEL_ID channel_id = (CHANNEL_ID)frame_byte(vectors, count, 0);
+			if (channel_id == TRACED_CHANNEL_ID) {
+				channel_id = (CHANNEL_ID)frame_byte(vectors, count, sizeof(CHANNEL_ID));
+			}
+
+			NETWORK_BYTE header_bytes[DELIVERY_HEADER_SIZE];
+			DeliveryHeader{ SEQUENCED_CHANNEL_ID, this->sent_sequences[channel_id]++, (uint16_t)num_bytes }.write(header_bytes);
+			this->socket->queue_datagram(this->destination(), header_bytes, DELIVERY_HEADER_SIZE, vectors, count);
+		}
+		else {
+			ReliableSender& sender = mode == RELIABLE_ORDERED ? this->ordered_sender : this->unordered_sender;
+			const std::vector<NETWORK_BYTE>& record = sender.wrap(vectors, count, ReliableSender::Clock::now());
+			this->socket->queue_datagram(this->destination(), record.data(), record.size(), nullptr, 0);
+			this->socket->count_unacked(1);
+		}
+
+		this->record_send(num_bytes);
+	}
+
+	void UDPPeer::send_acks() const {
+		NETWORK_BYTE ack_bytes[ACK_RECORD_SIZE];
+		if (this->ordered_receiver.has_ack_pending()) {
+			this->ordered_receiver.ack().write(ack_bytes);
+			this->socket->queue_datagram(this->destination(), ack_bytes, ACK_RECORD_SIZE, nullptr, 0);
+		}
+		if (this->unordered_receiver.has_ack_pending()) {
+			this->unordered_receiver.ack().write(ack_bytes);
+			this->socket->queue_datagram(this->destination(), ack_bytes, ACK_RECORD_SIZE, nullptr, 0);
+		}
+	}
+
+	void UDPPeer::retransmit() {
+		ReliableSender::Clock::time_point now = ReliableSender::Clock::now();
+		auto send = [this](const std::vector<NETWORK_BYTE>& record) {
+			this->send_acks();
+			this->socket->queue_datagram(this->destination(), record.data(), record.size(), nullptr, 0);
+		};
+
+		size_t sent = this->ordered_sender.retransmit(now, this->round_trip.get_retransmit_timeout(), send);
+		sent += this->unordered_sender.retransmit(now, this->round_trip.get_retransmit_timeout(), send);
+
+		this->retransmissions += sent;
+		SUNNET_METRICS_ONLY(Metrics::global.retransmissions.add(sent));
+	}
+
+	bool UDPPeer::receive(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		const NETWORK_BYTE*& cursor = this->reading_datagram ? this->datagram : this->frame;
+		NETWORK_BYTE_SIZE& remaining = this->reading_datagram ? this->datagram_remaining : this->frame_remaining;
+		if (num_bytes > remaining) {
+			this->reject_datagram();
+		}
+
+		std::memcpy(buffer, cursor, num_bytes);
+		cursor += num_bytes;
+		remaining -= num_bytes;
+		this->record_receive(num_bytes);
+		return true;
+	}
+}
+
+#endif
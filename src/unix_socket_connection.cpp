@@ -0,0 +1,268 @@
+#include "unix_socket_connection.h"
+
+#ifdef SUNNET_HAS_UNIX_SOCKETS
+
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <cstddef>
+#include <cstring>
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace SunNet {
+
+	/*
+	Fill in the address for a path, or for an abstract name if the path starts with '@'.
+	@return The length of the address, or 0 if the path is empty or too long
+	*/
+	static SOCKET_LEN make_unix_address(const std::string& path, struct sockaddr_un* address) {
+		std::memset(address, 0, sizeof(struct sockaddr_un));
+		address->sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(address->sun_path)) {
+			return 0;
+		}
+
+		std::memcpy(address->sun_path, path.data(), path.size());
+		if (path[0] == '@') {
+			/* Abstract names start with a NUL and are not NUL terminated */
+			address->sun_path[0] = '\0';
+			return (SOCKET_LEN)(offsetof(struct sockaddr_un, sun_path) + path.size());
+		}
+
+		return (SOCKET_LEN)(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
+	}
+
+	static int socket_type_of(SOCKET descriptor) {
+		int type = SOCK_STREAM;
+		socklen_t type_len = sizeof(type);
+		getsockopt(descriptor, SOL_SOCKET, SO_TYPE, &type, &type_len);
+		return type;
+	}
+
+	/* Whether something is still accepting connections at an address */
+	static bool is_listening(const struct sockaddr_un* address, SOCKET_LEN address_len, int type) {
+		SOCKET probe = open_socket(AF_UNIX, type, 0);
+		if (probe == INVALID_SOCKET) {
+			return false;
+		}
+
+		bool listening = connect_socket(probe, (const struct sockaddr*)address, address_len) != SOCKET_ERROR;
+		close(probe);
+		return listening;
+	}
+
+	UnixSocketConnection::UnixSocketConnection(UnixSocketType type) :
+		ChanneledSocketConnection(AF_UNIX, type, 0), type(type) {
+
+		if (type == UNIX_SEQPACKET) {
+			this->receive_whole_packets(UNIX_MAX_PACKET_SIZE);
+		}
+	}
+
+	UnixSocketConnection::UnixSocketConnection(SOCKET descriptor) :
+		ChanneledSocketConnection(descriptor, AF_UNIX, socket_type_of(descriptor), 0),
+		type((UnixSocketType)socket_type_of(descriptor)) {
+
+		if (this->type == UNIX_SEQPACKET) {
+			this->receive_whole_packets(UNIX_MAX_PACKET_SIZE);
+		}
+	}
+
+	UnixSocketConnection::~UnixSocketConnection() {
+		for (SOCKET descriptor : this->passed_descriptors) {
+			close(descriptor);
+		}
+
+		if (!this->bound_path.empty()) {
+			unlink(this->bound_path.c_str());
+		}
+	}
+
+	void UnixSocketConnection::check_packet_size(NETWORK_BYTE_SIZE num_bytes) const {
+		if (this->type == UNIX_SEQPACKET && num_bytes > UNIX_MAX_PACKET_SIZE) {
+			throw SendException(std::to_string(EMSGSIZE));
+		}
+	}
+
+	void UnixSocketConnection::send(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) const {
+		this->check_packet_size(num_bytes);
+		SocketConnection::send(bytes, num_bytes);
+	}
+
+	void UnixSocketConnection::send_vectored(SEND_VECTOR* vectors, int count) const {
+		NETWORK_BYTE_SIZE num_bytes = 0;
+		for (int index = 0; index < count; index++) {
+			num_bytes += vectors[index].iov_len;
+		}
+
+		this->check_packet_size(num_bytes);
+		SocketConnection::send_vectored(vectors, count);
+	}
+
+	void UnixSocketConnection::connect(std::string address, std::string) {
+		struct sockaddr_un unix_address;
+		SOCKET_LEN address_len = make_unix_address(address, &unix_address);
+		if (address_len == 0) {
+			throw ConnectException(std::to_string(ENAMETOOLONG));
+		}
+
+		if (connect_socket(this->get_descriptor(), (const struct sockaddr*)&unix_address, address_len) == SOCKET_ERROR) {
+			throw ConnectException(std::to_string(get_previous_error_code()));
+		}
+	}
+
+	void UnixSocketConnection::bind(std::string, std::string address) {
+		struct sockaddr_un unix_address;
+		SOCKET_LEN address_len = make_unix_address(address, &unix_address);
+		if (address_len == 0) {
+			throw BindException(std::to_string(ENAMETOOLONG));
+		}
+
+		/* A socket file nobody is listening on was left by a process which did not clean up */
+		bool is_path = address[0] != '@';
+		struct stat file_status;
+		if (is_path && lstat(address.c_str(), &file_status) == 0 && S_ISSOCK(file_status.st_mode) &&
+			!is_listening(&unix_address, address_len, this->type)) {
+			unlink(address.c_str());
+		}
+
+		if (bind_socket(this->get_descriptor(), (const struct sockaddr*)&unix_address, address_len) == SOCKET_ERROR) {
+			throw BindException(std::to_string(get_previous_error_code()));
+		}
+
+		if (is_path) {
+			this->bound_path = address;
+		}
+	}
+
+	int UnixSocketConnection::read_socket(NETWORK_BYTE* buffer, NETWORK_BYTE_SIZE num_bytes) const {
+		alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * UNIX_MAX_PASSED_DESCRIPTORS)];
+
+		struct iovec vector;
+		vector.iov_base = buffer;
+		vector.iov_len = num_bytes;
+
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		ssize_t received = recvmsg(this->get_descriptor(), &message, MSG_CMSG_CLOEXEC);
+		if (received <= 0) {
+			return (int)received;
+		}
+
+		/* Descriptors the kernel had no room to pass were closed, so the ones which arrived are incomplete */
+		bool truncated = (message.msg_flags & MSG_CTRUNC) != 0;
+		for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+			if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+				continue;
+			}
+
+			size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const unsigned char* data = CMSG_DATA(header);
+			for (size_t index = 0; index < count; index++) {
+				int descriptor;
+				std::memcpy(&descriptor, data + index * sizeof(int), sizeof(int));
+				if (truncated || this->passed_descriptors.size() >= UNIX_MAX_QUEUED_DESCRIPTORS) {
+					close(descriptor);
+				}
+				else {
+					this->passed_descriptors.push_back(descriptor);
+				}
+			}
+		}
+
+		if (truncated) {
+			throw ReceiveException(std::to_string(EMSGSIZE));
+		}
+
+		return (int)received;
+	}
+
+	void UnixSocketConnection::send_with_descriptors(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes,
+		const SOCKET* descriptors, int count) const {
+
+		SEND_VECTOR vector;
+		set_send_vector(&vector, bytes, num_bytes);
+		this->send_vectored_with_descriptors(&vector, 1, descriptors, count);
+	}
+
+	void UnixSocketConnection::send_vectored_with_descriptors(SEND_VECTOR* vectors, int vector_count,
+		const SOCKET* descriptors, int descriptor_count) const {
+
+		NETWORK_BYTE_SIZE num_bytes = 0;
+		for (int index = 0; index < vector_count; index++) {
+			num_bytes += vectors[index].iov_len;
+		}
+
+		if (num_bytes == 0 || descriptor_count < 0 || descriptor_count > UNIX_MAX_PASSED_DESCRIPTORS) {
+			throw SendException(std::to_string(EINVAL));
+		}
+		this->check_packet_size(num_bytes);
+
+		alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * UNIX_MAX_PASSED_DESCRIPTORS)];
+		std::memset(control, 0, sizeof(control));
+
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = vectors;
+		message.msg_iovlen = vector_count;
+		if (descriptor_count > 0) {
+			message.msg_control = control;
+			message.msg_controllen = CMSG_SPACE(sizeof(int) * descriptor_count);
+
+			struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(int) * descriptor_count);
+			std::memcpy(CMSG_DATA(header), descriptors, sizeof(int) * descriptor_count);
+		}
+
+		/* The descriptors go with the first bytes sent; anything left over is sent normally */
+		ssize_t sent;
+		while (true) {
+			sent = sendmsg(this->get_descriptor(), &message, MSG_NOSIGNAL);
+			SUNNET_METRICS_ONLY(this->metrics.send_calls.add(); Metrics::global.send_calls.add());
+			if (sent != SOCKET_ERROR) {
+				break;
+			}
+
+			this->wait_after_error<SendException>(POLLOUT);
+		}
+		this->record_send((NETWORK_BYTE_SIZE)sent);
+
+		NETWORK_BYTE_SIZE num_bytes_sent = (NETWORK_BYTE_SIZE)sent;
+		while (vector_count > 0 && num_bytes_sent >= vectors->iov_len) {
+			num_bytes_sent -= vectors->iov_len;
+			vectors++;
+			vector_count--;
+		}
+
+		if (vector_count > 0) {
+			set_send_vector(vectors, (NETWORK_BYTE*)vectors->iov_base + num_bytes_sent, vectors->iov_len - num_bytes_sent);
+			SocketConnection::send_vectored(vectors, vector_count);
+		}
+	}
+
+	SOCKET UnixSocketConnection::take_descriptor() {
+		if (this->passed_descriptors.empty()) {
+			return INVALID_SOCKET;
+		}
+
+		SOCKET descriptor = this->passed_descriptors.front();
+		this->passed_descriptors.pop_front();
+		return descriptor;
+	}
+}
+
+#endif
@@ -0,0 +1,482 @@
+/*
+sunnet_loadgen: drives many connections against any ChanneledServer from one PollService.
+
+Traffic is described as raw channel frames, so the load generator does not need the
+server's message types. Channel ids are the ones the server assigns, which follow the
+order it calls Channels::addNewChannel in.
+
+Usage:
+	sunnet_loadgen --host 127.0.0.1 --port 9000 --connections 20000 --duration 60
+		--send CHANNEL:SIZE:RATE[:REPLY_CHANNEL:REPLY_SIZE] ...
+		--receive CHANNEL:SIZE ...
+		--script FILE
+
+--send sends SIZE-byte messages on CHANNEL at RATE messages per second per connection.
+If the server answers each one with a REPLY_SIZE-byte message on REPLY_CHANNEL, the round
+trip is timed. --receive declares the size of any other channel the server sends on, so
+that its messages can be skipped; heartbeats are skipped without one. A script file holds the same directives, one per line:
+
+	# Movement updates at 20Hz, answered on channel 4
+	send 2 32 20 4 16
+	receive 7 128
+
+Sends never wait. A connection whose socket is full finishes the frame it was sending once
+poll() finds it writable, and skips the sends that fall due meanwhile. Skipped sends are
+reported, so that a server which stops reading shows up instead of stalling every
+connection behind one.
+*/
+#include "tcp_socket_connection.h"
+#include "channels.h"
+#include "pollservice.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace SunNet;
+
+/* A stream of messages sent by every connection */
+struct TrafficPattern {
+	CHANNEL_ID channel_id;
+	NETWORK_BYTE_SIZE size;
+	double rate; /** < Messages per second per connection */
+	bool expects_reply;
+	CHANNEL_ID reply_channel_id;
+
+	uint64_t sent; /** < Across every connection */
+	std::size_t next_connection; /** < Sends are spread round-robin */
+};
+
+/* A connection whose sends give up instead of waiting when the socket is full */
+class LoadSocket : public TCPSocketConnection {
+public:
+	/**
+	@return How many of the bytes went out, which is 0 when the socket is full
+	@throws SendException if the connection failed
+	*/
+	NETWORK_BYTE_SIZE send_some(const NETWORK_BYTE* bytes, NETWORK_BYTE_SIZE num_bytes) {
+		int sent = socket_send(this->get_descriptor(), bytes, num_bytes, 0);
+		if (sent == SOCKET_ERROR) {
+			int error = get_previous_error_code();
+			if (is_would_block_error(error) || is_interrupted_error(error)) {
+				return 0;
+			}
+			throw SendException(std::to_string(error));
+		}
+
+		this->record_send((NETWORK_BYTE_SIZE)sent);
+		return (NETWORK_BYTE_SIZE)sent;
+	}
+};
+
+struct LoadConnection {
+	std::shared_ptr<LoadSocket> socket;
+	ConnectionHandle handle;
+	std::vector<std::deque<uint64_t>> reply_waits; /** < Send times awaiting a reply, per pattern */
+	std::vector<NETWORK_BYTE> unsent; /** < The rest of a frame the socket had no room for */
+};
+
+struct LoadOptions {
+	std::string host = "127.0.0.1";
+	std::string port;
+	std::size_t connections = 100;
+	double duration = 10;
+	std::vector<TrafficPattern> patterns;
+	NETWORK_BYTE_SIZE channel_sizes[CHANNEL_ID_COUNT] = {};
+	bool channel_known[CHANNEL_ID_COUNT] = {};
+};
+
+static void usage(const char* program) {
+	std::cerr << "usage: " << program << " --port PORT [--host HOST] [--connections N] [--duration SECONDS]\n"
+		"    [--send CHANNEL:SIZE:RATE[:REPLY_CHANNEL:REPLY_SIZE]]... [--receive CHANNEL:SIZE]... [--script FILE]" << std::endl;
+	std::exit(2);
+}
+
+static CHANNEL_ID parse_channel_id(const std::string& field) {
+	unsigned long channel_id = std::stoul(field);
+	if (channel_id >= CHANNEL_ID_COUNT) {
+		throw std::invalid_argument("channel " + field + " is out of range; channels are 0 to " + std::to_string(CHANNEL_ID_COUNT - 1));
+	}
+	return (CHANNEL_ID)channel_id;
+}
+
+static void declare_channel(LoadOptions& options, CHANNEL_ID channel_id, unsigned long size) {
+	options.channel_sizes[channel_id] = (NETWORK_BYTE_SIZE)size;
+	options.channel_known[channel_id] = true;
+}
+
+/* Parse the fields of a send directive: CHANNEL SIZE RATE [REPLY_CHANNEL REPLY_SIZE] */
+static void add_send(LoadOptions& options, const std::vector<std::string>& fields) {
+	if (fields.size() != 3 && fields.size() != 5) {
+		throw std::invalid_argument("send needs CHANNEL SIZE RATE [REPLY_CHANNEL REPLY_SIZE]");
+	}
+
+	TrafficPattern pattern{};
+	pattern.channel_id = parse_channel_id(fields[0]);
+	pattern.size = (NETWORK_BYTE_SIZE)std::stoul(fields[1]);
+	pattern.rate = std::stod(fields[2]);
+	if (fields.size() == 5) {
+		pattern.expects_reply = true;
+		pattern.reply_channel_id = parse_channel_id(fields[3]);
+		declare_channel(options, pattern.reply_channel_id, std::stoul(fields[4]));
+	}
+
+	options.patterns.push_back(pattern);
+}
+
+static void add_receive(LoadOptions& options, const std::vector<std::string>& fields) {
+	if (fields.size() != 2) {
+		throw std::invalid_argument("receive needs CHANNEL SIZE");
+	}
+
+	declare_channel(options, parse_channel_id(fields[0]), std::stoul(fields[1]));
+}
+
+static std::vector<std::string> split(const std::string& text, char separator) {
+	std::vector<std::string> fields;
+	std::istringstream stream(text);
+	std::string field;
+	while (std::getline(stream, field, separator)) {
+		if (!field.empty()) {
+			fields.push_back(field);
+		}
+	}
+	return fields;
+}
+
+static void read_script(LoadOptions& options, const std::string& path) {
+	std::ifstream script(path);
+	if (!script) {
+		throw std::invalid_argument("cannot open script " + path);
+	}
+
+	std::string line;
+	while (std::getline(script, line)) {
+		line = line.substr(0, line.find('#'));
+		std::vector<std::string> fields = split(line, ' ');
+		if (fields.empty()) {
+			continue;
+		}
+
+		std::string directive = fields[0];
+		fields.erase(fields.begin());
+		if (directive == "send") {
+			add_send(options, fields);
+		}
+		else if (directive == "receive") {
+			add_receive(options, fields);
+		}
+		else {
+			throw std::invalid_argument("unknown directive " + directive);
+		}
+	}
+}
+
+static LoadOptions parse_options(int argc, char** argv) {
+	LoadOptions options;
+	try {
+		for (int index = 1; index < argc; index++) {
+			std::string argument = argv[index];
+			if (index + 1 >= argc) {
+				usage(argv[0]);
+			}
+
+			std::string value = argv[++index];
+			if (argument == "--host") options.host = value;
+			else if (argument == "--port") options.port = value;
+			else if (argument == "--connections") options.connections = std::stoul(value);
+			else if (argument == "--duration") options.duration = std::stod(value);
+			else if (argument == "--send") add_send(options, split(value, ':'));
+			else if (argument == "--receive") add_receive(options, split(value, ':'));
+			else if (argument == "--script") read_script(options, value);
+			else usage(argv[0]);
+		}
+	}
+	catch (std::exception& error) {
+		std::cerr << error.what() << std::endl;
+		usage(argv[0]);
+	}
+
+	if (options.port.empty() || options.patterns.empty()) {
+		usage(argv[0]);
+	}
+
+	return options;
+}
+
+static void raise_descriptor_limit() {
+#ifndef _WIN32
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+}
+
+class LoadGenerator {
+private:
+	LoadOptions options;
+	PollService poll_service;
+
+	std::vector<LoadConnection> connections;
+	std::vector<std::size_t> slot_connections; /** < The connection in each PollService slot */
+	std::vector<NETWORK_BYTE> send_buffer;
+	std::vector<NETWORK_BYTE> receive_buffer;
+
+	std::chrono::steady_clock::time_point start;
+	LatencyHistogram latency;
+	uint64_t messages_sent;
+	uint64_t messages_skipped; /** < Sends which fell due while their connection was full */
+	uint64_t bytes_sent;
+	uint64_t messages_received;
+	uint64_t bytes_received;
+	uint64_t disconnects;
+
+	void connect_all() {
+		this->connections.reserve(this->options.connections);
+		for (std::size_t index = 0; index < this->options.connections; index++) {
+			std::shared_ptr<LoadSocket> socket = std::make_shared<LoadSocket>();
+			socket->connect(this->options.host, this->options.port);
+			socket->set_nonblocking(true);
+
+			ConnectionHandle handle = this->poll_service.add_socket(socket);
+			if (handle.index >= this->slot_connections.size()) {
+				this->slot_connections.resize(handle.index + 1);
+			}
+			this->slot_connections[handle.index] = index;
+
+			this->connections.push_back(LoadConnection{ socket, handle, std::vector<std::deque<uint64_t>>(this->options.patterns.size()), {} });
+			if ((index + 1) % 1000 == 0) {
+				std::cout << "connected " << index + 1 << std::endl;
+			}
+		}
+	}
+
+	/* Send whatever each pattern is due to have sent by now, spread across the connections */
+	void send_due() {
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+		uint64_t now_ticks = CycleClock::now();
+
+		for (std::size_t pattern_index = 0; pattern_index < this->options.patterns.size(); pattern_index++) {
+			TrafficPattern& pattern = this->options.patterns[pattern_index];
+			uint64_t due = (uint64_t)(pattern.rate * this->connections.size() * elapsed);
+
+			this->send_buffer[0] = pattern.channel_id;
+			for (; pattern.sent < due; pattern.sent++) {
+				LoadConnection& connection = this->connections[pattern.next_connection];
+				pattern.next_connection = (pattern.next_connection + 1) % this->connections.size();
+				if (!connection.socket) {
+					continue;
+				}
+				if (!connection.unsent.empty()) {
+					this->messages_skipped++;
+					continue;
+				}
+
+				NETWORK_BYTE_SIZE frame_size = sizeof(CHANNEL_ID) + pattern.size;
+				try {
+					NETWORK_BYTE_SIZE sent = connection.socket->send_some(this->send_buffer.data(), frame_size);
+					if (sent < frame_size) {
+						/* The rest goes out once the socket has room, so the frame is still counted as sent */
+						connection.unsent.assign(this->send_buffer.begin() + sent, this->send_buffer.begin() + frame_size);
+						this->poll_service.set_writing(connection.handle, true);
+					}
+				}
+				catch (SendException&) {
+					this->disconnect(connection);
+					continue;
+				}
+
+				if (pattern.expects_reply) {
+					connection.reply_waits[pattern_index].push_back(now_ticks);
+				}
+				this->messages_sent++;
+				this->bytes_sent += frame_size;
+			}
+		}
+	}
+
+	/* Send what is left of a frame on a connection poll() found writable */
+	void send_unsent(ConnectionHandle handle) {
+		LoadConnection& connection = this->connections[this->slot_connections[handle.index]];
+		if (!connection.socket || connection.unsent.empty()) {
+			return;
+		}
+
+		try {
+			NETWORK_BYTE_SIZE sent = connection.socket->send_some(connection.unsent.data(), (NETWORK_BYTE_SIZE)connection.unsent.size());
+			connection.unsent.erase(connection.unsent.begin(), connection.unsent.begin() + sent);
+		}
+		catch (SendException&) {
+			this->disconnect(connection);
+			return;
+		}
+
+		if (!connection.unsent.empty()) {
+			this->poll_service.set_writing(connection.handle, true);
+		}
+	}
+
+	/* Read one frame, timing it if it answers a pattern. @return false if the connection closed */
+	bool receive_frame(LoadConnection& connection) {
+		CHANNEL_ID channel_id;
+		if (!connection.socket->receive(&channel_id, sizeof(CHANNEL_ID))) {
+			return false;
+		}
+
+		/* A server with heartbeats enabled sends them on quiet connections. They carry nothing */
+		if (channel_id == HEARTBEAT_CHANNEL_ID) {
+			return true;
+		}
+
+		if (!this->options.channel_known[channel_id]) {
+			std::cerr << "received unknown channel " << (unsigned)channel_id << "; declare it with --receive" << std::endl;
+			return false;
+		}
+
+		NETWORK_BYTE_SIZE size = this->options.channel_sizes[channel_id];
+		if (size > 0 && !connection.socket->receive(this->receive_buffer.data(), size)) {
+			return false;
+		}
+
+		this->messages_received++;
+		this->bytes_received += sizeof(CHANNEL_ID) + size;
+
+		for (std::size_t pattern_index = 0; pattern_index < this->options.patterns.size(); pattern_index++) {
+			const TrafficPattern& pattern = this->options.patterns[pattern_index];
+			std::deque<uint64_t>& waits = connection.reply_waits[pattern_index];
+			if (pattern.expects_reply && pattern.reply_channel_id == channel_id && !waits.empty()) {
+				this->latency.record(CycleClock::now() - waits.front());
+				waits.pop_front();
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	void handle_ready(const PollEvent& event) {
+		LoadConnection& connection = this->connections[this->slot_connections[event.handle.index]];
+		if (!connection.socket) {
+			return;
+		}
+
+		bool open = event.status == SOCKET_STATUS_NORMAL;
+
+		try {
+			while (open) {
+				open = this->receive_frame(connection);
+				if (connection.socket->buffered_bytes() == 0) {
+					break;
+				}
+			}
+		}
+		catch (ReceiveException&) {
+			open = false;
+		}
+
+		if (!open) {
+			this->disconnect(connection);
+		}
+	}
+
+	void disconnect(LoadConnection& connection) {
+		this->poll_service.remove_socket(connection.handle);
+		connection.socket.reset();
+		connection.unsent.clear();
+		this->disconnects++;
+	}
+
+	void report_progress(double seconds, uint64_t sent, uint64_t received) const {
+		std::cout << std::fixed << std::setprecision(0)
+			<< "t=" << seconds << "s sent " << sent << " msg/s, received " << received << " msg/s, "
+			<< this->connections.size() - this->disconnects << " connections" << std::endl;
+	}
+
+public:
+	LoadGenerator(LoadOptions options) : options(options), poll_service(1),
+		messages_sent(0), messages_skipped(0), bytes_sent(0), messages_received(0), bytes_received(0), disconnects(0) {
+
+		NETWORK_BYTE_SIZE largest_send = 0;
+		for (const TrafficPattern& pattern : this->options.patterns) {
+			largest_send = std::max(largest_send, pattern.size);
+		}
+		this->send_buffer.resize(sizeof(CHANNEL_ID) + largest_send);
+		this->receive_buffer.resize(*std::max_element(std::begin(this->options.channel_sizes), std::end(this->options.channel_sizes)) + 1);
+	}
+
+	void run() {
+		this->connect_all();
+		std::cout << "connected " << this->connections.size() << ", generating load for " << this->options.duration << "s" << std::endl;
+
+		this->start = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point end = this->start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(this->options.duration));
+
+		/* Sends go out on a 1ms timer, so rates are smooth rather than bursty */
+		this->poll_service.get_timers().schedule_repeating(std::chrono::milliseconds(1), [this]() { this->send_due(); });
+
+		std::chrono::steady_clock::time_point next_report = this->start + std::chrono::seconds(1);
+		uint64_t reported_sent = 0;
+		uint64_t reported_received = 0;
+		while (std::chrono::steady_clock::now() < end && this->disconnects < this->connections.size()) {
+			for (const PollEvent& event : this->poll_service.poll()) {
+				this->handle_ready(event);
+			}
+			for (ConnectionHandle handle : this->poll_service.get_writable()) {
+				this->send_unsent(handle);
+			}
+
+			if (std::chrono::steady_clock::now() >= next_report) {
+				double seconds = std::chrono::duration<double>(next_report - this->start).count();
+				this->report_progress(seconds, this->messages_sent - reported_sent, this->messages_received - reported_received);
+				reported_sent = this->messages_sent;
+				reported_received = this->messages_received;
+				next_report += std::chrono::seconds(1);
+			}
+		}
+
+		this->report(std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count());
+	}
+
+	void report(double seconds) const {
+		HistogramSnapshot round_trip = this->latency.snapshot();
+
+		std::cout << std::fixed << std::setprecision(1)
+			<< "\nduration " << seconds << "s, " << this->connections.size() << " connections, "
+			<< this->disconnects << " disconnected\n"
+			<< "sent " << this->messages_sent << " messages (" << this->messages_sent / seconds << " msg/s, "
+			<< this->bytes_sent / seconds / 1e6 << " MB/s)\n"
+			<< "skipped " << this->messages_skipped << " sends on full connections\n"
+			<< "received " << this->messages_received << " messages (" << this->messages_received / seconds << " msg/s, "
+			<< this->bytes_received / seconds / 1e6 << " MB/s)\n";
+
+		if (round_trip.count > 0) {
+			std::cout << "round trip over " << round_trip.count << " replies: p50 " << round_trip.p50 / 1e3
+				<< "us p90 " << round_trip.p90 / 1e3 << "us p99 " << round_trip.p99 / 1e3
+				<< "us p99.9 " << round_trip.p999 / 1e3 << "us max " << round_trip.max / 1e3 << "us" << std::endl;
+		}
+	}
+};
+
+int main(int argc, char** argv) {
+	LoadOptions options = parse_options(argc, argv);
+	raise_descriptor_limit();
+
+	LoadGenerator generator(options);
+	generator.run();
+	return 0;
+}